@@ -1,8 +1,14 @@
 #include "ecs.hh"
 #include <iostream>
 #include <cstdlib>
+#include <cstring>
 #include <chrono>
 #include <random>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
 
 struct small
 {
@@ -17,146 +23,686 @@ struct large
 
 struct tag {};
 
-void test_random_access()
+struct named
 {
-    monkero::scene ecs;
-    std::default_random_engine rng(0);
-    std::uniform_int_distribution<int> dist(0, 10);
+    std::string name;
+};
 
-    // Populate ECS.
-    size_t N = 1<<16;
-    std::vector<monkero::entity> ids;
-    for(size_t i = 0; i < N; ++i)
+struct ping
+{
+    int value;
+};
+
+// Only exists to give the scene lots of component containers.
+template<int I>
+struct filler
+{
+    int data;
+};
+
+template<>
+class monkero::search_index<named>
+{
+public:
+    monkero::entity find(const std::string& name) const
     {
-        monkero::entity id = ecs.add();
-        if(dist(rng)==0) ecs.attach(id, tag{});
-        if(dist(rng)==0) ecs.attach(id, small{});
-        if(dist(rng)==0) ecs.attach(id, large{});
-        ids.push_back(id);
+        auto it = name_to_id.find(name);
+        return it == name_to_id.end() ? monkero::INVALID_ENTITY : it->second;
     }
 
-    // Try random access. (random ids are precalculated first!)
-    size_t M = 100;
-    std::vector<monkero::entity> shuffled_ids;
+    void add_entity(monkero::entity id, const named& data)
+    {
+        name_to_id[data.name] = id;
+    }
 
-    for(size_t i = 0; i < M; ++i)
+    void remove_entity(monkero::entity, const named& data)
     {
-        std::shuffle(ids.begin(), ids.end(), rng);
-        shuffled_ids.insert(shuffled_ids.end(), ids.begin(), ids.end());
+        name_to_id.erase(data.name);
+    }
+
+    void update(monkero::scene&) {}
+
+private:
+    std::unordered_map<std::string, monkero::entity> name_to_id;
+};
+
+//==============================================================================
+// Harness
+//==============================================================================
+
+struct options
+{
+    unsigned warmup = 2;
+    unsigned repetitions = 10;
+    double tolerance = 0.1;
+    const char* json_path = nullptr;
+    const char* baseline_path = nullptr;
+    const char* filter = nullptr;
+};
+
+struct result
+{
+    std::string name;
+    unsigned warmup;
+    std::vector<double> samples;
+    double median;
+    double p10;
+    double p90;
+    double min;
+    double max;
+};
+
+options opts;
+std::vector<result> results;
+// Results are accumulated here so that the measured work can't be optimized
+// out.
+volatile size_t sink = 0;
+
+double percentile(const std::vector<double>& sorted, double q)
+{
+    return sorted[size_t(q * (sorted.size() - 1) + 0.5)];
+}
+
+// Calls setup() before each repetition outside of the timed region, and then
+// times body() with whatever setup() returned.
+template<typename Setup, typename Body>
+void measure(const char* name, Setup&& setup, Body&& body)
+{
+    if(opts.filter && !strstr(name, opts.filter))
+        return;
+
+    result r;
+    r.name = name;
+    r.warmup = opts.warmup;
+    for(unsigned i = 0; i < opts.warmup + opts.repetitions; ++i)
+    {
+        auto state = setup();
+        auto start = std::chrono::steady_clock::now();
+        body(*state);
+        auto finish = std::chrono::steady_clock::now();
+        if(i >= opts.warmup)
+            r.samples.push_back(
+                std::chrono::duration<double>(finish - start).count()
+            );
     }
 
-    auto start = std::chrono::high_resolution_clock::now();
-    int total = 0;
-    for(size_t i = 0; i < M*N; ++i)
+    std::vector<double> sorted = r.samples;
+    std::sort(sorted.begin(), sorted.end());
+    r.median = percentile(sorted, 0.5);
+    r.p10 = percentile(sorted, 0.1);
+    r.p90 = percentile(sorted, 0.9);
+    r.min = sorted.front();
+    r.max = sorted.back();
+    printf(
+        "%-32s median %10.6f  p10 %10.6f  p90 %10.6f  (%u reps)\n",
+        name, r.median, r.p10, r.p90, opts.repetitions
+    );
+    fflush(stdout);
+    results.push_back(std::move(r));
+}
+
+// For benchmarks that don't modify their fixture.
+template<typename Fixture, typename Body>
+void measure_shared(const char* name, Fixture& fixture, Body&& body)
+{
+    measure(name, [&](){ return &fixture; }, std::forward<Body>(body));
+}
+
+void write_json(const char* path)
+{
+    std::ofstream out(path);
+    out << "{\n  \"benchmarks\": [\n";
+    for(size_t i = 0; i < results.size(); ++i)
     {
-        tag* t = ecs.get<tag>(shuffled_ids[i]);
-        total += t != nullptr ? 1 : 0;
+        const result& r = results[i];
+        char line[512];
+        snprintf(
+            line, sizeof(line),
+            "    {\"name\": \"%s\", \"warmup\": %u, \"repetitions\": %zu, "
+            "\"median\": %.9g, \"p10\": %.9g, \"p90\": %.9g, "
+            "\"min\": %.9g, \"max\": %.9g}%s\n",
+            r.name.c_str(), r.warmup, r.samples.size(), r.median, r.p10,
+            r.p90, r.min, r.max, i + 1 < results.size() ? "," : ""
+        );
+        out << line;
     }
-    auto finish = std::chrono::high_resolution_clock::now();
-    auto diff = std::chrono::duration_cast<std::chrono::duration<float>>(finish-start).count();
-    printf("tag random access %f (count: %d)\n", diff, total);
+    out << "  ]\n}\n";
+}
 
-    start = std::chrono::high_resolution_clock::now();
-    total = 0;
-    for(size_t i = 0; i < M*N; ++i)
+// Only understands the files written by write_json().
+std::unordered_map<std::string, double> read_baseline(const char* path)
+{
+    std::unordered_map<std::string, double> medians;
+    std::ifstream in(path);
+    if(!in)
     {
-        small* t = ecs.get<small>(shuffled_ids[i]);
-        total += t != nullptr ? 1 : 0;
+        fprintf(stderr, "Unable to read baseline %s\n", path);
+        return medians;
     }
-    finish = std::chrono::high_resolution_clock::now();
-    diff = std::chrono::duration_cast<std::chrono::duration<float>>(finish-start).count();
-    printf("small random access %f (count: %d)\n", diff, total);
+    std::stringstream ss;
+    ss << in.rdbuf();
+    std::string text = ss.str();
 
-    start = std::chrono::high_resolution_clock::now();
-    total = 0;
-    for(size_t i = 0; i < M*N; ++i)
+    const std::string name_key = "\"name\": \"";
+    const std::string median_key = "\"median\": ";
+    size_t pos = 0;
+    while((pos = text.find(name_key, pos)) != std::string::npos)
     {
-        large* t = ecs.get<large>(shuffled_ids[i]);
-        total += t != nullptr ? 1 : 0;
+        pos += name_key.size();
+        size_t name_end = text.find('"', pos);
+        size_t median = text.find(median_key, name_end);
+        if(name_end == std::string::npos || median == std::string::npos)
+            break;
+        medians[text.substr(pos, name_end - pos)] =
+            strtod(text.c_str() + median + median_key.size(), nullptr);
+        pos = name_end;
     }
-    finish = std::chrono::high_resolution_clock::now();
-    diff = std::chrono::duration_cast<std::chrono::duration<float>>(finish-start).count();
-    printf("large random access %f (count: %d)\n", diff, total);
+    return medians;
 }
 
-void test_iteration()
+// Returns the number of benchmarks that got slower than allowed.
+unsigned compare_baseline(const char* path)
 {
-    monkero::scene ecs;
-    std::default_random_engine rng(0);
-    std::uniform_int_distribution<int> dist1(0, 1);
-    std::uniform_int_distribution<int> dist2(0, 1000);
+    std::unordered_map<std::string, double> baseline = read_baseline(path);
+    unsigned regressions = 0;
+    printf("\nComparison against %s:\n", path);
+    for(const result& r: results)
+    {
+        auto it = baseline.find(r.name);
+        if(it == baseline.end() || it->second <= 0)
+        {
+            printf("%-32s (no baseline)\n", r.name.c_str());
+            continue;
+        }
+        double ratio = r.median / it->second;
+        bool regressed = ratio > 1.0 + opts.tolerance;
+        printf(
+            "%-32s %+7.1f%%%s\n", r.name.c_str(), (ratio - 1.0) * 100.0,
+            regressed ? "  REGRESSION" : ""
+        );
+        if(regressed) regressions++;
+    }
+    return regressions;
+}
 
-    // Populate ECS.
-    size_t N = 1<<22;
-    std::vector<monkero::entity> ids;
-    for(size_t i = 0; i < N; ++i)
+// Benchmarks of fast paths that only exist to beat another benchmark, listed
+// as {fast path, the slower way}. Both timings come from the same noisy run,
+// so this is only reported and never fails the run.
+const std::pair<const char*, const char*> expected_wins[] = {
+    {"bulk erase", "erase"},
+};
+
+void report_expected_wins()
+{
+    auto find = [](const char* name) -> const result* {
+        for(const result& r: results)
+            if(r.name == name) return &r;
+        return nullptr;
+    };
+    bool printed_header = false;
+    for(auto [fast_name, slow_name]: expected_wins)
     {
-        monkero::entity id = ecs.add();
-        if(dist2(rng)==0) ecs.attach(id, tag{});
-        if(dist1(rng)==0) ecs.attach(id, small{2});
-        if(dist1(rng)==0) ecs.attach(id, large{2, {}});
-        ids.push_back(id);
+        const result* fast = find(fast_name);
+        const result* slow = find(slow_name);
+        if(!fast || !slow || slow->median <= 0)
+            continue;
+        if(!printed_header)
+        {
+            printf("\nExpected wins:\n");
+            printed_header = true;
+        }
+        double ratio = fast->median / slow->median;
+        bool lost = ratio >= 1.0;
+        printf(
+            "%-32s %+7.1f%% vs %s%s\n", fast_name, (ratio - 1.0) * 100.0,
+            slow_name, lost ? "  NOT FASTER" : ""
+        );
     }
+}
+
+//==============================================================================
+// Benchmarks
+//==============================================================================
+
+struct fixture
+{
+    monkero::scene ecs;
+    std::vector<monkero::entity> ids;
+};
 
-    // Try iteration.
-    size_t M = 100;
-    auto start = std::chrono::high_resolution_clock::now();
-    size_t total = 1;
-    for(size_t i = 0; i < M; ++i)
+// Every entity gets each component with a probability of 1/odds.
+std::unique_ptr<fixture> make_fixture(
+    size_t n,
+    int tag_odds,
+    int small_odds,
+    int large_odds
+){
+    auto f = std::make_unique<fixture>();
+    std::default_random_engine rng(0);
+    for(size_t i = 0; i < n; ++i)
     {
-        ecs([&](tag& t){
-            total <<= 1;
-        });
+        monkero::entity id = f->ecs.add();
+        if(rng() % tag_odds == 0) f->ecs.attach(id, tag{});
+        if(rng() % small_odds == 0) f->ecs.attach(id, small{2});
+        if(rng() % large_odds == 0) f->ecs.attach(id, large{2, {}});
+        f->ids.push_back(id);
     }
-    auto finish = std::chrono::high_resolution_clock::now();
-    auto diff = std::chrono::duration_cast<std::chrono::duration<float>>(finish-start).count();
-    printf("tag iteration %f (count: %lu, rubbish: %lu)\n", diff, M * ecs.count<tag>(), total);
+    return f;
+}
+
+template<int... I>
+void attach_fillers(
+    monkero::scene& ecs,
+    monkero::entity id,
+    std::integer_sequence<int, I...>
+){
+    (ecs.attach(id, filler<I>{I}), ...);
+}
+
+template<typename T>
+void bench_random_access(const char* name, fixture& f)
+{
+    measure_shared(name, f, [&](fixture& f){
+        size_t total = 0;
+        for(monkero::entity id: f.ids)
+            total += f.ecs.get<T>(id) != nullptr ? 1 : 0;
+        sink = sink + total;
+    });
+}
+
+void test_random_access()
+{
+    auto f = make_fixture(1<<16, 10, 10, 10);
 
-    start = std::chrono::high_resolution_clock::now();
-    total = 1;
-    for(size_t i = 0; i < M; ++i)
+    // Random ids are precalculated.
+    std::default_random_engine rng(0);
+    std::vector<monkero::entity> ids = f->ids;
+    f->ids.clear();
+    for(size_t i = 0; i < 16; ++i)
     {
-        ecs([&](small& t){
-            total *= t.data;
-        });
+        std::shuffle(ids.begin(), ids.end(), rng);
+        f->ids.insert(f->ids.end(), ids.begin(), ids.end());
     }
-    finish = std::chrono::high_resolution_clock::now();
-    diff = std::chrono::duration_cast<std::chrono::duration<float>>(finish-start).count();
-    printf("small iteration %f (count: %lu, rubbish: %lu)\n", diff, M * ecs.count<small>(), total);
 
-    start = std::chrono::high_resolution_clock::now();
-    total = 1;
-    for(size_t i = 0; i < M; ++i)
+    bench_random_access<tag>("tag random access", *f);
+    bench_random_access<small>("small random access", *f);
+    bench_random_access<large>("large random access", *f);
+
+    // Some of the handles are stale.
+    std::vector<monkero::entity_handle> handles;
+    for(monkero::entity id: f->ids)
+        handles.push_back(f->ecs.get_handle(id));
+    for(size_t i = 0; i < ids.size(); i += 7)
+        f->ecs.remove(ids[i]);
+    measure_shared("handle alive check", *f, [&](fixture& f){
+        size_t total = 0;
+        for(const monkero::entity_handle& h: handles)
+            total += f.ecs.alive(h) ? 1 : 0;
+        sink = sink + total;
+    });
+}
+
+void test_iteration()
+{
+    auto f = make_fixture(1<<20, 1000, 2, 2);
+
+    measure_shared("tag iteration", *f, [&](fixture& f){
+        size_t total = 0;
+        f.ecs([&](tag&){ total++; });
+        sink = sink + total;
+    });
+    measure_shared("small iteration", *f, [&](fixture& f){
+        size_t total = 0;
+        f.ecs([&](small& s){ total += s.data; });
+        sink = sink + total;
+    });
+    measure_shared("read-only small iteration", *f, [&](fixture& f){
+        size_t total = 0;
+        const monkero::scene& ecs = f.ecs;
+        ecs([&](const small& s){ total += s.data; });
+        sink = sink + total;
+    });
+    measure_shared("small range iteration", *f, [&](fixture& f){
+        // The last sixteenth of the entities in 16 separate ranges.
+        size_t total = 0;
+        monkero::entity step = (1<<20) / 256;
+        for(monkero::entity begin = 15 * 16 * step; begin < (1<<20); begin += step)
+            f.ecs.foreach_range(begin, begin + step, [&](small& s){
+                total += s.data;
+            });
+        sink = sink + total;
+    });
+    measure_shared("small sliced iteration", *f, [&](fixture& f){
+        // One whole pass in slices of 4096 entities.
+        size_t total = 0;
+        monkero::scene::cursor c(f.ecs);
+        while(!c.foreach([&](small& s){ total += s.data; }, 4096));
+        sink = sink + total;
+    });
+    measure_shared("large iteration", *f, [&](fixture& f){
+        size_t total = 0;
+        f.ecs([&](large& l){ total += l.data; });
+        sink = sink + total;
+    });
+    measure_shared("combo iteration", *f, [&](fixture& f){
+        size_t total = 0;
+        f.ecs([&](tag&, small& s, large& l){ total += s.data + l.data; });
+        sink = sink + total;
+    });
+    measure_shared("large join iteration", *f, [&](fixture& f){
+        size_t total = 0;
+        f.ecs([&](small& s, large& l){ total += s.data + l.data; });
+        sink = sink + total;
+    });
+    measure_shared("optional join iteration", *f, [&](fixture& f){
+        size_t total = 0;
+        f.ecs([&](small& s, large* l, tag* t){
+            total += s.data + (l ? l->data : 0) + (t ? 1 : 0);
+        });
+        sink = sink + total;
+    });
+    auto sparse = make_fixture(1<<20, 4, 4, 4);
+    measure_shared("sparse join iteration", *sparse, [&](fixture& f){
+        size_t total = 0;
+        f.ecs([&](tag&, small& s, large& l){ total += s.data + l.data; });
+        sink = sink + total;
+    });
+    // Both components are rare and mostly live in different blocks of IDs.
+    auto clustered = std::make_unique<fixture>();
+    for(size_t i = 0; i < (1<<20); ++i)
     {
-        ecs([&](large& t){
-            total *= t.data;
+        monkero::entity id = clustered->ecs.add();
+        bool block = (i >> 14) & 1;
+        if(i % (block ? 97 : 4093) == 0) clustered->ecs.attach(id, small{2});
+        if(i % (block ? 4093 : 89) == 0) clustered->ecs.attach(id, large{2, {}});
+    }
+    measure_shared("clustered sparse join iteration", *clustered, [&](fixture& f){
+        size_t total = 0;
+        f.ecs([&](small& s, large& l){ total += s.data + l.data; });
+        sink = sink + total;
+    });
+    monkero::scene::query<tag, small, large> sparse_query(sparse->ecs);
+    measure_shared("sparse join query", *sparse, [&](fixture&){
+        size_t total = 0;
+        sparse_query([&](tag&, small& s, large& l){ total += s.data + l.data; });
+        sink = sink + total;
+    });
+    measure_shared("small find_if", *f, [&](fixture& f){
+        // The match is a sixteenth of the way in.
+        monkero::entity target = (1<<20) / 16;
+        sink = sink + f.ecs.find_if([&](monkero::entity id, small&){
+            return id >= target;
         });
+    });
+    // Two kinds of entities created in turns, either mixed together or kept
+    // apart with ID pools.
+    for(bool pooled: {false, true})
+    {
+        auto mixed = std::make_unique<fixture>();
+        std::size_t pools[2] = {0, 0};
+        if(pooled)
+        {
+            pools[0] = mixed->ecs.add_id_pool(1<<18);
+            pools[1] = mixed->ecs.add_id_pool(1<<18);
+        }
+        for(size_t i = 0; i < (1<<18); ++i)
+        {
+            for(int kind = 0; kind < 2; ++kind)
+            {
+                monkero::entity id = pooled ?
+                    mixed->ecs.add_in_pool(pools[kind]) : mixed->ecs.add();
+                if(kind == 0) mixed->ecs.attach(id, small{2});
+                else mixed->ecs.attach(id, large{2, {}});
+            }
+        }
+        measure_shared(
+            pooled ? "pooled small iteration" : "interleaved small iteration",
+            *mixed,
+            [&](fixture& f){
+                size_t total = 0;
+                f.ecs([&](small& s){ total += s.data; });
+                sink = sink + total;
+            }
+        );
     }
-    finish = std::chrono::high_resolution_clock::now();
-    diff = std::chrono::duration_cast<std::chrono::duration<float>>(finish-start).count();
-    printf("large iteration %f (count: %lu, rubbish: %lu)\n", diff, M * ecs.count<large>(), total);
-
-    start = std::chrono::high_resolution_clock::now();
-    total = 1;
-    size_t sum = 0;
-    for(size_t i = 0; i < M; ++i)
+
+    // Few survivors spread over a large ID range, before and after
+    // compacting them.
+    auto churned = make_fixture(1<<20, 4, 1, 64);
+    std::vector<monkero::entity> dead;
+    std::default_random_engine churn_rng(0);
+    for(monkero::entity id: churned->ids)
+        if(churn_rng() % 16 != 0) dead.push_back(id);
+    churned->ecs.remove(dead.data(), dead.size());
+    for(bool compacted: {false, true})
     {
-        ecs([&](tag& t1, small& t2, large& t3){
-            total *= t2.data;
-            total *= t3.data;
-            sum++;
-        });
+        if(compacted) churned->ecs.compact();
+        measure_shared(
+            compacted ? "compacted small iteration" : "churned small iteration",
+            *churned,
+            [&](fixture& f){
+                size_t total = 0;
+                f.ecs([&](small& s){ total += s.data; });
+                sink = sink + total;
+            }
+        );
     }
-    finish = std::chrono::high_resolution_clock::now();
-    diff = std::chrono::duration_cast<std::chrono::duration<float>>(finish-start).count();
-    printf("combo iteration %f (count: %lu, rubbish: %lu)\n", diff, sum, total);
+
+    // Many tiny loops in a scene with lots of component types.
+    auto crowded = make_fixture(64, 1, 1, 1);
+    attach_fillers(
+        crowded->ecs, crowded->ids[0], std::make_integer_sequence<int, 32>()
+    );
+    measure_shared("crowded small iteration", *crowded, [&](fixture& f){
+        size_t total = 0;
+        for(int i = 0; i < 1000; ++i)
+            f.ecs([&](small& s){ total += s.data; });
+        sink = sink + total;
+    });
+    measure_shared("chunk iteration", *f, [&](fixture& f){
+        size_t total = 0;
+        f.ecs.foreach_chunk([&](monkero::entity, size_t count, small* s){
+            for(size_t i = 0; i < count; ++i)
+                total += s[i].data;
+        });
+        sink = sink + total;
+    });
+}
+
+void test_modification()
+{
+    constexpr size_t N = 1<<16;
+    auto empty = [](){ return std::make_unique<fixture>(); };
+    auto populated = [](){
+        auto f = make_fixture(N, 2, 1, 4);
+        std::shuffle(
+            f->ids.begin(), f->ids.end(), std::default_random_engine(0)
+        );
+        return f;
+    };
+
+    measure("insert", empty, [&](fixture& f){
+        for(size_t i = 0; i < N; ++i)
+            f.ecs.add(small{int(i)}, large{int(i), {}});
+    });
+    measure("bulk insert", empty, [&](fixture& f){
+        f.ecs.add_many<small, large>(N);
+    });
+    measure("erase", populated, [&](fixture& f){
+        for(monkero::entity id: f.ids)
+            f.ecs.remove(id);
+    });
+    // Short-lived entities, whose IDs are released and reused right away.
+    measure("churn", empty, [&](fixture& f){
+        monkero::entity ids[3];
+        for(size_t i = 0; i < N * 4; ++i)
+        {
+            for(monkero::entity& id: ids)
+                id = f.ecs.add();
+            for(monkero::entity id: ids)
+                f.ecs.remove(id);
+        }
+    });
+    measure("churn with components", empty, [&](fixture& f){
+        monkero::entity ids[3];
+        for(size_t i = 0; i < N; ++i)
+        {
+            for(monkero::entity& id: ids)
+                id = f.ecs.add(small{int(i)});
+            for(monkero::entity id: ids)
+                f.ecs.remove(id);
+        }
+    });
+    // The same, but in a scene that also has lots of unrelated component
+    // types. Removal only visits the containers in the entity's signature,
+    // so this should stay close to "erase".
+    auto crowded = [&](){
+        auto f = populated();
+        attach_fillers(
+            f->ecs, f->ecs.add(), std::make_integer_sequence<int, 32>()
+        );
+        return f;
+    };
+    measure("crowded erase", crowded, [&](fixture& f){
+        for(monkero::entity id: f.ids)
+            f.ecs.remove(id);
+    });
+    measure("bulk erase", populated, [&](fixture& f){
+        f.ecs.remove(f.ids.data(), f.ids.size());
+    });
+    measure("erase component type", populated, [&](fixture& f){
+        f.ecs.remove_all<small>();
+    });
+    measure("batched changes", populated, [&](fixture& f){
+        f.ecs([&](monkero::entity id, small&){
+            if(id&1) f.ecs.remove<small>(id);
+            else f.ecs.attach(id, tag{});
+        });
+    });
+}
+
+void test_events()
+{
+    constexpr size_t N = 1<<16;
+    auto with_handlers = [](){
+        auto f = std::make_unique<fixture>();
+        f->ecs.add_event_handler(
+            [](monkero::scene&, const monkero::add_component<small>& e){
+                sink = sink + e.data->data;
+            }
+        );
+        f->ecs.add_event_handler(
+            [](monkero::scene&, const ping& e){ sink = sink + e.value; }
+        );
+        return f;
+    };
+
+    measure("emit", with_handlers, [&](fixture& f){
+        for(size_t i = 0; i < N * 16; ++i)
+            f.ecs.emit(ping{int(i)});
+    });
+    measure("insert with handler", with_handlers, [&](fixture& f){
+        for(size_t i = 0; i < N; ++i)
+            f.ecs.add(small{int(i)});
+    });
+}
+
+void test_concat_copy()
+{
+    constexpr size_t N = 1<<16;
+    auto source = make_fixture(N, 2, 1, 4);
+
+    measure("concat", [](){ return std::make_unique<fixture>(); },
+        [&](fixture& f){ f.ecs.concat(source->ecs); }
+    );
+    measure("copy", [](){ return std::make_unique<fixture>(); },
+        [&](fixture& f){
+            for(monkero::entity id: source->ids)
+                f.ecs.copy(source->ecs, id);
+        }
+    );
 }
 
-int main()
+void test_search()
 {
+    constexpr size_t N = 1<<16;
+    std::vector<std::string> names;
+    for(size_t i = 0; i < N; ++i)
+        names.push_back("entity" + std::to_string(i));
+
+    measure("insert with search index",
+        [](){ return std::make_unique<fixture>(); },
+        [&](fixture& f){
+            for(const std::string& name: names)
+                f.ecs.add(named{name});
+        }
+    );
+
+    fixture f;
+    for(const std::string& name: names)
+        f.ecs.add(named{name});
+    std::shuffle(names.begin(), names.end(), std::default_random_engine(0));
+    measure_shared("search", f, [&](fixture& f){
+        size_t total = 0;
+        for(const std::string& name: names)
+            total += f.ecs.find<named>(name);
+        sink = sink + total;
+    });
+}
+
+void usage(const char* program)
+{
+    fprintf(
+        stderr,
+        "Usage: %s [--warmup N] [--repetitions N] [--filter SUBSTRING]\n"
+        "       [--json OUTPUT] [--baseline JSON] [--tolerance FRACTION]\n"
+        "Exits with a failure if any median is slower than the baseline by\n"
+        "more than the tolerance (default 0.1). Fast paths that don't beat\n"
+        "the slower way that they replace are only reported.\n",
+        program
+    );
+}
+
+int main(int argc, char** argv)
+{
+    for(int i = 1; i < argc; ++i)
+    {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i+1] : nullptr;
+        if(!value)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        if(!strcmp(arg, "--warmup")) opts.warmup = atoi(value);
+        else if(!strcmp(arg, "--repetitions")) opts.repetitions = atoi(value);
+        else if(!strcmp(arg, "--filter")) opts.filter = value;
+        else if(!strcmp(arg, "--json")) opts.json_path = value;
+        else if(!strcmp(arg, "--baseline")) opts.baseline_path = value;
+        else if(!strcmp(arg, "--tolerance")) opts.tolerance = atof(value);
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        ++i;
+    }
+    if(opts.repetitions == 0)
+        opts.repetitions = 1;
+
     test_random_access();
     test_iteration();
+    test_modification();
+    test_events();
+    test_concat_copy();
+    test_search();
 
-    return 0;
-}
+    if(opts.json_path)
+        write_json(opts.json_path);
+    report_expected_wins();
+    unsigned regressions = 0;
+    if(opts.baseline_path)
+        regressions = compare_baseline(opts.baseline_path);
 
+    return regressions > 0 ? 1 : 0;
+}
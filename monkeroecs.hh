@@ -49,8 +49,18 @@ SOFTWARE.
  */
 #ifndef MONKERO_ECS_HH
 #define MONKERO_ECS_HH
+//#define MONKERO_64BIT_ENTITIES
 //#define MONKERO_CONTAINER_DEALLOCATE_BUCKETS
 //#define MONKERO_CONTAINER_DEBUG_UTILS
+
+// How many entities ahead of the current one component data is prefetched
+// during foreach. Zero disables prefetching. It only pays off when the
+// iterated components don't fit in the last level cache; otherwise, the
+// extra cursor costs more than it saves.
+#ifndef MONKERO_PREFETCH_DISTANCE
+#define MONKERO_PREFETCH_DISTANCE 0
+#endif
+
 #include <cstdint>
 #include <map>
 #include <functional>
@@ -60,9 +70,21 @@ SOFTWARE.
 #include <utility>
 #include <type_traits>
 #include <algorithm>
+#include <iterator>
 #include <tuple>
 #include <map>
 #include <cstring>
+#include <cstddef>
+#include <memory_resource>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <thread>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 #ifdef MONKERO_CONTAINER_DEBUG_UTILS
 #include <iostream>
 #include <bitset>
@@ -81,15 +103,85 @@ SOFTWARE.
 namespace monkero
 {
 
+// Define this before including to use 64-bit entity IDs.
+//#define MONKERO_64BIT_ENTITIES
+
 /** The entity type, it's just an ID.
  * An entity alone will not take up memory in the ECS, only once components are
- * added does the entity truly use memory. You can change this to uint64_t if
- * you truly need over 4 billion entities and have tons of memory.
+ * added does the entity truly use memory. Define MONKERO_64BIT_ENTITIES if
+ * you truly need over 4 billion entities and have tons of memory; it doubles
+ * the size of the jump tables and of everything else that stores IDs.
+ * The per-ID bookkeeping of scenes and queries is paged, so it only takes
+ * memory around the IDs in use. Component containers still have a bucket
+ * slot for every 2^bucket_exp IDs up to the highest one, so components of
+ * IDs far past 32 bits should get a large component_bucket_exp_hint.
  */
+#ifdef MONKERO_64BIT_ENTITIES
+using entity = std::uint64_t;
+#else
 using entity = std::uint32_t;
+#endif
 // You are not allowed to use this entity ID.
 inline constexpr entity INVALID_ENTITY = 0;
 
+/** An entity ID along with the generation of that ID.
+ * The generation changes whenever the ID is released, so a handle kept
+ * around never refers to a later entity that happens to reuse the ID. See
+ * scene::get_handle() and scene::alive().
+ */
+struct entity_handle
+{
+    entity id = INVALID_ENTITY;
+    std::uint32_t generation = 0;
+
+    bool operator==(const entity_handle& other) const
+    { return id == other.id && generation == other.generation; }
+    bool operator!=(const entity_handle& other) const
+    { return !(*this == other); }
+};
+
+/** The new IDs that scene::compact() gave to the old ones.
+ * Live IDs keep their order, so this only stores runs of consecutive IDs.
+ * Its size depends on how scattered the live entities were, not on how high
+ * their IDs went.
+ */
+class entity_translation
+{
+public:
+    /** Returns the new ID of an old ID, INVALID_ENTITY if the old ID was not
+     * in use.
+     */
+    entity operator[](entity old_id) const
+    {
+        auto it = std::upper_bound(
+            runs.begin(), runs.end(), old_id,
+            [](entity id, const run& r){ return id < r.old_first; }
+        );
+        if(it == runs.begin())
+            return INVALID_ENTITY;
+        --it;
+        entity offset = old_id - it->old_first;
+        return offset < it->count ? it->new_first + offset : INVALID_ENTITY;
+    }
+
+    /** Returns true if no ID was translated, which is the case when nothing
+     * was compacted or there were no entities.
+     */
+    bool empty() const { return runs.empty(); }
+
+private:
+    friend class scene;
+
+    // IDs [old_first, old_first+count) became [new_first, new_first+count).
+    struct run
+    {
+        entity old_first;
+        entity new_first;
+        entity count;
+    };
+    std::vector<run> runs;
+};
+
 class scene;
 
 /** A built-in event emitted when a component is added to the ECS. */
@@ -111,6 +203,17 @@ struct remove_component
     Component* data; /**< A pointer to the component (it's not destroyed quite yet) */
 };
 
+/** A built-in event emitted by scene::compact() once entities have been
+ * renumbered. Anything that stores entity IDs should translate them here.
+ */
+struct renumber_entities
+{
+    /** New ID of each old ID. IDs that were not in use map to
+     * INVALID_ENTITY.
+     */
+    const entity_translation* translation_table;
+};
+
 /** This class is used to receive events of the specified type(s).
  * Once it is destructed, no events will be delivered to the associated
  * callback function anymore.
@@ -201,6 +304,83 @@ public:
     using empty_default_impl = void;
 };
 
+#ifdef __linux__
+/** A memory resource that places component buckets on huge pages.
+ * Large scenes can spend a lot of time in TLB misses when accessing components
+ * randomly. This resource reserves one large range of virtual memory up front
+ * and asks the kernel to back it with transparent huge pages. The memory is
+ * only committed when it is first touched. Freed blocks are merged with the
+ * free ranges next to them, and later allocations of any size are taken from
+ * those ranges first. Memory is only given back to the kernel once a whole
+ * huge page has become free, as discarding a part of one would split it.
+ *
+ * Allocations smaller than a page, and anything that no longer fits in the
+ * reserved range, are passed on to the upstream resource. Give this to the
+ * scene constructor to use it for all component storage. Like the scene, it
+ * is not thread-safe.
+ */
+class huge_page_resource: public std::pmr::memory_resource
+{
+public:
+    /** The constructor.
+     * \param reserve_size The size of the virtual address range to reserve.
+     * This does not use physical memory until the range is used.
+     * \param upstream The resource for small allocations and overflow.
+     */
+    inline explicit huge_page_resource(
+        std::size_t reserve_size = std::size_t(1) << 36,
+        std::pmr::memory_resource* upstream = std::pmr::get_default_resource()
+    );
+    huge_page_resource(const huge_page_resource& other) = delete;
+    inline ~huge_page_resource();
+
+    /** Returns the number of bytes currently allocated from the reserved range.
+     * \return The number of bytes in use, rounded up to whole pages.
+     */
+    inline std::size_t get_used_size() const;
+
+protected:
+    inline void* do_allocate(std::size_t bytes, std::size_t alignment) override;
+    inline void do_deallocate(
+        void* p,
+        std::size_t bytes,
+        std::size_t alignment
+    ) override;
+    inline bool do_is_equal(
+        const std::pmr::memory_resource& other
+    ) const noexcept override;
+
+private:
+    static constexpr std::size_t huge_page_size = std::size_t(2) << 20;
+
+    inline std::size_t round_size(
+        std::size_t bytes,
+        std::size_t alignment
+    ) const;
+    inline bool owns(void* p) const;
+    static inline std::uintptr_t align_up(
+        std::uintptr_t address,
+        std::size_t alignment
+    );
+    static inline std::uintptr_t align_down(
+        std::uintptr_t address,
+        std::size_t alignment
+    );
+
+    std::pmr::memory_resource* upstream;
+    std::size_t page_size;
+    std::uint8_t* mapping;
+    std::size_t mapping_size;
+    std::uint8_t* begin;
+    std::uint8_t* end;
+    std::uint8_t* top;
+    std::size_t used_size;
+    // Released ranges below top by their start address, to their sizes.
+    // Neighbouring ranges are always merged, and no range ends at top.
+    std::pmr::map<std::uint8_t*, std::size_t> free_ranges;
+};
+#endif
+
 template<typename T, typename=void>
 struct has_bucket_exp_hint: std::false_type { };
 
@@ -241,6 +421,218 @@ struct component_bucket_exp_hint
     }();
 };
 
+/** Lists the fields of a component that is stored as a structure of arrays.
+ * \see component_soa_fields
+ */
+template<auto... Members>
+struct soa_fields {};
+
+template<typename T, typename=void>
+struct has_soa_fields: std::false_type { };
+
+template<typename T>
+struct has_soa_fields<T, std::void_t<typename T::soa_fields>>
+: std::true_type { };
+
+template<typename T, bool = has_soa_fields<T>::value>
+struct default_soa_fields { using type = void; };
+
+template<typename T>
+struct default_soa_fields<T, true> { using type = typename T::soa_fields; };
+
+/** Provides structure-of-arrays storage choice for the component container.
+ * By default, components are stored as arrays of whole structures. If the hot
+ * loops only touch a few fields of a wide component, each field can be stored
+ * in its own array instead. To do that for your component type, you have two
+ * options:
+ * A (preferred when you can modify the component type):
+ *     Add a `using soa_fields = monkero::soa_fields<&T::a, &T::b, ...>;`
+ * B (needed when you cannot modify the component type):
+ *     Specialize component_soa_fields for your type and provide a
+ *     `using type = monkero::soa_fields<&T::a, &T::b, ...>;`
+ * The component must be an aggregate and all of its fields must be listed in
+ * declaration order, as the whole structure is rebuilt from them when needed.
+ * Such components are accessed through soa_ref and soa_span instead of
+ * pointers. add_component and remove_component events point to a temporary
+ * copy of the component.
+ */
+template<typename T>
+struct component_soa_fields
+{
+    using type = typename default_soa_fields<T>::type;
+};
+
+template<typename T>
+inline constexpr bool is_soa_component =
+    !std::is_void_v<typename component_soa_fields<T>::type>;
+
+template<typename M>
+struct soa_member;
+
+template<typename C, typename F>
+struct soa_member<F C::*> { using type = F; };
+
+template<typename T, typename Fields = typename component_soa_fields<T>::type>
+struct soa_layout;
+
+// The field arrays of a bucket are laid out back-to-back in one block.
+template<typename T, auto... Members>
+struct soa_layout<T, soa_fields<Members...>>
+{
+    static_assert(sizeof...(Members) > 0, "SoA components must have fields");
+    static_assert(
+        std::is_aggregate_v<T>,
+        "SoA components must be aggregates"
+    );
+
+    static constexpr std::size_t field_count = sizeof...(Members);
+    static constexpr std::size_t bucket_size =
+        std::size_t(1) << component_bucket_exp_hint<T>::value;
+    static constexpr auto members = std::make_tuple(Members...);
+
+    template<std::size_t I>
+    using field_type = typename soa_member<
+        std::tuple_element_t<I, std::remove_const_t<decltype(members)>>
+    >::type;
+
+    static constexpr std::array<std::size_t, field_count> offsets = []{
+        std::size_t sizes[] = {
+            sizeof(typename soa_member<decltype(Members)>::type)...
+        };
+        std::size_t aligns[] = {
+            alignof(typename soa_member<decltype(Members)>::type)...
+        };
+        std::array<std::size_t, field_count> result = {};
+        std::size_t offset = 0;
+        for(std::size_t i = 0; i < field_count; ++i)
+        {
+            offset = (offset + aligns[i] - 1) / aligns[i] * aligns[i];
+            result[i] = offset;
+            offset += sizes[i] * bucket_size;
+        }
+        return result;
+    }();
+    static constexpr std::size_t block_size =
+        offsets[field_count-1] + sizeof(field_type<field_count-1>) * bucket_size;
+
+    template<auto Member>
+    static constexpr std::size_t index_of();
+
+    template<typename F>
+    static F* at(std::uint8_t* block, std::size_t field, std::size_t index);
+
+    static void construct(std::uint8_t* block, std::size_t index, T& value);
+    static T load(std::uint8_t* block, std::size_t index);
+    static void destroy(std::uint8_t* block, std::size_t index);
+};
+
+/** A reference to the fields of one structure-of-arrays component.
+ * Takes the place of a component pointer, so it can be null and be tested in
+ * conditions.
+ * \see component_soa_fields
+ */
+template<typename T>
+class soa_ref
+{
+template<typename> friend class soa_ref;
+template<typename> friend class soa_span;
+template<typename> friend class component_container;
+public:
+    using layout = soa_layout<std::remove_const_t<T>>;
+
+    soa_ref(std::nullptr_t = nullptr);
+    soa_ref(std::uint8_t* block, std::size_t index);
+    template<
+        typename U,
+        typename = std::enable_if_t<std::is_same_v<const U, T>>
+    > soa_ref(const soa_ref<U>& other);
+
+    /** Returns a field of the component.
+     * \tparam Member Pointer to the member, e.g. &particle::x.
+     */
+    template<auto Member>
+    auto& get() const;
+
+    /** Gathers a copy of the whole component. */
+    std::remove_const_t<T> load() const;
+
+    explicit operator bool() const;
+    bool operator==(const soa_ref& other) const;
+    bool operator!=(const soa_ref& other) const;
+
+private:
+    std::uint8_t* block;
+    std::size_t index;
+};
+
+/** Consecutive structure-of-arrays components, as given by
+ * scene::foreach_chunk(). Each field is a plain array, so a loop over one
+ * field only touches the memory of that field.
+ */
+template<typename T>
+class soa_span
+{
+public:
+    using layout = soa_layout<std::remove_const_t<T>>;
+
+    soa_span(soa_ref<std::remove_const_t<T>> first);
+
+    /** Returns the array of a field.
+     * \tparam Member Pointer to the member, e.g. &particle::x.
+     */
+    template<auto Member>
+    auto* get() const;
+
+    /** Returns a reference to the i:th component of the span. */
+    soa_ref<T> operator[](std::size_t i) const;
+
+private:
+    soa_ref<T> first;
+};
+
+// Bit twiddling helpers. The bitscans must not be given zero.
+inline unsigned bitscan_forward(std::uint64_t mt);
+inline unsigned bitscan_reverse(std::uint64_t mt);
+inline unsigned popcount(std::uint64_t mt);
+// Hints that the cache line at ptr will be read soon.
+inline void prefetch(const void* ptr);
+
+/** Statistics of the recycled bucket blocks of a component container.
+ * \see scene::get_bucket_pool_stats()
+ */
+struct bucket_pool_stats
+{
+    std::size_t allocations = 0; /**< Blocks allocated from the heap */
+    std::size_t reuses = 0; /**< Blocks taken from the pool instead */
+    std::size_t deallocations = 0; /**< Blocks given back to the heap */
+    std::size_t retained = 0; /**< Blocks currently waiting in the pool */
+};
+
+// Recycles fixed-size bucket blocks, so that buckets that get emptied and
+// refilled don't cause heap traffic every time.
+template<typename U>
+class bucket_pool
+{
+public:
+    bucket_pool(std::size_t block_size, std::pmr::memory_resource* resource);
+    bucket_pool(const bucket_pool& other) = delete;
+    ~bucket_pool();
+
+    U* allocate();
+    void release(U* block);
+    void set_limit(std::size_t limit);
+    void add_stats(bucket_pool_stats& stats) const;
+
+private:
+    std::size_t block_size;
+    std::size_t limit;
+    std::pmr::memory_resource* resource;
+    std::pmr::vector<U*> blocks;
+    std::size_t allocations;
+    std::size_t reuses;
+    std::size_t deallocations;
+};
+
 class component_container_base
 {
 public:
@@ -248,10 +640,20 @@ public:
 
     inline virtual void start_batch() = 0;
     inline virtual void finish_batch() = 0;
-    inline virtual void erase(entity id) = 0;
+    // The scene passes false for update_signature when it clears the
+    // signature itself.
+    inline virtual void erase(entity id, bool update_signature = true) = 0;
+    inline virtual void erase_many(const entity* ids, std::size_t count) = 0;
     inline virtual void clear() = 0;
     inline virtual std::size_t size() const = 0;
+    inline virtual std::vector<entity> split_ranges(
+        std::uint32_t max_ranges
+    ) const = 0;
     inline virtual void update_search_index() = 0;
+    inline virtual void set_bucket_pool_limit(std::size_t limit) = 0;
+    inline virtual std::size_t renumber(
+        const entity_translation& translation_table
+    ) = 0;
     inline virtual void list_entities(
         std::map<entity, entity>& translation_table
     ) = 0;
@@ -274,7 +676,7 @@ public:
     std::uint32_t bucket_mask;
     std::uint32_t bucket_exp;
     entity*** bucket_jump_table;
-    std::uint32_t current_bucket;
+    entity current_bucket;
     entity current_entity;
     entity* current_jump_table;
 };
@@ -287,28 +689,51 @@ public:
     static constexpr uint32_t bitmask_bits = 64;
     static constexpr uint32_t bitmask_shift = 6; // 64 = 2**6
     static constexpr uint32_t bitmask_mask = 0x3F;
-    static constexpr uint32_t initial_bucket_count = 16u;
+    static constexpr entity initial_bucket_count = 16u;
+    // Batches with at least this many changes are applied by relinking the
+    // whole affected range instead of one change at a time.
+    static constexpr uint32_t batch_rebuild_threshold = 256u;
     static constexpr bool tag_component = std::is_empty_v<T>;
     static constexpr std::uint32_t bucket_exp =
         component_bucket_exp_hint<T>::value;
     static constexpr std::uint32_t bucket_mask = (1u<<bucket_exp)-1;
     static constexpr std::uint32_t bucket_bitmask_units =
         std::max(1u, (1u<<bucket_exp)>>bitmask_shift);
+    static constexpr bool soa_component = is_soa_component<T>;
+    static_assert(
+        !(soa_component && tag_component),
+        "Tag components cannot be stored as structures of arrays"
+    );
+
+    // Components are handed out through these; they're soa_refs for SoA
+    // components and plain pointers otherwise.
+    using pointer = std::conditional_t<soa_component, soa_ref<T>, T*>;
+    using const_pointer =
+        std::conditional_t<soa_component, soa_ref<const T>, const T*>;
 
     component_container(scene& ctx);
     component_container(component_container&& other) = delete;
     component_container(const component_container& other) = delete;
     ~component_container();
 
-    T* operator[](entity e);
-    const T* operator[](entity e) const;
+    pointer operator[](entity e);
+    const_pointer operator[](entity e) const;
 
     void insert(entity id, T&& value);
 
     template<typename... Args>
     void emplace(entity id, Args&&... value);
 
-    void erase(entity id) override;
+    // Adds components built by init(id) for the consecutive IDs
+    // [first, first+count). If nothing exists in that range yet, the bitmasks
+    // and jump table are filled for whole buckets at a time.
+    template<typename F>
+    void emplace_range(entity first, entity count, F&& init);
+
+    void erase(entity id, bool update_signature = true) override;
+    // Erases many entities at once, the IDs must be in ascending order.
+    // Their signatures are left for the scene to clear.
+    void erase_many(const entity* ids, std::size_t count) override;
 
     void clear() override;
 
@@ -328,8 +753,8 @@ public:
 
         iterator& operator++();
         iterator operator++(int);
-        std::pair<entity, T*> operator*();
-        std::pair<entity, const T*> operator*() const;
+        std::pair<entity, pointer> operator*();
+        std::pair<entity, const_pointer> operator*() const;
 
         bool operator==(const iterator& other) const;
         bool operator!=(const iterator& other) const;
@@ -346,17 +771,52 @@ public:
 
         component_container* from;
         entity current_entity;
-        std::uint32_t current_bucket;
+        entity current_bucket;
         entity* current_jump_table;
         T* current_components;
     };
 
     iterator begin();
     iterator end();
+    // Returns an iterator to the first entity whose ID is not less than id.
+    iterator lower_bound(entity id);
     std::size_t size() const override;
 
+    // Splits the ID space into at most max_ranges bucket-aligned ranges with
+    // roughly equal numbers of entities in them. Range i is
+    // [result[i], result[i+1]), the last entry is INVALID_ENTITY which stands
+    // for the end of the ID space.
+    std::vector<entity> split_ranges(std::uint32_t max_ranges) const override;
+
+    // Low-level access for bulk iteration. These reflect the state that is
+    // being iterated, that is, changes made during batching are not visible.
+    // Returns the presence bits of entities [word_index*64, word_index*64+64).
+    bitmask_type get_bitmask_word(entity word_index) const;
+    // Moves word_index forward to the first word that has entities in it.
+    // Returns false if there is no such word.
+    bool find_next_word(entity& word_index) const;
+    // Returns the first entity whose ID is not less than id, or
+    // INVALID_ENTITY if there is none.
+    entity find_next_entity(entity id) const;
+    // Returns the component of an entity, which must exist.
+    pointer get_unsafe(entity e);
+    // Starts fetching the component of an entity into cache, if it has a
+    // memory location of its own.
+    void prefetch_component(entity e) const;
+
     void update_search_index() override;
 
+    void set_bucket_pool_limit(std::size_t limit) override;
+    bucket_pool_stats get_bucket_pool_stats() const;
+
+    // Moves every entity to translation_table[id]. The new IDs must keep the
+    // order of the old ones and never be greater than them. Returns the
+    // number of bytes of buckets that were released.
+    std::size_t renumber(
+        const entity_translation& translation_table
+    ) override;
+    // Bytes of bitmask, jump table and component buckets currently in use.
+    std::size_t get_bucket_memory() const;
     void list_entities(
         std::map<entity, entity>& translation_table
     ) override;
@@ -380,60 +840,141 @@ public:
 #endif
 
 private:
-    T* get_unsafe(entity e);
     void destroy();
     void jump_table_insert(entity id);
     void jump_table_erase(entity id);
     std::size_t get_top_bitmask_size() const;
-    bool bitmask_empty(std::uint32_t bucket_index) const;
+    bool bitmask_empty(entity bucket_index) const;
     void bitmask_insert(entity id);
     // Returns a hint to whether the whole bucket should be removed or not.
     bool bitmask_erase(entity id);
 
+    template<typename U>
+    U* allocate_array(std::size_t count);
+    template<typename U>
+    void deallocate_array(U* ptr, std::size_t count);
+
     template<typename... Args>
     void bucket_insert(entity id, Args&&... args);
+    template<typename... Args>
+    pointer bucket_construct(entity id, Args&&... args);
     void bucket_erase(entity id, bool signal);
-    void bucket_self_erase(std::uint32_t bucket_index);
-    void try_jump_table_bucket_erase(std::uint32_t bucket_index);
+    void bucket_self_erase(entity bucket_index);
+    void try_jump_table_bucket_erase(entity bucket_index);
     void ensure_bucket_space(entity id);
-    void ensure_bitmask(std::uint32_t bucket_index);
-    void ensure_jump_table(std::uint32_t bucket_index);
+    void ensure_bitmask(entity bucket_index);
+    void ensure_jump_table(entity bucket_index);
+    // Enters batch mode if the scene is batching and this container has not
+    // been modified during the batch yet.
+    void join_batch();
     bool batch_change(entity id);
+    void batch_rebuild();
     entity find_previous_entity(entity id);
-    void signal_add(entity id, T* data);
-    void signal_remove(entity id, T* data);
-    static unsigned bitscan_reverse(std::uint64_t mt);
+    // Whether the state that iterators go through has any entities.
+    bool has_iterable_entities() const;
+    void signal_add(entity id, pointer data);
+    void signal_remove(entity id, pointer data);
+    void destroy_component(pointer data);
+    static pointer get_pointer(T* bucket, entity index);
     static bool find_bitmask_top(
         bitmask_type* bitmask,
-        std::uint32_t count,
-        std::uint32_t& top_index
+        entity count,
+        entity& top_index
     );
     static bool find_bitmask_previous_index(
         bitmask_type* bitmask,
-        std::uint32_t index,
-        std::uint32_t& prev_index
+        entity index,
+        entity& prev_index
+    );
+    static bool find_bitmask_next_index(
+        bitmask_type* bitmask,
+        entity count,
+        entity index,
+        entity& next_index
     );
 
     struct alignas(T) t_mimicker { std::uint8_t pad[sizeof(T)]; };
 
+    // SoA buckets are raw blocks that only pretend to be arrays of T.
+    static constexpr std::size_t component_block_units = []{
+        if constexpr(soa_component)
+            return (soa_layout<T>::block_size + sizeof(T) - 1) / sizeof(T);
+        else return std::size_t(1) << bucket_exp;
+    }();
+
     // Bucket data
-    std::uint32_t entity_count;
-    std::uint32_t bucket_count;
+    // Bucket indices and counts take as many bits as entity IDs do.
+    entity entity_count;
+    entity bucket_count;
     bitmask_type** bucket_bitmask;
     bitmask_type* top_bitmask;
     entity** bucket_jump_table;
     T** bucket_components;
 
+    // All memory of the container is allocated from here.
+    std::pmr::memory_resource* resource;
+
+    // Released buckets waiting for reuse
+    bucket_pool<bitmask_type> bitmask_pool;
+    bucket_pool<entity> jump_table_pool;
+    bucket_pool<t_mimicker> component_pool;
+
     // Batching data
     bool batching;
-    std::uint32_t batch_checklist_size;
-    std::uint32_t batch_checklist_capacity;
+    entity batch_checklist_size;
+    entity batch_checklist_capacity;
     entity* batch_checklist;
     bitmask_type** bucket_batch_bitmask;
 
     // Search index (kinda separate, but handy to keep around here.)
     scene* ctx;
     search_index<T> search;
+
+    // Bit of this component type in the entity signatures of the scene.
+    std::size_t type_key;
+};
+
+/** Excludes entities that have the given component from foreach().
+ * It is taken by value as a parameter of the foreach callback and carries no
+ * data, e.g. `[](entity id, A& a, without<B>){}` visits entities with A but
+ * not B.
+ * \tparam Component The component type that visited entities must not have.
+ */
+template<typename Component>
+struct without {};
+
+/** Iteration callbacks may return this to control the iteration.
+ * Callbacks that return void always continue.
+ */
+enum class iteration_control
+{
+    CONTINUE = 0,
+    BREAK
+};
+
+/** Decides which released entity ID gets reused first.
+ */
+enum class id_policy
+{
+    /** The most recently released ID, which is the cheapest to find. */
+    REUSE_LATEST = 0,
+    /** The lowest released ID, which keeps live entities packed into as few
+     * component buckets as possible. */
+    REUSE_LOWEST
+};
+
+/** The outcome of scene::compact().
+ */
+struct compact_result
+{
+    /** New ID of each old ID. IDs that were not in use map to
+     * INVALID_ENTITY.
+     */
+    entity_translation translation_table;
+    /** Bytes of bitmask, jump table and component buckets that were released
+     * to the bucket pools.
+     */
+    std::size_t released_bytes = 0;
 };
 
 /** The primary class of the ECS.
@@ -443,9 +984,17 @@ private:
 class scene
 {
 friend class event_subscription;
+template<typename> friend class component_container;
 public:
-    /** The constructor. */
-    inline scene();
+    /** The constructor.
+     * \param resource The memory resource that all component storage and
+     * entity bookkeeping of this scene is allocated from. It must outlive the
+     * scene. Event handlers still use the default allocator, as std::function
+     * does not support custom allocators.
+     */
+    inline scene(
+        std::pmr::memory_resource* resource = std::pmr::get_default_resource()
+    );
     /** The destructor.
      * It ensures that all remove_component events are sent for the remainder
      * of the components before event handlers are cleared.
@@ -462,7 +1011,11 @@ public:
      *   references or pointers to components. The function is only called when
      *   all referenced components are present for the entity; pointer
      *   parameters are optional and can be null if the component is not
-     *   present.
+     *   present. Structure-of-arrays components are taken as soa_ref<T>
+     *   instead, which is required. A without<T> parameter skips all entities
+     *   that have T; at least one parameter must not be a without<T>. If \p f
+     *   returns iteration_control::BREAK, no further entities are visited and
+     *   batching is finished as usual.
      */
     template<typename F>
     inline void foreach(F&& f);
@@ -473,6 +1026,123 @@ public:
     template<typename F>
     inline void operator()(F&& f);
 
+    /** Calls a given function for all suitable entities without modifying
+     * the scene.
+     * Batching is not used and no component containers are created, so this
+     * can be called from multiple threads at once as long as nothing modifies
+     * the scene at the same time. Component types that have never been added
+     * are treated as empty.
+     * \param f The iteration callback, see foreach() for the parameters.
+     *   Components must be taken as const references, pointers to const or
+     *   soa_ref<const T>.
+     * \see foreach()
+     */
+    template<typename F>
+    inline void foreach(F&& f) const;
+
+    /** Same as foreach() const, just syntactic sugar.
+     * \see foreach() const
+     */
+    template<typename F>
+    inline void operator()(F&& f) const;
+
+    /** Calls a given function for suitable entities within an ID range.
+     * Iteration starts directly from the first entity in the range, so this
+     * is useful for splitting work into jobs or resuming it later. Batching
+     * is enabled automatically, like with foreach().
+     * \param begin The first entity ID to consider.
+     * \param end The entity ID after the last one to consider.
+     *   INVALID_ENTITY means that there is no upper bound.
+     * \param f The iteration callback, see foreach() for the parameters.
+     * \see foreach()
+     */
+    template<typename F>
+    inline void foreach_range(entity begin, entity end, F&& f);
+
+    /** Same as foreach_range(), but read-only like foreach() const.
+     * \see foreach_range()
+     * \see foreach() const
+     */
+    template<typename F>
+    inline void foreach_range(entity begin, entity end, F&& f) const;
+
+    /** Finds the first suitable entity that matches a predicate.
+     * Entities are tested in ascending ID order and the search stops at the
+     * first match. Batching is enabled automatically, like with foreach().
+     * \param pred The predicate, taking the same parameters as the callback of
+     *   foreach() and returning bool.
+     * \return The first entity for which \p pred returned true, or
+     *   INVALID_ENTITY if there was none.
+     * \see foreach()
+     */
+    template<typename F>
+    inline entity find_if(F&& pred);
+
+    /** Same as find_if(), but read-only like foreach() const.
+     * \see find_if()
+     * \see foreach() const
+     */
+    template<typename F>
+    inline entity find_if(F&& pred) const;
+
+    /** Calls a given function for all suitable entities using multiple threads.
+     * The entities are split into bucket-aligned ranges of the smallest
+     * required component container, and the ranges are handed out to worker
+     * threads. The call returns once all entities have been visited. Batching
+     * is enabled for the duration of the whole call just like with foreach().
+     * \param f The iteration callback, see foreach() for the parameters. It is
+     *   called concurrently from multiple threads, so it must be safe to do
+     *   so. It may modify the components it's given, but it must not add or
+     *   remove entities or components, not even under a lock: that can
+     *   reallocate container internals that the other threads are reading.
+     *   Debug builds assert this. Collect the changes and apply them after
+     *   the call instead.
+     *   Returning iteration_control::BREAK stops handing out further ranges,
+     *   but other threads still finish the ranges they are working on.
+     * \param thread_count The number of threads to use, including the calling
+     *   thread. Zero uses std::thread::hardware_concurrency().
+     * \see foreach()
+     */
+    template<typename F>
+    inline void parallel_foreach(F&& f, unsigned thread_count = 0);
+
+    /** Calls a given function for runs of consecutive suitable entities.
+     * This is meant for loops that want to process plain arrays of components,
+     * e.g. for vectorization. Batching is enabled automatically, like with
+     * foreach().
+     * \param f The chunk callback. Its signature must be
+     *   void(entity first, std::size_t count, Components*... data), where all
+     *   listed components are required. It is called for each run of
+     *   consecutive entity IDs [first, first+count) that have all of the
+     *   components, and data[i] is the component of entity first+i. Runs are
+     *   split where any of the containers changes buckets, so a single run
+     *   never spans more than one bucket of any component type. For tag
+     *   components, the pointer refers to the single shared instance and must
+     *   not be indexed. Structure-of-arrays components are taken as
+     *   soa_span<T> instead of a pointer.
+     */
+    template<typename F>
+    inline void foreach_chunk(F&& f);
+
+    /** A persistent list of the entities that have all of the given
+     * components. It is kept up to date as components are added and removed,
+     * so iterating it is a linear walk instead of a join.
+     * \see query
+     */
+    template<typename... Components>
+    class query;
+
+    /** A position in entity ID order that iteration can be resumed from, so
+     * that long-running work can be split into slices over several frames.
+     * \see cursor
+     */
+    class cursor;
+
+    /** The set of component types that an entity has.
+     * \see signature
+     */
+    class signature;
+
     /** Adds an entity without components.
      * \return The new entity ID.
      */
@@ -487,6 +1157,56 @@ public:
     template<typename... Components>
     entity add(Components&&... components);
 
+    /** Adds many entities with the same set of components at once.
+     * The new entities get consecutive fresh IDs, which lets the component
+     * containers fill in their bookkeeping for whole buckets at a time. This
+     * is much faster than calling add() in a loop. Released IDs are not
+     * reused by this function.
+     * \tparam Components The components that all new entities get.
+     * \param count The number of entities to add.
+     * \param init Either nothing, in which case all components are
+     *   default-constructed, or one callback per component type, in the same
+     *   order. The callbacks are called as Component init(entity id) for each
+     *   new entity.
+     * \return The ID of the first new entity, the rest follow it. If the IDs
+     *   would run out, nothing is added and INVALID_ENTITY is returned.
+     */
+    template<typename... Components, typename... F>
+    entity add_many(std::size_t count, F&&... init);
+
+    /** Selects which released IDs get reused first by add() and
+     * add_in_pool().
+     * \param policy The new policy, id_policy::REUSE_LATEST by default.
+     */
+    inline void set_id_policy(id_policy policy);
+
+    /** Reserves a range of entity IDs for entities that belong together.
+     * Entities that are added through the same pool get IDs close to each
+     * other, so they share component buckets instead of being scattered
+     * among unrelated entities. IDs released from a pool are only reused by
+     * that pool.
+     * \param capacity The number of IDs to reserve. If the IDs would run out,
+     *   the pool gets as many as there are left.
+     * \return The index of the new pool, for add_in_pool(). Pools last for the
+     *   lifetime of the scene, clear_entities() empties them and reserves
+     *   their ranges again.
+     */
+    inline std::size_t add_id_pool(std::size_t capacity);
+
+    /** Adds an entity without components, taking its ID from a pool.
+     * \param pool The index of the pool, given by add_id_pool().
+     * \return The new entity ID, or INVALID_ENTITY if the pool is full.
+     */
+    inline entity add_in_pool(std::size_t pool);
+
+    /** Adds an entity with initial components, taking its ID from a pool.
+     * \param pool The index of the pool, given by add_id_pool().
+     * \param components All components that should be included, see add().
+     * \return The new entity ID, or INVALID_ENTITY if the pool is full.
+     */
+    template<typename... Components>
+    entity add_in_pool(std::size_t pool, Components&&... components);
+
     /** Adds a component to an existing entity, building it in-place.
      * \param id The entity that components are added to.
      * \param args Parameters for the constructor of the Component type.
@@ -510,6 +1230,15 @@ public:
      */
     inline void remove(entity id);
 
+    /** Removes all components of many entities and releases their IDs.
+     * The IDs are sorted first, so that each component container is walked
+     * once in order, bucket by bucket, instead of jumping around for each
+     * entity.
+     * \param ids The entities to remove. Each must be listed only once.
+     * \param count The number of entities in \p ids.
+     */
+    inline void remove(const entity* ids, std::size_t count);
+
     /** Removes a component of an entity.
      * \tparam Component The type of component to remove from the entity.
      * \param id The entity whose component to remove.
@@ -517,12 +1246,53 @@ public:
     template<typename Component>
     void remove(entity id);
 
+    /** Removes a component from all entities that have it.
+     * This is much faster than removing it from each entity separately.
+     * remove_component events are still sent for each removed component.
+     * \tparam Component The type of component to remove.
+     */
+    template<typename Component>
+    void remove_all();
+
     /** Removes all components of all entities.
      * It also resets the entity counter, so this truly invalidates all
      * previous entities!
      */
     inline void clear_entities();
 
+    /** Returns a handle that can later be checked with alive().
+     * Generations are only tracked for IDs that got a handle, so removing
+     * entities that never had one costs nothing extra.
+     * \param id The entity to make a handle for. It must not have been
+     *   removed.
+     * \return The handle of the entity.
+     */
+    inline entity_handle get_handle(entity id);
+
+    /** Checks if the entity of a handle still exists.
+     * This takes constant time and doesn't look at any components.
+     * \param handle The handle to check.
+     * \return false if the entity has been removed since the handle was made,
+     *   true otherwise.
+     */
+    inline bool alive(entity_handle handle) const;
+
+    /** Renumbers all entities densely and packs their components into as
+     * few buckets as possible.
+     * The relative order of the IDs is kept, and entities in ID pools stay in
+     * their pools. Components are moved to their new IDs, so pointers to
+     * them must be fetched again. A renumber_entities event is emitted once
+     * done, queries update themselves with it. All previous entity handles
+     * become stale and cursors should be reset.
+     * \return The translation from old IDs to new ones, and the amount of
+     *   bucket memory that became unused. To give it back to the memory
+     *   resource, see set_bucket_pool_limit(). Nothing is done during
+     *   batching, which is signaled by an empty translation table.
+     * \note The work done depends on the number of live and released IDs,
+     *   not on how high they go, so huge ID pools are fine.
+     */
+    inline compact_result compact();
+
     /** Copies entities from another ECS to this one.
      * \param other the other ECS whose entities and components to copy to this.
      * \param translation_table if not nullptr, will be filled in with the
@@ -546,7 +1316,9 @@ public:
 
     /** Starts batching behaviour for add/remove.
      * Batching allows you to safely add and remove components while you iterate
-     * over them, but comes with no performance benefit.
+     * over them, but comes with no performance benefit. Containers only enter
+     * batch mode once they are modified, so untouched component types cost
+     * nothing.
      */
     inline void start_batch();
 
@@ -569,22 +1341,34 @@ public:
     template<typename Component>
     bool has(entity id) const;
 
+    /** Returns the set of component types that an entity has.
+     * This is cheap to check for several component types at once, as it
+     * doesn't involve the component containers at all.
+     * \param id The entity whose component types to return.
+     * \return The signature of the entity. It refers to the scene, so it
+     *   should not be kept around while components are added or removed.
+     */
+    inline signature get_signature(entity id) const;
+
     /** Returns the desired component of an entity.
      * Const version.
      * \tparam Component the component type to get.
      * \param id The id of the entity whose component to fetch.
-     * \return A pointer to the component if present, null otherwise.
+     * \return A pointer to the component if present, null otherwise. For
+     * structure-of-arrays components, this is a soa_ref instead.
      */
     template<typename Component>
-    const Component* get(entity id) const;
+    typename component_container<Component>::const_pointer
+    get(entity id) const;
 
     /** Returns the desired component of an entity.
      * \tparam Component the component type to get.
      * \param id The id of the entity whose component to fetch.
-     * \return A pointer to the component if present, null otherwise.
+     * \return A pointer to the component if present, null otherwise. For
+     * structure-of-arrays components, this is a soa_ref instead.
      */
     template<typename Component>
-    Component* get(entity id);
+    typename component_container<Component>::pointer get(entity id);
 
     /** Uses search_index<Component> to find the desired component.
      * \tparam Component the component type to search for.
@@ -594,7 +1378,8 @@ public:
      * \see update_search_index()
      */
     template<typename Component, typename... Args>
-    Component* find_component(Args&&... args);
+    typename component_container<Component>::pointer
+    find_component(Args&&... args);
 
     /** Uses search_index<Component> to find the desired component.
      * Const version.
@@ -605,7 +1390,8 @@ public:
      * \see update_search_index()
      */
     template<typename Component, typename... Args>
-    const Component* find_component(Args&&... args) const;
+    typename component_container<Component>::const_pointer
+    find_component(Args&&... args) const;
 
     /** Uses search_index<Component> to find the desired entity.
      * \tparam Component the component type to search for.
@@ -627,6 +1413,38 @@ public:
      */
     inline void update_search_indices();
 
+    /** Sets how many released buckets each component container keeps around.
+     * Buckets are released when clear_entities() is called or, with
+     * MONKERO_CONTAINER_DEALLOCATE_BUCKETS, when they become empty. Retained
+     * buckets are reused instead of allocating new ones, so that repeatedly
+     * emptying and refilling buckets doesn't cause heap traffic. The limit
+     * applies separately to each kind of bucket block (component storage,
+     * bitmasks and jump tables) and defaults to zero.
+     * \param limit The maximum number of retained blocks of each kind. Applies
+     * to all current and future component containers.
+     */
+    inline void set_bucket_pool_limit(std::size_t limit);
+
+    /** Sets the bucket retention limit of one component type.
+     * \tparam Component the component type whose limit to set.
+     * \param limit The maximum number of retained blocks of each kind.
+     * \see set_bucket_pool_limit()
+     */
+    template<typename Component>
+    void set_bucket_pool_limit(std::size_t limit);
+
+    /** Returns the bucket allocation counters of one component type.
+     * \tparam Component the component type whose counters to return.
+     * \return The bucket pool statistics of that component container.
+     */
+    template<typename Component>
+    bucket_pool_stats get_bucket_pool_stats() const;
+
+    /** Returns the memory resource given to the constructor.
+     * \return The memory resource used by this scene.
+     */
+    inline std::pmr::memory_resource* get_memory_resource() const;
+
     /** Calls all handlers of the given event type.
      * \tparam EventType the type of the event to emit.
      * \param event The event to emit.
@@ -687,49 +1505,206 @@ public:
     event_subscription subscribe(F&&... callbacks);
 
 private:
-    template<bool pass_id, typename... Components>
-    struct foreach_impl
-    {
-        template<typename F>
-        static void foreach(scene& ctx, F&& f);
+    // Maps foreach parameter types to the component types they refer to.
+    template<typename Component>
+    struct component_target { using type = Component; };
 
-        template<typename Component>
-        struct iterator_wrapper
-        {
-            static constexpr bool required = true;
-            typename component_container<std::decay_t<std::remove_pointer_t<std::decay_t<Component>>>>::iterator iter;
-        };
+    template<typename Component>
+    struct component_target<soa_ref<Component>>
+    { using type = std::remove_const_t<Component>; };
 
-        template<typename Component>
-        static inline auto make_iterator(scene& ctx)
-        {
-            return iterator_wrapper<Component>{
-                ctx.get_container<std::decay_t<std::remove_pointer_t<std::decay_t<Component>>>>().begin()
-            };
-        }
+    template<typename Component>
+    struct component_target<without<Component>> { using type = Component; };
 
-        template<typename Component>
-        struct converter
-        {
-            template<typename T>
-            static inline T& convert(T*);
-        };
+    template<typename Component>
+    struct is_without: std::false_type {};
 
-        template<typename F>
-        static void call(
-            F&& f,
-            entity id,
-            std::decay_t<std::remove_pointer_t<std::decay_t<Components>>>*... args
-        );
-    };
+    template<typename Component>
+    struct is_without<without<Component>>: std::true_type {};
 
-    template<typename... Components>
-    foreach_impl<true, Components...>
-    foreach_redirector(const std::function<void(entity id, Components...)>&);
+    // Whether a foreach parameter can be used to modify the component.
+    template<typename Component>
+    struct is_read_only: std::bool_constant<
+        std::is_const_v<
+            std::remove_pointer_t<std::remove_reference_t<Component>>
+        > || (!std::is_reference_v<Component> && !std::is_pointer_v<Component>)
+    > {};
+
+    template<typename Component>
+    struct is_read_only<soa_ref<Component>>: std::is_const<Component> {};
+
+    // Calls an iteration callback, returns false if it asked to stop.
+    template<typename F, typename... Args>
+    static inline bool invoke_callback(F& f, Args&&... args);
+
+    // Per-ID values, kept in pages of 1<<page_exp IDs that are only
+    // allocated once something is stored in them. The pages are found through
+    // directories of 1<<directory_exp pages, which are also allocated on
+    // demand, so far apart IDs only cost memory around the IDs in use.
+    template<typename T>
+    class id_page_table
+    {
+    public:
+        static constexpr unsigned page_exp = 10;
+        static constexpr std::size_t page_size = std::size_t(1) << page_exp;
+
+        // Each ID has width values, which start out value-initialized.
+        id_page_table(
+            std::pmr::memory_resource* resource,
+            std::size_t width = 1
+        );
+        id_page_table(const id_page_table& other) = delete;
+        ~id_page_table();
+
+        // Returns the values of an ID, null if its page doesn't exist.
+        T* find(entity id) const;
+        // Like find(), but allocates the page if needed.
+        T* ensure(entity id);
+        // Calls f(first, values) for every allocated page, where values has
+        // the values of IDs [first, first+page_size).
+        template<typename F>
+        void foreach_page(F&& f) const;
+        std::size_t get_width() const;
+        // Changes the number of values per ID, keeping the existing ones.
+        void set_width(std::size_t width);
+        // Releases all pages, which resets every ID.
+        void clear();
+        void swap(id_page_table& other);
+
+    private:
+        static constexpr unsigned directory_exp = 10;
+        static constexpr std::size_t directory_size =
+            std::size_t(1) << directory_exp;
+
+        T* allocate_page(std::size_t width);
+        void deallocate_page(T* page, std::size_t width);
+
+        std::pmr::memory_resource* resource;
+        std::size_t width;
+        std::pmr::vector<T**> directories;
+    };
+
+    template<bool pass_id, typename... Components>
+    struct foreach_impl
+    {
+        template<typename F>
+        static void foreach(scene& ctx, F&& f);
+
+        template<typename F>
+        static void parallel_foreach(
+            scene& ctx,
+            F&& f,
+            unsigned thread_count
+        );
+
+        template<typename F>
+        static void foreach_range(
+            scene& ctx,
+            F&& f,
+            entity begin,
+            entity end
+        );
+
+        template<typename F>
+        static void foreach_read_only(
+            const scene& ctx,
+            F&& f,
+            entity begin,
+            entity end
+        );
+
+        template<bool read_only, typename F>
+        static entity find_if(scene& ctx, F&& pred);
+
+        // Iterates from begin until stop() returns true after visiting an
+        // entity. Returns the ID following the last visited entity, or
+        // INVALID_ENTITY if the end was reached.
+        template<typename F, typename S>
+        static entity foreach_slice(scene& ctx, F&& f, entity begin, S&& stop);
+
+        // Iterates over [begin, end), INVALID_ENTITY as end means no limit.
+        // When read_only is set, missing containers aren't created, but are
+        // treated as empty instead. Returns false if the callback stopped the
+        // iteration.
+        template<bool read_only, typename F>
+        static bool foreach_in_range(
+            scene& ctx,
+            F&& f,
+            entity begin,
+            entity end
+        );
+
+        template<typename Component>
+        using component_type = typename component_target<
+            std::decay_t<std::remove_pointer_t<std::decay_t<Component>>>
+        >::type;
+
+        template<typename Component>
+        using container_type = component_container<component_type<Component>>;
+
+        // Per-component state of the bitmask join in foreach_in_range().
+        template<typename Component>
+        struct join_state
+        {
+            static constexpr bool excluded =
+                is_without<std::decay_t<Component>>::value;
+            static constexpr bool required =
+                !std::is_pointer_v<Component> && !excluded;
+            container_type<Component>* container;
+            std::uint64_t word;
+        };
+
+        template<bool read_only, typename Component>
+        static inline container_type<Component>* get_join_container(
+            scene& ctx
+        );
+
+        template<typename Component>
+        struct converter
+        {
+            template<typename T>
+            static inline T& convert(T*);
+        };
+
+        template<typename F>
+        static bool call(
+            F&& f,
+            entity id,
+            typename container_type<Components>::pointer... args
+        );
+    };
+
+    template<typename... Components>
+    struct foreach_chunk_impl
+    {
+        template<typename F>
+        static void foreach(scene& ctx, F&& f);
+    };
+
+    template<typename R, typename... Components>
+    static foreach_impl<true, Components...>
+    foreach_redirector(const std::function<R(entity id, Components...)>&);
+
+    template<typename R, typename... Components>
+    static foreach_impl<false, Components...>
+    foreach_redirector(const std::function<R(Components...)>&);
+
+    template<typename Component>
+    struct chunk_component_type;
+
+    template<typename Component>
+    struct chunk_component_type<Component*>
+    { using type = std::remove_cv_t<Component>; };
+
+    template<typename Component>
+    struct chunk_component_type<soa_span<Component>>
+    { using type = std::remove_cv_t<Component>; };
 
     template<typename... Components>
-    foreach_impl<false, Components...>
-    foreach_redirector(const std::function<void(Components...)>&);
+    foreach_chunk_impl<typename chunk_component_type<Components>::type...>
+    foreach_chunk_redirector(
+        const std::function<void(entity, std::size_t, Components...)>&
+    );
 
     template<typename T>
     T event_handler_type_detector(const std::function<void(scene&, const T&)>&);
@@ -743,12 +1718,55 @@ private:
     template<typename Component>
     void try_attach_dependencies(entity id);
 
+    // Called before anything that adds or removes entities or components,
+    // which is not allowed during parallel_foreach().
+    inline void assert_not_parallel() const;
+
+    inline std::uint32_t get_generation(entity id) const;
+    // Makes existing handles of a released ID stale.
+    inline void release_generation(entity id);
+    // Makes all existing handles stale.
+    inline void release_all_generations();
+
+    // Keep the signatures up to date, called by the component containers.
+    inline void signature_insert(entity id, std::size_t key);
+    inline void signature_erase(entity id, std::size_t key);
+    inline void signature_erase_all(std::size_t key);
+
+    // A reserved range of IDs, [first, first+capacity).
+    struct id_pool
+    {
+        entity first;
+        std::size_t capacity;
+        // IDs [first, first+used) have been handed out at some point.
+        std::size_t used;
+        std::pmr::vector<entity> reusable_ids;
+    };
+
+    // Sorts IDs in ascending order. It's a radix sort, since comparison
+    // sorts are slow enough to eat up what sorting is meant to win.
+    static inline void sort_ids(std::pmr::vector<entity>& ids);
+
+    inline void reserve_id_pool(id_pool& pool, std::size_t capacity);
+    // Returns a released ID to the pool it came from, or to reusable_ids.
+    inline void release_id(entity id);
+    // Takes a released ID according to the policy, INVALID_ENTITY if there
+    // are none.
+    inline entity reuse_id(std::pmr::vector<entity>& ids);
+
     template<typename Component>
     component_container<Component>& get_container() const;
 
+    // Like get_container(), but returns null instead of creating the
+    // container if it doesn't exist yet.
+    template<typename Component>
+    component_container<Component>* find_container() const;
+
     template<typename Component>
     static size_t get_component_type_key();
-    inline static size_t component_type_key_counter = 0;
+    // Atomic, because keys can get assigned from read-only foreach calls in
+    // multiple threads.
+    inline static std::atomic<size_t> component_type_key_counter = 0;
 
     template<typename Event>
     static size_t get_event_type_key();
@@ -760,12 +1778,43 @@ private:
     template<class C, typename F>
     void internal_bind_handler(size_t id, C* c, F&& f);
 
+    // Destroys containers that were allocated from the memory resource.
+    struct container_deleter
+    {
+        std::pmr::memory_resource* resource;
+        std::size_t size;
+        std::size_t alignment;
+
+        inline void operator()(component_container_base* c) const;
+    };
+
+    std::pmr::memory_resource* resource;
     entity id_counter;
-    std::vector<entity> reusable_ids;
-    std::vector<entity> post_batch_reusable_ids;
+    std::pmr::vector<entity> reusable_ids;
+    std::pmr::vector<entity> post_batch_reusable_ids;
+    id_policy policy;
+    // Sorted by ID, since they are reserved in increasing order.
+    std::pmr::vector<id_pool> id_pools;
+    // Generation of each entity ID relative to generation_base. It's odd
+    // once a handle has been made, and only then does releasing the ID
+    // increase it. Clearing the entities moves generation_base past
+    // generation_top, the highest generation given out so far.
+    id_page_table<std::uint32_t> generations;
+    std::uint32_t generation_base;
+    std::uint32_t generation_top;
+    // Component types of each entity as a bitset indexed by the type key,
+    // as many words per entity as there are type keys in use.
+    id_page_table<std::uint64_t> signatures;
     size_t subscriber_counter;
     int defer_batch;
-    mutable std::vector<std::unique_ptr<component_container_base>> components;
+    // True while parallel_foreach() runs its worker threads.
+    bool parallel_iterating;
+    // Containers that have been modified during the current batch.
+    std::pmr::vector<component_container_base*> batched_containers;
+    std::size_t bucket_pool_limit;
+    mutable std::pmr::vector<
+        std::unique_ptr<component_container_base, container_deleter>
+    > components;
 
     struct event_handler
     {
@@ -791,6 +1840,180 @@ public:
     static void ensure_dependency_components_exist(entity id, scene& ctx);
 };
 
+/** A cached list of the entities that have all of the given components.
+ * The list is maintained through add_component and remove_component events,
+ * so repeatedly iterating the same set of components is much cheaper than
+ * with scene::foreach() when the set changes little between iterations. The
+ * cost is paid when components are added or removed instead. The query must
+ * be destroyed before its scene.
+ * \note Due to the callback nature, queries are immovable.
+ * \tparam Components The component types that listed entities have.
+ */
+template<typename... Components>
+class scene::query
+{
+public:
+    /** Builds the list from the entities currently in the scene.
+     * \param ctx The scene to track.
+     */
+    query(scene& ctx);
+    query(const query& other) = delete;
+    query(query&& other) = delete;
+
+    query& operator=(const query& other) = delete;
+    query& operator=(query&& other) = delete;
+
+    /** Calls a given function for all listed entities.
+     * Batching is enabled for the duration of the call like with
+     * scene::foreach(), and changes to the list made during it are applied
+     * once iteration finishes. Entities are visited in no particular order.
+     * \param f The iteration callback, taking either (entity, Components&...)
+     *   or just (Components&...). Structure-of-arrays components are taken as
+     *   soa_ref<T>. It may return iteration_control::BREAK to stop early.
+     */
+    template<typename F>
+    void foreach(F&& f);
+
+    /** Same as foreach(), just syntactic sugar.
+     * \see foreach()
+     */
+    template<typename F>
+    void operator()(F&& f);
+
+    /** Returns the number of listed entities.
+     * \return The number of entities that have all of the components.
+     */
+    std::size_t size() const;
+
+    /** Checks if an entity is listed.
+     * \param id The entity to check.
+     * \return true if the entity is listed, false otherwise.
+     */
+    bool contains(entity id) const;
+
+private:
+    template<typename Component>
+    using pointer = typename component_container<Component>::pointer;
+
+    struct entry
+    {
+        entity id;
+        std::tuple<pointer<Components>...> components;
+    };
+
+    // Lists the entities from scratch, e.g. after they're renumbered.
+    void rebuild();
+    void refresh(entity id);
+    void insert(entity id);
+    void erase(entity id);
+
+    scene* ctx;
+    std::pmr::vector<entry> entries;
+    // Index of each entity in entries plus one, zero if it's not listed.
+    id_page_table<std::uint32_t> indices;
+    // Changes made while iterating are applied once iteration is done.
+    std::pmr::vector<entity> deferred;
+    unsigned iterating;
+    event_subscription sub;
+};
+
+/** Iterates over suitable entities a limited amount at a time.
+ * Each call continues from the entity where the previous one stopped, in
+ * ascending ID order. Only the position is stored, so entities and
+ * components can be added and removed freely between calls: removed
+ * entities are not visited, and new ones are visited if they come after the
+ * position and on the next pass otherwise.
+ */
+class scene::cursor
+{
+public:
+    /** Starts from the beginning.
+     * \param ctx The scene to iterate over.
+     */
+    inline cursor(scene& ctx);
+
+    /** Calls a given function for at most a given number of entities.
+     * Batching is enabled for the duration of the call like with
+     * scene::foreach().
+     * \param f The iteration callback, see scene::foreach() for the
+     *   parameters. The callback types may differ between calls. Returning
+     *   iteration_control::BREAK ends the slice early.
+     * \param max_count The maximum number of entities to visit.
+     * \return true if the end was reached, in which case the next call starts
+     *   over from the beginning.
+     */
+    template<typename F>
+    bool foreach(F&& f, std::size_t max_count);
+
+    /** Calls a given function for entities until a time budget runs out.
+     * The clock is checked after each visited entity, so the slice can end
+     * up exceeding the budget by the duration of one callback.
+     * \param f The iteration callback, see foreach().
+     * \param max_time The time budget.
+     * \return true if the end was reached, in which case the next call starts
+     *   over from the beginning.
+     */
+    template<typename F, typename Rep, typename Period>
+    bool foreach(F&& f, std::chrono::duration<Rep, Period> max_time);
+
+    /** Moves back to the beginning.
+     */
+    inline void reset();
+
+    /** Returns the current position.
+     * \return The first entity ID that the next call may visit.
+     */
+    inline entity get_position() const;
+
+private:
+    template<typename F, typename S>
+    bool foreach_slice(F&& f, S&& stop);
+
+    scene* ctx;
+    entity position;
+};
+
+/** The set of component types that an entity has, stored as a bitset over
+ * the component types. Checks only look at the bits, so they take the same
+ * time no matter how many entities or component types there are.
+ * \see scene::get_signature()
+ */
+class scene::signature
+{
+friend class scene;
+public:
+    /** Checks if all of the given component types are included.
+     * \tparam Components The component types to check.
+     * \return true if the entity has every one of the components.
+     */
+    template<typename... Components>
+    bool has() const;
+
+    /** Checks if any of the given component types are included.
+     * \tparam Components The component types to check.
+     * \return true if the entity has at least one of the components.
+     */
+    template<typename... Components>
+    bool has_any() const;
+
+    /** Returns the number of component types included.
+     * \return The number of different components the entity has.
+     */
+    inline std::size_t count() const;
+
+    /** Checks if two signatures have the same component types.
+     */
+    inline bool operator==(const signature& other) const;
+    inline bool operator!=(const signature& other) const;
+
+private:
+    inline signature(const std::uint64_t* words, std::size_t word_count);
+    inline bool test(std::size_t key) const;
+
+    const std::uint64_t* words;
+    std::size_t word_count;
+};
+
 
 //==============================================================================
 // Implementation
@@ -836,411 +2059,1404 @@ void search_index<Component>::update(scene&) {}
 template<typename Component>
 void search_index<Component>::remove_entity(entity, const Component&) {}
 
-template<typename T>
-component_container<T>::component_container(scene& ctx)
-:   entity_count(0), bucket_count(0),
-    bucket_bitmask(nullptr), top_bitmask(nullptr),
-    bucket_jump_table(nullptr), bucket_components(nullptr), batching(false),
-    batch_checklist_size(0), batch_checklist_capacity(0),
-    batch_checklist(nullptr), bucket_batch_bitmask(nullptr), ctx(&ctx)
-{
-}
-
-template<typename T>
-component_container<T>::~component_container()
+#ifdef __linux__
+huge_page_resource::huge_page_resource(
+    std::size_t reserve_size,
+    std::pmr::memory_resource* upstream
+):  upstream(upstream), page_size(sysconf(_SC_PAGESIZE)), mapping(nullptr),
+    mapping_size(0), begin(nullptr), end(nullptr), top(nullptr),
+    used_size(0), free_ranges(upstream)
 {
-    destroy();
+    // Reserve an extra huge page so that the usable range can be aligned to
+    // huge page boundaries.
+    mapping_size = reserve_size + huge_page_size;
+    void* ptr = mmap(
+        nullptr, mapping_size, PROT_READ|PROT_WRITE,
+        MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0
+    );
+    if(ptr == MAP_FAILED)
+    { // Everything will just go to upstream then.
+        mapping_size = 0;
+        return;
+    }
+    mapping = static_cast<std::uint8_t*>(ptr);
+    begin = reinterpret_cast<std::uint8_t*>(align_up(
+        reinterpret_cast<std::uintptr_t>(mapping), huge_page_size
+    ));
+    end = begin + reserve_size;
+    top = begin;
+#ifdef MADV_HUGEPAGE
+    madvise(begin, reserve_size, MADV_HUGEPAGE);
+#endif
 }
 
-template<typename T>
-T* component_container<T>::operator[](entity e)
+huge_page_resource::~huge_page_resource()
 {
-    if(!contains(e)) return nullptr;
-    return get_unsafe(e);
+    if(mapping)
+        munmap(mapping, mapping_size);
 }
 
-template<typename T>
-const T* component_container<T>::operator[](entity e) const
+std::size_t huge_page_resource::get_used_size() const
 {
-    return const_cast<component_container<T>*>(this)->operator[](e);
+    return used_size;
 }
 
-template<typename T>
-void component_container<T>::insert(entity id, T&& value)
+void* huge_page_resource::do_allocate(std::size_t bytes, std::size_t alignment)
 {
-    emplace(id, std::move(value));
-}
+    if(bytes < page_size || !mapping)
+        return upstream->allocate(bytes, alignment);
 
-template<typename T>
-template<typename... Args>
-void component_container<T>::emplace(entity id, Args&&... args)
-{
-    if(id == INVALID_ENTITY)
-        return;
+    std::size_t size = round_size(bytes, alignment);
+    std::size_t align = std::max(alignment, page_size);
 
-    ensure_bucket_space(id);
-    if(contains(id))
-    { // If we just replace something that exists, life is easy.
-        bucket_erase(id, true);
-        bucket_insert(id, std::forward<Args>(args)...);
-    }
-    else if(batching)
+    // The lowest released range that fits is used first, which keeps the
+    // used memory packed towards the start.
+    for(auto it = free_ranges.begin(); it != free_ranges.end(); ++it)
     {
-        entity_count++;
-        if(!batch_change(id))
+        std::uintptr_t range_begin = reinterpret_cast<std::uintptr_t>(it->first);
+        std::uintptr_t range_end = range_begin + it->second;
+        std::uintptr_t start = align_up(range_begin, align);
+        if(start + size > range_end)
+            continue;
+
+        free_ranges.erase(it);
+        if(start > range_begin)
         {
-            // If there was already a change, that means that there was an
-            // existing batched erase. That means that we can replace an
-            // existing object instead.
-            bucket_erase(id, true);
+            free_ranges.emplace(
+                reinterpret_cast<std::uint8_t*>(range_begin),
+                start - range_begin
+            );
         }
-        bucket_insert(id, std::forward<Args>(args)...);
-    }
-    else
-    {
-        entity_count++;
-        bitmask_insert(id);
-        jump_table_insert(id);
-        bucket_insert(id, std::forward<Args>(args)...);
+        if(start + size < range_end)
+        {
+            free_ranges.emplace(
+                reinterpret_cast<std::uint8_t*>(start + size),
+                range_end - start - size
+            );
+        }
+        used_size += size;
+        return reinterpret_cast<void*>(start);
     }
+
+    std::uintptr_t start = align_up(reinterpret_cast<std::uintptr_t>(top), align);
+    if(start + size > reinterpret_cast<std::uintptr_t>(end))
+        return upstream->allocate(bytes, alignment);
+
+    // Nothing ends at top, so the skipped part doesn't need to be merged.
+    if(start > reinterpret_cast<std::uintptr_t>(top))
+        free_ranges.emplace(top, start - reinterpret_cast<std::uintptr_t>(top));
+    top = reinterpret_cast<std::uint8_t*>(start + size);
+    used_size += size;
+    return reinterpret_cast<void*>(start);
 }
 
-template<typename T>
-void component_container<T>::erase(entity id)
-{
-    if(!contains(id))
+void huge_page_resource::do_deallocate(
+    void* p,
+    std::size_t bytes,
+    std::size_t alignment
+){
+    if(!owns(p))
+    {
+        upstream->deallocate(p, bytes, alignment);
         return;
-    entity_count--;
+    }
 
-    if(batching)
+    std::size_t size = round_size(bytes, alignment);
+    used_size -= size;
+    std::uint8_t* block_begin = static_cast<std::uint8_t*>(p);
+    std::uint8_t* block_end = block_begin + size;
+    std::uint8_t* range_begin = block_begin;
+    std::uint8_t* range_end = block_end;
+
+    auto next = free_ranges.lower_bound(block_begin);
+    if(next != free_ranges.end() && next->first == block_end)
     {
-        if(!batch_change(id))
-        {
-            // If there was already a change, that means that there was an
-            // existing batched add. Because it's not being iterated, we can
-            // just destroy it here.
-            bucket_erase(id, true);
-        }
-        else signal_remove(id, get_unsafe(id));
+        range_end += next->second;
+        next = free_ranges.erase(next);
     }
-    else
+    if(next != free_ranges.begin())
     {
-        bool erase_bucket = bitmask_erase(id);
-        jump_table_erase(id);
-        bucket_erase(id, true);
-        if(erase_bucket)
+        auto prev = std::prev(next);
+        if(prev->first + prev->second == block_begin)
         {
-            bucket_self_erase(id >> bucket_exp);
-            try_jump_table_bucket_erase(id >> bucket_exp);
+            range_begin = prev->first;
+            free_ranges.erase(prev);
         }
     }
-}
 
-template<typename T>
-void component_container<T>::clear()
-{
-    if(batching)
-    { // Uh oh, this is super suboptimal :/ pls don't clear while iterating.
-        for(auto it = begin(); it != end(); ++it)
-        {
-            erase((*it).first);
-        }
+    // Only the huge pages that this block was the last used part of are
+    // discarded. Everything above top is free as well, and no whole huge page
+    // there is kept, so a range that reaches top also frees the huge page
+    // that top was in.
+    std::uintptr_t discard_begin = std::max(
+        align_up(reinterpret_cast<std::uintptr_t>(range_begin), huge_page_size),
+        align_down(reinterpret_cast<std::uintptr_t>(block_begin), huge_page_size)
+    );
+    std::uintptr_t discard_end = std::min(
+        align_down(reinterpret_cast<std::uintptr_t>(range_end), huge_page_size),
+        align_up(reinterpret_cast<std::uintptr_t>(block_end), huge_page_size)
+    );
+    if(range_end == top)
+    {
+        discard_end = std::min(
+            align_up(reinterpret_cast<std::uintptr_t>(top), huge_page_size),
+            reinterpret_cast<std::uintptr_t>(mapping + mapping_size)
+        );
     }
-    else
+    if(discard_begin < discard_end)
     {
-        // Clear top bitmask
-        std::uint32_t top_bitmask_count = get_top_bitmask_size();
-        for(std::uint32_t i = 0; i< top_bitmask_count; ++i)
-            top_bitmask[i] = 0;
+        madvise(
+            reinterpret_cast<void*>(discard_begin),
+            discard_end - discard_begin, MADV_DONTNEED
+        );
+    }
 
-        // Destroy all existing objects
-        if(
-            ctx->get_handler_count<remove_component<T>>() ||
-            !search_index_is_empty_default<decltype(search)>()
-        ){
-            for(auto it = begin(); it != end(); ++it)
-            {
-                auto pair = *it;
-                signal_remove(pair.first, pair.second);
-                pair.second->~T();
-            }
-        }
-        else
-        {
-            for(auto it = begin(); it != end(); ++it)
-                (*it).second->~T();
-        }
+    if(range_end == top)
+        top = range_begin;
+    else free_ranges.emplace(range_begin, range_end - range_begin);
+}
 
-        // Release all bucket pointers
-        for(std::uint32_t i = 0; i < bucket_count; ++i)
-        {
-            if(bucket_bitmask[i])
-            {
-                delete [] bucket_bitmask[i];
-                bucket_bitmask[i] = nullptr;
-            }
-            if(bucket_batch_bitmask[i])
-            {
-                delete [] bucket_batch_bitmask[i];
-                bucket_batch_bitmask[i] = nullptr;
-            }
-            if(bucket_jump_table[i])
-            {
-                delete [] bucket_jump_table[i];
-                bucket_jump_table[i] = nullptr;
-            }
-            if constexpr(!tag_component)
-            {
-                if(bucket_components[i])
-                {
-                    delete [] reinterpret_cast<t_mimicker*>(bucket_components[i]);
-                    bucket_components[i] = nullptr;
-                }
-            }
-        }
-    }
-    entity_count = 0;
+bool huge_page_resource::do_is_equal(
+    const std::pmr::memory_resource& other
+) const noexcept
+{
+    return this == &other;
 }
 
-template<typename T>
-bool component_container<T>::contains(entity id) const
+std::size_t huge_page_resource::round_size(
+    std::size_t bytes,
+    std::size_t alignment
+) const
 {
-    entity hi = id >> bucket_exp;
-    if(id == INVALID_ENTITY || hi >= bucket_count) return false;
-    entity lo = id & bucket_mask;
-    if(batching)
-    {
-        bitmask_type bitmask = bucket_bitmask[hi] ?
-            bucket_bitmask[hi][lo>>bitmask_shift] : 0;
-        if(bucket_batch_bitmask[hi])
-            bitmask ^= bucket_batch_bitmask[hi][lo>>bitmask_shift];
-        return (bitmask >> (lo&bitmask_mask))&1;
-    }
-    else
-    {
-        bitmask_type* bitmask = bucket_bitmask[hi];
-        if(!bitmask) return false;
-        return (bitmask[lo>>bitmask_shift] >> (lo&bitmask_mask))&1;
-    }
+    std::size_t align = std::max(alignment, page_size);
+    return (bytes + align - 1) / align * align;
 }
 
-template<typename T>
-void component_container<T>::start_batch()
+bool huge_page_resource::owns(void* p) const
 {
-    batching = true;
-    batch_checklist_size = 0;
+    return p >= begin && p < end;
 }
 
-template<typename T>
-void component_container<T>::finish_batch()
+std::uintptr_t huge_page_resource::align_up(
+    std::uintptr_t address,
+    std::size_t alignment
+){
+    return (address + alignment - 1) & ~(alignment - 1);
+}
+
+std::uintptr_t huge_page_resource::align_down(
+    std::uintptr_t address,
+    std::size_t alignment
+){
+    return address & ~(alignment - 1);
+}
+#endif
+
+unsigned bitscan_forward(std::uint64_t mt)
 {
-    if(!batching) return;
-    batching = false;
+#if defined(__GNUC__)
+    return __builtin_ctzll(mt);
+#elif defined(_MSC_VER)
+    unsigned long index = 0;
+    _BitScanForward64(&index, mt);
+    return index;
+#else
+    return popcount((mt & (~mt + 1)) - 1);
+#endif
+}
 
-    // Discard duplicate changes first.
-    for(std::uint32_t i = 0; i < batch_checklist_size; ++i)
-    {
-        std::uint32_t ri = batch_checklist_size-1-i;
-        entity& id = batch_checklist[ri];
-        entity hi = id >> bucket_exp;
-        entity lo = id & bucket_mask;
-        bitmask_type bit = std::uint64_t(1)<<(lo&bitmask_mask);
-        bitmask_type* bbit = bucket_batch_bitmask[hi];
-        if(bbit && (bbit[lo>>bitmask_shift] & bit))
-        { // Not a dupe, but latest state.
-            bbit[lo>>bitmask_shift] ^= bit;
-        }
-        else id = INVALID_ENTITY;
-    }
+unsigned bitscan_reverse(std::uint64_t mt)
+{
+#if defined(__GNUC__)
+    return 63 - __builtin_clzll(mt);
+#elif defined(_MSC_VER)
+    unsigned long index = 0;
+    _BitScanReverse64(&index, mt);
+    return index;
+#else
+    unsigned r = (mt > 0xFFFFFFFFF) << 5;
+    mt >>= r;
+    unsigned shift = (mt > 0xFFFF) << 4;
+    mt >>= shift;
+    r |= shift;
+    shift = (mt > 0xFF) << 3;
+    mt >>= shift;
+    r |= shift;
+    shift = (mt > 0xF) << 2;
+    mt >>= shift;
+    r |= shift;
+    shift = (mt > 0x3) << 1;
+    mt >>= shift;
+    r |= shift;
+    return r | (mt >> 1);
+#endif
+}
 
-    // Now, do all changes for realzies. All IDs that are left are unique and
-    // change the existence of an entity.
-    for(std::uint32_t i = 0; i < batch_checklist_size; ++i)
-    {
-        entity& id = batch_checklist[i];
-        if(id == INVALID_ENTITY) continue;
+unsigned popcount(std::uint64_t mt)
+{
+#if defined(__GNUC__)
+    return __builtin_popcountll(mt);
+#elif defined(_MSC_VER)
+    return __popcnt64(mt);
+#else
+    mt = mt - ((mt >> 1) & 0x5555555555555555llu);
+    mt = (mt & 0x3333333333333333llu) + ((mt >> 2) & 0x3333333333333333llu);
+    mt = (mt + (mt >> 4)) & 0x0F0F0F0F0F0F0F0Fllu;
+    return (mt * 0x0101010101010101llu) >> 56;
+#endif
+}
 
-        entity hi = id >> bucket_exp;
-        entity lo = id & bucket_mask;
-        bitmask_type bit = std::uint64_t(1)<<(lo&bitmask_mask);
-        if(bucket_bitmask[hi] && (bucket_bitmask[hi][lo>>bitmask_shift] & bit))
-        { // Erase
-            bitmask_erase(id);
-            jump_table_erase(id);
-            bucket_erase(id, false);
-        }
-        else
-        { // Insert (in-place)
-            bitmask_insert(id);
-            jump_table_insert(id);
-            // No need to add to bucket, that already happened due to batching
-            // semantics.
-        }
-    }
+void prefetch(const void* ptr)
+{
+#if defined(__GNUC__)
+    __builtin_prefetch(ptr);
+#else
+    (void)ptr;
+#endif
+}
 
-    // Finally, check erased entries for if we can remove their buckets.
-    for(std::uint32_t i = 0; i < batch_checklist_size; ++i)
-    {
-        entity& id = batch_checklist[i];
-        if(id == INVALID_ENTITY) continue;
+template<auto A, auto B>
+constexpr bool soa_same_member()
+{
+    if constexpr(std::is_same_v<decltype(A), decltype(B)>) return A == B;
+    else return false;
+}
 
-        entity hi = id >> bucket_exp;
-        if(bucket_bitmask[hi] == nullptr) // Already erased!
-            continue;
+template<typename T, auto... Members>
+template<auto Member>
+constexpr std::size_t soa_layout<T, soa_fields<Members...>>::index_of()
+{
+    std::size_t index = 0;
+    bool found = (
+        (soa_same_member<Member, Members>() ? true : (++index, false)) || ...
+    );
+    return found ? index : field_count;
+}
 
-        entity lo = id & bucket_mask;
-        if(bucket_bitmask[hi][lo>>bitmask_shift] == 0 && bitmask_empty(hi))
-        { // This got erased, so check if the whole bucket is empty.
-            bucket_self_erase(hi);
-            try_jump_table_bucket_erase(id >> bucket_exp);
-        }
-    }
+template<typename T, auto... Members>
+template<typename F>
+F* soa_layout<T, soa_fields<Members...>>::at(
+    std::uint8_t* block,
+    std::size_t field,
+    std::size_t index
+){
+    return reinterpret_cast<F*>(block + offsets[field]) + index;
+}
+
+template<typename T, auto... Members>
+void soa_layout<T, soa_fields<Members...>>::construct(
+    std::uint8_t* block,
+    std::size_t index,
+    T& value
+){
+    std::size_t field = 0;
+    (new (at<typename soa_member<decltype(Members)>::type>(block, field++, index))
+        typename soa_member<decltype(Members)>::type(
+            std::move(value.*Members)
+        ), ...);
+}
+
+template<typename T, auto... Members>
+T soa_layout<T, soa_fields<Members...>>::load(
+    std::uint8_t* block,
+    std::size_t index
+){
+    std::size_t field = 0;
+    return T{
+        *at<typename soa_member<decltype(Members)>::type>(
+            block, field++, index
+        )...
+    };
+}
+
+template<typename T, auto... Members>
+void soa_layout<T, soa_fields<Members...>>::destroy(
+    std::uint8_t* block,
+    std::size_t index
+){
+    std::size_t field = 0;
+    (std::destroy_at(
+        at<typename soa_member<decltype(Members)>::type>(block, field++, index)
+    ), ...);
 }
 
 template<typename T>
-typename component_container<T>::iterator component_container<T>::begin()
+soa_ref<T>::soa_ref(std::nullptr_t)
+: block(nullptr), index(0)
 {
-    if(entity_count == 0) return end();
-    // The jump entry for INVALID_ENTITY stores the first valid entity index.
-    // INVALID_ENTITY is always present, but doesn't cause allocation of a
-    // component for itself.
-    return iterator(*this, bucket_jump_table[0][0]);
 }
 
 template<typename T>
-typename component_container<T>::iterator component_container<T>::end()
+soa_ref<T>::soa_ref(std::uint8_t* block, std::size_t index)
+: block(block), index(index)
 {
-    return iterator(*this, INVALID_ENTITY);
 }
 
 template<typename T>
-std::size_t component_container<T>::size() const
+template<typename U, typename>
+soa_ref<T>::soa_ref(const soa_ref<U>& other)
+: block(other.block), index(other.index)
 {
-    return entity_count;
 }
 
 template<typename T>
-void component_container<T>::update_search_index()
+template<auto Member>
+auto& soa_ref<T>::get() const
 {
-    search.update(*ctx);
+    constexpr std::size_t i = layout::template index_of<Member>();
+    static_assert(i < layout::field_count, "Member is not in soa_fields");
+    using F = typename layout::template field_type<i>;
+    return *static_cast<std::conditional_t<std::is_const_v<T>, const F, F>*>(
+        layout::template at<F>(block, i, index)
+    );
 }
 
 template<typename T>
-void component_container<T>::list_entities(
-    std::map<entity, entity>& translation_table
-){
-    for(auto it = begin(); it; ++it)
-        translation_table[(*it).first] = INVALID_ENTITY;
+std::remove_const_t<T> soa_ref<T>::load() const
+{
+    return layout::load(block, index);
 }
 
 template<typename T>
-void component_container<T>::concat(
-    scene& target,
-    const std::map<entity, entity>& translation_table
-){
-    if constexpr(std::is_copy_constructible_v<T>)
-    {
-        for(auto it = begin(); it; ++it)
-        {
-            auto pair = *it;
-            target.emplace<T>(translation_table.at(pair.first), *pair.second);
-        }
-    }
+soa_ref<T>::operator bool() const
+{
+    return block != nullptr;
 }
 
 template<typename T>
-void component_container<T>::copy(
-    scene& target,
-    entity result_id,
-    entity original_id
-){
-    if constexpr(std::is_copy_constructible_v<T>)
-    {
-        T* comp = operator[](original_id);
-        if(comp) target.emplace<T>(result_id, *comp);
-    }
+bool soa_ref<T>::operator==(const soa_ref& other) const
+{
+    return block == other.block && index == other.index;
 }
 
 template<typename T>
-template<typename... Args>
-entity component_container<T>::find_entity(Args&&... args) const
+bool soa_ref<T>::operator!=(const soa_ref& other) const
 {
-    return search.find(std::forward<Args>(args)...);
+    return !(*this == other);
 }
 
 template<typename T>
-T* component_container<T>::get_unsafe(entity e)
+soa_span<T>::soa_span(soa_ref<std::remove_const_t<T>> first)
+: first(first)
 {
-    if constexpr(tag_component)
-    {
-        // We can return basically anything, since tag components are just tags.
-        // As long as it's not nullptr, that is.
-        return reinterpret_cast<T*>(&bucket_components);
-    }
-    else return &bucket_components[e>>bucket_exp][e&bucket_mask];
 }
 
 template<typename T>
-void component_container<T>::destroy()
+template<auto Member>
+auto* soa_span<T>::get() const
 {
-    // Cannot batch while destroying.
-    if(batching)
-        finish_batch();
+    return &first.template get<Member>();
+}
 
-    // Destruct all entries
-    clear();
-#ifndef MONKERO_CONTAINER_DEALLOCATE_BUCKETS
-    for(size_t i = 0; i < bucket_count; ++i)
+template<typename T>
+soa_ref<T> soa_span<T>::operator[](std::size_t i) const
+{
+    return soa_ref<T>(first.block, first.index + i);
+}
+
+template<typename U>
+bucket_pool<U>::bucket_pool(
+    std::size_t block_size,
+    std::pmr::memory_resource* resource
+):  block_size(block_size), limit(0), resource(resource), blocks(resource),
+    allocations(0), reuses(0), deallocations(0)
+{
+}
+
+template<typename U>
+bucket_pool<U>::~bucket_pool()
+{
+    set_limit(0);
+}
+
+template<typename U>
+U* bucket_pool<U>::allocate()
+{
+    if(blocks.size() > 0)
     {
-        if(bucket_bitmask[i])
-            delete bucket_bitmask[i];
-        if(bucket_jump_table[i])
-            delete bucket_jump_table[i];
-        if constexpr(!tag_component)
-        {
-            if(bucket_components[i])
-                delete bucket_components[i];
-        }
-        if(bucket_batch_bitmask[i])
-            delete bucket_batch_bitmask[i];
+        U* block = blocks.back();
+        blocks.pop_back();
+        reuses++;
+        return block;
     }
-#endif
+    allocations++;
+    return static_cast<U*>(
+        resource->allocate(sizeof(U) * block_size, alignof(U))
+    );
+}
 
-    // Free top-level arrays (bottom-level arrays should have been deleted in
-    // clear().
-    if(bucket_bitmask)
-        delete[] bucket_bitmask;
-    if(top_bitmask)
-        delete[] top_bitmask;
-    if(bucket_jump_table)
+template<typename U>
+void bucket_pool<U>::release(U* block)
+{
+    if(!block) return;
+    if(blocks.size() < limit)
+        blocks.push_back(block);
+    else
     {
-        // The initial jump table entry won't get erased otherwise, as it is a
-        // special case due to INVALID_ENTITY.
-        delete[] bucket_jump_table[0];
-        delete[] bucket_jump_table;
+        deallocations++;
+        resource->deallocate(block, sizeof(U) * block_size, alignof(U));
     }
-    if constexpr(!tag_component)
+}
+
+template<typename U>
+void bucket_pool<U>::set_limit(std::size_t limit)
+{
+    this->limit = limit;
+    while(blocks.size() > limit)
     {
-        if(bucket_components)
-            delete[] bucket_components;
+        deallocations++;
+        resource->deallocate(
+            blocks.back(), sizeof(U) * block_size, alignof(U)
+        );
+        blocks.pop_back();
     }
-    if(batch_checklist)
-        delete[] batch_checklist;
-    if(bucket_batch_bitmask)
-        delete[] bucket_batch_bitmask;
+}
+
+template<typename U>
+void bucket_pool<U>::add_stats(bucket_pool_stats& stats) const
+{
+    stats.allocations += allocations;
+    stats.reuses += reuses;
+    stats.deallocations += deallocations;
+    stats.retained += blocks.size();
 }
 
 template<typename T>
-void component_container<T>::jump_table_insert(entity id)
+component_container<T>::component_container(scene& ctx)
+:   entity_count(0), bucket_count(0),
+    bucket_bitmask(nullptr), top_bitmask(nullptr),
+    bucket_jump_table(nullptr), bucket_components(nullptr),
+    resource(ctx.get_memory_resource()),
+    bitmask_pool(bucket_bitmask_units, resource),
+    jump_table_pool(1u<<bucket_exp, resource),
+    component_pool(tag_component ? 0 : component_block_units, resource),
+    batching(false),
+    batch_checklist_size(0), batch_checklist_capacity(0),
+    batch_checklist(nullptr), bucket_batch_bitmask(nullptr), ctx(&ctx),
+    type_key(scene::get_component_type_key<T>())
 {
-    // Assumes that the corresponding bitmask change has already been made.
-    std::uint32_t cur_hi = id >> bucket_exp;
-    std::uint32_t cur_lo = id & bucket_mask;
-    ensure_jump_table(cur_hi);
+}
+
+template<typename T>
+component_container<T>::~component_container()
+{
+    destroy();
+}
+
+template<typename T>
+typename component_container<T>::pointer
+component_container<T>::operator[](entity e)
+{
+    if(!contains(e)) return nullptr;
+    return get_unsafe(e);
+}
+
+template<typename T>
+typename component_container<T>::const_pointer
+component_container<T>::operator[](entity e) const
+{
+    return const_cast<component_container<T>*>(this)->operator[](e);
+}
+
+template<typename T>
+void component_container<T>::insert(entity id, T&& value)
+{
+    emplace(id, std::move(value));
+}
+
+template<typename T>
+template<typename... Args>
+void component_container<T>::emplace(entity id, Args&&... args)
+{
+    if(id == INVALID_ENTITY)
+        return;
+
+    join_batch();
+    ensure_bucket_space(id);
+    if(contains(id))
+    { // If we just replace something that exists, life is easy.
+        bucket_erase(id, true);
+        bucket_insert(id, std::forward<Args>(args)...);
+    }
+    else if(batching)
+    {
+        entity_count++;
+        ctx->signature_insert(id, type_key);
+        if(!batch_change(id))
+        {
+            // If there was already a change, that means that there was an
+            // existing batched erase. That means that we can replace an
+            // existing object instead.
+            bucket_erase(id, true);
+        }
+        bucket_insert(id, std::forward<Args>(args)...);
+    }
+    else
+    {
+        entity_count++;
+        ctx->signature_insert(id, type_key);
+        bitmask_insert(id);
+        jump_table_insert(id);
+        bucket_insert(id, std::forward<Args>(args)...);
+    }
+}
+
+template<typename T>
+template<typename F>
+void component_container<T>::emplace_range(
+    entity first,
+    entity count,
+    F&& init
+){
+    if(first == INVALID_ENTITY || count == 0)
+        return;
+
+    join_batch();
+    entity last = first + (count - 1);
+    ensure_bucket_space(last);
+
+    // The range must fit in the gap between two existing entities (or the
+    // end), otherwise this is just a series of regular emplaces.
+    entity prev = INVALID_ENTITY;
+    entity next = INVALID_ENTITY;
+    if(entity_count != 0)
+        prev = find_previous_entity(first);
+    ensure_jump_table(prev >> bucket_exp);
+    if(entity_count != 0)
+        next = bucket_jump_table[prev >> bucket_exp][prev & bucket_mask];
+    if(batching || (next != INVALID_ENTITY && next <= last))
+    {
+        for(std::uint64_t id = first; id <= last; ++id)
+            emplace(entity(id), init(entity(id)));
+        return;
+    }
+
+    for(std::uint64_t id = first; id <= last; ++id)
+    {
+        bucket_construct(entity(id), init(entity(id)));
+        ctx->signature_insert(entity(id), type_key);
+    }
+
+    // Link the range in between prev and next.
+    if(prev + 1 < first)
+    {
+        ensure_jump_table((first-1) >> bucket_exp);
+        bucket_jump_table[(first-1) >> bucket_exp][(first-1) & bucket_mask] =
+            prev;
+    }
+    bucket_jump_table[prev >> bucket_exp][prev & bucket_mask] = first;
+    if(next != INVALID_ENTITY && last + 1 < next)
+        bucket_jump_table[(next-1) >> bucket_exp][(next-1) & bucket_mask] = last;
+
+    for(entity hi = first >> bucket_exp; hi <= (last >> bucket_exp); ++hi)
+    {
+        std::uint32_t begin_lo = hi == (first >> bucket_exp) ?
+            first & bucket_mask : 0;
+        std::uint32_t end_lo = hi == (last >> bucket_exp) ?
+            last & bucket_mask : bucket_mask;
+
+        ensure_jump_table(hi);
+        entity* jump = bucket_jump_table[hi];
+        entity base = entity(hi) << bucket_exp;
+        for(std::uint32_t lo = begin_lo; lo < end_lo; ++lo)
+            jump[lo] = base + lo + 1;
+        jump[end_lo] = hi == (last >> bucket_exp) ? next : base + end_lo + 1;
+
+        ensure_bitmask(hi);
+        for(std::uint32_t lo = begin_lo; lo <= end_lo;)
+        {
+            std::uint32_t bit = lo & bitmask_mask;
+            std::uint32_t n = std::min(end_lo - lo + 1, bitmask_bits - bit);
+            bitmask_type bits = n == bitmask_bits ?
+                ~bitmask_type(0) : ((bitmask_type(1) << n) - 1) << bit;
+            bucket_bitmask[hi][lo >> bitmask_shift] |= bits;
+            lo += n;
+        }
+        top_bitmask[hi>>bitmask_shift] |= std::uint64_t(1)<<(hi&bitmask_mask);
+    }
+    entity_count += count;
+
+    for(std::uint64_t id = first; id <= last; ++id)
+        signal_add(entity(id), get_unsafe(entity(id)));
+}
+
+template<typename T>
+void component_container<T>::erase(entity id, bool update_signature)
+{
+    if(!contains(id))
+        return;
+    join_batch();
+    entity_count--;
+    if(update_signature)
+        ctx->signature_erase(id, type_key);
+
+    if(batching)
+    {
+        if(!batch_change(id))
+        {
+            // If there was already a change, that means that there was an
+            // existing batched add. Because it's not being iterated, we can
+            // just destroy it here.
+            bucket_erase(id, true);
+        }
+        else signal_remove(id, get_unsafe(id));
+    }
+    else
+    {
+        bool erase_bucket = bitmask_erase(id);
+        jump_table_erase(id);
+        bucket_erase(id, true);
+        if(erase_bucket)
+        {
+            bucket_self_erase(id >> bucket_exp);
+            try_jump_table_bucket_erase(id >> bucket_exp);
+        }
+    }
+}
+
+template<typename T>
+void component_container<T>::erase_many(const entity* ids, std::size_t count)
+{
+    if(batching || ctx->defer_batch > 0)
+    {
+        for(std::size_t i = 0; i < count; ++i)
+            erase(ids[i], false);
+        return;
+    }
+
+    // The IDs are sorted, so each bucket is visited once and the jump table
+    // is unlinked in order. Whether the bucket became empty is only checked
+    // once all of its entities are gone.
+    std::size_t i = 0;
+    while(i < count)
+    {
+        entity hi = ids[i] >> bucket_exp;
+        if(hi >= bucket_count)
+            break;
+
+        bool erased = false;
+        for(; i < count && (ids[i] >> bucket_exp) == hi; ++i)
+        {
+            entity id = ids[i];
+            std::uint32_t lo = id & bucket_mask;
+            bitmask_type bit = std::uint64_t(1)<<(lo&bitmask_mask);
+            // Removal handlers may change the buckets, so nothing is cached
+            // across entities.
+            bitmask_type* bitmask = bucket_bitmask[hi];
+            if(!bitmask || !(bitmask[lo>>bitmask_shift] & bit))
+                continue;
+
+            bitmask[lo>>bitmask_shift] &= ~bit;
+            entity_count--;
+            jump_table_erase(id);
+            bucket_erase(id, true);
+            erased = true;
+        }
+
+        if(erased && bitmask_empty(hi))
+        {
+            top_bitmask[hi>>bitmask_shift] &= ~(std::uint64_t(1)<<(hi&bitmask_mask));
+            bucket_self_erase(hi);
+            try_jump_table_bucket_erase(hi);
+        }
+    }
+}
+
+template<typename T>
+void component_container<T>::clear()
+{
+    if(entity_count != 0)
+        join_batch();
+    if(batching)
+    { // Uh oh, this is super suboptimal :/ pls don't clear while iterating.
+        for(auto it = begin(); it != end(); ++it)
+        {
+            erase((*it).first);
+        }
+    }
+    else
+    {
+        if(entity_count != 0)
+            ctx->signature_erase_all(type_key);
+
+        // Clear top bitmask
+        entity top_bitmask_count = get_top_bitmask_size();
+        for(entity i = 0; i< top_bitmask_count; ++i)
+            top_bitmask[i] = 0;
+
+        // Destroy all existing objects
+        if(
+            ctx->get_handler_count<remove_component<T>>() ||
+            !search_index_is_empty_default<decltype(search)>()
+        ){
+            for(auto it = begin(); it != end(); ++it)
+            {
+                auto pair = *it;
+                signal_remove(pair.first, pair.second);
+                destroy_component(pair.second);
+            }
+        }
+        else
+        {
+            for(auto it = begin(); it != end(); ++it)
+                destroy_component((*it).second);
+        }
+
+        // Release all bucket pointers
+        for(entity i = 0; i < bucket_count; ++i)
+        {
+            bitmask_pool.release(bucket_bitmask[i]);
+            bucket_bitmask[i] = nullptr;
+            bitmask_pool.release(bucket_batch_bitmask[i]);
+            bucket_batch_bitmask[i] = nullptr;
+            jump_table_pool.release(bucket_jump_table[i]);
+            bucket_jump_table[i] = nullptr;
+            if constexpr(!tag_component)
+            {
+                component_pool.release(
+                    reinterpret_cast<t_mimicker*>(bucket_components[i])
+                );
+                bucket_components[i] = nullptr;
+            }
+        }
+    }
+    entity_count = 0;
+}
+
+template<typename T>
+bool component_container<T>::contains(entity id) const
+{
+    entity hi = id >> bucket_exp;
+    if(id == INVALID_ENTITY || hi >= bucket_count) return false;
+    entity lo = id & bucket_mask;
+    if(batching)
+    {
+        bitmask_type bitmask = bucket_bitmask[hi] ?
+            bucket_bitmask[hi][lo>>bitmask_shift] : 0;
+        if(bucket_batch_bitmask[hi])
+            bitmask ^= bucket_batch_bitmask[hi][lo>>bitmask_shift];
+        return (bitmask >> (lo&bitmask_mask))&1;
+    }
+    else
+    {
+        bitmask_type* bitmask = bucket_bitmask[hi];
+        if(!bitmask) return false;
+        return (bitmask[lo>>bitmask_shift] >> (lo&bitmask_mask))&1;
+    }
+}
+
+template<typename T>
+void component_container<T>::start_batch()
+{
+    batching = true;
+    batch_checklist_size = 0;
+}
+
+template<typename T>
+void component_container<T>::join_batch()
+{
+    ctx->assert_not_parallel();
+    if(!batching && ctx->defer_batch > 0)
+    {
+        start_batch();
+        ctx->batched_containers.push_back(this);
+    }
+}
+
+template<typename T>
+void component_container<T>::finish_batch()
+{
+    if(!batching) return;
+    batching = false;
+
+    if(batch_checklist_size >= batch_rebuild_threshold)
+    {
+        // Large batches are cheaper to apply all at once than one by one.
+        batch_rebuild();
+    }
+    else
+    {
+        // Discard duplicate changes first.
+        for(entity i = 0; i < batch_checklist_size; ++i)
+        {
+            entity ri = batch_checklist_size-1-i;
+            entity& id = batch_checklist[ri];
+            entity hi = id >> bucket_exp;
+            entity lo = id & bucket_mask;
+            bitmask_type bit = std::uint64_t(1)<<(lo&bitmask_mask);
+            bitmask_type* bbit = bucket_batch_bitmask[hi];
+            if(bbit && (bbit[lo>>bitmask_shift] & bit))
+            { // Not a dupe, but latest state.
+                bbit[lo>>bitmask_shift] ^= bit;
+            }
+            else id = INVALID_ENTITY;
+        }
+
+        // Now, do all changes for realzies. All IDs that are left are unique
+        // and change the existence of an entity.
+        for(entity i = 0; i < batch_checklist_size; ++i)
+        {
+            entity& id = batch_checklist[i];
+            if(id == INVALID_ENTITY) continue;
+
+            entity hi = id >> bucket_exp;
+            entity lo = id & bucket_mask;
+            bitmask_type bit = std::uint64_t(1)<<(lo&bitmask_mask);
+            if(bucket_bitmask[hi] && (bucket_bitmask[hi][lo>>bitmask_shift] & bit))
+            { // Erase
+                bitmask_erase(id);
+                jump_table_erase(id);
+                bucket_erase(id, false);
+            }
+            else
+            { // Insert (in-place)
+                bitmask_insert(id);
+                jump_table_insert(id);
+                // No need to add to bucket, that already happened due to
+                // batching semantics.
+            }
+        }
+    }
+
+    // Finally, check erased entries for if we can remove their buckets.
+    for(entity i = 0; i < batch_checklist_size; ++i)
+    {
+        entity& id = batch_checklist[i];
+        if(id == INVALID_ENTITY) continue;
+
+        entity hi = id >> bucket_exp;
+        if(bucket_bitmask[hi] == nullptr) // Already erased!
+            continue;
+
+        entity lo = id & bucket_mask;
+        if(bucket_bitmask[hi][lo>>bitmask_shift] == 0 && bitmask_empty(hi))
+        { // This got erased, so check if the whole bucket is empty.
+            bucket_self_erase(hi);
+            try_jump_table_bucket_erase(id >> bucket_exp);
+        }
+    }
+}
+
+template<typename T>
+void component_container<T>::batch_rebuild()
+{
+    // The batch bitmasks hold exactly the entities whose existence changes,
+    // already in order, so they can be applied a word at a time.
+    entity first_id = INVALID_ENTITY;
+    entity last_id = INVALID_ENTITY;
+    for(entity hi = 0; hi < bucket_count; ++hi)
+    {
+        bitmask_type* changes = bucket_batch_bitmask[hi];
+        if(!changes) continue;
+
+        bitmask_type* bits = nullptr;
+        bitmask_type any = 0;
+        for(std::uint32_t j = 0; j < bucket_bitmask_units; ++j)
+        {
+            bitmask_type changed = changes[j];
+            if(changed == 0) continue;
+            changes[j] = 0;
+
+            if(!bits)
+            {
+                ensure_bitmask(hi);
+                bits = bucket_bitmask[hi];
+            }
+            entity base = (hi << bucket_exp) + (j << bitmask_shift);
+            if(first_id == INVALID_ENTITY)
+                first_id = base + bitscan_forward(changed);
+            last_id = base + bitscan_reverse(changed);
+
+            bitmask_type removed = bits[j] & changed;
+            bits[j] ^= changed;
+            while(removed != 0)
+            {
+                bucket_erase(base + bitscan_forward(removed), false);
+                removed &= removed - 1;
+            }
+        }
+        if(!bits) continue;
+
+        for(std::uint32_t j = 0; j < bucket_bitmask_units; ++j)
+            any |= bits[j];
+        bitmask_type top_bit = std::uint64_t(1)<<(hi&bitmask_mask);
+        if(any) top_bitmask[hi>>bitmask_shift] |= top_bit;
+        else top_bitmask[hi>>bitmask_shift] &= ~top_bit;
+    }
+    if(first_id == INVALID_ENTITY)
+        return;
+
+    // Relink every existing entity from the one preceding the first change
+    // to the one following the last change.
+    entity prev = find_previous_entity(first_id);
+    ensure_jump_table(prev >> bucket_exp);
+    entity* prev_jump =
+        &bucket_jump_table[prev >> bucket_exp][prev & bucket_mask];
+
+    entity word = first_id >> bitmask_shift;
+    bitmask_type mask = get_bitmask_word(word) &
+        (~bitmask_type(0) << (first_id & bitmask_mask));
+    for(;;)
+    {
+        while(mask == 0)
+        {
+            ++word;
+            if(!find_next_word(word))
+            {
+                *prev_jump = INVALID_ENTITY;
+                return;
+            }
+            mask = get_bitmask_word(word);
+        }
+        entity id = (word << bitmask_shift) + bitscan_forward(mask);
+        mask &= mask - 1;
+
+        *prev_jump = id;
+        if(prev + 1 < id)
+        { // Make the skipped block's end point back to its start
+            entity end_id = id - 1;
+            ensure_jump_table(end_id >> bucket_exp);
+            bucket_jump_table[end_id >> bucket_exp][end_id & bucket_mask] = prev;
+        }
+        if(id > last_id)
+            return;
+
+        ensure_jump_table(id >> bucket_exp);
+        prev_jump = &bucket_jump_table[id >> bucket_exp][id & bucket_mask];
+        prev = id;
+    }
+}
+
+template<typename T>
+bool component_container<T>::has_iterable_entities() const
+{
+    // While batching, entity_count already includes the batched changes, but
+    // iteration goes through the state before them.
+    if(!batching) return entity_count != 0;
+    return bucket_count != 0 && bucket_jump_table[0] != nullptr;
+}
+
+template<typename T>
+typename component_container<T>::iterator component_container<T>::begin()
+{
+    if(!has_iterable_entities()) return end();
+    // The jump entry for INVALID_ENTITY stores the first valid entity index.
+    // INVALID_ENTITY is always present, but doesn't cause allocation of a
+    // component for itself.
+    return iterator(*this, bucket_jump_table[0][0]);
+}
+
+template<typename T>
+typename component_container<T>::iterator component_container<T>::end()
+{
+    return iterator(*this, INVALID_ENTITY);
+}
+
+template<typename T>
+typename component_container<T>::iterator component_container<T>::lower_bound(entity id)
+{
+    if(!has_iterable_entities())
+        return end();
+    return iterator(*this, find_next_entity(id));
+}
+
+template<typename T>
+std::size_t component_container<T>::size() const
+{
+    return entity_count;
+}
+
+template<typename T>
+std::vector<entity> component_container<T>::split_ranges(
+    std::uint32_t max_ranges
+) const {
+    std::vector<entity> ranges;
+    ranges.push_back(INVALID_ENTITY);
+
+    std::size_t total = 0;
+    std::vector<std::uint32_t> bucket_sizes(bucket_count, 0);
+    for(entity i = 0; i < bucket_count; ++i)
+    {
+        if(!((top_bitmask[i>>bitmask_shift] >> (i&bitmask_mask))&1))
+            continue;
+        for(std::uint32_t j = 0; j < bucket_bitmask_units; ++j)
+            bucket_sizes[i] += popcount(bucket_bitmask[i][j]);
+        total += bucket_sizes[i];
+    }
+
+    std::size_t target = (total + max_ranges - 1) / std::max(max_ranges, 1u);
+    std::size_t accumulated = 0;
+    for(entity i = 0; i+1 < bucket_count; ++i)
+    {
+        accumulated += bucket_sizes[i];
+        if(accumulated != 0 && accumulated >= target)
+        {
+            ranges.push_back((i+1) << bucket_exp);
+            accumulated = 0;
+        }
+    }
+    ranges.push_back(INVALID_ENTITY);
+    return ranges;
+}
+
+template<typename T>
+typename component_container<T>::bitmask_type
+component_container<T>::get_bitmask_word(entity word_index) const
+{
+    if constexpr(bucket_exp >= bitmask_shift)
+    {
+        entity hi = word_index >> (bucket_exp - bitmask_shift);
+        if(hi >= bucket_count || !bucket_bitmask[hi])
+            return 0;
+        return bucket_bitmask[hi][word_index & (bucket_bitmask_units-1)];
+    }
+    else
+    {
+        // Buckets are smaller than a word, so gather the word from several.
+        bitmask_type word = 0;
+        entity first = (word_index << bitmask_shift) >> bucket_exp;
+        for(entity i = 0; i < (1u << (bitmask_shift - bucket_exp)); ++i)
+        {
+            entity hi = first + i;
+            if(hi < bucket_count && bucket_bitmask[hi])
+                word |= bucket_bitmask[hi][0] << (i << bucket_exp);
+        }
+        return word;
+    }
+}
+
+template<typename T>
+bool component_container<T>::find_next_word(entity& word_index) const
+{
+    entity hi = (std::uint64_t(word_index) << bitmask_shift) >> bucket_exp;
+    entity top_count = get_top_bitmask_size();
+    while(
+        hi < bucket_count &&
+        find_bitmask_next_index(top_bitmask, top_count, hi, hi) &&
+        hi < bucket_count
+    ){
+        if constexpr(bucket_exp >= bitmask_shift)
+        {
+            entity first = entity(hi) << (bucket_exp - bitmask_shift);
+            entity j = word_index > first ? word_index - first : 0;
+            for(; j < bucket_bitmask_units; ++j)
+            {
+                if(bucket_bitmask[hi][j] != 0)
+                {
+                    word_index = first + j;
+                    return true;
+                }
+            }
+            ++hi;
+        }
+        else
+        {
+            word_index = std::max(
+                word_index, (entity(hi) << bucket_exp) >> bitmask_shift
+            );
+            return true;
+        }
+    }
+    return false;
+}
+
+template<typename T>
+entity component_container<T>::find_next_entity(entity id) const
+{
+    entity hi = id >> bucket_exp;
+    std::uint32_t lo = id & bucket_mask;
+    if(hi >= bucket_count)
+        return INVALID_ENTITY;
+
+    // Try to find in the current bucket.
+    entity next_index = 0;
+    if(find_bitmask_next_index(
+        bucket_bitmask[hi], bucket_bitmask_units, lo, next_index
+    )) return (hi << bucket_exp) + next_index;
+
+    // If that failed, search from the top bitmask.
+    entity bucket_index = 0;
+    if(
+        hi+1 >= bucket_count ||
+        !find_bitmask_next_index(
+            top_bitmask, get_top_bitmask_size(), hi+1, bucket_index
+        ) || bucket_index >= bucket_count
+    ) return INVALID_ENTITY;
+
+    // Now, find the lowest bit in the bucket that was found.
+    find_bitmask_next_index(
+        bucket_bitmask[bucket_index], bucket_bitmask_units, 0, next_index
+    );
+    return (bucket_index << bucket_exp) + next_index;
+}
+
+template<typename T>
+void component_container<T>::update_search_index()
+{
+    search.update(*ctx);
+}
+
+template<typename T>
+void component_container<T>::set_bucket_pool_limit(std::size_t limit)
+{
+    bitmask_pool.set_limit(limit);
+    jump_table_pool.set_limit(limit);
+    component_pool.set_limit(limit);
+}
+
+template<typename T>
+bucket_pool_stats component_container<T>::get_bucket_pool_stats() const
+{
+    bucket_pool_stats stats;
+    bitmask_pool.add_stats(stats);
+    jump_table_pool.add_stats(stats);
+    component_pool.add_stats(stats);
+    return stats;
+}
+
+template<typename T>
+std::size_t component_container<T>::renumber(
+    const entity_translation& translation_table
+){
+    std::size_t memory_before = get_bucket_memory();
+    std::pmr::vector<entity> ids(resource);
+    ids.reserve(entity_count);
+    for(auto it = begin(); it; ++it)
+        ids.push_back((*it).first);
+
+    // Since the new IDs are in the same order and never greater than the old
+    // ones, components can be moved down in place without overwriting
+    // anything that hasn't been moved yet.
+    if constexpr(!tag_component)
+    {
+        bool reindex = !search_index_is_empty_default<decltype(search)>();
+        for(entity old_id: ids)
+        {
+            entity new_id = translation_table[old_id];
+            if(new_id == old_id)
+                continue;
+            pointer data = get_unsafe(old_id);
+            if constexpr(soa_component)
+            {
+                T value = data.load();
+                if(reindex)
+                {
+                    search.remove_entity(old_id, value);
+                    search.add_entity(new_id, value);
+                }
+                bucket_construct(new_id, std::move(value));
+            }
+            else
+            {
+                if(reindex) search.remove_entity(old_id, *data);
+                pointer new_data = bucket_construct(new_id, std::move(*data));
+                if(reindex) search.add_entity(new_id, *new_data);
+            }
+            destroy_component(data);
+        }
+    }
+
+    // The bitmasks and jump tables are simply rebuilt from scratch.
+    entity top_bitmask_count = get_top_bitmask_size();
+    for(entity i = 0; i < top_bitmask_count; ++i)
+        top_bitmask[i] = 0;
+    for(entity i = 0; i < bucket_count; ++i)
+    {
+        bitmask_pool.release(bucket_bitmask[i]);
+        bucket_bitmask[i] = nullptr;
+        bitmask_pool.release(bucket_batch_bitmask[i]);
+        bucket_batch_bitmask[i] = nullptr;
+        jump_table_pool.release(bucket_jump_table[i]);
+        bucket_jump_table[i] = nullptr;
+    }
+    for(entity old_id: ids)
+    {
+        entity new_id = translation_table[old_id];
+        bitmask_insert(new_id);
+        jump_table_insert(new_id);
+    }
+
+    if constexpr(!tag_component)
+    {
+        for(entity i = 0; i < bucket_count; ++i)
+        {
+            if(bucket_bitmask[i] == nullptr)
+            {
+                component_pool.release(
+                    reinterpret_cast<t_mimicker*>(bucket_components[i])
+                );
+                bucket_components[i] = nullptr;
+            }
+        }
+    }
+    return memory_before - get_bucket_memory();
+}
+
+template<typename T>
+std::size_t component_container<T>::get_bucket_memory() const
+{
+    std::size_t bytes = 0;
+    for(entity i = 0; i < bucket_count; ++i)
+    {
+        if(bucket_bitmask[i])
+            bytes += sizeof(bitmask_type) * bucket_bitmask_units;
+        if(bucket_batch_bitmask[i])
+            bytes += sizeof(bitmask_type) * bucket_bitmask_units;
+        if(bucket_jump_table[i])
+            bytes += sizeof(entity) << bucket_exp;
+        if constexpr(!tag_component)
+        {
+            if(bucket_components[i])
+                bytes += sizeof(t_mimicker) * component_block_units;
+        }
+    }
+    return bytes;
+}
+
+template<typename T>
+void component_container<T>::list_entities(
+    std::map<entity, entity>& translation_table
+){
+    for(auto it = begin(); it; ++it)
+        translation_table[(*it).first] = INVALID_ENTITY;
+}
+
+template<typename T>
+void component_container<T>::concat(
+    scene& target,
+    const std::map<entity, entity>& translation_table
+){
+    if constexpr(std::is_copy_constructible_v<T>)
+    {
+        for(auto it = begin(); it; ++it)
+        {
+            auto pair = *it;
+            if constexpr(soa_component)
+                target.emplace<T>(
+                    translation_table.at(pair.first), pair.second.load()
+                );
+            else
+                target.emplace<T>(
+                    translation_table.at(pair.first), *pair.second
+                );
+        }
+    }
+}
+
+template<typename T>
+void component_container<T>::copy(
+    scene& target,
+    entity result_id,
+    entity original_id
+){
+    if constexpr(std::is_copy_constructible_v<T>)
+    {
+        pointer comp = operator[](original_id);
+        if constexpr(soa_component)
+        {
+            if(comp) target.emplace<T>(result_id, comp.load());
+        }
+        else if(comp) target.emplace<T>(result_id, *comp);
+    }
+}
+
+template<typename T>
+template<typename... Args>
+entity component_container<T>::find_entity(Args&&... args) const
+{
+    return search.find(std::forward<Args>(args)...);
+}
+
+template<typename T>
+typename component_container<T>::pointer
+component_container<T>::get_unsafe(entity e)
+{
+    if constexpr(tag_component)
+    {
+        // We can return basically anything, since tag components are just tags.
+        // As long as it's not nullptr, that is.
+        return reinterpret_cast<T*>(&bucket_components);
+    }
+    else return get_pointer(bucket_components[e>>bucket_exp], e&bucket_mask);
+}
+
+template<typename T>
+void component_container<T>::prefetch_component(entity e) const
+{
+    // SoA fields are spread over separate arrays that are walked in order
+    // anyway, so they're left to the hardware prefetcher.
+    if constexpr(!tag_component && !soa_component)
+        prefetch(bucket_components[e>>bucket_exp] + (e&bucket_mask));
+    else (void)e;
+}
+
+template<typename T>
+void component_container<T>::destroy()
+{
+    // Cannot batch while destroying.
+    if(batching)
+        finish_batch();
+
+    // Destruct all entries
+    clear();
+#ifndef MONKERO_CONTAINER_DEALLOCATE_BUCKETS
+    for(size_t i = 0; i < bucket_count; ++i)
+    {
+        bitmask_pool.release(bucket_bitmask[i]);
+        jump_table_pool.release(bucket_jump_table[i]);
+        if constexpr(!tag_component)
+        {
+            component_pool.release(
+                reinterpret_cast<t_mimicker*>(bucket_components[i])
+            );
+        }
+        bitmask_pool.release(bucket_batch_bitmask[i]);
+    }
+#endif
+
+    // Free top-level arrays (bottom-level arrays should have been deleted in
+    // clear().
+    deallocate_array(top_bitmask, get_top_bitmask_size());
+    deallocate_array(bucket_bitmask, bucket_count);
+    if(bucket_jump_table)
+    {
+        // The initial jump table entry won't get erased otherwise, as it is a
+        // special case due to INVALID_ENTITY.
+        jump_table_pool.release(bucket_jump_table[0]);
+        deallocate_array(bucket_jump_table, bucket_count);
+    }
+    if constexpr(!tag_component)
+        deallocate_array(bucket_components, bucket_count);
+    deallocate_array(batch_checklist, batch_checklist_capacity);
+    deallocate_array(bucket_batch_bitmask, bucket_count);
+}
+
+template<typename T>
+template<typename U>
+U* component_container<T>::allocate_array(std::size_t count)
+{
+    return static_cast<U*>(resource->allocate(sizeof(U) * count, alignof(U)));
+}
+
+template<typename T>
+template<typename U>
+void component_container<T>::deallocate_array(U* ptr, std::size_t count)
+{
+    if(ptr)
+        resource->deallocate(ptr, sizeof(U) * count, alignof(U));
+}
+
+template<typename T>
+void component_container<T>::jump_table_insert(entity id)
+{
+    // Assumes that the corresponding bitmask change has already been made.
+    entity cur_hi = id >> bucket_exp;
+    std::uint32_t cur_lo = id & bucket_mask;
+    ensure_jump_table(cur_hi);
 
     // Find the start of the preceding block.
     entity prev_start_id = find_previous_entity(id);
-    std::uint32_t prev_start_hi = prev_start_id >> bucket_exp;
+    entity prev_start_hi = prev_start_id >> bucket_exp;
     std::uint32_t prev_start_lo = prev_start_id & bucket_mask;
     ensure_jump_table(prev_start_hi);
     entity& prev_start = bucket_jump_table[prev_start_hi][prev_start_lo];
@@ -1248,7 +3464,7 @@ void component_container<T>::jump_table_insert(entity id)
     if(prev_start_id + 1 < id)
     { // Make preceding block's end point back to its start
         entity prev_end_id = id-1;
-        std::uint32_t prev_end_hi = prev_end_id >> bucket_exp;
+        entity prev_end_hi = prev_end_id >> bucket_exp;
         std::uint32_t prev_end_lo = prev_end_id & bucket_mask;
         ensure_jump_table(prev_end_hi);
         entity& prev_end = bucket_jump_table[prev_end_hi][prev_end_lo];
@@ -1258,7 +3474,7 @@ void component_container<T>::jump_table_insert(entity id)
     if(id + 1 < prev_start)
     { // Make succeeding block's end point back to its start
         entity next_end_id = prev_start-1;
-        std::uint32_t next_end_hi = next_end_id >> bucket_exp;
+        entity next_end_hi = next_end_id >> bucket_exp;
         std::uint32_t next_end_lo = next_end_id & bucket_mask;
         entity& next_end = bucket_jump_table[next_end_hi][next_end_lo];
         next_end = id;
@@ -1271,10 +3487,10 @@ void component_container<T>::jump_table_insert(entity id)
 template<typename T>
 void component_container<T>::jump_table_erase(entity id)
 {
-    std::uint32_t hi = id >> bucket_exp;
+    entity hi = id >> bucket_exp;
     std::uint32_t lo = id & bucket_mask;
     entity prev = id-1;
-    std::uint32_t prev_hi = prev >> bucket_exp;
+    entity prev_hi = prev >> bucket_exp;
     std::uint32_t prev_lo = prev & bucket_mask;
 
     entity& prev_jmp = bucket_jump_table[prev_hi][prev_lo];
@@ -1313,7 +3529,7 @@ std::size_t component_container<T>::get_top_bitmask_size() const
 }
 
 template<typename T>
-bool component_container<T>::bitmask_empty(std::uint32_t bucket_index) const
+bool component_container<T>::bitmask_empty(entity bucket_index) const
 {
     if(bucket_bitmask[bucket_index] == nullptr)
         return true;
@@ -1328,7 +3544,7 @@ bool component_container<T>::bitmask_empty(std::uint32_t bucket_index) const
 template<typename T>
 void component_container<T>::bitmask_insert(entity id)
 {
-    std::uint32_t hi = id >> bucket_exp;
+    entity hi = id >> bucket_exp;
     std::uint32_t lo = id & bucket_mask;
     ensure_bitmask(hi);
     bitmask_type& mask = bucket_bitmask[hi][lo>>bitmask_shift];
@@ -1340,7 +3556,7 @@ void component_container<T>::bitmask_insert(entity id)
 template<typename T>
 bool component_container<T>::bitmask_erase(entity id)
 {
-    std::uint32_t hi = id >> bucket_exp;
+    entity hi = id >> bucket_exp;
     std::uint32_t lo = id & bucket_mask;
     bucket_bitmask[hi][lo>>bitmask_shift] &= ~(std::uint64_t(1)<<(lo&bitmask_mask));
     if(bucket_bitmask[hi][lo>>bitmask_shift] == 0 && bitmask_empty(hi))
@@ -1354,78 +3570,101 @@ bool component_container<T>::bitmask_erase(entity id)
 template<typename T>
 template<typename... Args>
 void component_container<T>::bucket_insert(entity id, Args&&... args)
+{
+    signal_add(id, bucket_construct(id, std::forward<Args>(args)...));
+}
+
+template<typename T>
+template<typename... Args>
+typename component_container<T>::pointer
+component_container<T>::bucket_construct(entity id, Args&&... args)
 {
     // This function assumes that there isn't an existing entity at the same
     // position.
-    T* data = nullptr;
-    if constexpr(tag_component)
-    {
-        data = reinterpret_cast<T*>(&bucket_components);
-        new (&bucket_components) T(std::forward<Args>(args)...);
-    }
-    else
+    if constexpr(soa_component)
     {
-        std::uint32_t hi = id >> bucket_exp;
+        entity hi = id >> bucket_exp;
         std::uint32_t lo = id & bucket_mask;
-
-        // If this component container doesn't exist yet, create it.
         if(bucket_components[hi] == nullptr)
         {
             bucket_components[hi] = reinterpret_cast<T*>(
-                new t_mimicker[1u<<bucket_exp]
+                component_pool.allocate()
             );
         }
-        data = &bucket_components[hi][lo];
+
+        // The component is built whole and then scattered into the field
+        // arrays.
+        T value = [&]{
+            if constexpr(std::is_constructible_v<T, Args&&...>)
+                return T(std::forward<Args>(args)...);
+            else return T{std::forward<Args>(args)...};
+        }();
+        soa_layout<T>::construct(
+            reinterpret_cast<std::uint8_t*>(bucket_components[hi]), lo, value
+        );
+        return get_pointer(bucket_components[hi], lo);
+    }
+    else
+    {
+        T* data = nullptr;
+        if constexpr(tag_component)
+        {
+            data = reinterpret_cast<T*>(&bucket_components);
+            new (&bucket_components) T(std::forward<Args>(args)...);
+        }
+        else
+        {
+            entity hi = id >> bucket_exp;
+            std::uint32_t lo = id & bucket_mask;
+
+            // If this component container doesn't exist yet, create it.
+            if(bucket_components[hi] == nullptr)
+            {
+                bucket_components[hi] = reinterpret_cast<T*>(
+                    component_pool.allocate()
+                );
+            }
+            data = &bucket_components[hi][lo];
+        }
+        // Create the related component here.
+        new (data) T(std::forward<Args>(args)...);
+        return data;
     }
-    // Create the related component here.
-    new (data) T(std::forward<Args>(args)...);
-    signal_add(id, data);
 }
 
 template<typename T>
 void component_container<T>::bucket_erase(entity id, bool signal)
 {
     // This function assumes that the given entity exists.
-    T* data = nullptr;
-    if constexpr(tag_component)
-    {
-        data = reinterpret_cast<T*>(&bucket_components);
-    }
-    else
-    {
-        std::uint32_t hi = id >> bucket_exp;
-        std::uint32_t lo = id & bucket_mask;
-        data = &bucket_components[hi][lo];
-    }
+    pointer data = get_unsafe(id);
     if(signal) signal_remove(id, data);
-    data->~T();
+    destroy_component(data);
 }
 
 template<typename T>
-void component_container<T>::bucket_self_erase(std::uint32_t i)
+void component_container<T>::bucket_self_erase(entity i)
 {
     (void)i;
 #ifdef MONKERO_CONTAINER_DEALLOCATE_BUCKETS
     // If the bucket got emptied, nuke it.
-    delete[] bucket_bitmask[i];
+    bitmask_pool.release(bucket_bitmask[i]);
     bucket_bitmask[i] = nullptr;
 
-    if(bucket_batch_bitmask[i])
-    {
-        delete[] bucket_batch_bitmask[i];
-        bucket_batch_bitmask[i] = nullptr;
-    }
+    bitmask_pool.release(bucket_batch_bitmask[i]);
+    bucket_batch_bitmask[i] = nullptr;
 
     if constexpr(!tag_component)
     {
-        delete[] reinterpret_cast<t_mimicker*>(bucket_components[i]);
+        component_pool.release(
+            reinterpret_cast<t_mimicker*>(bucket_components[i])
+        );
         bucket_components[i] = nullptr;
     }
 #endif
 }
 
 template<typename T>
-void component_container<T>::try_jump_table_bucket_erase(std::uint32_t i)
+void component_container<T>::try_jump_table_bucket_erase(entity i)
 {
     (void)i;
 #ifdef MONKERO_CONTAINER_DEALLOCATE_BUCKETS
@@ -1437,7 +3676,7 @@ void component_container<T>::try_jump_table_bucket_erase(std::uint32_t i)
     // We can be removed if the succeeding bucket is also empty.
     if(i+1 >= bucket_count || bucket_bitmask[i+1] == nullptr)
     {
-        delete[] bucket_jump_table[i];
+        jump_table_pool.release(bucket_jump_table[i]);
         bucket_jump_table[i] = nullptr;
     }
 #endif
@@ -1449,65 +3688,68 @@ void component_container<T>::ensure_bucket_space(entity id)
     if((id>>bucket_exp) < bucket_count)
         return;
 
-    std::uint32_t new_bucket_count = std::max(initial_bucket_count, bucket_count);
+    entity new_bucket_count = std::max(initial_bucket_count, bucket_count);
     while(new_bucket_count <= (id>>bucket_exp))
         new_bucket_count *= 2;
 
-    bitmask_type** new_bucket_batch_bitmask = new bitmask_type*[new_bucket_count];
+    bitmask_type** new_bucket_batch_bitmask =
+        allocate_array<bitmask_type*>(new_bucket_count);
     memcpy(new_bucket_batch_bitmask, bucket_batch_bitmask,
         sizeof(bitmask_type*)*bucket_count);
     memset(new_bucket_batch_bitmask+bucket_count, 0,
         sizeof(bitmask_type*)*(new_bucket_count-bucket_count));
-    delete [] bucket_batch_bitmask;
+    deallocate_array(bucket_batch_bitmask, bucket_count);
     bucket_batch_bitmask = new_bucket_batch_bitmask;
 
-    bitmask_type** new_bucket_bitmask = new bitmask_type*[new_bucket_count];
+    bitmask_type** new_bucket_bitmask =
+        allocate_array<bitmask_type*>(new_bucket_count);
     memcpy(new_bucket_bitmask, bucket_bitmask,
         sizeof(bitmask_type*)*bucket_count);
     memset(new_bucket_bitmask+bucket_count, 0,
         sizeof(bitmask_type*)*(new_bucket_count-bucket_count));
-    delete [] bucket_bitmask;
+    deallocate_array(bucket_bitmask, bucket_count);
     bucket_bitmask = new_bucket_bitmask;
 
-    entity** new_bucket_jump_table = new entity*[new_bucket_count];
+    entity** new_bucket_jump_table = allocate_array<entity*>(new_bucket_count);
     memcpy(new_bucket_jump_table, bucket_jump_table,
         sizeof(entity*)*bucket_count);
     memset(new_bucket_jump_table+bucket_count, 0,
         sizeof(entity*)*(new_bucket_count-bucket_count));
-    delete [] bucket_jump_table;
+    deallocate_array(bucket_jump_table, bucket_count);
     bucket_jump_table = new_bucket_jump_table;
 
     // Create initial jump table entry.
     if(bucket_count == 0)
     {
-        bucket_jump_table[0] = new entity[1 << bucket_exp];
+        bucket_jump_table[0] = jump_table_pool.allocate();
         memset(bucket_jump_table[0], 0, sizeof(entity)*(1 << bucket_exp));
     }
 
     if constexpr(!tag_component)
     {
-        T** new_bucket_components = new T*[new_bucket_count];
+        T** new_bucket_components = allocate_array<T*>(new_bucket_count);
         memcpy(new_bucket_components, bucket_components,
             sizeof(T*)*bucket_count);
         memset(new_bucket_components+bucket_count, 0,
             sizeof(T*)*(new_bucket_count-bucket_count));
-        delete [] bucket_components;
+        deallocate_array(bucket_components, bucket_count);
         bucket_components = new_bucket_components;
     }
 
-    std::uint32_t top_bitmask_count = get_top_bitmask_size();
-    std::uint32_t new_top_bitmask_count = std::max(
+    entity top_bitmask_count = get_top_bitmask_size();
+    entity new_top_bitmask_count = std::max(
         initial_bucket_count,
         new_bucket_count >> bitmask_shift
     );
     if(top_bitmask_count != new_top_bitmask_count)
     {
-        bitmask_type* new_top_bitmask = new bitmask_type[new_top_bitmask_count];
+        bitmask_type* new_top_bitmask =
+            allocate_array<bitmask_type>(new_top_bitmask_count);
         memcpy(new_top_bitmask, top_bitmask,
             sizeof(bitmask_type)*top_bitmask_count);
         memset(new_top_bitmask+top_bitmask_count, 0,
             sizeof(bitmask_type)*(new_top_bitmask_count-top_bitmask_count));
-        delete [] top_bitmask;
+        deallocate_array(top_bitmask, top_bitmask_count);
         top_bitmask = new_top_bitmask;
     }
 
@@ -1515,11 +3757,11 @@ void component_container<T>::ensure_bucket_space(entity id)
 }
 
 template<typename T>
-void component_container<T>::ensure_bitmask(std::uint32_t bucket_index)
+void component_container<T>::ensure_bitmask(entity bucket_index)
 {
     if(bucket_bitmask[bucket_index] == nullptr)
     {
-        bucket_bitmask[bucket_index] = new bitmask_type[bucket_bitmask_units];
+        bucket_bitmask[bucket_index] = bitmask_pool.allocate();
         std::memset(
             bucket_bitmask[bucket_index], 0,
             sizeof(bitmask_type)*bucket_bitmask_units
@@ -1528,11 +3770,11 @@ void component_container<T>::ensure_bitmask(std::uint32_t bucket_index)
 }
 
 template<typename T>
-void component_container<T>::ensure_jump_table(std::uint32_t bucket_index)
+void component_container<T>::ensure_jump_table(entity bucket_index)
 {
     if(!bucket_jump_table[bucket_index])
     {
-        bucket_jump_table[bucket_index] = new entity[1 << bucket_exp];
+        bucket_jump_table[bucket_index] = jump_table_pool.allocate();
         memset(bucket_jump_table[bucket_index], 0, sizeof(entity)*(1 << bucket_exp));
     }
 }
@@ -1540,11 +3782,11 @@ void component_container<T>::ensure_jump_table(std::uint32_t bucket_index)
 template<typename T>
 bool component_container<T>::batch_change(entity id)
 {
-    std::uint32_t hi = id >> bucket_exp;
+    entity hi = id >> bucket_exp;
     std::uint32_t lo = id & bucket_mask;
     if(bucket_batch_bitmask[hi] == nullptr)
     {
-        bucket_batch_bitmask[hi] = new bitmask_type[bucket_bitmask_units];
+        bucket_batch_bitmask[hi] = bitmask_pool.allocate();
         std::memset(
             bucket_batch_bitmask[hi], 0,
             sizeof(bitmask_type)*bucket_bitmask_units
@@ -1557,16 +3799,17 @@ bool component_container<T>::batch_change(entity id)
     { // If there will be a change, add this to the list.
         if(batch_checklist_size == batch_checklist_capacity)
         {
-            std::uint32_t new_batch_checklist_capacity = std::max(
+            entity new_batch_checklist_capacity = std::max(
                 initial_bucket_count,
                 batch_checklist_capacity * 2
             );
-            entity* new_batch_checklist = new entity[new_batch_checklist_capacity];
+            entity* new_batch_checklist =
+                allocate_array<entity>(new_batch_checklist_capacity);
             memcpy(new_batch_checklist, batch_checklist,
                 sizeof(entity)*batch_checklist_capacity);
             memset(new_batch_checklist + batch_checklist_capacity, 0,
                 sizeof(entity)*(new_batch_checklist_capacity-batch_checklist_capacity));
-            delete [] batch_checklist;
+            deallocate_array(batch_checklist, batch_checklist_capacity);
             batch_checklist = new_batch_checklist;
             batch_checklist_capacity = new_batch_checklist_capacity;
         }
@@ -1580,16 +3823,16 @@ bool component_container<T>::batch_change(entity id)
 template<typename T>
 entity component_container<T>::find_previous_entity(entity id)
 {
-    std::uint32_t hi = id >> bucket_exp;
+    entity hi = id >> bucket_exp;
     std::uint32_t lo = id & bucket_mask;
 
     // Try to find in the current bucket.
-    std::uint32_t prev_index = 0;
+    entity prev_index = 0;
     if(find_bitmask_previous_index(bucket_bitmask[hi], lo, prev_index))
         return (hi << bucket_exp) + prev_index;
 
     // If that failed, search from the top bitmask.
-    std::uint32_t bucket_index = 0;
+    entity bucket_index = 0;
     if(!find_bitmask_previous_index(top_bitmask, hi, bucket_index))
         return INVALID_ENTITY;
 
@@ -1604,58 +3847,74 @@ entity component_container<T>::find_previous_entity(entity id)
 
 
 template<typename T>
-void component_container<T>::signal_add(entity id, T* data)
+void component_container<T>::signal_add(entity id, pointer data)
 {
-    search.add_entity(id, *data);
-    ctx->emit(add_component<T>{id, data});
+    if constexpr(soa_component)
+    {
+        // Handlers want the whole component, which only exists as a copy.
+        if(
+            ctx->get_handler_count<add_component<T>>() == 0 &&
+            search_index_is_empty_default<decltype(search)>()
+        ) return;
+        T value = data.load();
+        search.add_entity(id, value);
+        ctx->emit(add_component<T>{id, &value});
+    }
+    else
+    {
+        search.add_entity(id, *data);
+        ctx->emit(add_component<T>{id, data});
+    }
 }
 
 template<typename T>
-void component_container<T>::signal_remove(entity id, T* data)
+void component_container<T>::signal_remove(entity id, pointer data)
 {
-    search.remove_entity(id, *data);
-    ctx->emit(remove_component<T>{id, data});
+    if constexpr(soa_component)
+    {
+        if(
+            ctx->get_handler_count<remove_component<T>>() == 0 &&
+            search_index_is_empty_default<decltype(search)>()
+        ) return;
+        T value = data.load();
+        search.remove_entity(id, value);
+        ctx->emit(remove_component<T>{id, &value});
+    }
+    else
+    {
+        search.remove_entity(id, *data);
+        ctx->emit(remove_component<T>{id, data});
+    }
 }
 
 template<typename T>
-unsigned component_container<T>::bitscan_reverse(std::uint64_t mt)
+void component_container<T>::destroy_component(pointer data)
 {
-#if defined(__GNUC__)
-    return 63 - __builtin_clzll(mt);
-#elif defined(_MSC_VER)
-    unsigned long index = 0;
-    _BitScanReverse64(&index, mt);
-    return index;
-#else
-    unsigned r = (mt > 0xFFFFFFFFF) << 5;
-    mt >>= r;
-    unsigned shift = (mt > 0xFFFF) << 4;
-    mt >>= shift;
-    r |= shift;
-    shift = (mt > 0xFF) << 3;
-    mt >>= shift;
-    r |= shift;
-    shift = (mt > 0xF) << 2;
-    mt >>= shift;
-    r |= shift;
-    shift = (mt > 0x3) << 1;
-    mt >>= shift;
-    r |= shift;
-    return r | (mt >> 1);
-#endif
+    if constexpr(soa_component)
+        soa_layout<T>::destroy(data.block, data.index);
+    else data->~T();
+}
+
+template<typename T>
+typename component_container<T>::pointer
+component_container<T>::get_pointer(T* bucket, entity index)
+{
+    if constexpr(soa_component)
+        return pointer(reinterpret_cast<std::uint8_t*>(bucket), index);
+    else return bucket + index;
 }
 
 template<typename T>
 bool component_container<T>::find_bitmask_top(
     bitmask_type* bitmask,
-    std::uint32_t count,
-    std::uint32_t& top_index
+    entity count,
+    entity& top_index
 ){
-    for(std::uint32_t j = 0, i = count-1; j < count; ++j, --i)
+    for(entity j = 0, i = count-1; j < count; ++j, --i)
     {
         if(bitmask[i] != 0)
         {
-            std::uint32_t index = bitscan_reverse(bitmask[i]);
+            entity index = bitscan_reverse(bitmask[i]);
             top_index = (i << bitmask_shift) + index;
             return true;
         }
@@ -1667,18 +3926,18 @@ bool component_container<T>::find_bitmask_top(
 template<typename T>
 bool component_container<T>::find_bitmask_previous_index(
     bitmask_type* bitmask,
-    std::uint32_t index,
-    std::uint32_t& prev_index
+    entity index,
+    entity& prev_index
 ){
     if(!bitmask)
         return false;
 
-    std::uint32_t bm_index = index >> bitmask_shift;
+    entity bm_index = index >> bitmask_shift;
     bitmask_type bm_mask = (std::uint64_t(1)<<(index&bitmask_mask))-1;
     bitmask_type cur_mask = bitmask[bm_index] & bm_mask;
     if(cur_mask != 0)
     {
-        std::uint32_t index = bitscan_reverse(cur_mask);
+        entity index = bitscan_reverse(cur_mask);
         prev_index = (bm_index << bitmask_shift) + index;
         return true;
     }
@@ -1686,6 +3945,29 @@ bool component_container<T>::find_bitmask_previous_index(
     return find_bitmask_top(bitmask, bm_index, prev_index);
 }
 
+template<typename T>
+bool component_container<T>::find_bitmask_next_index(
+    bitmask_type* bitmask,
+    entity count,
+    entity index,
+    entity& next_index
+){
+    entity bm_index = index >> bitmask_shift;
+    if(!bitmask || bm_index >= count)
+        return false;
+
+    bitmask_type cur_mask =
+        bitmask[bm_index] & (~bitmask_type(0) << (index&bitmask_mask));
+    while(cur_mask == 0)
+    {
+        if(++bm_index >= count)
+            return false;
+        cur_mask = bitmask[bm_index];
+    }
+    next_index = (bm_index << bitmask_shift) + bitscan_forward(cur_mask);
+    return true;
+}
+
 template<typename T>
 component_container<T>::iterator::iterator(component_container& from, entity e)
 :   from(&from), current_entity(e), current_bucket(e>>bucket_exp)
@@ -1703,7 +3985,7 @@ component_container<T>::iterator::iterator(component_container& from, entity e)
 void component_container_entity_advancer::advance()
 {
     current_entity = current_jump_table[current_entity&bucket_mask];
-    std::uint32_t next_bucket = current_entity >> bucket_exp;
+    entity next_bucket = current_entity >> bucket_exp;
     if(next_bucket != current_bucket)
     {
         current_bucket = next_bucket;
@@ -1715,7 +3997,7 @@ template<typename T>
 typename component_container<T>::iterator& component_container<T>::iterator::operator++()
 {
     current_entity = current_jump_table[current_entity&bucket_mask];
-    std::uint32_t next_bucket = current_entity >> bucket_exp;
+    entity next_bucket = current_entity >> bucket_exp;
     if(next_bucket != current_bucket)
     {
         current_bucket = next_bucket;
@@ -1737,7 +4019,8 @@ typename component_container<T>::iterator component_container<T>::iterator::oper
 }
 
 template<typename T>
-std::pair<entity, T*> component_container<T>::iterator::operator*()
+std::pair<entity, typename component_container<T>::pointer>
+component_container<T>::iterator::operator*()
 {
     if constexpr(tag_component)
     {
@@ -1750,13 +4033,14 @@ std::pair<entity, T*> component_container<T>::iterator::operator*()
     {
         return {
             current_entity,
-            &current_components[current_entity&bucket_mask]
+            get_pointer(current_components, current_entity&bucket_mask)
         };
     }
 }
 
 template<typename T>
-std::pair<entity, const T*> component_container<T>::iterator::operator*() const
+std::pair<entity, typename component_container<T>::const_pointer>
+component_container<T>::iterator::operator*() const
 {
     if constexpr(tag_component)
     {
@@ -1769,7 +4053,7 @@ std::pair<entity, const T*> component_container<T>::iterator::operator*() const
     {
         return {
             current_entity,
-            &current_components[current_entity&bucket_mask]
+            get_pointer(current_components, current_entity&bucket_mask)
         };
     }
 }
@@ -1792,7 +4076,7 @@ bool component_container<T>::iterator::try_advance(entity id)
     if(current_entity == id)
         return true;
 
-    std::uint32_t next_bucket = id >> bucket_exp;
+    entity next_bucket = id >> bucket_exp;
     std::uint32_t lo = id & bucket_mask;
     if(
         id < current_entity ||
@@ -1848,21 +4132,21 @@ template<typename T>
 bool component_container<T>::test_invariant() const
 {
     // Check bitmask internal validity
-    std::uint32_t top_bitmask_count = get_top_bitmask_size();
-    std::uint32_t top_index = 0;
+    entity top_bitmask_count = get_top_bitmask_size();
+    entity top_index = 0;
     bool found = top_bitmask && find_bitmask_top(
         top_bitmask,
         top_bitmask_count,
         top_index
     );
-    std::uint32_t bitmask_entity_count = 0;
+    entity bitmask_entity_count = 0;
     if(found && top_index >= bucket_count && !batching)
     {
         std::cout << "Top bitmask has a higher bit than bucket count!\n";
         return false;
     }
 
-    for(std::uint32_t i = 0; i < bucket_count; ++i)
+    for(entity i = 0; i < bucket_count; ++i)
     {
         int present = (top_bitmask[i>>bitmask_shift] >> (i&bitmask_mask))&1;
         if(present && !bucket_bitmask[i] && !batching)
@@ -1901,7 +4185,7 @@ bool component_container<T>::test_invariant() const
     }
 
     // Check jump table internal validity
-    std::uint32_t jump_table_entity_count = 0;
+    entity jump_table_entity_count = 0;
     if(entity_count != 0)
     {
         entity prev_id = 0;
@@ -1952,7 +4236,7 @@ bool component_container<T>::test_invariant() const
 template<typename T>
 void component_container<T>::print_bitmask() const
 {
-    for(std::uint32_t i = 0; i < bucket_count; ++i)
+    for(entity i = 0; i < bucket_count; ++i)
     {
         int present = (top_bitmask[i>>bitmask_shift] >> (i&bitmask_mask))&1;
         std::cout << "bucket " << i << " ("<< (present ? "present" : "empty") << "): ";
@@ -1977,138 +4261,539 @@ template<typename T>
 void component_container<T>::print_jump_table() const
 {
     std::uint32_t k = 0;
-    for(std::uint32_t i = 0; i < bucket_count; ++i)
+    for(entity i = 0; i < bucket_count; ++i)
     {
         if(bucket_jump_table[i] == nullptr)
         {
             std::uint32_t k_start = k;
-            std::uint32_t i_start = i;
+            entity i_start = i;
             for(; i < bucket_count && bucket_jump_table[i] == nullptr; ++i)
                 k += 1<<bucket_exp;
             --i;
             std::uint32_t k_end = k-1;
-            std::uint32_t i_end = i;
+            entity i_end = i;
             if(i_start == i_end)
                 std::cout << "bucket " << i_start << ": " << k_start << " to " << k_end;
             else
-                std::cout << "buckets " << i_start << " to " << i_end << ": " << k_start << " to " << k_end;
-        }
-        else
-        {
-            std::cout << "bucket " << i << ":\n";
-
-            std::cout << "\tindices: |";
+                std::cout << "buckets " << i_start << " to " << i_end << ": " << k_start << " to " << k_end;
+        }
+        else
+        {
+            std::cout << "bucket " << i << ":\n";
+
+            std::cout << "\tindices: |";
+
+            for(int j = 0; j < (1<<bucket_exp); ++j, ++k)
+                std::cout << " " << k << " |";
+
+            std::cout << "\n\tdata:    |";
+            for(int j = 0; j < (1<<bucket_exp); ++j)
+            {
+                std::cout << " " << bucket_jump_table[i][j] << " |";
+            }
+        }
+        std::cout << "\n";
+    }
+}
+#endif
+
+scene::scene(std::pmr::memory_resource* resource)
+:   resource(resource), id_counter(1), reusable_ids(resource),
+    post_batch_reusable_ids(resource), policy(id_policy::REUSE_LATEST),
+    id_pools(resource), generations(resource), generation_base(0),
+    generation_top(0), signatures(resource),
+    subscriber_counter(0), defer_batch(0), parallel_iterating(false),
+    batched_containers(resource), bucket_pool_limit(0), components(resource)
+{
+}
+
+scene::~scene()
+{
+    // This is called manually so that remove events are fired if necessary.
+    clear_entities();
+    // The containers still look up event handlers when destroyed, so they
+    // must go before the handlers do.
+    components.clear();
+}
+
+template<bool pass_id, typename... Components>
+template<typename F>
+void scene::foreach_impl<pass_id, Components...>::foreach(scene& ctx, F&& f)
+{
+    foreach_range(ctx, std::forward<F>(f), INVALID_ENTITY, INVALID_ENTITY);
+}
+
+template<bool pass_id, typename... Components>
+template<typename F>
+void scene::foreach_impl<pass_id, Components...>::foreach_range(
+    scene& ctx,
+    F&& f,
+    entity begin,
+    entity end
+){
+    ctx.start_batch();
+    foreach_in_range<false>(ctx, std::forward<F>(f), begin, end);
+    ctx.finish_batch();
+}
+
+template<bool pass_id, typename... Components>
+template<typename F>
+void scene::foreach_impl<pass_id, Components...>::parallel_foreach(
+    scene& ctx,
+    F&& f,
+    unsigned thread_count
+){
+    if(thread_count == 0)
+        thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+
+    ctx.start_batch();
+
+    // The smallest required container drives the split, just like it drives
+    // the iteration itself. If there are none, the largest one is used. This
+    // also creates all missing containers before any threads are started.
+    constexpr bool all_optional =
+        (!join_state<Components>::required && ...);
+    component_container_base* driver = nullptr;
+    (
+        [&](component_container_base* c, bool required, bool excluded){
+            if(excluded || (!all_optional && !required)) return;
+            if(
+                !driver ||
+                (all_optional && c->size() > driver->size()) ||
+                (!all_optional && c->size() < driver->size())
+            ) driver = c;
+        }(
+            &ctx.get_container<component_type<Components>>(),
+            join_state<Components>::required,
+            join_state<Components>::excluded
+        ), ...
+    );
+
+    // Oversubscribe a bit so that uneven ranges get balanced out.
+    std::vector<entity> ranges = driver->split_ranges(thread_count * 4);
+    std::atomic<std::size_t> next_range(0);
+    std::atomic<bool> stopped(false);
+    auto worker = [&](){
+        while(!stopped)
+        {
+            std::size_t i = next_range++;
+            if(i+1 >= ranges.size()) break;
+            if(!foreach_in_range<false>(ctx, f, ranges[i], ranges[i+1]))
+                stopped = true;
+        }
+    };
+
+    bool was_parallel = ctx.parallel_iterating;
+    ctx.parallel_iterating = true;
+    std::vector<std::thread> threads;
+    for(unsigned i = 1; i < thread_count && i+1 < ranges.size(); ++i)
+        threads.emplace_back(worker);
+    worker();
+    for(std::thread& t: threads)
+        t.join();
+    ctx.parallel_iterating = was_parallel;
+
+    ctx.finish_batch();
+}
+
+template<bool pass_id, typename... Components>
+template<typename F>
+void scene::foreach_impl<pass_id, Components...>::foreach_read_only(
+    const scene& ctx,
+    F&& f,
+    entity begin,
+    entity end
+){
+    static_assert(
+        (is_read_only<Components>::value && ...),
+        "Read-only foreach must take components as const references, "
+        "pointers to const or soa_ref<const T>"
+    );
+    // Nothing gets modified, iterators just don't have const versions.
+    foreach_in_range<true>(
+        const_cast<scene&>(ctx), std::forward<F>(f), begin, end
+    );
+}
+
+template<bool pass_id, typename... Components>
+template<bool read_only, typename F>
+entity scene::foreach_impl<pass_id, Components...>::find_if(
+    scene& ctx,
+    F&& pred
+){
+    entity found = INVALID_ENTITY;
+    auto test = [&](entity id, auto&&... args){
+        bool match;
+        if constexpr(pass_id) match = pred(id, args...);
+        else match = pred(args...);
+        if(!match) return iteration_control::CONTINUE;
+        found = id;
+        return iteration_control::BREAK;
+    };
+    // The ID is needed for the result even if pred doesn't take it.
+    using impl = foreach_impl<true, Components...>;
+    if constexpr(read_only)
+        impl::foreach_read_only(ctx, test, INVALID_ENTITY, INVALID_ENTITY);
+    else impl::foreach_range(ctx, test, INVALID_ENTITY, INVALID_ENTITY);
+    return found;
+}
+
+template<bool pass_id, typename... Components>
+template<typename F, typename S>
+entity scene::foreach_impl<pass_id, Components...>::foreach_slice(
+    scene& ctx,
+    F&& f,
+    entity begin,
+    S&& stop
+){
+    entity next = INVALID_ENTITY;
+    auto visit = [&](entity id, auto&&... args){
+        bool proceed;
+        if constexpr(pass_id) proceed = invoke_callback(f, id, args...);
+        else proceed = invoke_callback(f, args...);
+        if(proceed && !stop())
+            return iteration_control::CONTINUE;
+        next = id + 1;
+        return iteration_control::BREAK;
+    };
+    foreach_impl<true, Components...>::foreach_range(
+        ctx, visit, begin, INVALID_ENTITY
+    );
+    return next;
+}
+
+template<bool pass_id, typename... Components>
+template<bool read_only, typename Component>
+auto scene::foreach_impl<pass_id, Components...>::get_join_container(
+    scene& ctx
+) -> container_type<Component>*
+{
+    if constexpr(read_only)
+        return ctx.find_container<component_type<Component>>();
+    else return &ctx.get_container<component_type<Component>>();
+}
+
+template<bool pass_id, typename... Components>
+template<bool read_only, typename F>
+bool scene::foreach_impl<pass_id, Components...>::foreach_in_range(
+    scene& ctx,
+    F&& f,
+    entity begin,
+    entity end
+){
+    static_assert(
+        !(is_without<std::decay_t<Components>>::value && ...),
+        "foreach needs at least one component that isn't excluded"
+    );
+
+    // Wraps around to the largest ID when end is INVALID_ENTITY.
+    entity last = end - 1;
+
+    if constexpr(sizeof...(Components) == 1)
+    {
+        // If we're only iterating one category, we can do it very quickly!
+        auto* c = get_join_container<read_only, Components...>(ctx);
+        if(!c) return true;
+        auto it = c->lower_bound(begin);
+
+        // A second cursor runs ahead through the jump table, so that only
+        // components that will actually be visited get prefetched.
+        using container = std::remove_pointer_t<decltype(it.get_container())>;
+        constexpr bool prefetch = MONKERO_PREFETCH_DISTANCE > 0 &&
+            !container::tag_component && !container::soa_component;
+        component_container_entity_advancer ahead = {};
+        if constexpr(prefetch)
+        {
+            ahead = it.get_advancer();
+            for(
+                unsigned i = 0;
+                i < MONKERO_PREFETCH_DISTANCE &&
+                ahead.current_entity != INVALID_ENTITY;
+                ++i
+            ){
+                it.get_container()->prefetch_component(ahead.current_entity);
+                ahead.advance();
+            }
+        }
+
+        while(it && it.get_id() <= last)
+        {
+            if constexpr(prefetch)
+            {
+                if(ahead.current_entity != INVALID_ENTITY)
+                {
+                    it.get_container()->prefetch_component(
+                        ahead.current_entity
+                    );
+                    ahead.advance();
+                }
+            }
+            auto [cur_id, ptr] = *it;
+            if(!call(std::forward<F>(f), cur_id, ptr))
+                return false;
+            ++it;
+        }
+    }
+    else
+    {
+        // Multiple components are joined one bitmask word (64 entities) at
+        // a time. Required components are ANDed together, or if there are
+        // none, the optional ones are ORed together. Excluded components are
+        // then masked out. Runs of entities that don't match are therefore
+        // skipped in bulk instead of probing each of them.
+        std::tuple state(join_state<Components>{
+            get_join_container<read_only, Components>(ctx), 0
+        }...);
+#define monkero_apply_tuple(...) \
+        std::apply([&](auto&... s){return (__VA_ARGS__);}, state)
+
+        // Only read-only iteration can run into missing containers. Other
+        // than required ones, they're simply skipped.
+        if(monkero_apply_tuple(((s.required && !s.container) || ...)))
+            return true;
+
+        // Note that all checks based on s.required are compile-time, it's
+        // constexpr!
+        constexpr bool all_optional =
+            (!join_state<Components>::required && ...);
+
+        // A very sparse required component is better followed through its
+        // jump table, which skips straight to the next entity instead of the
+        // next non-empty word.
+        component_container_entity_advancer advancer = {};
+        const void* driver = nullptr;
+        bool sparse = false;
+        if constexpr(!all_optional)
+        {
+            std::size_t min_length = monkero_apply_tuple(std::min({
+                (s.required ?
+                    s.container->size() :
+                    std::numeric_limits<std::size_t>::max()
+                )...
+            }));
+            sparse = min_length < (ctx.id_counter >> 6);
+            if(sparse)
+            {
+                monkero_apply_tuple(
+                    (s.required && s.container->size() == min_length ?
+                        (advancer = s.container->lower_bound(begin).get_advancer(),
+                        driver = s.container, void()) : void()), ...
+                );
+            }
+        }
+
+        entity word = begin >> 6;
+        for(;;)
+        {
+            if constexpr(all_optional)
+            {
+                // Closest word that has any of the components.
+                entity next = std::numeric_limits<entity>::max();
+                monkero_apply_tuple(([&](){
+                    entity w = word;
+                    if(
+                        !s.excluded && s.container &&
+                        s.container->find_next_word(w)
+                    )
+                        next = std::min(next, w);
+                }(), ...));
+                if(next == std::numeric_limits<entity>::max())
+                    break;
+                word = next;
+            }
+            else if(sparse)
+            {
+                // Leapfrog between the driver and the other required
+                // containers. When they skip a gap, the driver seeks past it
+                // through its bitmasks instead of walking its jump table.
+                entity start_word;
+                bool found = true;
+                do
+                {
+                    start_word = word;
+                    if(
+                        advancer.current_entity != INVALID_ENTITY &&
+                        (advancer.current_entity >> 6) < word
+                    ){
+                        // The next entity is usually close, so try a single
+                        // step first.
+                        advancer.advance();
+                        if(
+                            advancer.current_entity != INVALID_ENTITY &&
+                            (advancer.current_entity >> 6) < word
+                        ) monkero_apply_tuple(((s.required && s.container == driver ?
+                            (advancer = s.container->lower_bound(
+                                entity(word) << 6
+                            ).get_advancer(), void()) : void()
+                        ), ...));
+                    }
+                    if(advancer.current_entity == INVALID_ENTITY)
+                    {
+                        found = false;
+                        break;
+                    }
+                    word = advancer.current_entity >> 6;
+                    found = monkero_apply_tuple((
+                        !s.required || s.container == driver ||
+                        s.container->find_next_word(word)
+                    ) && ...);
+                }
+                while(found && start_word != word);
+                if(!found) break;
+            }
+            else
+            {
+                // Leapfrog until all required containers agree on the next
+                // non-empty word.
+                entity start_word;
+                bool found = true;
+                do
+                {
+                    start_word = word;
+                    found = monkero_apply_tuple(
+                        (!s.required || s.container->find_next_word(word)) && ...
+                    );
+                }
+                while(found && start_word != word);
+                if(!found) break;
+            }
 
-            for(int j = 0; j < (1<<bucket_exp); ++j, ++k)
-                std::cout << " " << k << " |";
+            std::uint64_t first = std::uint64_t(word) << 6;
+            if(first > last) break;
+
+            monkero_apply_tuple((
+                s.word = s.required || s.container ?
+                    s.container->get_bitmask_word(word) : 0,
+                void()
+            ), ...);
+            std::uint64_t mask = all_optional ?
+                monkero_apply_tuple(((s.excluded ? 0 : s.word) | ...)) :
+                monkero_apply_tuple(
+                    ((s.required ? s.word : ~std::uint64_t(0)) & ...)
+                );
+            mask &= monkero_apply_tuple(
+                ((s.excluded ? ~s.word : ~std::uint64_t(0)) & ...)
+            );
+            if(first < begin)
+                mask &= ~std::uint64_t(0) << (begin - first);
+            if(last - first < 63)
+                mask &= (std::uint64_t(2) << (last - first)) - 1;
+
+            // Components of the matches a few steps ahead within the word
+            // are prefetched.
+            std::uint64_t ahead = mask;
+            auto prefetch_next = [&](){
+                if(ahead == 0) return;
+                unsigned bit = bitscan_forward(ahead);
+                ahead &= ahead - 1;
+                monkero_apply_tuple(((
+                    s.required || (!s.excluded && ((s.word >> bit) & 1)) ?
+                        s.container->prefetch_component(entity(first + bit)) :
+                        void()
+                ), ...));
+            };
+            if constexpr(MONKERO_PREFETCH_DISTANCE > 0)
+            {
+                for(unsigned i = 0; i < MONKERO_PREFETCH_DISTANCE; ++i)
+                    prefetch_next();
+            }
 
-            std::cout << "\n\tdata:    |";
-            for(int j = 0; j < (1<<bucket_exp); ++j)
+            while(mask != 0)
             {
-                std::cout << " " << bucket_jump_table[i][j] << " |";
+                unsigned bit = bitscan_forward(mask);
+                mask &= mask - 1;
+                entity id = entity(first + bit);
+                if constexpr(MONKERO_PREFETCH_DISTANCE > 0)
+                    prefetch_next();
+                if(!monkero_apply_tuple(call(
+                    std::forward<F>(f), id,
+                    (s.required || (!s.excluded && ((s.word >> bit) & 1)) ?
+                        s.container->get_unsafe(id) : nullptr)...
+                ))) return false;
             }
+
+            if(first + 64 > last) break;
+            ++word;
         }
-        std::cout << "\n";
     }
+#undef monkero_apply_tuple
+    return true;
 }
-#endif
-
-scene::scene()
-: id_counter(1), subscriber_counter(0), defer_batch(0)
-{
-}
-
-scene::~scene()
-{
-    // This is called manually so that remove events are fired if necessary.
-    clear_entities();
-}
-
-template<bool pass_id, typename... Components>
-template<typename Component>
-struct scene::foreach_impl<pass_id, Components...>::iterator_wrapper<Component*>
-{
-    static constexpr bool required = false;
-    typename component_container<std::decay_t<std::remove_pointer_t<std::decay_t<Component>>>>::iterator iter;
-};
 
-template<bool pass_id, typename... Components>
+template<typename... Components>
 template<typename F>
-void scene::foreach_impl<pass_id, Components...>::foreach(scene& ctx, F&& f)
+void scene::foreach_chunk_impl<Components...>::foreach(scene& ctx, F&& f)
 {
+    static_assert(
+        sizeof...(Components) > 0,
+        "foreach_chunk needs at least one component type"
+    );
     ctx.start_batch();
 
-    std::tuple component_it(make_iterator<Components>(ctx)...);
+    std::tuple containers(&ctx.get_container<Components>()...);
 #define monkero_apply_tuple(...) \
-    std::apply([&](auto&... it){return (__VA_ARGS__);}, component_it)
+    std::apply([&](auto*... c){return (__VA_ARGS__);}, containers)
 
-    // Note that all checks based on it.required are compile-time, it's
-    // constexpr!
-    constexpr bool all_optional = (std::is_pointer_v<Components> && ...);
+    // Runs are cut at the boundaries of the smallest buckets.
+    constexpr std::uint32_t min_exp = std::min({
+        component_container<Components>::bucket_exp...
+    });
 
-    if constexpr(sizeof...(Components) == 1)
-    {
-        // If we're only iterating one category, we can do it very quickly!
-        auto& it = std::get<0>(component_it).iter;
-        while(it)
-        {
-            auto [cur_id, ptr] = *it;
-            call(std::forward<F>(f), cur_id, ptr);
-            ++it;
-        }
-    }
-    else if constexpr(all_optional)
+    entity run_first = INVALID_ENTITY;
+    std::uint64_t run_count = 0;
+    auto flush = [&](){
+        if(run_count == 0) return;
+        monkero_apply_tuple(
+            f(run_first, std::size_t(run_count), c->get_unsafe(run_first)...)
+        );
+        run_count = 0;
+    };
+
+    entity word = 0;
+    for(;;)
     {
-        // If all are optional, iteration logic has to differ a bit. The other
-        // version would never quit as there would be zero finished required
-        // iterators.
-        while(monkero_apply_tuple((bool)it.iter || ...))
+        // Leapfrog until all containers agree on the next non-empty word.
+        entity start_word;
+        bool found = true;
+        do
         {
-            entity cur_id = monkero_apply_tuple(std::min({
-                (it.iter ? it.iter.get_id() : std::numeric_limits<entity>::max())...
-            }));
-            monkero_apply_tuple(call(
-                std::forward<F>(f),
-                cur_id,
-                (it.iter.get_id() == cur_id ? (*it.iter).second : nullptr)...
-            ));
-            monkero_apply_tuple(
-                (it.iter && it.iter.get_id() == cur_id ? (++it.iter, void()) : void()), ...
-            );
+            start_word = word;
+            found = monkero_apply_tuple((c->find_next_word(word) && ...));
         }
-    }
-    else
-    {
-        // This is the generic implementation for when there's multiple
-        // components where some are potentially optional.
-        std::size_t min_length = monkero_apply_tuple(std::min({
-            (it.required ?
-                it.iter.get_container()->size() :
-                std::numeric_limits<std::size_t>::max()
-            )...
-        }));
+        while(found && start_word != word);
+        if(!found) break;
 
-        component_container_entity_advancer advancer = {};
-        monkero_apply_tuple(
-            (it.required && it.iter.get_container()->size() == min_length ?
-                (advancer = it.iter.get_advancer(), void()): void()), ...
+        std::uint64_t mask = monkero_apply_tuple(
+            (c->get_bitmask_word(word) & ...)
         );
-
-        while(advancer.current_entity != INVALID_ENTITY)
+        while(mask != 0)
         {
-            bool have_all_required = monkero_apply_tuple(
-                (it.iter.try_advance(advancer.current_entity) || !it.required) && ...
-            );
-            if(have_all_required)
+            unsigned start = bitscan_forward(mask);
+            std::uint64_t rest = ~(mask >> start);
+            unsigned length = rest == 0 ? 64 - start : bitscan_forward(rest);
+            mask = start + length >= 64 ? 0 : mask & (~std::uint64_t(0) << (start + length));
+
+            std::uint64_t first = (std::uint64_t(word) << 6) + start;
+            while(length > 0)
             {
-                monkero_apply_tuple(call(
-                    std::forward<F>(f), advancer.current_entity,
-                    (it.iter.get_id() == advancer.current_entity ? (*it.iter).second : nullptr)...
-                ));
+                std::uint64_t bucket_end = ((first >> min_exp) + 1) << min_exp;
+                unsigned piece = std::min<std::uint64_t>(length, bucket_end - first);
+                if(
+                    run_count == 0 ||
+                    run_first + run_count != first ||
+                    (run_first >> min_exp) != (first >> min_exp)
+                ){
+                    flush();
+                    run_first = first;
+                }
+                run_count += piece;
+                first += piece;
+                length -= piece;
             }
-            advancer.advance();
         }
+        ++word;
     }
+    flush();
 #undef monkero_apply_tuple
 
     ctx.finish_batch();
@@ -2122,6 +4807,23 @@ struct scene::foreach_impl<pass_id, Components...>::converter<Component*>
     static inline T* convert(T* val) { return val; }
 };
 
+template<bool pass_id, typename... Components>
+template<typename Component>
+struct scene::foreach_impl<pass_id, Components...>::converter<soa_ref<Component>>
+{
+    template<typename T>
+    static inline soa_ref<Component> convert(soa_ref<T> val) { return val; }
+};
+
+template<bool pass_id, typename... Components>
+template<typename Component>
+struct scene::foreach_impl<pass_id, Components...>::converter<without<Component>>
+{
+    // Takes whatever pointer type the container has, even soa_ref.
+    template<typename Pointer>
+    static inline without<Component> convert(Pointer) { return {}; }
+};
+
 template<bool pass_id, typename... Components>
 template<typename Component>
 template<typename T>
@@ -2132,13 +4834,152 @@ T& scene::foreach_impl<pass_id, Components...>::converter<Component>::convert(T*
 
 template<bool pass_id, typename... Components>
 template<typename F>
-void scene::foreach_impl<pass_id, Components...>::call(
+bool scene::foreach_impl<pass_id, Components...>::call(
     F&& f,
     entity id,
-    std::decay_t<std::remove_pointer_t<std::decay_t<Components>>>*... args
+    typename container_type<Components>::pointer... args
 ){
-    if constexpr(pass_id) f(id, converter<Components>::convert(args)...);
-    else f(converter<Components>::convert(args)...);
+    if constexpr(pass_id)
+        return invoke_callback(f, id, converter<Components>::convert(args)...);
+    else return invoke_callback(f, converter<Components>::convert(args)...);
+}
+
+template<typename F, typename... Args>
+bool scene::invoke_callback(F& f, Args&&... args)
+{
+    if constexpr(std::is_void_v<std::invoke_result_t<F&, Args...>>)
+    {
+        f(std::forward<Args>(args)...);
+        return true;
+    }
+    else return f(std::forward<Args>(args)...) != iteration_control::BREAK;
+}
+
+template<typename T>
+scene::id_page_table<T>::id_page_table(
+    std::pmr::memory_resource* resource,
+    std::size_t width
+):  resource(resource), width(width), directories(resource)
+{
+}
+
+template<typename T>
+scene::id_page_table<T>::~id_page_table()
+{
+    clear();
+}
+
+template<typename T>
+T* scene::id_page_table<T>::find(entity id) const
+{
+    std::size_t page = id >> page_exp;
+    std::size_t directory = page >> directory_exp;
+    if(directory >= directories.size() || !directories[directory])
+        return nullptr;
+    T* values = directories[directory][page & (directory_size - 1)];
+    if(!values)
+        return nullptr;
+    return values + (id & (page_size - 1)) * width;
+}
+
+template<typename T>
+T* scene::id_page_table<T>::ensure(entity id)
+{
+    std::size_t page = id >> page_exp;
+    std::size_t directory = page >> directory_exp;
+    if(directory >= directories.size())
+        directories.resize(directory + 1, nullptr);
+    T**& pages = directories[directory];
+    if(!pages)
+    {
+        pages = static_cast<T**>(resource->allocate(
+            sizeof(T*) * directory_size, alignof(T*)
+        ));
+        std::fill_n(pages, directory_size, nullptr);
+    }
+    T*& values = pages[page & (directory_size - 1)];
+    if(!values)
+        values = allocate_page(width);
+    return values + (id & (page_size - 1)) * width;
+}
+
+template<typename T>
+template<typename F>
+void scene::id_page_table<T>::foreach_page(F&& f) const
+{
+    for(std::size_t directory = 0; directory < directories.size(); ++directory)
+    {
+        T** pages = directories[directory];
+        if(!pages) continue;
+        for(std::size_t i = 0; i < directory_size; ++i)
+        {
+            if(pages[i])
+                f(entity(((directory << directory_exp) + i) << page_exp), pages[i]);
+        }
+    }
+}
+
+template<typename T>
+std::size_t scene::id_page_table<T>::get_width() const
+{
+    return width;
+}
+
+template<typename T>
+void scene::id_page_table<T>::set_width(std::size_t new_width)
+{
+    std::size_t kept = std::min(width, new_width);
+    for(T** pages: directories)
+    {
+        if(!pages) continue;
+        for(std::size_t i = 0; i < directory_size; ++i)
+        {
+            if(!pages[i]) continue;
+            T* values = allocate_page(new_width);
+            for(std::size_t j = 0; j < page_size; ++j)
+                std::copy_n(pages[i] + j * width, kept, values + j * new_width);
+            deallocate_page(pages[i], width);
+            pages[i] = values;
+        }
+    }
+    width = new_width;
+}
+
+template<typename T>
+void scene::id_page_table<T>::clear()
+{
+    for(T** pages: directories)
+    {
+        if(!pages) continue;
+        for(std::size_t i = 0; i < directory_size; ++i)
+            if(pages[i]) deallocate_page(pages[i], width);
+        resource->deallocate(pages, sizeof(T*) * directory_size, alignof(T*));
+    }
+    std::pmr::vector<T**>(resource).swap(directories);
+}
+
+template<typename T>
+void scene::id_page_table<T>::swap(id_page_table& other)
+{
+    std::swap(resource, other.resource);
+    std::swap(width, other.width);
+    directories.swap(other.directories);
+}
+
+template<typename T>
+T* scene::id_page_table<T>::allocate_page(std::size_t width)
+{
+    T* values = static_cast<T*>(resource->allocate(
+        sizeof(T) * (width << page_exp), alignof(T)
+    ));
+    std::fill_n(values, width << page_exp, T());
+    return values;
+}
+
+template<typename T>
+void scene::id_page_table<T>::deallocate_page(T* page, std::size_t width)
+{
+    resource->deallocate(page, sizeof(T) * (width << page_exp), alignof(T));
 }
 
 template<typename T, typename=void>
@@ -2152,52 +4993,276 @@ struct has_ensure_dependency_components_exist<
     )
 > : std::true_type { };
 
-template<typename Component>
-void scene::try_attach_dependencies(entity id)
+template<typename Component>
+void scene::try_attach_dependencies(entity id)
+{
+    (void)id;
+    if constexpr(has_ensure_dependency_components_exist<Component>::value)
+        Component::ensure_dependency_components_exist(id, *this);
+}
+
+void scene::assert_not_parallel() const
+{
+    assert(
+        !parallel_iterating &&
+        "Entities and components can't be added or removed during "
+        "parallel_foreach()"
+    );
+}
+
+template<typename F>
+void scene::foreach(F&& f)
+{
+    // This one little trick lets us know the argument types without
+    // actually using the std::function wrapper at runtime!
+    decltype(
+        foreach_redirector(std::function(f))
+    )::foreach(*this, std::forward<F>(f));
+}
+
+template<typename F>
+void scene::operator()(F&& f)
+{
+    foreach(std::forward<F>(f));
+}
+
+template<typename F>
+void scene::foreach(F&& f) const
+{
+    foreach_range(INVALID_ENTITY, INVALID_ENTITY, std::forward<F>(f));
+}
+
+template<typename F>
+void scene::operator()(F&& f) const
+{
+    foreach(std::forward<F>(f));
+}
+
+template<typename F>
+void scene::foreach_range(entity begin, entity end, F&& f)
+{
+    decltype(
+        foreach_redirector(std::function(f))
+    )::foreach_range(*this, std::forward<F>(f), begin, end);
+}
+
+template<typename F>
+void scene::foreach_range(entity begin, entity end, F&& f) const
+{
+    decltype(
+        foreach_redirector(std::function(f))
+    )::foreach_read_only(*this, std::forward<F>(f), begin, end);
+}
+
+template<typename F>
+entity scene::find_if(F&& pred)
+{
+    return decltype(
+        foreach_redirector(std::function(pred))
+    )::template find_if<false>(*this, std::forward<F>(pred));
+}
+
+template<typename F>
+entity scene::find_if(F&& pred) const
+{
+    return decltype(
+        foreach_redirector(std::function(pred))
+    )::template find_if<true>(
+        const_cast<scene&>(*this), std::forward<F>(pred)
+    );
+}
+
+template<typename F>
+void scene::foreach_chunk(F&& f)
+{
+    decltype(
+        foreach_chunk_redirector(std::function(f))
+    )::foreach(*this, std::forward<F>(f));
+}
+
+template<typename F>
+void scene::parallel_foreach(F&& f, unsigned thread_count)
+{
+    decltype(
+        foreach_redirector(std::function(f))
+    )::parallel_foreach(*this, std::forward<F>(f), thread_count);
+}
+
+entity scene::add()
+{
+    assert_not_parallel();
+    if(reusable_ids.size() > 0)
+        return reuse_id(reusable_ids);
+    if(id_counter == INVALID_ENTITY)
+        return INVALID_ENTITY;
+    return id_counter++;
+}
+
+template<typename... Components>
+entity scene::add(Components&&... components)
+{
+    entity id = add();
+    attach(id, std::forward<Components>(components)...);
+    return id;
+}
+
+void scene::set_id_policy(id_policy policy)
+{
+    if(policy == id_policy::REUSE_LOWEST && this->policy != policy)
+    {
+        std::make_heap(
+            reusable_ids.begin(), reusable_ids.end(), std::greater<entity>()
+        );
+        for(id_pool& pool: id_pools)
+        {
+            std::make_heap(
+                pool.reusable_ids.begin(), pool.reusable_ids.end(),
+                std::greater<entity>()
+            );
+        }
+    }
+    this->policy = policy;
+}
+
+std::size_t scene::add_id_pool(std::size_t capacity)
+{
+    id_pools.push_back({INVALID_ENTITY, 0, 0, {}});
+    reserve_id_pool(id_pools.back(), capacity);
+    return id_pools.size()-1;
+}
+
+entity scene::add_in_pool(std::size_t pool)
+{
+    assert_not_parallel();
+    id_pool& p = id_pools[pool];
+    entity id = reuse_id(p.reusable_ids);
+    if(id != INVALID_ENTITY)
+        return id;
+    if(p.used == p.capacity)
+        return INVALID_ENTITY;
+    return p.first + entity(p.used++);
+}
+
+template<typename... Components>
+entity scene::add_in_pool(std::size_t pool, Components&&... components)
+{
+    entity id = add_in_pool(pool);
+    attach(id, std::forward<Components>(components)...);
+    return id;
+}
+
+void scene::sort_ids(std::pmr::vector<entity>& ids)
+{
+    if(ids.size() < 256)
+    {
+        std::sort(ids.begin(), ids.end());
+        return;
+    }
+
+    // Least significant digit first, digits above the largest ID are skipped.
+    constexpr unsigned digit_bits = 11;
+    constexpr std::size_t digit_mask = (std::size_t(1) << digit_bits) - 1;
+    entity max_id = *std::max_element(ids.begin(), ids.end());
+    std::pmr::vector<entity> sorted(ids.size(), ids.get_allocator());
+    std::size_t offsets[std::size_t(1) << digit_bits];
+    for(
+        unsigned shift = 0;
+        shift < sizeof(entity) * 8 && (max_id >> shift) != 0;
+        shift += digit_bits
+    ){
+        std::fill(std::begin(offsets), std::end(offsets), 0);
+        for(entity id: ids)
+            offsets[(id >> shift) & digit_mask]++;
+        std::size_t total = 0;
+        for(std::size_t& offset: offsets)
+        {
+            std::size_t digit_count = offset;
+            offset = total;
+            total += digit_count;
+        }
+        for(entity id: ids)
+            sorted[offsets[(id >> shift) & digit_mask]++] = id;
+        ids.swap(sorted);
+    }
+}
+
+void scene::reserve_id_pool(id_pool& pool, std::size_t capacity)
 {
-    (void)id;
-    if constexpr(has_ensure_dependency_components_exist<Component>::value)
-        Component::ensure_dependency_components_exist(id, *this);
+    // The number of IDs left doesn't fit in 64-bit entities when all of them
+    // are left, so this is one less than that.
+    bool exhausted = id_counter == INVALID_ENTITY;
+    std::uint64_t last_left = std::numeric_limits<entity>::max() - id_counter;
+    // Empty pools go to the end to keep id_pools sorted.
+    pool.first = exhausted ? std::numeric_limits<entity>::max() : id_counter;
+    pool.capacity = exhausted || capacity == 0 ? 0 :
+        std::min<std::uint64_t>(capacity - 1, last_left) + 1;
+    pool.used = 0;
+    pool.reusable_ids.clear();
+    // Wraps around to INVALID_ENTITY if this took the last IDs.
+    id_counter += entity(pool.capacity);
 }
 
-template<typename F>
-void scene::foreach(F&& f)
+void scene::release_id(entity id)
 {
-    // This one little trick lets us know the argument types without
-    // actually using the std::function wrapper at runtime!
-    decltype(
-        foreach_redirector(std::function(f))
-    )::foreach(*this, std::forward<F>(f));
+    std::pmr::vector<entity>* ids = &reusable_ids;
+    if(!id_pools.empty() && id >= id_pools.front().first)
+    {
+        auto it = std::upper_bound(
+            id_pools.begin(), id_pools.end(), id,
+            [](entity id, const id_pool& pool){ return id < pool.first; }
+        );
+        // Empty pools don't own any IDs, so they're skipped.
+        do --it;
+        while(it->capacity == 0 && it != id_pools.begin());
+        if(id - it->first < it->capacity)
+            ids = &it->reusable_ids;
+    }
+    ids->push_back(id);
+    if(policy == id_policy::REUSE_LOWEST)
+        std::push_heap(ids->begin(), ids->end(), std::greater<entity>());
 }
 
-template<typename F>
-void scene::operator()(F&& f)
+entity scene::reuse_id(std::pmr::vector<entity>& ids)
 {
-    foreach(std::forward<F>(f));
+    if(ids.empty())
+        return INVALID_ENTITY;
+    if(policy == id_policy::REUSE_LOWEST)
+        std::pop_heap(ids.begin(), ids.end(), std::greater<entity>());
+    entity id = ids.back();
+    ids.pop_back();
+    return id;
 }
 
-entity scene::add()
+template<typename... Components, typename... F>
+entity scene::add_many(std::size_t count, F&&... init)
 {
-    if(reusable_ids.size() > 0)
+    static_assert(
+        sizeof...(F) == 0 || sizeof...(F) == sizeof...(Components),
+        "add_many needs either no initializers or one per component"
+    );
+    if(
+        count == 0 || id_counter == INVALID_ENTITY ||
+        count - 1 > std::numeric_limits<entity>::max() - id_counter
+    ) return INVALID_ENTITY;
+
+    assert_not_parallel();
+    entity first = id_counter;
+    id_counter += count;
+
+    for(std::uint64_t id = first; id < first + count; ++id)
+        (try_attach_dependencies<Components>(entity(id)), ...);
+
+    if constexpr(sizeof...(F) == 0)
     {
-        entity id = reusable_ids.back();
-        reusable_ids.pop_back();
-        return id;
+        (get_container<Components>().emplace_range(
+            first, count, [](entity){ return Components(); }
+        ), ...);
     }
     else
     {
-        if(id_counter == INVALID_ENTITY)
-            return INVALID_ENTITY;
-        return id_counter++;
+        (get_container<Components>().emplace_range(first, count, init), ...);
     }
-}
-
-template<typename... Components>
-entity scene::add(Components&&... components)
-{
-    entity id = add();
-    attach(id, std::forward<Components>(components)...);
-    return id;
+    return first;
 }
 
 template<typename Component, typename... Args>
@@ -2224,22 +5289,92 @@ void scene::attach(entity id, Components&&... components)
 
 void scene::remove(entity id)
 {
-    for(auto& c: components)
-        if(c) c->erase(id);
+    assert_not_parallel();
+    // Only the containers that the entity has components in are visited.
+    // Each signature word is cleared once as a whole, so the containers
+    // don't need to clear their bits one by one. Removal handlers may widen
+    // the signatures, so the pointer is looked up again for every word.
+    for(std::size_t w = 0; w < signatures.get_width(); ++w)
+    {
+        std::uint64_t* words = signatures.find(id);
+        if(!words)
+            break;
+        std::uint64_t word = words[w];
+        words[w] = 0;
+        for(; word; word &= word-1)
+            components[w*64 + bitscan_forward(word)]->erase(id, false);
+    }
+    release_generation(id);
     if(defer_batch == 0)
-        reusable_ids.push_back(id);
+        release_id(id);
     else
         post_batch_reusable_ids.push_back(id);
 }
 
+void scene::remove(const entity* ids, std::size_t count)
+{
+    assert_not_parallel();
+    std::pmr::vector<entity> sorted(ids, ids + count, resource);
+    sort_ids(sorted);
+
+    // Only the containers that some of the entities have components in are
+    // visited. The signatures are cleared here, the containers leave them be.
+    std::size_t width = signatures.get_width();
+    std::pmr::vector<std::uint64_t> used(width, 0, resource);
+    for(entity id: sorted)
+    {
+        if(std::uint64_t* words = signatures.find(id))
+        {
+            for(std::size_t w = 0; w < width; ++w)
+            {
+                used[w] |= words[w];
+                words[w] = 0;
+            }
+        }
+    }
+    for(std::size_t w = 0; w < used.size(); ++w)
+    {
+        for(std::uint64_t word = used[w]; word; word &= word-1)
+        {
+            components[w*64 + bitscan_forward(word)]->erase_many(
+                sorted.data(), sorted.size()
+            );
+        }
+    }
+    for(entity id: sorted)
+        release_generation(id);
+
+    if(defer_batch == 0)
+    {
+        for(std::size_t i = 0; i < count; ++i)
+            release_id(ids[i]);
+    }
+    else
+    {
+        post_batch_reusable_ids.insert(
+            post_batch_reusable_ids.end(), ids, ids + count
+        );
+    }
+}
+
 template<typename Component>
 void scene::remove(entity id)
 {
     get_container<Component>().erase(id);
 }
 
+template<typename Component>
+void scene::remove_all()
+{
+    get_container<Component>().clear();
+}
+
 void scene::clear_entities()
 {
+    assert_not_parallel();
+    // Every signature is going to be empty, so the containers don't need to
+    // clear their bits one by one.
+    signatures.clear();
     for(auto& c: components)
         if(c) c->clear();
 
@@ -2248,7 +5383,190 @@ void scene::clear_entities()
         id_counter = 1;
         reusable_ids.clear();
         post_batch_reusable_ids.clear();
+        for(id_pool& pool: id_pools)
+            reserve_id_pool(pool, pool.capacity);
+
+        // All IDs were released at once.
+        release_all_generations();
+    }
+}
+
+entity_handle scene::get_handle(entity id)
+{
+    // The odd bit marks that the generation has a handle, so that removing
+    // the ID has to move on to the next one.
+    std::uint32_t& generation = *generations.ensure(id);
+    generation |= 1;
+    generation_top = std::max(generation_top, generation);
+    return {id, generation_base + generation};
+}
+
+bool scene::alive(entity_handle handle) const
+{
+    if(
+        handle.id == INVALID_ENTITY ||
+        (id_counter != INVALID_ENTITY && handle.id >= id_counter)
+    ) return false;
+    return handle.generation == get_generation(handle.id);
+}
+
+std::uint32_t scene::get_generation(entity id) const
+{
+    const std::uint32_t* generation = generations.find(id);
+    return generation_base + (generation ? *generation : 0);
+}
+
+void scene::release_generation(entity id)
+{
+    // Without handles, nothing can tell the generations apart, so this
+    // doesn't allocate or write anything.
+    if(generation_top == 0)
+        return;
+    std::uint32_t* generation = generations.find(id);
+    if(generation && (*generation & 1))
+        ++*generation;
+}
+
+void scene::signature_insert(entity id, std::size_t key)
+{
+    std::size_t word = key >> 6;
+    if(word >= signatures.get_width())
+        signatures.set_width(word + 1);
+    signatures.ensure(id)[word] |= std::uint64_t(1) << (key & 63);
+}
+
+void scene::signature_erase(entity id, std::size_t key)
+{
+    std::size_t word = key >> 6;
+    std::uint64_t* words = signatures.find(id);
+    if(words && word < signatures.get_width())
+        words[word] &= ~(std::uint64_t(1) << (key & 63));
+}
+
+void scene::signature_erase_all(std::size_t key)
+{
+    std::size_t word = key >> 6;
+    std::size_t width = signatures.get_width();
+    if(word >= width)
+        return;
+    std::uint64_t mask = ~(std::uint64_t(1) << (key & 63));
+    std::size_t page_words = width << id_page_table<std::uint64_t>::page_exp;
+    signatures.foreach_page([&](entity, std::uint64_t* page){
+        for(std::size_t i = word; i < page_words; i += width)
+            page[i] &= mask;
+    });
+}
+
+void scene::release_all_generations()
+{
+    // Every generation starts from one that no existing handle can have.
+    generation_base += generation_top + 1;
+    generation_top = 0;
+    generations.clear();
+}
+
+compact_result scene::compact()
+{
+    compact_result result;
+    if(defer_batch != 0)
+        return result;
+
+    // The released IDs split the handed out ones into runs of live IDs,
+    // which get consecutive new IDs. Those are in ascending order, so no ID
+    // ever grows.
+    std::pmr::vector<entity> released(
+        reusable_ids.begin(), reusable_ids.end(), resource
+    );
+    for(const id_pool& pool: id_pools)
+        released.insert(
+            released.end(), pool.reusable_ids.begin(), pool.reusable_ids.end()
+        );
+    sort_ids(released);
+
+    auto& runs = result.translation_table.runs;
+    auto free_id = released.begin();
+    entity next = 1;
+    // Translates the live IDs in [first, last].
+    auto translate = [&](entity first, entity last){
+        for(entity id = first;;)
+        {
+            while(free_id != released.end() && *free_id < id)
+                ++free_id;
+            entity run_last = last;
+            if(free_id != released.end() && *free_id <= last)
+            {
+                if(*free_id == id)
+                {
+                    if(id == last)
+                        return;
+                    ++id;
+                    continue;
+                }
+                run_last = *free_id - 1;
+            }
+            entity count = run_last - id + 1;
+            runs.push_back({id, next, count});
+            next += count;
+            if(run_last == last)
+                return;
+            id = run_last + 1;
+        }
+    };
+
+    // Pools keep their capacity, only their live entities are packed at the
+    // start. Their unused ends are skipped without looking at them.
+    entity id = 1;
+    for(id_pool& pool: id_pools)
+    {
+        // Pools that got no IDs at all are at the end of the ID range.
+        if(pool.capacity == 0 && pool.first == std::numeric_limits<entity>::max())
+            continue;
+        if(id < pool.first)
+            translate(id, pool.first - 1);
+        entity first = next;
+        if(pool.used != 0)
+            translate(pool.first, pool.first + entity(pool.used - 1));
+        id = pool.first + entity(pool.capacity);
+        pool.first = first;
+        pool.used = next - first;
+        pool.reusable_ids.clear();
+        next = first + entity(pool.capacity);
     }
+    // Wraps around to INVALID_ENTITY if every ID has been handed out.
+    entity last = id_counter - 1;
+    if(id != INVALID_ENTITY && last != INVALID_ENTITY && id <= last)
+        translate(id, last);
+    id_counter = next;
+    reusable_ids.clear();
+
+    // The signatures are moved to new pages, since the old ones may be
+    // scattered far apart.
+    id_page_table<std::uint64_t> old_signatures(resource);
+    old_signatures.swap(signatures);
+    std::size_t width = old_signatures.get_width();
+    signatures.set_width(width);
+    old_signatures.foreach_page([&](entity first, const std::uint64_t* page){
+        for(std::size_t i = 0; i < id_page_table<std::uint64_t>::page_size; ++i)
+        {
+            const std::uint64_t* words = page + i * width;
+            if(std::all_of(
+                words, words + width,
+                [](std::uint64_t word){ return word == 0; }
+            )) continue;
+            entity new_id = result.translation_table[first + entity(i)];
+            if(new_id != INVALID_ENTITY)
+                std::copy_n(words, width, signatures.ensure(new_id));
+        }
+    });
+
+    for(auto& c: components)
+        if(c) result.released_bytes += c->renumber(result.translation_table);
+
+    // Existing handles carry the old IDs, so they must not stay alive.
+    release_all_generations();
+
+    emit(renumber_entities{&result.translation_table});
+    return result;
 }
 
 void scene::concat(
@@ -2284,12 +5602,8 @@ entity scene::copy(scene& other, entity other_id)
 
 void scene::start_batch()
 {
+    // Containers join the batch lazily when they are first modified.
     ++defer_batch;
-    if(defer_batch == 1)
-    {
-        for(auto& c: components)
-            if(c) c->start_batch();
-    }
 }
 
 void scene::finish_batch()
@@ -2299,14 +5613,12 @@ void scene::finish_batch()
         --defer_batch;
         if(defer_batch == 0)
         {
-            for(auto& c: components)
-                if(c) c->finish_batch();
+            for(component_container_base* c: batched_containers)
+                c->finish_batch();
+            batched_containers.clear();
 
-            reusable_ids.insert(
-                reusable_ids.end(),
-                post_batch_reusable_ids.begin(),
-                post_batch_reusable_ids.end()
-            );
+            for(entity id: post_batch_reusable_ids)
+                release_id(id);
             post_batch_reusable_ids.clear();
         }
     }
@@ -2324,20 +5636,28 @@ bool scene::has(entity id) const
     return get_container<Component>().contains(id);
 }
 
+scene::signature scene::get_signature(entity id) const
+{
+    const std::uint64_t* words = signatures.find(id);
+    return signature(words, words ? signatures.get_width() : 0);
+}
+
 template<typename Component>
-const Component* scene::get(entity id) const
+typename component_container<Component>::const_pointer
+scene::get(entity id) const
 {
     return get_container<Component>()[id];
 }
 
 template<typename Component>
-Component* scene::get(entity id)
+typename component_container<Component>::pointer scene::get(entity id)
 {
     return get_container<Component>()[id];
 }
 
 template<typename Component, typename... Args>
-Component* scene::find_component(Args&&... args)
+typename component_container<Component>::pointer
+scene::find_component(Args&&... args)
 {
     return get<Component>(
         find<Component>(std::forward<Args>(args)...)
@@ -2345,7 +5665,8 @@ Component* scene::find_component(Args&&... args)
 }
 
 template<typename Component, typename... Args>
-const Component* scene::find_component(Args&&... args) const
+typename component_container<Component>::const_pointer
+scene::find_component(Args&&... args) const
 {
     return get<Component>(
         find<Component>(std::forward<Args>(args)...)
@@ -2370,6 +5691,30 @@ void scene::update_search_indices()
         if(c) c->update_search_index();
 }
 
+void scene::set_bucket_pool_limit(std::size_t limit)
+{
+    bucket_pool_limit = limit;
+    for(auto& c: components)
+        if(c) c->set_bucket_pool_limit(limit);
+}
+
+template<typename Component>
+void scene::set_bucket_pool_limit(std::size_t limit)
+{
+    get_container<Component>().set_bucket_pool_limit(limit);
+}
+
+template<typename Component>
+bucket_pool_stats scene::get_bucket_pool_stats() const
+{
+    return get_container<Component>().get_bucket_pool_stats();
+}
+
+std::pmr::memory_resource* scene::get_memory_resource() const
+{
+    return resource;
+}
+
 template<typename EventType>
 void scene::emit(const EventType& event)
 {
@@ -2447,13 +5792,40 @@ component_container<Component>& scene::get_container() const
     auto& base_ptr = components[key];
     if(!base_ptr)
     {
-        base_ptr.reset(new component_container<Component>(*const_cast<scene*>(this)));
-        if(defer_batch > 0)
-            base_ptr->start_batch();
+        assert_not_parallel();
+        void* mem = resource->allocate(
+            sizeof(component_container<Component>),
+            alignof(component_container<Component>)
+        );
+        base_ptr = std::unique_ptr<component_container_base, container_deleter>(
+            new (mem) component_container<Component>(*const_cast<scene*>(this)),
+            container_deleter{
+                resource,
+                sizeof(component_container<Component>),
+                alignof(component_container<Component>)
+            }
+        );
+        base_ptr->set_bucket_pool_limit(bucket_pool_limit);
     }
     return *static_cast<component_container<Component>*>(base_ptr.get());
 }
 
+template<typename Component>
+component_container<Component>* scene::find_container() const
+{
+    size_t key = get_component_type_key<Component>();
+    if(components.size() <= key)
+        return nullptr;
+    return static_cast<component_container<Component>*>(components[key].get());
+}
+
+void scene::container_deleter::operator()(component_container_base* c) const
+{
+    void* mem = dynamic_cast<void*>(c);
+    c->~component_container_base();
+    resource->deallocate(mem, size, alignment);
+}
+
 template<typename Component>
 size_t scene::get_component_type_key()
 {
@@ -2506,5 +5878,238 @@ ensure_dependency_components_exist(entity id, scene& ctx)
     ((ctx.has<DependencyComponents>(id) ? void() : ctx.attach(id, DependencyComponents())), ...);
 }
 
+template<typename... Components>
+scene::query<Components...>::query(scene& ctx)
+:   ctx(&ctx), entries(ctx.get_memory_resource()),
+    indices(ctx.get_memory_resource()), deferred(ctx.get_memory_resource()),
+    iterating(0),
+    sub(ctx.subscribe(
+        [this](scene&, const add_component<Components>& e){
+            refresh(e.id);
+        }...,
+        // Removal is handled without checking the other components, as
+        // they may already be on their way out too (e.g. when clearing).
+        [this](scene&, const remove_component<Components>& e){
+            if(iterating) deferred.push_back(e.id);
+            else erase(e.id);
+        }...,
+        [this](scene&, const renumber_entities&){ rebuild(); }
+    ))
+{
+    static_assert(
+        sizeof...(Components) > 0,
+        "A query needs at least one component type"
+    );
+    static_assert(
+        ((std::is_same_v<Components, std::decay_t<Components>> &&
+          !std::is_pointer_v<Components>) && ...),
+        "Query components must be plain component types"
+    );
+    rebuild();
+}
+
+template<typename... Components>
+template<typename F>
+void scene::query<Components...>::foreach(F&& f)
+{
+    ctx->start_batch();
+    iterating++;
+    for(std::size_t i = 0; i < entries.size(); ++i)
+    {
+        entry& e = entries[i];
+        bool proceed = std::apply([&](auto... ptr){
+            auto deref = [](auto p) -> decltype(auto) {
+                if constexpr(std::is_pointer_v<decltype(p)>) return *p;
+                else return p;
+            };
+            if constexpr(std::is_invocable_v<F&, entity, decltype(deref(ptr))...>)
+                return invoke_callback(f, e.id, deref(ptr)...);
+            else return invoke_callback(f, deref(ptr)...);
+        }, e.components);
+        if(!proceed) break;
+    }
+    iterating--;
+    ctx->finish_batch();
+
+    if(iterating == 0)
+    {
+        // Refreshing can't cause further changes, so this can't grow while
+        // it's being walked.
+        for(entity id: deferred)
+            refresh(id);
+        deferred.clear();
+    }
+}
+
+template<typename... Components>
+template<typename F>
+void scene::query<Components...>::operator()(F&& f)
+{
+    foreach(std::forward<F>(f));
+}
+
+template<typename... Components>
+std::size_t scene::query<Components...>::size() const
+{
+    return entries.size();
+}
+
+template<typename... Components>
+bool scene::query<Components...>::contains(entity id) const
+{
+    const std::uint32_t* index = indices.find(id);
+    return index && *index != 0;
+}
+
+template<typename... Components>
+void scene::query<Components...>::refresh(entity id)
+{
+    if(iterating)
+        deferred.push_back(id);
+    else if((ctx->has<Components>(id) && ...))
+        insert(id);
+    else erase(id);
+}
+
+template<typename... Components>
+void scene::query<Components...>::rebuild()
+{
+    entries.clear();
+    indices.clear();
+    foreach_impl<
+        true,
+        std::conditional_t<
+            component_container<Components>::soa_component,
+            soa_ref<Components>,
+            Components&
+        >...
+    >::foreach(*ctx, [&](entity id, auto&&...){ insert(id); });
+}
+
+template<typename... Components>
+void scene::query<Components...>::insert(entity id)
+{
+    // Components may have been replaced, so the pointers are always updated.
+    std::uint32_t& index = *indices.ensure(id);
+    if(index == 0)
+    {
+        entries.push_back({id, {}});
+        index = entries.size();
+    }
+    entries[index-1].components = {ctx->get<Components>(id)...};
+}
+
+template<typename... Components>
+void scene::query<Components...>::erase(entity id)
+{
+    if(!contains(id))
+        return;
+
+    std::uint32_t* index = indices.find(id);
+    std::uint32_t i = *index;
+    *index = 0;
+    if(i != entries.size())
+    {
+        entries[i-1] = entries.back();
+        *indices.find(entries[i-1].id) = i;
+    }
+    entries.pop_back();
+}
+
+scene::cursor::cursor(scene& ctx)
+:   ctx(&ctx), position(INVALID_ENTITY)
+{
+}
+
+template<typename F>
+bool scene::cursor::foreach(F&& f, std::size_t max_count)
+{
+    if(max_count == 0)
+        return false;
+    std::size_t count = 0;
+    return foreach_slice(
+        std::forward<F>(f), [&](){ return ++count == max_count; }
+    );
+}
+
+template<typename F, typename Rep, typename Period>
+bool scene::cursor::foreach(F&& f, std::chrono::duration<Rep, Period> max_time)
+{
+    auto deadline = std::chrono::steady_clock::now() + max_time;
+    return foreach_slice(
+        std::forward<F>(f),
+        [&](){ return std::chrono::steady_clock::now() >= deadline; }
+    );
+}
+
+void scene::cursor::reset()
+{
+    position = INVALID_ENTITY;
+}
+
+entity scene::cursor::get_position() const
+{
+    return position;
+}
+
+template<typename F, typename S>
+bool scene::cursor::foreach_slice(F&& f, S&& stop)
+{
+    position = decltype(
+        foreach_redirector(std::function(f))
+    )::foreach_slice(*ctx, std::forward<F>(f), position, stop);
+    return position == INVALID_ENTITY;
+}
+
+template<typename... Components>
+bool scene::signature::has() const
+{
+    return (test(get_component_type_key<Components>()) && ...);
+}
+
+template<typename... Components>
+bool scene::signature::has_any() const
+{
+    return (test(get_component_type_key<Components>()) || ...);
+}
+
+std::size_t scene::signature::count() const
+{
+    std::size_t total = 0;
+    for(std::size_t i = 0; i < word_count; ++i)
+        total += popcount(words[i]);
+    return total;
+}
+
+bool scene::signature::operator==(const signature& other) const
+{
+    // Missing words are the same as empty ones.
+    for(std::size_t i = 0; i < std::max(word_count, other.word_count); ++i)
+    {
+        std::uint64_t a = i < word_count ? words[i] : 0;
+        std::uint64_t b = i < other.word_count ? other.words[i] : 0;
+        if(a != b)
+            return false;
+    }
+    return true;
+}
+
+bool scene::signature::operator!=(const signature& other) const
+{
+    return !operator==(other);
+}
+
+scene::signature::signature(const std::uint64_t* words, std::size_t word_count)
+:   words(words), word_count(word_count)
+{
+}
+
+bool scene::signature::test(std::size_t key) const
+{
+    std::size_t word = key >> 6;
+    return word < word_count &&
+        (words[word] & (std::uint64_t(1) << (key & 63)));
+}
+
 }
 #endif
@@ -30,9 +30,21 @@ SOFTWARE.
 #include <type_traits>
 #include <algorithm>
 #include <map>
+#include <vector>
+#include <memory_resource>
+#include <array>
+#include <tuple>
 //#define MONKERO_CONTAINER_DEALLOCATE_BUCKETS
 //#define MONKERO_CONTAINER_DEBUG_UTILS
 
+// How many entities ahead of the current one component data is prefetched
+// during foreach. Zero disables prefetching. It only pays off when the
+// iterated components don't fit in the last level cache; otherwise, the
+// extra cursor costs more than it saves.
+#ifndef MONKERO_PREFETCH_DISTANCE
+#define MONKERO_PREFETCH_DISTANCE 0
+#endif
+
 namespace monkero
 {
 
@@ -78,6 +90,218 @@ struct component_bucket_exp_hint
     }();
 };
 
+/** Lists the fields of a component that is stored as a structure of arrays.
+ * \see component_soa_fields
+ */
+template<auto... Members>
+struct soa_fields {};
+
+template<typename T, typename=void>
+struct has_soa_fields: std::false_type { };
+
+template<typename T>
+struct has_soa_fields<T, std::void_t<typename T::soa_fields>>
+: std::true_type { };
+
+template<typename T, bool = has_soa_fields<T>::value>
+struct default_soa_fields { using type = void; };
+
+template<typename T>
+struct default_soa_fields<T, true> { using type = typename T::soa_fields; };
+
+/** Provides structure-of-arrays storage choice for the component container.
+ * By default, components are stored as arrays of whole structures. If the hot
+ * loops only touch a few fields of a wide component, each field can be stored
+ * in its own array instead. To do that for your component type, you have two
+ * options:
+ * A (preferred when you can modify the component type):
+ *     Add a `using soa_fields = monkero::soa_fields<&T::a, &T::b, ...>;`
+ * B (needed when you cannot modify the component type):
+ *     Specialize component_soa_fields for your type and provide a
+ *     `using type = monkero::soa_fields<&T::a, &T::b, ...>;`
+ * The component must be an aggregate and all of its fields must be listed in
+ * declaration order, as the whole structure is rebuilt from them when needed.
+ * Such components are accessed through soa_ref and soa_span instead of
+ * pointers. add_component and remove_component events point to a temporary
+ * copy of the component.
+ */
+template<typename T>
+struct component_soa_fields
+{
+    using type = typename default_soa_fields<T>::type;
+};
+
+template<typename T>
+inline constexpr bool is_soa_component =
+    !std::is_void_v<typename component_soa_fields<T>::type>;
+
+template<typename M>
+struct soa_member;
+
+template<typename C, typename F>
+struct soa_member<F C::*> { using type = F; };
+
+template<typename T, typename Fields = typename component_soa_fields<T>::type>
+struct soa_layout;
+
+// The field arrays of a bucket are laid out back-to-back in one block.
+template<typename T, auto... Members>
+struct soa_layout<T, soa_fields<Members...>>
+{
+    static_assert(sizeof...(Members) > 0, "SoA components must have fields");
+    static_assert(
+        std::is_aggregate_v<T>,
+        "SoA components must be aggregates"
+    );
+
+    static constexpr std::size_t field_count = sizeof...(Members);
+    static constexpr std::size_t bucket_size =
+        std::size_t(1) << component_bucket_exp_hint<T>::value;
+    static constexpr auto members = std::make_tuple(Members...);
+
+    template<std::size_t I>
+    using field_type = typename soa_member<
+        std::tuple_element_t<I, std::remove_const_t<decltype(members)>>
+    >::type;
+
+    static constexpr std::array<std::size_t, field_count> offsets = []{
+        std::size_t sizes[] = {
+            sizeof(typename soa_member<decltype(Members)>::type)...
+        };
+        std::size_t aligns[] = {
+            alignof(typename soa_member<decltype(Members)>::type)...
+        };
+        std::array<std::size_t, field_count> result = {};
+        std::size_t offset = 0;
+        for(std::size_t i = 0; i < field_count; ++i)
+        {
+            offset = (offset + aligns[i] - 1) / aligns[i] * aligns[i];
+            result[i] = offset;
+            offset += sizes[i] * bucket_size;
+        }
+        return result;
+    }();
+    static constexpr std::size_t block_size =
+        offsets[field_count-1] + sizeof(field_type<field_count-1>) * bucket_size;
+
+    template<auto Member>
+    static constexpr std::size_t index_of();
+
+    template<typename F>
+    static F* at(std::uint8_t* block, std::size_t field, std::size_t index);
+
+    static void construct(std::uint8_t* block, std::size_t index, T& value);
+    static T load(std::uint8_t* block, std::size_t index);
+    static void destroy(std::uint8_t* block, std::size_t index);
+};
+
+/** A reference to the fields of one structure-of-arrays component.
+ * Takes the place of a component pointer, so it can be null and be tested in
+ * conditions.
+ * \see component_soa_fields
+ */
+template<typename T>
+class soa_ref
+{
+template<typename> friend class soa_ref;
+template<typename> friend class soa_span;
+template<typename> friend class component_container;
+public:
+    using layout = soa_layout<std::remove_const_t<T>>;
+
+    soa_ref(std::nullptr_t = nullptr);
+    soa_ref(std::uint8_t* block, std::size_t index);
+    template<
+        typename U,
+        typename = std::enable_if_t<std::is_same_v<const U, T>>
+    > soa_ref(const soa_ref<U>& other);
+
+    /** Returns a field of the component.
+     * \tparam Member Pointer to the member, e.g. &particle::x.
+     */
+    template<auto Member>
+    auto& get() const;
+
+    /** Gathers a copy of the whole component. */
+    std::remove_const_t<T> load() const;
+
+    explicit operator bool() const;
+    bool operator==(const soa_ref& other) const;
+    bool operator!=(const soa_ref& other) const;
+
+private:
+    std::uint8_t* block;
+    std::size_t index;
+};
+
+/** Consecutive structure-of-arrays components, as given by
+ * scene::foreach_chunk(). Each field is a plain array, so a loop over one
+ * field only touches the memory of that field.
+ */
+template<typename T>
+class soa_span
+{
+public:
+    using layout = soa_layout<std::remove_const_t<T>>;
+
+    soa_span(soa_ref<std::remove_const_t<T>> first);
+
+    /** Returns the array of a field.
+     * \tparam Member Pointer to the member, e.g. &particle::x.
+     */
+    template<auto Member>
+    auto* get() const;
+
+    /** Returns a reference to the i:th component of the span. */
+    soa_ref<T> operator[](std::size_t i) const;
+
+private:
+    soa_ref<T> first;
+};
+
+// Bit twiddling helpers. The bitscans must not be given zero.
+inline unsigned bitscan_forward(std::uint64_t mt);
+inline unsigned bitscan_reverse(std::uint64_t mt);
+inline unsigned popcount(std::uint64_t mt);
+// Hints that the cache line at ptr will be read soon.
+inline void prefetch(const void* ptr);
+
+/** Statistics of the recycled bucket blocks of a component container.
+ * \see scene::get_bucket_pool_stats()
+ */
+struct bucket_pool_stats
+{
+    std::size_t allocations = 0; /**< Blocks allocated from the heap */
+    std::size_t reuses = 0; /**< Blocks taken from the pool instead */
+    std::size_t deallocations = 0; /**< Blocks given back to the heap */
+    std::size_t retained = 0; /**< Blocks currently waiting in the pool */
+};
+
+// Recycles fixed-size bucket blocks, so that buckets that get emptied and
+// refilled don't cause heap traffic every time.
+template<typename U>
+class bucket_pool
+{
+public:
+    bucket_pool(std::size_t block_size, std::pmr::memory_resource* resource);
+    bucket_pool(const bucket_pool& other) = delete;
+    ~bucket_pool();
+
+    U* allocate();
+    void release(U* block);
+    void set_limit(std::size_t limit);
+    void add_stats(bucket_pool_stats& stats) const;
+
+private:
+    std::size_t block_size;
+    std::size_t limit;
+    std::pmr::memory_resource* resource;
+    std::pmr::vector<U*> blocks;
+    std::size_t allocations;
+    std::size_t reuses;
+    std::size_t deallocations;
+};
+
 class component_container_base
 {
 public:
@@ -85,10 +309,20 @@ public:
 
     inline virtual void start_batch() = 0;
     inline virtual void finish_batch() = 0;
-    inline virtual void erase(entity id) = 0;
+    // The scene passes false for update_signature when it clears the
+    // signature itself.
+    inline virtual void erase(entity id, bool update_signature = true) = 0;
+    inline virtual void erase_many(const entity* ids, std::size_t count) = 0;
     inline virtual void clear() = 0;
     inline virtual std::size_t size() const = 0;
+    inline virtual std::vector<entity> split_ranges(
+        std::uint32_t max_ranges
+    ) const = 0;
     inline virtual void update_search_index() = 0;
+    inline virtual void set_bucket_pool_limit(std::size_t limit) = 0;
+    inline virtual std::size_t renumber(
+        const entity_translation& translation_table
+    ) = 0;
     inline virtual void list_entities(
         std::map<entity, entity>& translation_table
     ) = 0;
@@ -111,7 +345,7 @@ public:
     std::uint32_t bucket_mask;
     std::uint32_t bucket_exp;
     entity*** bucket_jump_table;
-    std::uint32_t current_bucket;
+    entity current_bucket;
     entity current_entity;
     entity* current_jump_table;
 };
@@ -124,28 +358,51 @@ public:
     static constexpr uint32_t bitmask_bits = 64;
     static constexpr uint32_t bitmask_shift = 6; // 64 = 2**6
     static constexpr uint32_t bitmask_mask = 0x3F;
-    static constexpr uint32_t initial_bucket_count = 16u;
+    static constexpr entity initial_bucket_count = 16u;
+    // Batches with at least this many changes are applied by relinking the
+    // whole affected range instead of one change at a time.
+    static constexpr uint32_t batch_rebuild_threshold = 256u;
     static constexpr bool tag_component = std::is_empty_v<T>;
     static constexpr std::uint32_t bucket_exp =
         component_bucket_exp_hint<T>::value;
     static constexpr std::uint32_t bucket_mask = (1u<<bucket_exp)-1;
     static constexpr std::uint32_t bucket_bitmask_units =
         std::max(1u, (1u<<bucket_exp)>>bitmask_shift);
+    static constexpr bool soa_component = is_soa_component<T>;
+    static_assert(
+        !(soa_component && tag_component),
+        "Tag components cannot be stored as structures of arrays"
+    );
+
+    // Components are handed out through these; they're soa_refs for SoA
+    // components and plain pointers otherwise.
+    using pointer = std::conditional_t<soa_component, soa_ref<T>, T*>;
+    using const_pointer =
+        std::conditional_t<soa_component, soa_ref<const T>, const T*>;
 
     component_container(scene& ctx);
     component_container(component_container&& other) = delete;
     component_container(const component_container& other) = delete;
     ~component_container();
 
-    T* operator[](entity e);
-    const T* operator[](entity e) const;
+    pointer operator[](entity e);
+    const_pointer operator[](entity e) const;
 
     void insert(entity id, T&& value);
 
     template<typename... Args>
     void emplace(entity id, Args&&... value);
 
-    void erase(entity id) override;
+    // Adds components built by init(id) for the consecutive IDs
+    // [first, first+count). If nothing exists in that range yet, the bitmasks
+    // and jump table are filled for whole buckets at a time.
+    template<typename F>
+    void emplace_range(entity first, entity count, F&& init);
+
+    void erase(entity id, bool update_signature = true) override;
+    // Erases many entities at once, the IDs must be in ascending order.
+    // Their signatures are left for the scene to clear.
+    void erase_many(const entity* ids, std::size_t count) override;
 
     void clear() override;
 
@@ -165,8 +422,8 @@ public:
 
         iterator& operator++();
         iterator operator++(int);
-        std::pair<entity, T*> operator*();
-        std::pair<entity, const T*> operator*() const;
+        std::pair<entity, pointer> operator*();
+        std::pair<entity, const_pointer> operator*() const;
 
         bool operator==(const iterator& other) const;
         bool operator!=(const iterator& other) const;
@@ -183,17 +440,52 @@ public:
 
         component_container* from;
         entity current_entity;
-        std::uint32_t current_bucket;
+        entity current_bucket;
         entity* current_jump_table;
         T* current_components;
     };
 
     iterator begin();
     iterator end();
+    // Returns an iterator to the first entity whose ID is not less than id.
+    iterator lower_bound(entity id);
     std::size_t size() const override;
 
+    // Splits the ID space into at most max_ranges bucket-aligned ranges with
+    // roughly equal numbers of entities in them. Range i is
+    // [result[i], result[i+1]), the last entry is INVALID_ENTITY which stands
+    // for the end of the ID space.
+    std::vector<entity> split_ranges(std::uint32_t max_ranges) const override;
+
+    // Low-level access for bulk iteration. These reflect the state that is
+    // being iterated, that is, changes made during batching are not visible.
+    // Returns the presence bits of entities [word_index*64, word_index*64+64).
+    bitmask_type get_bitmask_word(entity word_index) const;
+    // Moves word_index forward to the first word that has entities in it.
+    // Returns false if there is no such word.
+    bool find_next_word(entity& word_index) const;
+    // Returns the first entity whose ID is not less than id, or
+    // INVALID_ENTITY if there is none.
+    entity find_next_entity(entity id) const;
+    // Returns the component of an entity, which must exist.
+    pointer get_unsafe(entity e);
+    // Starts fetching the component of an entity into cache, if it has a
+    // memory location of its own.
+    void prefetch_component(entity e) const;
+
     void update_search_index() override;
 
+    void set_bucket_pool_limit(std::size_t limit) override;
+    bucket_pool_stats get_bucket_pool_stats() const;
+
+    // Moves every entity to translation_table[id]. The new IDs must keep the
+    // order of the old ones and never be greater than them. Returns the
+    // number of bytes of buckets that were released.
+    std::size_t renumber(
+        const entity_translation& translation_table
+    ) override;
+    // Bytes of bitmask, jump table and component buckets currently in use.
+    std::size_t get_bucket_memory() const;
     void list_entities(
         std::map<entity, entity>& translation_table
     ) override;
@@ -217,60 +509,98 @@ public:
 #endif
 
 private:
-    T* get_unsafe(entity e);
     void destroy();
     void jump_table_insert(entity id);
     void jump_table_erase(entity id);
     std::size_t get_top_bitmask_size() const;
-    bool bitmask_empty(std::uint32_t bucket_index) const;
+    bool bitmask_empty(entity bucket_index) const;
     void bitmask_insert(entity id);
     // Returns a hint to whether the whole bucket should be removed or not.
     bool bitmask_erase(entity id);
 
+    template<typename U>
+    U* allocate_array(std::size_t count);
+    template<typename U>
+    void deallocate_array(U* ptr, std::size_t count);
+
     template<typename... Args>
     void bucket_insert(entity id, Args&&... args);
+    template<typename... Args>
+    pointer bucket_construct(entity id, Args&&... args);
     void bucket_erase(entity id, bool signal);
-    void bucket_self_erase(std::uint32_t bucket_index);
-    void try_jump_table_bucket_erase(std::uint32_t bucket_index);
+    void bucket_self_erase(entity bucket_index);
+    void try_jump_table_bucket_erase(entity bucket_index);
     void ensure_bucket_space(entity id);
-    void ensure_bitmask(std::uint32_t bucket_index);
-    void ensure_jump_table(std::uint32_t bucket_index);
+    void ensure_bitmask(entity bucket_index);
+    void ensure_jump_table(entity bucket_index);
+    // Enters batch mode if the scene is batching and this container has not
+    // been modified during the batch yet.
+    void join_batch();
     bool batch_change(entity id);
+    void batch_rebuild();
     entity find_previous_entity(entity id);
-    void signal_add(entity id, T* data);
-    void signal_remove(entity id, T* data);
-    static unsigned bitscan_reverse(std::uint64_t mt);
+    // Whether the state that iterators go through has any entities.
+    bool has_iterable_entities() const;
+    void signal_add(entity id, pointer data);
+    void signal_remove(entity id, pointer data);
+    void destroy_component(pointer data);
+    static pointer get_pointer(T* bucket, entity index);
     static bool find_bitmask_top(
         bitmask_type* bitmask,
-        std::uint32_t count,
-        std::uint32_t& top_index
+        entity count,
+        entity& top_index
     );
     static bool find_bitmask_previous_index(
         bitmask_type* bitmask,
-        std::uint32_t index,
-        std::uint32_t& prev_index
+        entity index,
+        entity& prev_index
+    );
+    static bool find_bitmask_next_index(
+        bitmask_type* bitmask,
+        entity count,
+        entity index,
+        entity& next_index
     );
 
     struct alignas(T) t_mimicker { std::uint8_t pad[sizeof(T)]; };
 
+    // SoA buckets are raw blocks that only pretend to be arrays of T.
+    static constexpr std::size_t component_block_units = []{
+        if constexpr(soa_component)
+            return (soa_layout<T>::block_size + sizeof(T) - 1) / sizeof(T);
+        else return std::size_t(1) << bucket_exp;
+    }();
+
     // Bucket data
-    std::uint32_t entity_count;
-    std::uint32_t bucket_count;
+    // Bucket indices and counts take as many bits as entity IDs do.
+    entity entity_count;
+    entity bucket_count;
     bitmask_type** bucket_bitmask;
     bitmask_type* top_bitmask;
     entity** bucket_jump_table;
     T** bucket_components;
 
+    // All memory of the container is allocated from here.
+    std::pmr::memory_resource* resource;
+
+    // Released buckets waiting for reuse
+    bucket_pool<bitmask_type> bitmask_pool;
+    bucket_pool<entity> jump_table_pool;
+    bucket_pool<t_mimicker> component_pool;
+
     // Batching data
     bool batching;
-    std::uint32_t batch_checklist_size;
-    std::uint32_t batch_checklist_capacity;
+    entity batch_checklist_size;
+    entity batch_checklist_capacity;
     entity* batch_checklist;
     bitmask_type** bucket_batch_bitmask;
 
     // Search index (kinda separate, but handy to keep around here.)
     scene* ctx;
     search_index<T> search;
+
+    // Bit of this component type in the entity signatures of the scene.
+    std::size_t type_key;
 };
 
 }
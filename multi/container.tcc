@@ -34,13 +34,288 @@ SOFTWARE.
 namespace monkero
 {
 
+unsigned bitscan_forward(std::uint64_t mt)
+{
+#if defined(__GNUC__)
+    return __builtin_ctzll(mt);
+#elif defined(_MSC_VER)
+    unsigned long index = 0;
+    _BitScanForward64(&index, mt);
+    return index;
+#else
+    return popcount((mt & (~mt + 1)) - 1);
+#endif
+}
+
+unsigned bitscan_reverse(std::uint64_t mt)
+{
+#if defined(__GNUC__)
+    return 63 - __builtin_clzll(mt);
+#elif defined(_MSC_VER)
+    unsigned long index = 0;
+    _BitScanReverse64(&index, mt);
+    return index;
+#else
+    unsigned r = (mt > 0xFFFFFFFFF) << 5;
+    mt >>= r;
+    unsigned shift = (mt > 0xFFFF) << 4;
+    mt >>= shift;
+    r |= shift;
+    shift = (mt > 0xFF) << 3;
+    mt >>= shift;
+    r |= shift;
+    shift = (mt > 0xF) << 2;
+    mt >>= shift;
+    r |= shift;
+    shift = (mt > 0x3) << 1;
+    mt >>= shift;
+    r |= shift;
+    return r | (mt >> 1);
+#endif
+}
+
+unsigned popcount(std::uint64_t mt)
+{
+#if defined(__GNUC__)
+    return __builtin_popcountll(mt);
+#elif defined(_MSC_VER)
+    return __popcnt64(mt);
+#else
+    mt = mt - ((mt >> 1) & 0x5555555555555555llu);
+    mt = (mt & 0x3333333333333333llu) + ((mt >> 2) & 0x3333333333333333llu);
+    mt = (mt + (mt >> 4)) & 0x0F0F0F0F0F0F0F0Fllu;
+    return (mt * 0x0101010101010101llu) >> 56;
+#endif
+}
+
+void prefetch(const void* ptr)
+{
+#if defined(__GNUC__)
+    __builtin_prefetch(ptr);
+#else
+    (void)ptr;
+#endif
+}
+
+template<auto A, auto B>
+constexpr bool soa_same_member()
+{
+    if constexpr(std::is_same_v<decltype(A), decltype(B)>) return A == B;
+    else return false;
+}
+
+template<typename T, auto... Members>
+template<auto Member>
+constexpr std::size_t soa_layout<T, soa_fields<Members...>>::index_of()
+{
+    std::size_t index = 0;
+    bool found = (
+        (soa_same_member<Member, Members>() ? true : (++index, false)) || ...
+    );
+    return found ? index : field_count;
+}
+
+template<typename T, auto... Members>
+template<typename F>
+F* soa_layout<T, soa_fields<Members...>>::at(
+    std::uint8_t* block,
+    std::size_t field,
+    std::size_t index
+){
+    return reinterpret_cast<F*>(block + offsets[field]) + index;
+}
+
+template<typename T, auto... Members>
+void soa_layout<T, soa_fields<Members...>>::construct(
+    std::uint8_t* block,
+    std::size_t index,
+    T& value
+){
+    std::size_t field = 0;
+    (new (at<typename soa_member<decltype(Members)>::type>(block, field++, index))
+        typename soa_member<decltype(Members)>::type(
+            std::move(value.*Members)
+        ), ...);
+}
+
+template<typename T, auto... Members>
+T soa_layout<T, soa_fields<Members...>>::load(
+    std::uint8_t* block,
+    std::size_t index
+){
+    std::size_t field = 0;
+    return T{
+        *at<typename soa_member<decltype(Members)>::type>(
+            block, field++, index
+        )...
+    };
+}
+
+template<typename T, auto... Members>
+void soa_layout<T, soa_fields<Members...>>::destroy(
+    std::uint8_t* block,
+    std::size_t index
+){
+    std::size_t field = 0;
+    (std::destroy_at(
+        at<typename soa_member<decltype(Members)>::type>(block, field++, index)
+    ), ...);
+}
+
+template<typename T>
+soa_ref<T>::soa_ref(std::nullptr_t)
+: block(nullptr), index(0)
+{
+}
+
+template<typename T>
+soa_ref<T>::soa_ref(std::uint8_t* block, std::size_t index)
+: block(block), index(index)
+{
+}
+
+template<typename T>
+template<typename U, typename>
+soa_ref<T>::soa_ref(const soa_ref<U>& other)
+: block(other.block), index(other.index)
+{
+}
+
+template<typename T>
+template<auto Member>
+auto& soa_ref<T>::get() const
+{
+    constexpr std::size_t i = layout::template index_of<Member>();
+    static_assert(i < layout::field_count, "Member is not in soa_fields");
+    using F = typename layout::template field_type<i>;
+    return *static_cast<std::conditional_t<std::is_const_v<T>, const F, F>*>(
+        layout::template at<F>(block, i, index)
+    );
+}
+
+template<typename T>
+std::remove_const_t<T> soa_ref<T>::load() const
+{
+    return layout::load(block, index);
+}
+
+template<typename T>
+soa_ref<T>::operator bool() const
+{
+    return block != nullptr;
+}
+
+template<typename T>
+bool soa_ref<T>::operator==(const soa_ref& other) const
+{
+    return block == other.block && index == other.index;
+}
+
+template<typename T>
+bool soa_ref<T>::operator!=(const soa_ref& other) const
+{
+    return !(*this == other);
+}
+
+template<typename T>
+soa_span<T>::soa_span(soa_ref<std::remove_const_t<T>> first)
+: first(first)
+{
+}
+
+template<typename T>
+template<auto Member>
+auto* soa_span<T>::get() const
+{
+    return &first.template get<Member>();
+}
+
+template<typename T>
+soa_ref<T> soa_span<T>::operator[](std::size_t i) const
+{
+    return soa_ref<T>(first.block, first.index + i);
+}
+
+template<typename U>
+bucket_pool<U>::bucket_pool(
+    std::size_t block_size,
+    std::pmr::memory_resource* resource
+):  block_size(block_size), limit(0), resource(resource), blocks(resource),
+    allocations(0), reuses(0), deallocations(0)
+{
+}
+
+template<typename U>
+bucket_pool<U>::~bucket_pool()
+{
+    set_limit(0);
+}
+
+template<typename U>
+U* bucket_pool<U>::allocate()
+{
+    if(blocks.size() > 0)
+    {
+        U* block = blocks.back();
+        blocks.pop_back();
+        reuses++;
+        return block;
+    }
+    allocations++;
+    return static_cast<U*>(
+        resource->allocate(sizeof(U) * block_size, alignof(U))
+    );
+}
+
+template<typename U>
+void bucket_pool<U>::release(U* block)
+{
+    if(!block) return;
+    if(blocks.size() < limit)
+        blocks.push_back(block);
+    else
+    {
+        deallocations++;
+        resource->deallocate(block, sizeof(U) * block_size, alignof(U));
+    }
+}
+
+template<typename U>
+void bucket_pool<U>::set_limit(std::size_t limit)
+{
+    this->limit = limit;
+    while(blocks.size() > limit)
+    {
+        deallocations++;
+        resource->deallocate(
+            blocks.back(), sizeof(U) * block_size, alignof(U)
+        );
+        blocks.pop_back();
+    }
+}
+
+template<typename U>
+void bucket_pool<U>::add_stats(bucket_pool_stats& stats) const
+{
+    stats.allocations += allocations;
+    stats.reuses += reuses;
+    stats.deallocations += deallocations;
+    stats.retained += blocks.size();
+}
+
 template<typename T>
 component_container<T>::component_container(scene& ctx)
 :   entity_count(0), bucket_count(0),
     bucket_bitmask(nullptr), top_bitmask(nullptr),
-    bucket_jump_table(nullptr), bucket_components(nullptr), batching(false),
+    bucket_jump_table(nullptr), bucket_components(nullptr),
+    resource(ctx.get_memory_resource()),
+    bitmask_pool(bucket_bitmask_units, resource),
+    jump_table_pool(1u<<bucket_exp, resource),
+    component_pool(tag_component ? 0 : component_block_units, resource),
+    batching(false),
     batch_checklist_size(0), batch_checklist_capacity(0),
-    batch_checklist(nullptr), bucket_batch_bitmask(nullptr), ctx(&ctx)
+    batch_checklist(nullptr), bucket_batch_bitmask(nullptr), ctx(&ctx),
+    type_key(scene::get_component_type_key<T>())
 {
 }
 
@@ -51,14 +326,16 @@ component_container<T>::~component_container()
 }
 
 template<typename T>
-T* component_container<T>::operator[](entity e)
+typename component_container<T>::pointer
+component_container<T>::operator[](entity e)
 {
     if(!contains(e)) return nullptr;
     return get_unsafe(e);
 }
 
 template<typename T>
-const T* component_container<T>::operator[](entity e) const
+typename component_container<T>::const_pointer
+component_container<T>::operator[](entity e) const
 {
     return const_cast<component_container<T>*>(this)->operator[](e);
 }
@@ -76,6 +353,7 @@ void component_container<T>::emplace(entity id, Args&&... args)
     if(id == INVALID_ENTITY)
         return;
 
+    join_batch();
     ensure_bucket_space(id);
     if(contains(id))
     { // If we just replace something that exists, life is easy.
@@ -85,6 +363,7 @@ void component_container<T>::emplace(entity id, Args&&... args)
     else if(batching)
     {
         entity_count++;
+        ctx->signature_insert(id, type_key);
         if(!batch_change(id))
         {
             // If there was already a change, that means that there was an
@@ -97,6 +376,7 @@ void component_container<T>::emplace(entity id, Args&&... args)
     else
     {
         entity_count++;
+        ctx->signature_insert(id, type_key);
         bitmask_insert(id);
         jump_table_insert(id);
         bucket_insert(id, std::forward<Args>(args)...);
@@ -104,11 +384,93 @@ void component_container<T>::emplace(entity id, Args&&... args)
 }
 
 template<typename T>
-void component_container<T>::erase(entity id)
+template<typename F>
+void component_container<T>::emplace_range(
+    entity first,
+    entity count,
+    F&& init
+){
+    if(first == INVALID_ENTITY || count == 0)
+        return;
+
+    join_batch();
+    entity last = first + (count - 1);
+    ensure_bucket_space(last);
+
+    // The range must fit in the gap between two existing entities (or the
+    // end), otherwise this is just a series of regular emplaces.
+    entity prev = INVALID_ENTITY;
+    entity next = INVALID_ENTITY;
+    if(entity_count != 0)
+        prev = find_previous_entity(first);
+    ensure_jump_table(prev >> bucket_exp);
+    if(entity_count != 0)
+        next = bucket_jump_table[prev >> bucket_exp][prev & bucket_mask];
+    if(batching || (next != INVALID_ENTITY && next <= last))
+    {
+        for(std::uint64_t id = first; id <= last; ++id)
+            emplace(entity(id), init(entity(id)));
+        return;
+    }
+
+    for(std::uint64_t id = first; id <= last; ++id)
+    {
+        bucket_construct(entity(id), init(entity(id)));
+        ctx->signature_insert(entity(id), type_key);
+    }
+
+    // Link the range in between prev and next.
+    if(prev + 1 < first)
+    {
+        ensure_jump_table((first-1) >> bucket_exp);
+        bucket_jump_table[(first-1) >> bucket_exp][(first-1) & bucket_mask] =
+            prev;
+    }
+    bucket_jump_table[prev >> bucket_exp][prev & bucket_mask] = first;
+    if(next != INVALID_ENTITY && last + 1 < next)
+        bucket_jump_table[(next-1) >> bucket_exp][(next-1) & bucket_mask] = last;
+
+    for(entity hi = first >> bucket_exp; hi <= (last >> bucket_exp); ++hi)
+    {
+        std::uint32_t begin_lo = hi == (first >> bucket_exp) ?
+            first & bucket_mask : 0;
+        std::uint32_t end_lo = hi == (last >> bucket_exp) ?
+            last & bucket_mask : bucket_mask;
+
+        ensure_jump_table(hi);
+        entity* jump = bucket_jump_table[hi];
+        entity base = entity(hi) << bucket_exp;
+        for(std::uint32_t lo = begin_lo; lo < end_lo; ++lo)
+            jump[lo] = base + lo + 1;
+        jump[end_lo] = hi == (last >> bucket_exp) ? next : base + end_lo + 1;
+
+        ensure_bitmask(hi);
+        for(std::uint32_t lo = begin_lo; lo <= end_lo;)
+        {
+            std::uint32_t bit = lo & bitmask_mask;
+            std::uint32_t n = std::min(end_lo - lo + 1, bitmask_bits - bit);
+            bitmask_type bits = n == bitmask_bits ?
+                ~bitmask_type(0) : ((bitmask_type(1) << n) - 1) << bit;
+            bucket_bitmask[hi][lo >> bitmask_shift] |= bits;
+            lo += n;
+        }
+        top_bitmask[hi>>bitmask_shift] |= std::uint64_t(1)<<(hi&bitmask_mask);
+    }
+    entity_count += count;
+
+    for(std::uint64_t id = first; id <= last; ++id)
+        signal_add(entity(id), get_unsafe(entity(id)));
+}
+
+template<typename T>
+void component_container<T>::erase(entity id, bool update_signature)
 {
     if(!contains(id))
         return;
+    join_batch();
     entity_count--;
+    if(update_signature)
+        ctx->signature_erase(id, type_key);
 
     if(batching)
     {
@@ -134,9 +496,59 @@ void component_container<T>::erase(entity id)
     }
 }
 
+template<typename T>
+void component_container<T>::erase_many(const entity* ids, std::size_t count)
+{
+    if(batching || ctx->defer_batch > 0)
+    {
+        for(std::size_t i = 0; i < count; ++i)
+            erase(ids[i], false);
+        return;
+    }
+
+    // The IDs are sorted, so each bucket is visited once and the jump table
+    // is unlinked in order. Whether the bucket became empty is only checked
+    // once all of its entities are gone.
+    std::size_t i = 0;
+    while(i < count)
+    {
+        entity hi = ids[i] >> bucket_exp;
+        if(hi >= bucket_count)
+            break;
+
+        bool erased = false;
+        for(; i < count && (ids[i] >> bucket_exp) == hi; ++i)
+        {
+            entity id = ids[i];
+            std::uint32_t lo = id & bucket_mask;
+            bitmask_type bit = std::uint64_t(1)<<(lo&bitmask_mask);
+            // Removal handlers may change the buckets, so nothing is cached
+            // across entities.
+            bitmask_type* bitmask = bucket_bitmask[hi];
+            if(!bitmask || !(bitmask[lo>>bitmask_shift] & bit))
+                continue;
+
+            bitmask[lo>>bitmask_shift] &= ~bit;
+            entity_count--;
+            jump_table_erase(id);
+            bucket_erase(id, true);
+            erased = true;
+        }
+
+        if(erased && bitmask_empty(hi))
+        {
+            top_bitmask[hi>>bitmask_shift] &= ~(std::uint64_t(1)<<(hi&bitmask_mask));
+            bucket_self_erase(hi);
+            try_jump_table_bucket_erase(hi);
+        }
+    }
+}
+
 template<typename T>
 void component_container<T>::clear()
 {
+    if(entity_count != 0)
+        join_batch();
     if(batching)
     { // Uh oh, this is super suboptimal :/ pls don't clear while iterating.
         for(auto it = begin(); it != end(); ++it)
@@ -146,9 +558,12 @@ void component_container<T>::clear()
     }
     else
     {
+        if(entity_count != 0)
+            ctx->signature_erase_all(type_key);
+
         // Clear top bitmask
-        std::uint32_t top_bitmask_count = get_top_bitmask_size();
-        for(std::uint32_t i = 0; i< top_bitmask_count; ++i)
+        entity top_bitmask_count = get_top_bitmask_size();
+        for(entity i = 0; i< top_bitmask_count; ++i)
             top_bitmask[i] = 0;
 
         // Destroy all existing objects
@@ -160,40 +575,30 @@ void component_container<T>::clear()
             {
                 auto pair = *it;
                 signal_remove(pair.first, pair.second);
-                pair.second->~T();
+                destroy_component(pair.second);
             }
         }
         else
         {
             for(auto it = begin(); it != end(); ++it)
-                (*it).second->~T();
+                destroy_component((*it).second);
         }
 
         // Release all bucket pointers
-        for(std::uint32_t i = 0; i < bucket_count; ++i)
+        for(entity i = 0; i < bucket_count; ++i)
         {
-            if(bucket_bitmask[i])
-            {
-                delete [] bucket_bitmask[i];
-                bucket_bitmask[i] = nullptr;
-            }
-            if(bucket_batch_bitmask[i])
-            {
-                delete [] bucket_batch_bitmask[i];
-                bucket_batch_bitmask[i] = nullptr;
-            }
-            if(bucket_jump_table[i])
-            {
-                delete [] bucket_jump_table[i];
-                bucket_jump_table[i] = nullptr;
-            }
+            bitmask_pool.release(bucket_bitmask[i]);
+            bucket_bitmask[i] = nullptr;
+            bitmask_pool.release(bucket_batch_bitmask[i]);
+            bucket_batch_bitmask[i] = nullptr;
+            jump_table_pool.release(bucket_jump_table[i]);
+            bucket_jump_table[i] = nullptr;
             if constexpr(!tag_component)
             {
-                if(bucket_components[i])
-                {
-                    delete [] reinterpret_cast<t_mimicker*>(bucket_components[i]);
-                    bucket_components[i] = nullptr;
-                }
+                component_pool.release(
+                    reinterpret_cast<t_mimicker*>(bucket_components[i])
+                );
+                bucket_components[i] = nullptr;
             }
         }
     }
@@ -229,55 +634,74 @@ void component_container<T>::start_batch()
     batch_checklist_size = 0;
 }
 
+template<typename T>
+void component_container<T>::join_batch()
+{
+    ctx->assert_not_parallel();
+    if(!batching && ctx->defer_batch > 0)
+    {
+        start_batch();
+        ctx->batched_containers.push_back(this);
+    }
+}
+
 template<typename T>
 void component_container<T>::finish_batch()
 {
     if(!batching) return;
     batching = false;
 
-    // Discard duplicate changes first.
-    for(std::uint32_t i = 0; i < batch_checklist_size; ++i)
+    if(batch_checklist_size >= batch_rebuild_threshold)
     {
-        std::uint32_t ri = batch_checklist_size-1-i;
-        entity& id = batch_checklist[ri];
-        entity hi = id >> bucket_exp;
-        entity lo = id & bucket_mask;
-        bitmask_type bit = std::uint64_t(1)<<(lo&bitmask_mask);
-        bitmask_type* bbit = bucket_batch_bitmask[hi];
-        if(bbit && (bbit[lo>>bitmask_shift] & bit))
-        { // Not a dupe, but latest state.
-            bbit[lo>>bitmask_shift] ^= bit;
-        }
-        else id = INVALID_ENTITY;
+        // Large batches are cheaper to apply all at once than one by one.
+        batch_rebuild();
     }
-
-    // Now, do all changes for realzies. All IDs that are left are unique and
-    // change the existence of an entity.
-    for(std::uint32_t i = 0; i < batch_checklist_size; ++i)
+    else
     {
-        entity& id = batch_checklist[i];
-        if(id == INVALID_ENTITY) continue;
-
-        entity hi = id >> bucket_exp;
-        entity lo = id & bucket_mask;
-        bitmask_type bit = std::uint64_t(1)<<(lo&bitmask_mask);
-        if(bucket_bitmask[hi] && (bucket_bitmask[hi][lo>>bitmask_shift] & bit))
-        { // Erase
-            bitmask_erase(id);
-            jump_table_erase(id);
-            bucket_erase(id, false);
+        // Discard duplicate changes first.
+        for(entity i = 0; i < batch_checklist_size; ++i)
+        {
+            entity ri = batch_checklist_size-1-i;
+            entity& id = batch_checklist[ri];
+            entity hi = id >> bucket_exp;
+            entity lo = id & bucket_mask;
+            bitmask_type bit = std::uint64_t(1)<<(lo&bitmask_mask);
+            bitmask_type* bbit = bucket_batch_bitmask[hi];
+            if(bbit && (bbit[lo>>bitmask_shift] & bit))
+            { // Not a dupe, but latest state.
+                bbit[lo>>bitmask_shift] ^= bit;
+            }
+            else id = INVALID_ENTITY;
         }
-        else
-        { // Insert (in-place)
-            bitmask_insert(id);
-            jump_table_insert(id);
-            // No need to add to bucket, that already happened due to batching
-            // semantics.
+
+        // Now, do all changes for realzies. All IDs that are left are unique
+        // and change the existence of an entity.
+        for(entity i = 0; i < batch_checklist_size; ++i)
+        {
+            entity& id = batch_checklist[i];
+            if(id == INVALID_ENTITY) continue;
+
+            entity hi = id >> bucket_exp;
+            entity lo = id & bucket_mask;
+            bitmask_type bit = std::uint64_t(1)<<(lo&bitmask_mask);
+            if(bucket_bitmask[hi] && (bucket_bitmask[hi][lo>>bitmask_shift] & bit))
+            { // Erase
+                bitmask_erase(id);
+                jump_table_erase(id);
+                bucket_erase(id, false);
+            }
+            else
+            { // Insert (in-place)
+                bitmask_insert(id);
+                jump_table_insert(id);
+                // No need to add to bucket, that already happened due to
+                // batching semantics.
+            }
         }
     }
 
     // Finally, check erased entries for if we can remove their buckets.
-    for(std::uint32_t i = 0; i < batch_checklist_size; ++i)
+    for(entity i = 0; i < batch_checklist_size; ++i)
     {
         entity& id = batch_checklist[i];
         if(id == INVALID_ENTITY) continue;
@@ -295,10 +719,109 @@ void component_container<T>::finish_batch()
     }
 }
 
+template<typename T>
+void component_container<T>::batch_rebuild()
+{
+    // The batch bitmasks hold exactly the entities whose existence changes,
+    // already in order, so they can be applied a word at a time.
+    entity first_id = INVALID_ENTITY;
+    entity last_id = INVALID_ENTITY;
+    for(entity hi = 0; hi < bucket_count; ++hi)
+    {
+        bitmask_type* changes = bucket_batch_bitmask[hi];
+        if(!changes) continue;
+
+        bitmask_type* bits = nullptr;
+        bitmask_type any = 0;
+        for(std::uint32_t j = 0; j < bucket_bitmask_units; ++j)
+        {
+            bitmask_type changed = changes[j];
+            if(changed == 0) continue;
+            changes[j] = 0;
+
+            if(!bits)
+            {
+                ensure_bitmask(hi);
+                bits = bucket_bitmask[hi];
+            }
+            entity base = (hi << bucket_exp) + (j << bitmask_shift);
+            if(first_id == INVALID_ENTITY)
+                first_id = base + bitscan_forward(changed);
+            last_id = base + bitscan_reverse(changed);
+
+            bitmask_type removed = bits[j] & changed;
+            bits[j] ^= changed;
+            while(removed != 0)
+            {
+                bucket_erase(base + bitscan_forward(removed), false);
+                removed &= removed - 1;
+            }
+        }
+        if(!bits) continue;
+
+        for(std::uint32_t j = 0; j < bucket_bitmask_units; ++j)
+            any |= bits[j];
+        bitmask_type top_bit = std::uint64_t(1)<<(hi&bitmask_mask);
+        if(any) top_bitmask[hi>>bitmask_shift] |= top_bit;
+        else top_bitmask[hi>>bitmask_shift] &= ~top_bit;
+    }
+    if(first_id == INVALID_ENTITY)
+        return;
+
+    // Relink every existing entity from the one preceding the first change
+    // to the one following the last change.
+    entity prev = find_previous_entity(first_id);
+    ensure_jump_table(prev >> bucket_exp);
+    entity* prev_jump =
+        &bucket_jump_table[prev >> bucket_exp][prev & bucket_mask];
+
+    entity word = first_id >> bitmask_shift;
+    bitmask_type mask = get_bitmask_word(word) &
+        (~bitmask_type(0) << (first_id & bitmask_mask));
+    for(;;)
+    {
+        while(mask == 0)
+        {
+            ++word;
+            if(!find_next_word(word))
+            {
+                *prev_jump = INVALID_ENTITY;
+                return;
+            }
+            mask = get_bitmask_word(word);
+        }
+        entity id = (word << bitmask_shift) + bitscan_forward(mask);
+        mask &= mask - 1;
+
+        *prev_jump = id;
+        if(prev + 1 < id)
+        { // Make the skipped block's end point back to its start
+            entity end_id = id - 1;
+            ensure_jump_table(end_id >> bucket_exp);
+            bucket_jump_table[end_id >> bucket_exp][end_id & bucket_mask] = prev;
+        }
+        if(id > last_id)
+            return;
+
+        ensure_jump_table(id >> bucket_exp);
+        prev_jump = &bucket_jump_table[id >> bucket_exp][id & bucket_mask];
+        prev = id;
+    }
+}
+
+template<typename T>
+bool component_container<T>::has_iterable_entities() const
+{
+    // While batching, entity_count already includes the batched changes, but
+    // iteration goes through the state before them.
+    if(!batching) return entity_count != 0;
+    return bucket_count != 0 && bucket_jump_table[0] != nullptr;
+}
+
 template<typename T>
 typename component_container<T>::iterator component_container<T>::begin()
 {
-    if(entity_count == 0) return end();
+    if(!has_iterable_entities()) return end();
     // The jump entry for INVALID_ENTITY stores the first valid entity index.
     // INVALID_ENTITY is always present, but doesn't cause allocation of a
     // component for itself.
@@ -311,18 +834,267 @@ typename component_container<T>::iterator component_container<T>::end()
     return iterator(*this, INVALID_ENTITY);
 }
 
+template<typename T>
+typename component_container<T>::iterator component_container<T>::lower_bound(entity id)
+{
+    if(!has_iterable_entities())
+        return end();
+    return iterator(*this, find_next_entity(id));
+}
+
 template<typename T>
 std::size_t component_container<T>::size() const
 {
     return entity_count;
 }
 
+template<typename T>
+std::vector<entity> component_container<T>::split_ranges(
+    std::uint32_t max_ranges
+) const {
+    std::vector<entity> ranges;
+    ranges.push_back(INVALID_ENTITY);
+
+    std::size_t total = 0;
+    std::vector<std::uint32_t> bucket_sizes(bucket_count, 0);
+    for(entity i = 0; i < bucket_count; ++i)
+    {
+        if(!((top_bitmask[i>>bitmask_shift] >> (i&bitmask_mask))&1))
+            continue;
+        for(std::uint32_t j = 0; j < bucket_bitmask_units; ++j)
+            bucket_sizes[i] += popcount(bucket_bitmask[i][j]);
+        total += bucket_sizes[i];
+    }
+
+    std::size_t target = (total + max_ranges - 1) / std::max(max_ranges, 1u);
+    std::size_t accumulated = 0;
+    for(entity i = 0; i+1 < bucket_count; ++i)
+    {
+        accumulated += bucket_sizes[i];
+        if(accumulated != 0 && accumulated >= target)
+        {
+            ranges.push_back((i+1) << bucket_exp);
+            accumulated = 0;
+        }
+    }
+    ranges.push_back(INVALID_ENTITY);
+    return ranges;
+}
+
+template<typename T>
+typename component_container<T>::bitmask_type
+component_container<T>::get_bitmask_word(entity word_index) const
+{
+    if constexpr(bucket_exp >= bitmask_shift)
+    {
+        entity hi = word_index >> (bucket_exp - bitmask_shift);
+        if(hi >= bucket_count || !bucket_bitmask[hi])
+            return 0;
+        return bucket_bitmask[hi][word_index & (bucket_bitmask_units-1)];
+    }
+    else
+    {
+        // Buckets are smaller than a word, so gather the word from several.
+        bitmask_type word = 0;
+        entity first = (word_index << bitmask_shift) >> bucket_exp;
+        for(entity i = 0; i < (1u << (bitmask_shift - bucket_exp)); ++i)
+        {
+            entity hi = first + i;
+            if(hi < bucket_count && bucket_bitmask[hi])
+                word |= bucket_bitmask[hi][0] << (i << bucket_exp);
+        }
+        return word;
+    }
+}
+
+template<typename T>
+bool component_container<T>::find_next_word(entity& word_index) const
+{
+    entity hi = (std::uint64_t(word_index) << bitmask_shift) >> bucket_exp;
+    entity top_count = get_top_bitmask_size();
+    while(
+        hi < bucket_count &&
+        find_bitmask_next_index(top_bitmask, top_count, hi, hi) &&
+        hi < bucket_count
+    ){
+        if constexpr(bucket_exp >= bitmask_shift)
+        {
+            entity first = entity(hi) << (bucket_exp - bitmask_shift);
+            entity j = word_index > first ? word_index - first : 0;
+            for(; j < bucket_bitmask_units; ++j)
+            {
+                if(bucket_bitmask[hi][j] != 0)
+                {
+                    word_index = first + j;
+                    return true;
+                }
+            }
+            ++hi;
+        }
+        else
+        {
+            word_index = std::max(
+                word_index, (entity(hi) << bucket_exp) >> bitmask_shift
+            );
+            return true;
+        }
+    }
+    return false;
+}
+
+template<typename T>
+entity component_container<T>::find_next_entity(entity id) const
+{
+    entity hi = id >> bucket_exp;
+    std::uint32_t lo = id & bucket_mask;
+    if(hi >= bucket_count)
+        return INVALID_ENTITY;
+
+    // Try to find in the current bucket.
+    entity next_index = 0;
+    if(find_bitmask_next_index(
+        bucket_bitmask[hi], bucket_bitmask_units, lo, next_index
+    )) return (hi << bucket_exp) + next_index;
+
+    // If that failed, search from the top bitmask.
+    entity bucket_index = 0;
+    if(
+        hi+1 >= bucket_count ||
+        !find_bitmask_next_index(
+            top_bitmask, get_top_bitmask_size(), hi+1, bucket_index
+        ) || bucket_index >= bucket_count
+    ) return INVALID_ENTITY;
+
+    // Now, find the lowest bit in the bucket that was found.
+    find_bitmask_next_index(
+        bucket_bitmask[bucket_index], bucket_bitmask_units, 0, next_index
+    );
+    return (bucket_index << bucket_exp) + next_index;
+}
+
 template<typename T>
 void component_container<T>::update_search_index()
 {
     search.update(*ctx);
 }
 
+template<typename T>
+void component_container<T>::set_bucket_pool_limit(std::size_t limit)
+{
+    bitmask_pool.set_limit(limit);
+    jump_table_pool.set_limit(limit);
+    component_pool.set_limit(limit);
+}
+
+template<typename T>
+bucket_pool_stats component_container<T>::get_bucket_pool_stats() const
+{
+    bucket_pool_stats stats;
+    bitmask_pool.add_stats(stats);
+    jump_table_pool.add_stats(stats);
+    component_pool.add_stats(stats);
+    return stats;
+}
+
+template<typename T>
+std::size_t component_container<T>::renumber(
+    const entity_translation& translation_table
+){
+    std::size_t memory_before = get_bucket_memory();
+    std::pmr::vector<entity> ids(resource);
+    ids.reserve(entity_count);
+    for(auto it = begin(); it; ++it)
+        ids.push_back((*it).first);
+
+    // Since the new IDs are in the same order and never greater than the old
+    // ones, components can be moved down in place without overwriting
+    // anything that hasn't been moved yet.
+    if constexpr(!tag_component)
+    {
+        bool reindex = !search_index_is_empty_default<decltype(search)>();
+        for(entity old_id: ids)
+        {
+            entity new_id = translation_table[old_id];
+            if(new_id == old_id)
+                continue;
+            pointer data = get_unsafe(old_id);
+            if constexpr(soa_component)
+            {
+                T value = data.load();
+                if(reindex)
+                {
+                    search.remove_entity(old_id, value);
+                    search.add_entity(new_id, value);
+                }
+                bucket_construct(new_id, std::move(value));
+            }
+            else
+            {
+                if(reindex) search.remove_entity(old_id, *data);
+                pointer new_data = bucket_construct(new_id, std::move(*data));
+                if(reindex) search.add_entity(new_id, *new_data);
+            }
+            destroy_component(data);
+        }
+    }
+
+    // The bitmasks and jump tables are simply rebuilt from scratch.
+    entity top_bitmask_count = get_top_bitmask_size();
+    for(entity i = 0; i < top_bitmask_count; ++i)
+        top_bitmask[i] = 0;
+    for(entity i = 0; i < bucket_count; ++i)
+    {
+        bitmask_pool.release(bucket_bitmask[i]);
+        bucket_bitmask[i] = nullptr;
+        bitmask_pool.release(bucket_batch_bitmask[i]);
+        bucket_batch_bitmask[i] = nullptr;
+        jump_table_pool.release(bucket_jump_table[i]);
+        bucket_jump_table[i] = nullptr;
+    }
+    for(entity old_id: ids)
+    {
+        entity new_id = translation_table[old_id];
+        bitmask_insert(new_id);
+        jump_table_insert(new_id);
+    }
+
+    if constexpr(!tag_component)
+    {
+        for(entity i = 0; i < bucket_count; ++i)
+        {
+            if(bucket_bitmask[i] == nullptr)
+            {
+                component_pool.release(
+                    reinterpret_cast<t_mimicker*>(bucket_components[i])
+                );
+                bucket_components[i] = nullptr;
+            }
+        }
+    }
+    return memory_before - get_bucket_memory();
+}
+
+template<typename T>
+std::size_t component_container<T>::get_bucket_memory() const
+{
+    std::size_t bytes = 0;
+    for(entity i = 0; i < bucket_count; ++i)
+    {
+        if(bucket_bitmask[i])
+            bytes += sizeof(bitmask_type) * bucket_bitmask_units;
+        if(bucket_batch_bitmask[i])
+            bytes += sizeof(bitmask_type) * bucket_bitmask_units;
+        if(bucket_jump_table[i])
+            bytes += sizeof(entity) << bucket_exp;
+        if constexpr(!tag_component)
+        {
+            if(bucket_components[i])
+                bytes += sizeof(t_mimicker) * component_block_units;
+        }
+    }
+    return bytes;
+}
+
 template<typename T>
 void component_container<T>::list_entities(
     std::map<entity, entity>& translation_table
@@ -341,7 +1113,14 @@ void component_container<T>::concat(
         for(auto it = begin(); it; ++it)
         {
             auto pair = *it;
-            target.emplace<T>(translation_table.at(pair.first), *pair.second);
+            if constexpr(soa_component)
+                target.emplace<T>(
+                    translation_table.at(pair.first), pair.second.load()
+                );
+            else
+                target.emplace<T>(
+                    translation_table.at(pair.first), *pair.second
+                );
         }
     }
 }
@@ -354,8 +1133,12 @@ void component_container<T>::copy(
 ){
     if constexpr(std::is_copy_constructible_v<T>)
     {
-        T* comp = operator[](original_id);
-        if(comp) target.emplace<T>(result_id, *comp);
+        pointer comp = operator[](original_id);
+        if constexpr(soa_component)
+        {
+            if(comp) target.emplace<T>(result_id, comp.load());
+        }
+        else if(comp) target.emplace<T>(result_id, *comp);
     }
 }
 
@@ -367,7 +1150,8 @@ entity component_container<T>::find_entity(Args&&... args) const
 }
 
 template<typename T>
-T* component_container<T>::get_unsafe(entity e)
+typename component_container<T>::pointer
+component_container<T>::get_unsafe(entity e)
 {
     if constexpr(tag_component)
     {
@@ -375,7 +1159,17 @@ T* component_container<T>::get_unsafe(entity e)
         // As long as it's not nullptr, that is.
         return reinterpret_cast<T*>(&bucket_components);
     }
-    else return &bucket_components[e>>bucket_exp][e&bucket_mask];
+    else return get_pointer(bucket_components[e>>bucket_exp], e&bucket_mask);
+}
+
+template<typename T>
+void component_container<T>::prefetch_component(entity e) const
+{
+    // SoA fields are spread over separate arrays that are walked in order
+    // anyway, so they're left to the hardware prefetcher.
+    if constexpr(!tag_component && !soa_component)
+        prefetch(bucket_components[e>>bucket_exp] + (e&bucket_mask));
+    else (void)e;
 }
 
 template<typename T>
@@ -390,55 +1184,61 @@ void component_container<T>::destroy()
 #ifndef MONKERO_CONTAINER_DEALLOCATE_BUCKETS
     for(size_t i = 0; i < bucket_count; ++i)
     {
-        if(bucket_bitmask[i])
-            delete bucket_bitmask[i];
-        if(bucket_jump_table[i])
-            delete bucket_jump_table[i];
+        bitmask_pool.release(bucket_bitmask[i]);
+        jump_table_pool.release(bucket_jump_table[i]);
         if constexpr(!tag_component)
         {
-            if(bucket_components[i])
-                delete bucket_components[i];
+            component_pool.release(
+                reinterpret_cast<t_mimicker*>(bucket_components[i])
+            );
         }
-        if(bucket_batch_bitmask[i])
-            delete bucket_batch_bitmask[i];
+        bitmask_pool.release(bucket_batch_bitmask[i]);
     }
 #endif
 
     // Free top-level arrays (bottom-level arrays should have been deleted in
     // clear().
-    if(bucket_bitmask)
-        delete[] bucket_bitmask;
-    if(top_bitmask)
-        delete[] top_bitmask;
+    deallocate_array(top_bitmask, get_top_bitmask_size());
+    deallocate_array(bucket_bitmask, bucket_count);
     if(bucket_jump_table)
     {
         // The initial jump table entry won't get erased otherwise, as it is a
         // special case due to INVALID_ENTITY.
-        delete[] bucket_jump_table[0];
-        delete[] bucket_jump_table;
+        jump_table_pool.release(bucket_jump_table[0]);
+        deallocate_array(bucket_jump_table, bucket_count);
     }
     if constexpr(!tag_component)
-    {
-        if(bucket_components)
-            delete[] bucket_components;
-    }
-    if(batch_checklist)
-        delete[] batch_checklist;
-    if(bucket_batch_bitmask)
-        delete[] bucket_batch_bitmask;
+        deallocate_array(bucket_components, bucket_count);
+    deallocate_array(batch_checklist, batch_checklist_capacity);
+    deallocate_array(bucket_batch_bitmask, bucket_count);
+}
+
+template<typename T>
+template<typename U>
+U* component_container<T>::allocate_array(std::size_t count)
+{
+    return static_cast<U*>(resource->allocate(sizeof(U) * count, alignof(U)));
+}
+
+template<typename T>
+template<typename U>
+void component_container<T>::deallocate_array(U* ptr, std::size_t count)
+{
+    if(ptr)
+        resource->deallocate(ptr, sizeof(U) * count, alignof(U));
 }
 
 template<typename T>
 void component_container<T>::jump_table_insert(entity id)
 {
     // Assumes that the corresponding bitmask change has already been made.
-    std::uint32_t cur_hi = id >> bucket_exp;
+    entity cur_hi = id >> bucket_exp;
     std::uint32_t cur_lo = id & bucket_mask;
     ensure_jump_table(cur_hi);
 
     // Find the start of the preceding block.
     entity prev_start_id = find_previous_entity(id);
-    std::uint32_t prev_start_hi = prev_start_id >> bucket_exp;
+    entity prev_start_hi = prev_start_id >> bucket_exp;
     std::uint32_t prev_start_lo = prev_start_id & bucket_mask;
     ensure_jump_table(prev_start_hi);
     entity& prev_start = bucket_jump_table[prev_start_hi][prev_start_lo];
@@ -446,7 +1246,7 @@ void component_container<T>::jump_table_insert(entity id)
     if(prev_start_id + 1 < id)
     { // Make preceding block's end point back to its start
         entity prev_end_id = id-1;
-        std::uint32_t prev_end_hi = prev_end_id >> bucket_exp;
+        entity prev_end_hi = prev_end_id >> bucket_exp;
         std::uint32_t prev_end_lo = prev_end_id & bucket_mask;
         ensure_jump_table(prev_end_hi);
         entity& prev_end = bucket_jump_table[prev_end_hi][prev_end_lo];
@@ -456,7 +1256,7 @@ void component_container<T>::jump_table_insert(entity id)
     if(id + 1 < prev_start)
     { // Make succeeding block's end point back to its start
         entity next_end_id = prev_start-1;
-        std::uint32_t next_end_hi = next_end_id >> bucket_exp;
+        entity next_end_hi = next_end_id >> bucket_exp;
         std::uint32_t next_end_lo = next_end_id & bucket_mask;
         entity& next_end = bucket_jump_table[next_end_hi][next_end_lo];
         next_end = id;
@@ -469,10 +1269,10 @@ void component_container<T>::jump_table_insert(entity id)
 template<typename T>
 void component_container<T>::jump_table_erase(entity id)
 {
-    std::uint32_t hi = id >> bucket_exp;
+    entity hi = id >> bucket_exp;
     std::uint32_t lo = id & bucket_mask;
     entity prev = id-1;
-    std::uint32_t prev_hi = prev >> bucket_exp;
+    entity prev_hi = prev >> bucket_exp;
     std::uint32_t prev_lo = prev & bucket_mask;
 
     entity& prev_jmp = bucket_jump_table[prev_hi][prev_lo];
@@ -511,7 +1311,7 @@ std::size_t component_container<T>::get_top_bitmask_size() const
 }
 
 template<typename T>
-bool component_container<T>::bitmask_empty(std::uint32_t bucket_index) const
+bool component_container<T>::bitmask_empty(entity bucket_index) const
 {
     if(bucket_bitmask[bucket_index] == nullptr)
         return true;
@@ -526,7 +1326,7 @@ bool component_container<T>::bitmask_empty(std::uint32_t bucket_index) const
 template<typename T>
 void component_container<T>::bitmask_insert(entity id)
 {
-    std::uint32_t hi = id >> bucket_exp;
+    entity hi = id >> bucket_exp;
     std::uint32_t lo = id & bucket_mask;
     ensure_bitmask(hi);
     bitmask_type& mask = bucket_bitmask[hi][lo>>bitmask_shift];
@@ -538,7 +1338,7 @@ void component_container<T>::bitmask_insert(entity id)
 template<typename T>
 bool component_container<T>::bitmask_erase(entity id)
 {
-    std::uint32_t hi = id >> bucket_exp;
+    entity hi = id >> bucket_exp;
     std::uint32_t lo = id & bucket_mask;
     bucket_bitmask[hi][lo>>bitmask_shift] &= ~(std::uint64_t(1)<<(lo&bitmask_mask));
     if(bucket_bitmask[hi][lo>>bitmask_shift] == 0 && bitmask_empty(hi))
@@ -552,78 +1352,101 @@ bool component_container<T>::bitmask_erase(entity id)
 template<typename T>
 template<typename... Args>
 void component_container<T>::bucket_insert(entity id, Args&&... args)
+{
+    signal_add(id, bucket_construct(id, std::forward<Args>(args)...));
+}
+
+template<typename T>
+template<typename... Args>
+typename component_container<T>::pointer
+component_container<T>::bucket_construct(entity id, Args&&... args)
 {
     // This function assumes that there isn't an existing entity at the same
     // position.
-    T* data = nullptr;
-    if constexpr(tag_component)
+    if constexpr(soa_component)
     {
-        data = reinterpret_cast<T*>(&bucket_components);
-        new (&bucket_components) T(std::forward<Args>(args)...);
-    }
-    else
-    {
-        std::uint32_t hi = id >> bucket_exp;
+        entity hi = id >> bucket_exp;
         std::uint32_t lo = id & bucket_mask;
-
-        // If this component container doesn't exist yet, create it.
         if(bucket_components[hi] == nullptr)
         {
             bucket_components[hi] = reinterpret_cast<T*>(
-                new t_mimicker[1u<<bucket_exp]
+                component_pool.allocate()
             );
         }
-        data = &bucket_components[hi][lo];
+
+        // The component is built whole and then scattered into the field
+        // arrays.
+        T value = [&]{
+            if constexpr(std::is_constructible_v<T, Args&&...>)
+                return T(std::forward<Args>(args)...);
+            else return T{std::forward<Args>(args)...};
+        }();
+        soa_layout<T>::construct(
+            reinterpret_cast<std::uint8_t*>(bucket_components[hi]), lo, value
+        );
+        return get_pointer(bucket_components[hi], lo);
+    }
+    else
+    {
+        T* data = nullptr;
+        if constexpr(tag_component)
+        {
+            data = reinterpret_cast<T*>(&bucket_components);
+            new (&bucket_components) T(std::forward<Args>(args)...);
+        }
+        else
+        {
+            entity hi = id >> bucket_exp;
+            std::uint32_t lo = id & bucket_mask;
+
+            // If this component container doesn't exist yet, create it.
+            if(bucket_components[hi] == nullptr)
+            {
+                bucket_components[hi] = reinterpret_cast<T*>(
+                    component_pool.allocate()
+                );
+            }
+            data = &bucket_components[hi][lo];
+        }
+        // Create the related component here.
+        new (data) T(std::forward<Args>(args)...);
+        return data;
     }
-    // Create the related component here.
-    new (data) T(std::forward<Args>(args)...);
-    signal_add(id, data);
 }
 
 template<typename T>
 void component_container<T>::bucket_erase(entity id, bool signal)
 {
     // This function assumes that the given entity exists.
-    T* data = nullptr;
-    if constexpr(tag_component)
-    {
-        data = reinterpret_cast<T*>(&bucket_components);
-    }
-    else
-    {
-        std::uint32_t hi = id >> bucket_exp;
-        std::uint32_t lo = id & bucket_mask;
-        data = &bucket_components[hi][lo];
-    }
+    pointer data = get_unsafe(id);
     if(signal) signal_remove(id, data);
-    data->~T();
+    destroy_component(data);
 }
 
 template<typename T>
-void component_container<T>::bucket_self_erase(std::uint32_t i)
+void component_container<T>::bucket_self_erase(entity i)
 {
     (void)i;
 #ifdef MONKERO_CONTAINER_DEALLOCATE_BUCKETS
     // If the bucket got emptied, nuke it.
-    delete[] bucket_bitmask[i];
+    bitmask_pool.release(bucket_bitmask[i]);
     bucket_bitmask[i] = nullptr;
 
-    if(bucket_batch_bitmask[i])
-    {
-        delete[] bucket_batch_bitmask[i];
-        bucket_batch_bitmask[i] = nullptr;
-    }
+    bitmask_pool.release(bucket_batch_bitmask[i]);
+    bucket_batch_bitmask[i] = nullptr;
 
     if constexpr(!tag_component)
     {
-        delete[] reinterpret_cast<t_mimicker*>(bucket_components[i]);
+        component_pool.release(
+            reinterpret_cast<t_mimicker*>(bucket_components[i])
+        );
         bucket_components[i] = nullptr;
     }
 #endif
 }
 
 template<typename T>
-void component_container<T>::try_jump_table_bucket_erase(std::uint32_t i)
+void component_container<T>::try_jump_table_bucket_erase(entity i)
 {
     (void)i;
 #ifdef MONKERO_CONTAINER_DEALLOCATE_BUCKETS
@@ -635,7 +1458,7 @@ void component_container<T>::try_jump_table_bucket_erase(std::uint32_t i)
     // We can be removed if the succeeding bucket is also empty.
     if(i+1 >= bucket_count || bucket_bitmask[i+1] == nullptr)
     {
-        delete[] bucket_jump_table[i];
+        jump_table_pool.release(bucket_jump_table[i]);
         bucket_jump_table[i] = nullptr;
     }
 #endif
@@ -647,65 +1470,68 @@ void component_container<T>::ensure_bucket_space(entity id)
     if((id>>bucket_exp) < bucket_count)
         return;
 
-    std::uint32_t new_bucket_count = std::max(initial_bucket_count, bucket_count);
+    entity new_bucket_count = std::max(initial_bucket_count, bucket_count);
     while(new_bucket_count <= (id>>bucket_exp))
         new_bucket_count *= 2;
 
-    bitmask_type** new_bucket_batch_bitmask = new bitmask_type*[new_bucket_count];
+    bitmask_type** new_bucket_batch_bitmask =
+        allocate_array<bitmask_type*>(new_bucket_count);
     memcpy(new_bucket_batch_bitmask, bucket_batch_bitmask,
         sizeof(bitmask_type*)*bucket_count);
     memset(new_bucket_batch_bitmask+bucket_count, 0,
         sizeof(bitmask_type*)*(new_bucket_count-bucket_count));
-    delete [] bucket_batch_bitmask;
+    deallocate_array(bucket_batch_bitmask, bucket_count);
     bucket_batch_bitmask = new_bucket_batch_bitmask;
 
-    bitmask_type** new_bucket_bitmask = new bitmask_type*[new_bucket_count];
+    bitmask_type** new_bucket_bitmask =
+        allocate_array<bitmask_type*>(new_bucket_count);
     memcpy(new_bucket_bitmask, bucket_bitmask,
         sizeof(bitmask_type*)*bucket_count);
     memset(new_bucket_bitmask+bucket_count, 0,
         sizeof(bitmask_type*)*(new_bucket_count-bucket_count));
-    delete [] bucket_bitmask;
+    deallocate_array(bucket_bitmask, bucket_count);
     bucket_bitmask = new_bucket_bitmask;
 
-    entity** new_bucket_jump_table = new entity*[new_bucket_count];
+    entity** new_bucket_jump_table = allocate_array<entity*>(new_bucket_count);
     memcpy(new_bucket_jump_table, bucket_jump_table,
         sizeof(entity*)*bucket_count);
     memset(new_bucket_jump_table+bucket_count, 0,
         sizeof(entity*)*(new_bucket_count-bucket_count));
-    delete [] bucket_jump_table;
+    deallocate_array(bucket_jump_table, bucket_count);
     bucket_jump_table = new_bucket_jump_table;
 
     // Create initial jump table entry.
     if(bucket_count == 0)
     {
-        bucket_jump_table[0] = new entity[1 << bucket_exp];
+        bucket_jump_table[0] = jump_table_pool.allocate();
         memset(bucket_jump_table[0], 0, sizeof(entity)*(1 << bucket_exp));
     }
 
     if constexpr(!tag_component)
     {
-        T** new_bucket_components = new T*[new_bucket_count];
+        T** new_bucket_components = allocate_array<T*>(new_bucket_count);
         memcpy(new_bucket_components, bucket_components,
             sizeof(T*)*bucket_count);
         memset(new_bucket_components+bucket_count, 0,
             sizeof(T*)*(new_bucket_count-bucket_count));
-        delete [] bucket_components;
+        deallocate_array(bucket_components, bucket_count);
         bucket_components = new_bucket_components;
     }
 
-    std::uint32_t top_bitmask_count = get_top_bitmask_size();
-    std::uint32_t new_top_bitmask_count = std::max(
+    entity top_bitmask_count = get_top_bitmask_size();
+    entity new_top_bitmask_count = std::max(
         initial_bucket_count,
         new_bucket_count >> bitmask_shift
     );
     if(top_bitmask_count != new_top_bitmask_count)
     {
-        bitmask_type* new_top_bitmask = new bitmask_type[new_top_bitmask_count];
+        bitmask_type* new_top_bitmask =
+            allocate_array<bitmask_type>(new_top_bitmask_count);
         memcpy(new_top_bitmask, top_bitmask,
             sizeof(bitmask_type)*top_bitmask_count);
         memset(new_top_bitmask+top_bitmask_count, 0,
             sizeof(bitmask_type)*(new_top_bitmask_count-top_bitmask_count));
-        delete [] top_bitmask;
+        deallocate_array(top_bitmask, top_bitmask_count);
         top_bitmask = new_top_bitmask;
     }
 
@@ -713,11 +1539,11 @@ void component_container<T>::ensure_bucket_space(entity id)
 }
 
 template<typename T>
-void component_container<T>::ensure_bitmask(std::uint32_t bucket_index)
+void component_container<T>::ensure_bitmask(entity bucket_index)
 {
     if(bucket_bitmask[bucket_index] == nullptr)
     {
-        bucket_bitmask[bucket_index] = new bitmask_type[bucket_bitmask_units];
+        bucket_bitmask[bucket_index] = bitmask_pool.allocate();
         std::memset(
             bucket_bitmask[bucket_index], 0,
             sizeof(bitmask_type)*bucket_bitmask_units
@@ -726,11 +1552,11 @@ void component_container<T>::ensure_bitmask(std::uint32_t bucket_index)
 }
 
 template<typename T>
-void component_container<T>::ensure_jump_table(std::uint32_t bucket_index)
+void component_container<T>::ensure_jump_table(entity bucket_index)
 {
     if(!bucket_jump_table[bucket_index])
     {
-        bucket_jump_table[bucket_index] = new entity[1 << bucket_exp];
+        bucket_jump_table[bucket_index] = jump_table_pool.allocate();
         memset(bucket_jump_table[bucket_index], 0, sizeof(entity)*(1 << bucket_exp));
     }
 }
@@ -738,11 +1564,11 @@ void component_container<T>::ensure_jump_table(std::uint32_t bucket_index)
 template<typename T>
 bool component_container<T>::batch_change(entity id)
 {
-    std::uint32_t hi = id >> bucket_exp;
+    entity hi = id >> bucket_exp;
     std::uint32_t lo = id & bucket_mask;
     if(bucket_batch_bitmask[hi] == nullptr)
     {
-        bucket_batch_bitmask[hi] = new bitmask_type[bucket_bitmask_units];
+        bucket_batch_bitmask[hi] = bitmask_pool.allocate();
         std::memset(
             bucket_batch_bitmask[hi], 0,
             sizeof(bitmask_type)*bucket_bitmask_units
@@ -755,16 +1581,17 @@ bool component_container<T>::batch_change(entity id)
     { // If there will be a change, add this to the list.
         if(batch_checklist_size == batch_checklist_capacity)
         {
-            std::uint32_t new_batch_checklist_capacity = std::max(
+            entity new_batch_checklist_capacity = std::max(
                 initial_bucket_count,
                 batch_checklist_capacity * 2
             );
-            entity* new_batch_checklist = new entity[new_batch_checklist_capacity];
+            entity* new_batch_checklist =
+                allocate_array<entity>(new_batch_checklist_capacity);
             memcpy(new_batch_checklist, batch_checklist,
                 sizeof(entity)*batch_checklist_capacity);
             memset(new_batch_checklist + batch_checklist_capacity, 0,
                 sizeof(entity)*(new_batch_checklist_capacity-batch_checklist_capacity));
-            delete [] batch_checklist;
+            deallocate_array(batch_checklist, batch_checklist_capacity);
             batch_checklist = new_batch_checklist;
             batch_checklist_capacity = new_batch_checklist_capacity;
         }
@@ -778,16 +1605,16 @@ bool component_container<T>::batch_change(entity id)
 template<typename T>
 entity component_container<T>::find_previous_entity(entity id)
 {
-    std::uint32_t hi = id >> bucket_exp;
+    entity hi = id >> bucket_exp;
     std::uint32_t lo = id & bucket_mask;
 
     // Try to find in the current bucket.
-    std::uint32_t prev_index = 0;
+    entity prev_index = 0;
     if(find_bitmask_previous_index(bucket_bitmask[hi], lo, prev_index))
         return (hi << bucket_exp) + prev_index;
 
     // If that failed, search from the top bitmask.
-    std::uint32_t bucket_index = 0;
+    entity bucket_index = 0;
     if(!find_bitmask_previous_index(top_bitmask, hi, bucket_index))
         return INVALID_ENTITY;
 
@@ -802,58 +1629,74 @@ entity component_container<T>::find_previous_entity(entity id)
 
 
 template<typename T>
-void component_container<T>::signal_add(entity id, T* data)
+void component_container<T>::signal_add(entity id, pointer data)
 {
-    search.add_entity(id, *data);
-    ctx->emit(add_component<T>{id, data});
+    if constexpr(soa_component)
+    {
+        // Handlers want the whole component, which only exists as a copy.
+        if(
+            ctx->get_handler_count<add_component<T>>() == 0 &&
+            search_index_is_empty_default<decltype(search)>()
+        ) return;
+        T value = data.load();
+        search.add_entity(id, value);
+        ctx->emit(add_component<T>{id, &value});
+    }
+    else
+    {
+        search.add_entity(id, *data);
+        ctx->emit(add_component<T>{id, data});
+    }
 }
 
 template<typename T>
-void component_container<T>::signal_remove(entity id, T* data)
+void component_container<T>::signal_remove(entity id, pointer data)
 {
-    search.remove_entity(id, *data);
-    ctx->emit(remove_component<T>{id, data});
+    if constexpr(soa_component)
+    {
+        if(
+            ctx->get_handler_count<remove_component<T>>() == 0 &&
+            search_index_is_empty_default<decltype(search)>()
+        ) return;
+        T value = data.load();
+        search.remove_entity(id, value);
+        ctx->emit(remove_component<T>{id, &value});
+    }
+    else
+    {
+        search.remove_entity(id, *data);
+        ctx->emit(remove_component<T>{id, data});
+    }
 }
 
 template<typename T>
-unsigned component_container<T>::bitscan_reverse(std::uint64_t mt)
+void component_container<T>::destroy_component(pointer data)
 {
-#if defined(__GNUC__)
-    return 63 - __builtin_clzll(mt);
-#elif defined(_MSC_VER)
-    unsigned long index = 0;
-    _BitScanReverse64(&index, mt);
-    return index;
-#else
-    unsigned r = (mt > 0xFFFFFFFFF) << 5;
-    mt >>= r;
-    unsigned shift = (mt > 0xFFFF) << 4;
-    mt >>= shift;
-    r |= shift;
-    shift = (mt > 0xFF) << 3;
-    mt >>= shift;
-    r |= shift;
-    shift = (mt > 0xF) << 2;
-    mt >>= shift;
-    r |= shift;
-    shift = (mt > 0x3) << 1;
-    mt >>= shift;
-    r |= shift;
-    return r | (mt >> 1);
-#endif
+    if constexpr(soa_component)
+        soa_layout<T>::destroy(data.block, data.index);
+    else data->~T();
+}
+
+template<typename T>
+typename component_container<T>::pointer
+component_container<T>::get_pointer(T* bucket, entity index)
+{
+    if constexpr(soa_component)
+        return pointer(reinterpret_cast<std::uint8_t*>(bucket), index);
+    else return bucket + index;
 }
 
 template<typename T>
 bool component_container<T>::find_bitmask_top(
     bitmask_type* bitmask,
-    std::uint32_t count,
-    std::uint32_t& top_index
+    entity count,
+    entity& top_index
 ){
-    for(std::uint32_t j = 0, i = count-1; j < count; ++j, --i)
+    for(entity j = 0, i = count-1; j < count; ++j, --i)
     {
         if(bitmask[i] != 0)
         {
-            std::uint32_t index = bitscan_reverse(bitmask[i]);
+            entity index = bitscan_reverse(bitmask[i]);
             top_index = (i << bitmask_shift) + index;
             return true;
         }
@@ -865,18 +1708,18 @@ bool component_container<T>::find_bitmask_top(
 template<typename T>
 bool component_container<T>::find_bitmask_previous_index(
     bitmask_type* bitmask,
-    std::uint32_t index,
-    std::uint32_t& prev_index
+    entity index,
+    entity& prev_index
 ){
     if(!bitmask)
         return false;
 
-    std::uint32_t bm_index = index >> bitmask_shift;
+    entity bm_index = index >> bitmask_shift;
     bitmask_type bm_mask = (std::uint64_t(1)<<(index&bitmask_mask))-1;
     bitmask_type cur_mask = bitmask[bm_index] & bm_mask;
     if(cur_mask != 0)
     {
-        std::uint32_t index = bitscan_reverse(cur_mask);
+        entity index = bitscan_reverse(cur_mask);
         prev_index = (bm_index << bitmask_shift) + index;
         return true;
     }
@@ -884,6 +1727,29 @@ bool component_container<T>::find_bitmask_previous_index(
     return find_bitmask_top(bitmask, bm_index, prev_index);
 }
 
+template<typename T>
+bool component_container<T>::find_bitmask_next_index(
+    bitmask_type* bitmask,
+    entity count,
+    entity index,
+    entity& next_index
+){
+    entity bm_index = index >> bitmask_shift;
+    if(!bitmask || bm_index >= count)
+        return false;
+
+    bitmask_type cur_mask =
+        bitmask[bm_index] & (~bitmask_type(0) << (index&bitmask_mask));
+    while(cur_mask == 0)
+    {
+        if(++bm_index >= count)
+            return false;
+        cur_mask = bitmask[bm_index];
+    }
+    next_index = (bm_index << bitmask_shift) + bitscan_forward(cur_mask);
+    return true;
+}
+
 template<typename T>
 component_container<T>::iterator::iterator(component_container& from, entity e)
 :   from(&from), current_entity(e), current_bucket(e>>bucket_exp)
@@ -901,7 +1767,7 @@ component_container<T>::iterator::iterator(component_container& from, entity e)
 void component_container_entity_advancer::advance()
 {
     current_entity = current_jump_table[current_entity&bucket_mask];
-    std::uint32_t next_bucket = current_entity >> bucket_exp;
+    entity next_bucket = current_entity >> bucket_exp;
     if(next_bucket != current_bucket)
     {
         current_bucket = next_bucket;
@@ -913,7 +1779,7 @@ template<typename T>
 typename component_container<T>::iterator& component_container<T>::iterator::operator++()
 {
     current_entity = current_jump_table[current_entity&bucket_mask];
-    std::uint32_t next_bucket = current_entity >> bucket_exp;
+    entity next_bucket = current_entity >> bucket_exp;
     if(next_bucket != current_bucket)
     {
         current_bucket = next_bucket;
@@ -935,7 +1801,8 @@ typename component_container<T>::iterator component_container<T>::iterator::oper
 }
 
 template<typename T>
-std::pair<entity, T*> component_container<T>::iterator::operator*()
+std::pair<entity, typename component_container<T>::pointer>
+component_container<T>::iterator::operator*()
 {
     if constexpr(tag_component)
     {
@@ -948,13 +1815,14 @@ std::pair<entity, T*> component_container<T>::iterator::operator*()
     {
         return {
             current_entity,
-            &current_components[current_entity&bucket_mask]
+            get_pointer(current_components, current_entity&bucket_mask)
         };
     }
 }
 
 template<typename T>
-std::pair<entity, const T*> component_container<T>::iterator::operator*() const
+std::pair<entity, typename component_container<T>::const_pointer>
+component_container<T>::iterator::operator*() const
 {
     if constexpr(tag_component)
     {
@@ -967,7 +1835,7 @@ std::pair<entity, const T*> component_container<T>::iterator::operator*() const
     {
         return {
             current_entity,
-            &current_components[current_entity&bucket_mask]
+            get_pointer(current_components, current_entity&bucket_mask)
         };
     }
 }
@@ -990,7 +1858,7 @@ bool component_container<T>::iterator::try_advance(entity id)
     if(current_entity == id)
         return true;
 
-    std::uint32_t next_bucket = id >> bucket_exp;
+    entity next_bucket = id >> bucket_exp;
     std::uint32_t lo = id & bucket_mask;
     if(
         id < current_entity ||
@@ -1046,21 +1914,21 @@ template<typename T>
 bool component_container<T>::test_invariant() const
 {
     // Check bitmask internal validity
-    std::uint32_t top_bitmask_count = get_top_bitmask_size();
-    std::uint32_t top_index = 0;
+    entity top_bitmask_count = get_top_bitmask_size();
+    entity top_index = 0;
     bool found = top_bitmask && find_bitmask_top(
         top_bitmask,
         top_bitmask_count,
         top_index
     );
-    std::uint32_t bitmask_entity_count = 0;
+    entity bitmask_entity_count = 0;
     if(found && top_index >= bucket_count && !batching)
     {
         std::cout << "Top bitmask has a higher bit than bucket count!\n";
         return false;
     }
 
-    for(std::uint32_t i = 0; i < bucket_count; ++i)
+    for(entity i = 0; i < bucket_count; ++i)
     {
         int present = (top_bitmask[i>>bitmask_shift] >> (i&bitmask_mask))&1;
         if(present && !bucket_bitmask[i] && !batching)
@@ -1099,7 +1967,7 @@ bool component_container<T>::test_invariant() const
     }
 
     // Check jump table internal validity
-    std::uint32_t jump_table_entity_count = 0;
+    entity jump_table_entity_count = 0;
     if(entity_count != 0)
     {
         entity prev_id = 0;
@@ -1150,7 +2018,7 @@ bool component_container<T>::test_invariant() const
 template<typename T>
 void component_container<T>::print_bitmask() const
 {
-    for(std::uint32_t i = 0; i < bucket_count; ++i)
+    for(entity i = 0; i < bucket_count; ++i)
     {
         int present = (top_bitmask[i>>bitmask_shift] >> (i&bitmask_mask))&1;
         std::cout << "bucket " << i << " ("<< (present ? "present" : "empty") << "): ";
@@ -1175,17 +2043,17 @@ template<typename T>
 void component_container<T>::print_jump_table() const
 {
     std::uint32_t k = 0;
-    for(std::uint32_t i = 0; i < bucket_count; ++i)
+    for(entity i = 0; i < bucket_count; ++i)
     {
         if(bucket_jump_table[i] == nullptr)
         {
             std::uint32_t k_start = k;
-            std::uint32_t i_start = i;
+            entity i_start = i;
             for(; i < bucket_count && bucket_jump_table[i] == nullptr; ++i)
                 k += 1<<bucket_exp;
             --i;
             std::uint32_t k_end = k-1;
-            std::uint32_t i_end = i;
+            entity i_end = i;
             if(i_start == i_end)
                 std::cout << "bucket " << i_start << ": " << k_start << " to " << k_end;
             else
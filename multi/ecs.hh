@@ -51,16 +51,64 @@ SOFTWARE.
 #define MONKERO_ECS_HH
 #include "container.hh"
 #include "event.hh"
+#include "page_resource.hh"
+#include <atomic>
+#include <cassert>
+#include <chrono>
 #include <cstdint>
 #include <map>
 #include <functional>
 #include <memory>
+#include <memory_resource>
 #include <vector>
 
 /** This namespace contains all of MonkeroECS. */
 namespace monkero
 {
 
+/** Excludes entities that have the given component from foreach().
+ * It is taken by value as a parameter of the foreach callback and carries no
+ * data, e.g. `[](entity id, A& a, without<B>){}` visits entities with A but
+ * not B.
+ * \tparam Component The component type that visited entities must not have.
+ */
+template<typename Component>
+struct without {};
+
+/** Iteration callbacks may return this to control the iteration.
+ * Callbacks that return void always continue.
+ */
+enum class iteration_control
+{
+    CONTINUE = 0,
+    BREAK
+};
+
+/** Decides which released entity ID gets reused first.
+ */
+enum class id_policy
+{
+    /** The most recently released ID, which is the cheapest to find. */
+    REUSE_LATEST = 0,
+    /** The lowest released ID, which keeps live entities packed into as few
+     * component buckets as possible. */
+    REUSE_LOWEST
+};
+
+/** The outcome of scene::compact().
+ */
+struct compact_result
+{
+    /** New ID of each old ID. IDs that were not in use map to
+     * INVALID_ENTITY.
+     */
+    entity_translation translation_table;
+    /** Bytes of bitmask, jump table and component buckets that were released
+     * to the bucket pools.
+     */
+    std::size_t released_bytes = 0;
+};
+
 /** The primary class of the ECS.
  * Entities are created by it, components are attached throught it and events
  * are routed through it.
@@ -68,9 +116,17 @@ namespace monkero
 class scene
 {
 friend class event_subscription;
+template<typename> friend class component_container;
 public:
-    /** The constructor. */
-    inline scene();
+    /** The constructor.
+     * \param resource The memory resource that all component storage and
+     * entity bookkeeping of this scene is allocated from. It must outlive the
+     * scene. Event handlers still use the default allocator, as std::function
+     * does not support custom allocators.
+     */
+    inline scene(
+        std::pmr::memory_resource* resource = std::pmr::get_default_resource()
+    );
     /** The destructor.
      * It ensures that all remove_component events are sent for the remainder
      * of the components before event handlers are cleared.
@@ -87,7 +143,11 @@ public:
      *   references or pointers to components. The function is only called when
      *   all referenced components are present for the entity; pointer
      *   parameters are optional and can be null if the component is not
-     *   present.
+     *   present. Structure-of-arrays components are taken as soa_ref<T>
+     *   instead, which is required. A without<T> parameter skips all entities
+     *   that have T; at least one parameter must not be a without<T>. If \p f
+     *   returns iteration_control::BREAK, no further entities are visited and
+     *   batching is finished as usual.
      */
     template<typename F>
     inline void foreach(F&& f);
@@ -98,6 +158,123 @@ public:
     template<typename F>
     inline void operator()(F&& f);
 
+    /** Calls a given function for all suitable entities without modifying
+     * the scene.
+     * Batching is not used and no component containers are created, so this
+     * can be called from multiple threads at once as long as nothing modifies
+     * the scene at the same time. Component types that have never been added
+     * are treated as empty.
+     * \param f The iteration callback, see foreach() for the parameters.
+     *   Components must be taken as const references, pointers to const or
+     *   soa_ref<const T>.
+     * \see foreach()
+     */
+    template<typename F>
+    inline void foreach(F&& f) const;
+
+    /** Same as foreach() const, just syntactic sugar.
+     * \see foreach() const
+     */
+    template<typename F>
+    inline void operator()(F&& f) const;
+
+    /** Calls a given function for suitable entities within an ID range.
+     * Iteration starts directly from the first entity in the range, so this
+     * is useful for splitting work into jobs or resuming it later. Batching
+     * is enabled automatically, like with foreach().
+     * \param begin The first entity ID to consider.
+     * \param end The entity ID after the last one to consider.
+     *   INVALID_ENTITY means that there is no upper bound.
+     * \param f The iteration callback, see foreach() for the parameters.
+     * \see foreach()
+     */
+    template<typename F>
+    inline void foreach_range(entity begin, entity end, F&& f);
+
+    /** Same as foreach_range(), but read-only like foreach() const.
+     * \see foreach_range()
+     * \see foreach() const
+     */
+    template<typename F>
+    inline void foreach_range(entity begin, entity end, F&& f) const;
+
+    /** Finds the first suitable entity that matches a predicate.
+     * Entities are tested in ascending ID order and the search stops at the
+     * first match. Batching is enabled automatically, like with foreach().
+     * \param pred The predicate, taking the same parameters as the callback of
+     *   foreach() and returning bool.
+     * \return The first entity for which \p pred returned true, or
+     *   INVALID_ENTITY if there was none.
+     * \see foreach()
+     */
+    template<typename F>
+    inline entity find_if(F&& pred);
+
+    /** Same as find_if(), but read-only like foreach() const.
+     * \see find_if()
+     * \see foreach() const
+     */
+    template<typename F>
+    inline entity find_if(F&& pred) const;
+
+    /** Calls a given function for all suitable entities using multiple threads.
+     * The entities are split into bucket-aligned ranges of the smallest
+     * required component container, and the ranges are handed out to worker
+     * threads. The call returns once all entities have been visited. Batching
+     * is enabled for the duration of the whole call just like with foreach().
+     * \param f The iteration callback, see foreach() for the parameters. It is
+     *   called concurrently from multiple threads, so it must be safe to do
+     *   so. It may modify the components it's given, but it must not add or
+     *   remove entities or components, not even under a lock: that can
+     *   reallocate container internals that the other threads are reading.
+     *   Debug builds assert this. Collect the changes and apply them after
+     *   the call instead.
+     *   Returning iteration_control::BREAK stops handing out further ranges,
+     *   but other threads still finish the ranges they are working on.
+     * \param thread_count The number of threads to use, including the calling
+     *   thread. Zero uses std::thread::hardware_concurrency().
+     * \see foreach()
+     */
+    template<typename F>
+    inline void parallel_foreach(F&& f, unsigned thread_count = 0);
+
+    /** Calls a given function for runs of consecutive suitable entities.
+     * This is meant for loops that want to process plain arrays of components,
+     * e.g. for vectorization. Batching is enabled automatically, like with
+     * foreach().
+     * \param f The chunk callback. Its signature must be
+     *   void(entity first, std::size_t count, Components*... data), where all
+     *   listed components are required. It is called for each run of
+     *   consecutive entity IDs [first, first+count) that have all of the
+     *   components, and data[i] is the component of entity first+i. Runs are
+     *   split where any of the containers changes buckets, so a single run
+     *   never spans more than one bucket of any component type. For tag
+     *   components, the pointer refers to the single shared instance and must
+     *   not be indexed. Structure-of-arrays components are taken as
+     *   soa_span<T> instead of a pointer.
+     */
+    template<typename F>
+    inline void foreach_chunk(F&& f);
+
+    /** A persistent list of the entities that have all of the given
+     * components. It is kept up to date as components are added and removed,
+     * so iterating it is a linear walk instead of a join.
+     * \see query
+     */
+    template<typename... Components>
+    class query;
+
+    /** A position in entity ID order that iteration can be resumed from, so
+     * that long-running work can be split into slices over several frames.
+     * \see cursor
+     */
+    class cursor;
+
+    /** The set of component types that an entity has.
+     * \see signature
+     */
+    class signature;
+
     /** Adds an entity without components.
      * \return The new entity ID.
      */
@@ -112,6 +289,56 @@ public:
     template<typename... Components>
     entity add(Components&&... components);
 
+    /** Adds many entities with the same set of components at once.
+     * The new entities get consecutive fresh IDs, which lets the component
+     * containers fill in their bookkeeping for whole buckets at a time. This
+     * is much faster than calling add() in a loop. Released IDs are not
+     * reused by this function.
+     * \tparam Components The components that all new entities get.
+     * \param count The number of entities to add.
+     * \param init Either nothing, in which case all components are
+     *   default-constructed, or one callback per component type, in the same
+     *   order. The callbacks are called as Component init(entity id) for each
+     *   new entity.
+     * \return The ID of the first new entity, the rest follow it. If the IDs
+     *   would run out, nothing is added and INVALID_ENTITY is returned.
+     */
+    template<typename... Components, typename... F>
+    entity add_many(std::size_t count, F&&... init);
+
+    /** Selects which released IDs get reused first by add() and
+     * add_in_pool().
+     * \param policy The new policy, id_policy::REUSE_LATEST by default.
+     */
+    inline void set_id_policy(id_policy policy);
+
+    /** Reserves a range of entity IDs for entities that belong together.
+     * Entities that are added through the same pool get IDs close to each
+     * other, so they share component buckets instead of being scattered
+     * among unrelated entities. IDs released from a pool are only reused by
+     * that pool.
+     * \param capacity The number of IDs to reserve. If the IDs would run out,
+     *   the pool gets as many as there are left.
+     * \return The index of the new pool, for add_in_pool(). Pools last for the
+     *   lifetime of the scene, clear_entities() empties them and reserves
+     *   their ranges again.
+     */
+    inline std::size_t add_id_pool(std::size_t capacity);
+
+    /** Adds an entity without components, taking its ID from a pool.
+     * \param pool The index of the pool, given by add_id_pool().
+     * \return The new entity ID, or INVALID_ENTITY if the pool is full.
+     */
+    inline entity add_in_pool(std::size_t pool);
+
+    /** Adds an entity with initial components, taking its ID from a pool.
+     * \param pool The index of the pool, given by add_id_pool().
+     * \param components All components that should be included, see add().
+     * \return The new entity ID, or INVALID_ENTITY if the pool is full.
+     */
+    template<typename... Components>
+    entity add_in_pool(std::size_t pool, Components&&... components);
+
     /** Adds a component to an existing entity, building it in-place.
      * \param id The entity that components are added to.
      * \param args Parameters for the constructor of the Component type.
@@ -135,6 +362,15 @@ public:
      */
     inline void remove(entity id);
 
+    /** Removes all components of many entities and releases their IDs.
+     * The IDs are sorted first, so that each component container is walked
+     * once in order, bucket by bucket, instead of jumping around for each
+     * entity.
+     * \param ids The entities to remove. Each must be listed only once.
+     * \param count The number of entities in \p ids.
+     */
+    inline void remove(const entity* ids, std::size_t count);
+
     /** Removes a component of an entity.
      * \tparam Component The type of component to remove from the entity.
      * \param id The entity whose component to remove.
@@ -142,12 +378,53 @@ public:
     template<typename Component>
     void remove(entity id);
 
+    /** Removes a component from all entities that have it.
+     * This is much faster than removing it from each entity separately.
+     * remove_component events are still sent for each removed component.
+     * \tparam Component The type of component to remove.
+     */
+    template<typename Component>
+    void remove_all();
+
     /** Removes all components of all entities.
      * It also resets the entity counter, so this truly invalidates all
      * previous entities!
      */
     inline void clear_entities();
 
+    /** Returns a handle that can later be checked with alive().
+     * Generations are only tracked for IDs that got a handle, so removing
+     * entities that never had one costs nothing extra.
+     * \param id The entity to make a handle for. It must not have been
+     *   removed.
+     * \return The handle of the entity.
+     */
+    inline entity_handle get_handle(entity id);
+
+    /** Checks if the entity of a handle still exists.
+     * This takes constant time and doesn't look at any components.
+     * \param handle The handle to check.
+     * \return false if the entity has been removed since the handle was made,
+     *   true otherwise.
+     */
+    inline bool alive(entity_handle handle) const;
+
+    /** Renumbers all entities densely and packs their components into as
+     * few buckets as possible.
+     * The relative order of the IDs is kept, and entities in ID pools stay in
+     * their pools. Components are moved to their new IDs, so pointers to
+     * them must be fetched again. A renumber_entities event is emitted once
+     * done, queries update themselves with it. All previous entity handles
+     * become stale and cursors should be reset.
+     * \return The translation from old IDs to new ones, and the amount of
+     *   bucket memory that became unused. To give it back to the memory
+     *   resource, see set_bucket_pool_limit(). Nothing is done during
+     *   batching, which is signaled by an empty translation table.
+     * \note The work done depends on the number of live and released IDs,
+     *   not on how high they go, so huge ID pools are fine.
+     */
+    inline compact_result compact();
+
     /** Copies entities from another ECS to this one.
      * \param other the other ECS whose entities and components to copy to this.
      * \param translation_table if not nullptr, will be filled in with the
@@ -171,7 +448,9 @@ public:
 
     /** Starts batching behaviour for add/remove.
      * Batching allows you to safely add and remove components while you iterate
-     * over them, but comes with no performance benefit.
+     * over them, but comes with no performance benefit. Containers only enter
+     * batch mode once they are modified, so untouched component types cost
+     * nothing.
      */
     inline void start_batch();
 
@@ -194,22 +473,34 @@ public:
     template<typename Component>
     bool has(entity id) const;
 
+    /** Returns the set of component types that an entity has.
+     * This is cheap to check for several component types at once, as it
+     * doesn't involve the component containers at all.
+     * \param id The entity whose component types to return.
+     * \return The signature of the entity. It refers to the scene, so it
+     *   should not be kept around while components are added or removed.
+     */
+    inline signature get_signature(entity id) const;
+
     /** Returns the desired component of an entity.
      * Const version.
      * \tparam Component the component type to get.
      * \param id The id of the entity whose component to fetch.
-     * \return A pointer to the component if present, null otherwise.
+     * \return A pointer to the component if present, null otherwise. For
+     * structure-of-arrays components, this is a soa_ref instead.
      */
     template<typename Component>
-    const Component* get(entity id) const;
+    typename component_container<Component>::const_pointer
+    get(entity id) const;
 
     /** Returns the desired component of an entity.
      * \tparam Component the component type to get.
      * \param id The id of the entity whose component to fetch.
-     * \return A pointer to the component if present, null otherwise.
+     * \return A pointer to the component if present, null otherwise. For
+     * structure-of-arrays components, this is a soa_ref instead.
      */
     template<typename Component>
-    Component* get(entity id);
+    typename component_container<Component>::pointer get(entity id);
 
     /** Uses search_index<Component> to find the desired component.
      * \tparam Component the component type to search for.
@@ -219,7 +510,8 @@ public:
      * \see update_search_index()
      */
     template<typename Component, typename... Args>
-    Component* find_component(Args&&... args);
+    typename component_container<Component>::pointer
+    find_component(Args&&... args);
 
     /** Uses search_index<Component> to find the desired component.
      * Const version.
@@ -230,7 +522,8 @@ public:
      * \see update_search_index()
      */
     template<typename Component, typename... Args>
-    const Component* find_component(Args&&... args) const;
+    typename component_container<Component>::const_pointer
+    find_component(Args&&... args) const;
 
     /** Uses search_index<Component> to find the desired entity.
      * \tparam Component the component type to search for.
@@ -252,6 +545,38 @@ public:
      */
     inline void update_search_indices();
 
+    /** Sets how many released buckets each component container keeps around.
+     * Buckets are released when clear_entities() is called or, with
+     * MONKERO_CONTAINER_DEALLOCATE_BUCKETS, when they become empty. Retained
+     * buckets are reused instead of allocating new ones, so that repeatedly
+     * emptying and refilling buckets doesn't cause heap traffic. The limit
+     * applies separately to each kind of bucket block (component storage,
+     * bitmasks and jump tables) and defaults to zero.
+     * \param limit The maximum number of retained blocks of each kind. Applies
+     * to all current and future component containers.
+     */
+    inline void set_bucket_pool_limit(std::size_t limit);
+
+    /** Sets the bucket retention limit of one component type.
+     * \tparam Component the component type whose limit to set.
+     * \param limit The maximum number of retained blocks of each kind.
+     * \see set_bucket_pool_limit()
+     */
+    template<typename Component>
+    void set_bucket_pool_limit(std::size_t limit);
+
+    /** Returns the bucket allocation counters of one component type.
+     * \tparam Component the component type whose counters to return.
+     * \return The bucket pool statistics of that component container.
+     */
+    template<typename Component>
+    bucket_pool_stats get_bucket_pool_stats() const;
+
+    /** Returns the memory resource given to the constructor.
+     * \return The memory resource used by this scene.
+     */
+    inline std::pmr::memory_resource* get_memory_resource() const;
+
     /** Calls all handlers of the given event type.
      * \tparam EventType the type of the event to emit.
      * \param event The event to emit.
@@ -312,26 +637,159 @@ public:
     event_subscription subscribe(F&&... callbacks);
 
 private:
+    // Maps foreach parameter types to the component types they refer to.
+    template<typename Component>
+    struct component_target { using type = Component; };
+
+    template<typename Component>
+    struct component_target<soa_ref<Component>>
+    { using type = std::remove_const_t<Component>; };
+
+    template<typename Component>
+    struct component_target<without<Component>> { using type = Component; };
+
+    template<typename Component>
+    struct is_without: std::false_type {};
+
+    template<typename Component>
+    struct is_without<without<Component>>: std::true_type {};
+
+    // Whether a foreach parameter can be used to modify the component.
+    template<typename Component>
+    struct is_read_only: std::bool_constant<
+        std::is_const_v<
+            std::remove_pointer_t<std::remove_reference_t<Component>>
+        > || (!std::is_reference_v<Component> && !std::is_pointer_v<Component>)
+    > {};
+
+    template<typename Component>
+    struct is_read_only<soa_ref<Component>>: std::is_const<Component> {};
+
+    // Calls an iteration callback, returns false if it asked to stop.
+    template<typename F, typename... Args>
+    static inline bool invoke_callback(F& f, Args&&... args);
+
+    // Per-ID values, kept in pages of 1<<page_exp IDs that are only
+    // allocated once something is stored in them. The pages are found through
+    // directories of 1<<directory_exp pages, which are also allocated on
+    // demand, so far apart IDs only cost memory around the IDs in use.
+    template<typename T>
+    class id_page_table
+    {
+    public:
+        static constexpr unsigned page_exp = 10;
+        static constexpr std::size_t page_size = std::size_t(1) << page_exp;
+
+        // Each ID has width values, which start out value-initialized.
+        id_page_table(
+            std::pmr::memory_resource* resource,
+            std::size_t width = 1
+        );
+        id_page_table(const id_page_table& other) = delete;
+        ~id_page_table();
+
+        // Returns the values of an ID, null if its page doesn't exist.
+        T* find(entity id) const;
+        // Like find(), but allocates the page if needed.
+        T* ensure(entity id);
+        // Calls f(first, values) for every allocated page, where values has
+        // the values of IDs [first, first+page_size).
+        template<typename F>
+        void foreach_page(F&& f) const;
+        std::size_t get_width() const;
+        // Changes the number of values per ID, keeping the existing ones.
+        void set_width(std::size_t width);
+        // Releases all pages, which resets every ID.
+        void clear();
+        void swap(id_page_table& other);
+
+    private:
+        static constexpr unsigned directory_exp = 10;
+        static constexpr std::size_t directory_size =
+            std::size_t(1) << directory_exp;
+
+        T* allocate_page(std::size_t width);
+        void deallocate_page(T* page, std::size_t width);
+
+        std::pmr::memory_resource* resource;
+        std::size_t width;
+        std::pmr::vector<T**> directories;
+    };
+
     template<bool pass_id, typename... Components>
     struct foreach_impl
     {
         template<typename F>
         static void foreach(scene& ctx, F&& f);
 
+        template<typename F>
+        static void parallel_foreach(
+            scene& ctx,
+            F&& f,
+            unsigned thread_count
+        );
+
+        template<typename F>
+        static void foreach_range(
+            scene& ctx,
+            F&& f,
+            entity begin,
+            entity end
+        );
+
+        template<typename F>
+        static void foreach_read_only(
+            const scene& ctx,
+            F&& f,
+            entity begin,
+            entity end
+        );
+
+        template<bool read_only, typename F>
+        static entity find_if(scene& ctx, F&& pred);
+
+        // Iterates from begin until stop() returns true after visiting an
+        // entity. Returns the ID following the last visited entity, or
+        // INVALID_ENTITY if the end was reached.
+        template<typename F, typename S>
+        static entity foreach_slice(scene& ctx, F&& f, entity begin, S&& stop);
+
+        // Iterates over [begin, end), INVALID_ENTITY as end means no limit.
+        // When read_only is set, missing containers aren't created, but are
+        // treated as empty instead. Returns false if the callback stopped the
+        // iteration.
+        template<bool read_only, typename F>
+        static bool foreach_in_range(
+            scene& ctx,
+            F&& f,
+            entity begin,
+            entity end
+        );
+
         template<typename Component>
-        struct iterator_wrapper
-        {
-            static constexpr bool required = true;
-            typename component_container<std::decay_t<std::remove_pointer_t<std::decay_t<Component>>>>::iterator iter;
-        };
+        using component_type = typename component_target<
+            std::decay_t<std::remove_pointer_t<std::decay_t<Component>>>
+        >::type;
 
         template<typename Component>
-        static inline auto make_iterator(scene& ctx)
+        using container_type = component_container<component_type<Component>>;
+
+        // Per-component state of the bitmask join in foreach_in_range().
+        template<typename Component>
+        struct join_state
         {
-            return iterator_wrapper<Component>{
-                ctx.get_container<std::decay_t<std::remove_pointer_t<std::decay_t<Component>>>>().begin()
-            };
-        }
+            static constexpr bool excluded =
+                is_without<std::decay_t<Component>>::value;
+            static constexpr bool required =
+                !std::is_pointer_v<Component> && !excluded;
+            container_type<Component>* container;
+            std::uint64_t word;
+        };
+
+        template<bool read_only, typename Component>
+        static inline container_type<Component>* get_join_container(
+            scene& ctx
+        );
 
         template<typename Component>
         struct converter
@@ -341,20 +799,44 @@ private:
         };
 
         template<typename F>
-        static void call(
+        static bool call(
             F&& f,
             entity id,
-            std::decay_t<std::remove_pointer_t<std::decay_t<Components>>>*... args
+            typename container_type<Components>::pointer... args
         );
     };
 
     template<typename... Components>
-    foreach_impl<true, Components...>
-    foreach_redirector(const std::function<void(entity id, Components...)>&);
+    struct foreach_chunk_impl
+    {
+        template<typename F>
+        static void foreach(scene& ctx, F&& f);
+    };
+
+    template<typename R, typename... Components>
+    static foreach_impl<true, Components...>
+    foreach_redirector(const std::function<R(entity id, Components...)>&);
+
+    template<typename R, typename... Components>
+    static foreach_impl<false, Components...>
+    foreach_redirector(const std::function<R(Components...)>&);
+
+    template<typename Component>
+    struct chunk_component_type;
+
+    template<typename Component>
+    struct chunk_component_type<Component*>
+    { using type = std::remove_cv_t<Component>; };
+
+    template<typename Component>
+    struct chunk_component_type<soa_span<Component>>
+    { using type = std::remove_cv_t<Component>; };
 
     template<typename... Components>
-    foreach_impl<false, Components...>
-    foreach_redirector(const std::function<void(Components...)>&);
+    foreach_chunk_impl<typename chunk_component_type<Components>::type...>
+    foreach_chunk_redirector(
+        const std::function<void(entity, std::size_t, Components...)>&
+    );
 
     template<typename T>
     T event_handler_type_detector(const std::function<void(scene&, const T&)>&);
@@ -368,12 +850,55 @@ private:
     template<typename Component>
     void try_attach_dependencies(entity id);
 
+    // Called before anything that adds or removes entities or components,
+    // which is not allowed during parallel_foreach().
+    inline void assert_not_parallel() const;
+
+    inline std::uint32_t get_generation(entity id) const;
+    // Makes existing handles of a released ID stale.
+    inline void release_generation(entity id);
+    // Makes all existing handles stale.
+    inline void release_all_generations();
+
+    // Keep the signatures up to date, called by the component containers.
+    inline void signature_insert(entity id, std::size_t key);
+    inline void signature_erase(entity id, std::size_t key);
+    inline void signature_erase_all(std::size_t key);
+
+    // A reserved range of IDs, [first, first+capacity).
+    struct id_pool
+    {
+        entity first;
+        std::size_t capacity;
+        // IDs [first, first+used) have been handed out at some point.
+        std::size_t used;
+        std::pmr::vector<entity> reusable_ids;
+    };
+
+    // Sorts IDs in ascending order. It's a radix sort, since comparison
+    // sorts are slow enough to eat up what sorting is meant to win.
+    static inline void sort_ids(std::pmr::vector<entity>& ids);
+
+    inline void reserve_id_pool(id_pool& pool, std::size_t capacity);
+    // Returns a released ID to the pool it came from, or to reusable_ids.
+    inline void release_id(entity id);
+    // Takes a released ID according to the policy, INVALID_ENTITY if there
+    // are none.
+    inline entity reuse_id(std::pmr::vector<entity>& ids);
+
     template<typename Component>
     component_container<Component>& get_container() const;
 
+    // Like get_container(), but returns null instead of creating the
+    // container if it doesn't exist yet.
+    template<typename Component>
+    component_container<Component>* find_container() const;
+
     template<typename Component>
     static size_t get_component_type_key();
-    inline static size_t component_type_key_counter = 0;
+    // Atomic, because keys can get assigned from read-only foreach calls in
+    // multiple threads.
+    inline static std::atomic<size_t> component_type_key_counter = 0;
 
     template<typename Event>
     static size_t get_event_type_key();
@@ -385,12 +910,43 @@ private:
     template<class C, typename F>
     void internal_bind_handler(size_t id, C* c, F&& f);
 
+    // Destroys containers that were allocated from the memory resource.
+    struct container_deleter
+    {
+        std::pmr::memory_resource* resource;
+        std::size_t size;
+        std::size_t alignment;
+
+        inline void operator()(component_container_base* c) const;
+    };
+
+    std::pmr::memory_resource* resource;
     entity id_counter;
-    std::vector<entity> reusable_ids;
-    std::vector<entity> post_batch_reusable_ids;
+    std::pmr::vector<entity> reusable_ids;
+    std::pmr::vector<entity> post_batch_reusable_ids;
+    id_policy policy;
+    // Sorted by ID, since they are reserved in increasing order.
+    std::pmr::vector<id_pool> id_pools;
+    // Generation of each entity ID relative to generation_base. It's odd
+    // once a handle has been made, and only then does releasing the ID
+    // increase it. Clearing the entities moves generation_base past
+    // generation_top, the highest generation given out so far.
+    id_page_table<std::uint32_t> generations;
+    std::uint32_t generation_base;
+    std::uint32_t generation_top;
+    // Component types of each entity as a bitset indexed by the type key,
+    // as many words per entity as there are type keys in use.
+    id_page_table<std::uint64_t> signatures;
     size_t subscriber_counter;
     int defer_batch;
-    mutable std::vector<std::unique_ptr<component_container_base>> components;
+    // True while parallel_foreach() runs its worker threads.
+    bool parallel_iterating;
+    // Containers that have been modified during the current batch.
+    std::pmr::vector<component_container_base*> batched_containers;
+    std::size_t bucket_pool_limit;
+    mutable std::pmr::vector<
+        std::unique_ptr<component_container_base, container_deleter>
+    > components;
 
     struct event_handler
     {
@@ -416,10 +972,185 @@ public:
     static void ensure_dependency_components_exist(entity id, scene& ctx);
 };
 
+/** A cached list of the entities that have all of the given components.
+ * The list is maintained through add_component and remove_component events,
+ * so repeatedly iterating the same set of components is much cheaper than
+ * with scene::foreach() when the set changes little between iterations. The
+ * cost is paid when components are added or removed instead. The query must
+ * be destroyed before its scene.
+ * \note Due to the callback nature, queries are immovable.
+ * \tparam Components The component types that listed entities have.
+ */
+template<typename... Components>
+class scene::query
+{
+public:
+    /** Builds the list from the entities currently in the scene.
+     * \param ctx The scene to track.
+     */
+    query(scene& ctx);
+    query(const query& other) = delete;
+    query(query&& other) = delete;
+
+    query& operator=(const query& other) = delete;
+    query& operator=(query&& other) = delete;
+
+    /** Calls a given function for all listed entities.
+     * Batching is enabled for the duration of the call like with
+     * scene::foreach(), and changes to the list made during it are applied
+     * once iteration finishes. Entities are visited in no particular order.
+     * \param f The iteration callback, taking either (entity, Components&...)
+     *   or just (Components&...). Structure-of-arrays components are taken as
+     *   soa_ref<T>. It may return iteration_control::BREAK to stop early.
+     */
+    template<typename F>
+    void foreach(F&& f);
+
+    /** Same as foreach(), just syntactic sugar.
+     * \see foreach()
+     */
+    template<typename F>
+    void operator()(F&& f);
+
+    /** Returns the number of listed entities.
+     * \return The number of entities that have all of the components.
+     */
+    std::size_t size() const;
+
+    /** Checks if an entity is listed.
+     * \param id The entity to check.
+     * \return true if the entity is listed, false otherwise.
+     */
+    bool contains(entity id) const;
+
+private:
+    template<typename Component>
+    using pointer = typename component_container<Component>::pointer;
+
+    struct entry
+    {
+        entity id;
+        std::tuple<pointer<Components>...> components;
+    };
+
+    // Lists the entities from scratch, e.g. after they're renumbered.
+    void rebuild();
+    void refresh(entity id);
+    void insert(entity id);
+    void erase(entity id);
+
+    scene* ctx;
+    std::pmr::vector<entry> entries;
+    // Index of each entity in entries plus one, zero if it's not listed.
+    id_page_table<std::uint32_t> indices;
+    // Changes made while iterating are applied once iteration is done.
+    std::pmr::vector<entity> deferred;
+    unsigned iterating;
+    event_subscription sub;
+};
+
+/** Iterates over suitable entities a limited amount at a time.
+ * Each call continues from the entity where the previous one stopped, in
+ * ascending ID order. Only the position is stored, so entities and
+ * components can be added and removed freely between calls: removed
+ * entities are not visited, and new ones are visited if they come after the
+ * position and on the next pass otherwise.
+ */
+class scene::cursor
+{
+public:
+    /** Starts from the beginning.
+     * \param ctx The scene to iterate over.
+     */
+    inline cursor(scene& ctx);
+
+    /** Calls a given function for at most a given number of entities.
+     * Batching is enabled for the duration of the call like with
+     * scene::foreach().
+     * \param f The iteration callback, see scene::foreach() for the
+     *   parameters. The callback types may differ between calls. Returning
+     *   iteration_control::BREAK ends the slice early.
+     * \param max_count The maximum number of entities to visit.
+     * \return true if the end was reached, in which case the next call starts
+     *   over from the beginning.
+     */
+    template<typename F>
+    bool foreach(F&& f, std::size_t max_count);
+
+    /** Calls a given function for entities until a time budget runs out.
+     * The clock is checked after each visited entity, so the slice can end
+     * up exceeding the budget by the duration of one callback.
+     * \param f The iteration callback, see foreach().
+     * \param max_time The time budget.
+     * \return true if the end was reached, in which case the next call starts
+     *   over from the beginning.
+     */
+    template<typename F, typename Rep, typename Period>
+    bool foreach(F&& f, std::chrono::duration<Rep, Period> max_time);
+
+    /** Moves back to the beginning.
+     */
+    inline void reset();
+
+    /** Returns the current position.
+     * \return The first entity ID that the next call may visit.
+     */
+    inline entity get_position() const;
+
+private:
+    template<typename F, typename S>
+    bool foreach_slice(F&& f, S&& stop);
+
+    scene* ctx;
+    entity position;
+};
+
+/** The set of component types that an entity has, stored as a bitset over
+ * the component types. Checks only look at the bits, so they take the same
+ * time no matter how many entities or component types there are.
+ * \see scene::get_signature()
+ */
+class scene::signature
+{
+friend class scene;
+public:
+    /** Checks if all of the given component types are included.
+     * \tparam Components The component types to check.
+     * \return true if the entity has every one of the components.
+     */
+    template<typename... Components>
+    bool has() const;
+
+    /** Checks if any of the given component types are included.
+     * \tparam Components The component types to check.
+     * \return true if the entity has at least one of the components.
+     */
+    template<typename... Components>
+    bool has_any() const;
+
+    /** Returns the number of component types included.
+     * \return The number of different components the entity has.
+     */
+    inline std::size_t count() const;
+
+    /** Checks if two signatures have the same component types.
+     */
+    inline bool operator==(const signature& other) const;
+    inline bool operator!=(const signature& other) const;
+
+private:
+    inline signature(const std::uint64_t* words, std::size_t word_count);
+    inline bool test(std::size_t key) const;
+
+    const std::uint64_t* words;
+    std::size_t word_count;
+};
+
 }
 
 #include "event.tcc"
 #include "search_index.tcc"
+#include "page_resource.tcc"
 #include "container.tcc"
 #include "ecs.tcc"
 
@@ -25,12 +25,19 @@ SOFTWARE.
 #define MONKERO_ECS_TCC
 #include "ecs.hh"
 #include <limits>
+#include <atomic>
+#include <thread>
 
 namespace monkero
 {
 
-scene::scene()
-: id_counter(1), subscriber_counter(0), defer_batch(0)
+scene::scene(std::pmr::memory_resource* resource)
+:   resource(resource), id_counter(1), reusable_ids(resource),
+    post_batch_reusable_ids(resource), policy(id_policy::REUSE_LATEST),
+    id_pools(resource), generations(resource), generation_base(0),
+    generation_top(0), signatures(resource),
+    subscriber_counter(0), defer_batch(0), parallel_iterating(false),
+    batched_containers(resource), bucket_pool_limit(0), components(resource)
 {
 }
 
@@ -38,93 +45,489 @@ scene::~scene()
 {
     // This is called manually so that remove events are fired if necessary.
     clear_entities();
+    // The containers still look up event handlers when destroyed, so they
+    // must go before the handlers do.
+    components.clear();
 }
 
 template<bool pass_id, typename... Components>
-template<typename Component>
-struct scene::foreach_impl<pass_id, Components...>::iterator_wrapper<Component*>
+template<typename F>
+void scene::foreach_impl<pass_id, Components...>::foreach(scene& ctx, F&& f)
 {
-    static constexpr bool required = false;
-    typename component_container<std::decay_t<std::remove_pointer_t<std::decay_t<Component>>>>::iterator iter;
-};
+    foreach_range(ctx, std::forward<F>(f), INVALID_ENTITY, INVALID_ENTITY);
+}
 
 template<bool pass_id, typename... Components>
 template<typename F>
-void scene::foreach_impl<pass_id, Components...>::foreach(scene& ctx, F&& f)
-{
+void scene::foreach_impl<pass_id, Components...>::foreach_range(
+    scene& ctx,
+    F&& f,
+    entity begin,
+    entity end
+){
     ctx.start_batch();
+    foreach_in_range<false>(ctx, std::forward<F>(f), begin, end);
+    ctx.finish_batch();
+}
 
-    std::tuple component_it(make_iterator<Components>(ctx)...);
-#define monkero_apply_tuple(...) \
-    std::apply([&](auto&... it){return (__VA_ARGS__);}, component_it)
+template<bool pass_id, typename... Components>
+template<typename F>
+void scene::foreach_impl<pass_id, Components...>::parallel_foreach(
+    scene& ctx,
+    F&& f,
+    unsigned thread_count
+){
+    if(thread_count == 0)
+        thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+
+    ctx.start_batch();
+
+    // The smallest required container drives the split, just like it drives
+    // the iteration itself. If there are none, the largest one is used. This
+    // also creates all missing containers before any threads are started.
+    constexpr bool all_optional =
+        (!join_state<Components>::required && ...);
+    component_container_base* driver = nullptr;
+    (
+        [&](component_container_base* c, bool required, bool excluded){
+            if(excluded || (!all_optional && !required)) return;
+            if(
+                !driver ||
+                (all_optional && c->size() > driver->size()) ||
+                (!all_optional && c->size() < driver->size())
+            ) driver = c;
+        }(
+            &ctx.get_container<component_type<Components>>(),
+            join_state<Components>::required,
+            join_state<Components>::excluded
+        ), ...
+    );
+
+    // Oversubscribe a bit so that uneven ranges get balanced out.
+    std::vector<entity> ranges = driver->split_ranges(thread_count * 4);
+    std::atomic<std::size_t> next_range(0);
+    std::atomic<bool> stopped(false);
+    auto worker = [&](){
+        while(!stopped)
+        {
+            std::size_t i = next_range++;
+            if(i+1 >= ranges.size()) break;
+            if(!foreach_in_range<false>(ctx, f, ranges[i], ranges[i+1]))
+                stopped = true;
+        }
+    };
+
+    bool was_parallel = ctx.parallel_iterating;
+    ctx.parallel_iterating = true;
+    std::vector<std::thread> threads;
+    for(unsigned i = 1; i < thread_count && i+1 < ranges.size(); ++i)
+        threads.emplace_back(worker);
+    worker();
+    for(std::thread& t: threads)
+        t.join();
+    ctx.parallel_iterating = was_parallel;
+
+    ctx.finish_batch();
+}
+
+template<bool pass_id, typename... Components>
+template<typename F>
+void scene::foreach_impl<pass_id, Components...>::foreach_read_only(
+    const scene& ctx,
+    F&& f,
+    entity begin,
+    entity end
+){
+    static_assert(
+        (is_read_only<Components>::value && ...),
+        "Read-only foreach must take components as const references, "
+        "pointers to const or soa_ref<const T>"
+    );
+    // Nothing gets modified, iterators just don't have const versions.
+    foreach_in_range<true>(
+        const_cast<scene&>(ctx), std::forward<F>(f), begin, end
+    );
+}
 
-    // Note that all checks based on it.required are compile-time, it's
-    // constexpr!
-    constexpr bool all_optional = (std::is_pointer_v<Components> && ...);
+template<bool pass_id, typename... Components>
+template<bool read_only, typename F>
+entity scene::foreach_impl<pass_id, Components...>::find_if(
+    scene& ctx,
+    F&& pred
+){
+    entity found = INVALID_ENTITY;
+    auto test = [&](entity id, auto&&... args){
+        bool match;
+        if constexpr(pass_id) match = pred(id, args...);
+        else match = pred(args...);
+        if(!match) return iteration_control::CONTINUE;
+        found = id;
+        return iteration_control::BREAK;
+    };
+    // The ID is needed for the result even if pred doesn't take it.
+    using impl = foreach_impl<true, Components...>;
+    if constexpr(read_only)
+        impl::foreach_read_only(ctx, test, INVALID_ENTITY, INVALID_ENTITY);
+    else impl::foreach_range(ctx, test, INVALID_ENTITY, INVALID_ENTITY);
+    return found;
+}
+
+template<bool pass_id, typename... Components>
+template<typename F, typename S>
+entity scene::foreach_impl<pass_id, Components...>::foreach_slice(
+    scene& ctx,
+    F&& f,
+    entity begin,
+    S&& stop
+){
+    entity next = INVALID_ENTITY;
+    auto visit = [&](entity id, auto&&... args){
+        bool proceed;
+        if constexpr(pass_id) proceed = invoke_callback(f, id, args...);
+        else proceed = invoke_callback(f, args...);
+        if(proceed && !stop())
+            return iteration_control::CONTINUE;
+        next = id + 1;
+        return iteration_control::BREAK;
+    };
+    foreach_impl<true, Components...>::foreach_range(
+        ctx, visit, begin, INVALID_ENTITY
+    );
+    return next;
+}
+
+template<bool pass_id, typename... Components>
+template<bool read_only, typename Component>
+auto scene::foreach_impl<pass_id, Components...>::get_join_container(
+    scene& ctx
+) -> container_type<Component>*
+{
+    if constexpr(read_only)
+        return ctx.find_container<component_type<Component>>();
+    else return &ctx.get_container<component_type<Component>>();
+}
+
+template<bool pass_id, typename... Components>
+template<bool read_only, typename F>
+bool scene::foreach_impl<pass_id, Components...>::foreach_in_range(
+    scene& ctx,
+    F&& f,
+    entity begin,
+    entity end
+){
+    static_assert(
+        !(is_without<std::decay_t<Components>>::value && ...),
+        "foreach needs at least one component that isn't excluded"
+    );
+
+    // Wraps around to the largest ID when end is INVALID_ENTITY.
+    entity last = end - 1;
 
     if constexpr(sizeof...(Components) == 1)
     {
         // If we're only iterating one category, we can do it very quickly!
-        auto& it = std::get<0>(component_it).iter;
-        while(it)
+        auto* c = get_join_container<read_only, Components...>(ctx);
+        if(!c) return true;
+        auto it = c->lower_bound(begin);
+
+        // A second cursor runs ahead through the jump table, so that only
+        // components that will actually be visited get prefetched.
+        using container = std::remove_pointer_t<decltype(it.get_container())>;
+        constexpr bool prefetch = MONKERO_PREFETCH_DISTANCE > 0 &&
+            !container::tag_component && !container::soa_component;
+        component_container_entity_advancer ahead = {};
+        if constexpr(prefetch)
+        {
+            ahead = it.get_advancer();
+            for(
+                unsigned i = 0;
+                i < MONKERO_PREFETCH_DISTANCE &&
+                ahead.current_entity != INVALID_ENTITY;
+                ++i
+            ){
+                it.get_container()->prefetch_component(ahead.current_entity);
+                ahead.advance();
+            }
+        }
+
+        while(it && it.get_id() <= last)
         {
+            if constexpr(prefetch)
+            {
+                if(ahead.current_entity != INVALID_ENTITY)
+                {
+                    it.get_container()->prefetch_component(
+                        ahead.current_entity
+                    );
+                    ahead.advance();
+                }
+            }
             auto [cur_id, ptr] = *it;
-            call(std::forward<F>(f), cur_id, ptr);
+            if(!call(std::forward<F>(f), cur_id, ptr))
+                return false;
             ++it;
         }
     }
-    else if constexpr(all_optional)
+    else
     {
-        // If all are optional, iteration logic has to differ a bit. The other
-        // version would never quit as there would be zero finished required
-        // iterators.
-        while(monkero_apply_tuple((bool)it.iter || ...))
+        // Multiple components are joined one bitmask word (64 entities) at
+        // a time. Required components are ANDed together, or if there are
+        // none, the optional ones are ORed together. Excluded components are
+        // then masked out. Runs of entities that don't match are therefore
+        // skipped in bulk instead of probing each of them.
+        std::tuple state(join_state<Components>{
+            get_join_container<read_only, Components>(ctx), 0
+        }...);
+#define monkero_apply_tuple(...) \
+        std::apply([&](auto&... s){return (__VA_ARGS__);}, state)
+
+        // Only read-only iteration can run into missing containers. Other
+        // than required ones, they're simply skipped.
+        if(monkero_apply_tuple(((s.required && !s.container) || ...)))
+            return true;
+
+        // Note that all checks based on s.required are compile-time, it's
+        // constexpr!
+        constexpr bool all_optional =
+            (!join_state<Components>::required && ...);
+
+        // A very sparse required component is better followed through its
+        // jump table, which skips straight to the next entity instead of the
+        // next non-empty word.
+        component_container_entity_advancer advancer = {};
+        const void* driver = nullptr;
+        bool sparse = false;
+        if constexpr(!all_optional)
         {
-            entity cur_id = monkero_apply_tuple(std::min({
-                (it.iter ? it.iter.get_id() : std::numeric_limits<entity>::max())...
+            std::size_t min_length = monkero_apply_tuple(std::min({
+                (s.required ?
+                    s.container->size() :
+                    std::numeric_limits<std::size_t>::max()
+                )...
             }));
-            monkero_apply_tuple(call(
-                std::forward<F>(f),
-                cur_id,
-                (it.iter.get_id() == cur_id ? (*it.iter).second : nullptr)...
-            ));
-            monkero_apply_tuple(
-                (it.iter && it.iter.get_id() == cur_id ? (++it.iter, void()) : void()), ...
+            sparse = min_length < (ctx.id_counter >> 6);
+            if(sparse)
+            {
+                monkero_apply_tuple(
+                    (s.required && s.container->size() == min_length ?
+                        (advancer = s.container->lower_bound(begin).get_advancer(),
+                        driver = s.container, void()) : void()), ...
+                );
+            }
+        }
+
+        entity word = begin >> 6;
+        for(;;)
+        {
+            if constexpr(all_optional)
+            {
+                // Closest word that has any of the components.
+                entity next = std::numeric_limits<entity>::max();
+                monkero_apply_tuple(([&](){
+                    entity w = word;
+                    if(
+                        !s.excluded && s.container &&
+                        s.container->find_next_word(w)
+                    )
+                        next = std::min(next, w);
+                }(), ...));
+                if(next == std::numeric_limits<entity>::max())
+                    break;
+                word = next;
+            }
+            else if(sparse)
+            {
+                // Leapfrog between the driver and the other required
+                // containers. When they skip a gap, the driver seeks past it
+                // through its bitmasks instead of walking its jump table.
+                entity start_word;
+                bool found = true;
+                do
+                {
+                    start_word = word;
+                    if(
+                        advancer.current_entity != INVALID_ENTITY &&
+                        (advancer.current_entity >> 6) < word
+                    ){
+                        // The next entity is usually close, so try a single
+                        // step first.
+                        advancer.advance();
+                        if(
+                            advancer.current_entity != INVALID_ENTITY &&
+                            (advancer.current_entity >> 6) < word
+                        ) monkero_apply_tuple(((s.required && s.container == driver ?
+                            (advancer = s.container->lower_bound(
+                                entity(word) << 6
+                            ).get_advancer(), void()) : void()
+                        ), ...));
+                    }
+                    if(advancer.current_entity == INVALID_ENTITY)
+                    {
+                        found = false;
+                        break;
+                    }
+                    word = advancer.current_entity >> 6;
+                    found = monkero_apply_tuple((
+                        !s.required || s.container == driver ||
+                        s.container->find_next_word(word)
+                    ) && ...);
+                }
+                while(found && start_word != word);
+                if(!found) break;
+            }
+            else
+            {
+                // Leapfrog until all required containers agree on the next
+                // non-empty word.
+                entity start_word;
+                bool found = true;
+                do
+                {
+                    start_word = word;
+                    found = monkero_apply_tuple(
+                        (!s.required || s.container->find_next_word(word)) && ...
+                    );
+                }
+                while(found && start_word != word);
+                if(!found) break;
+            }
+
+            std::uint64_t first = std::uint64_t(word) << 6;
+            if(first > last) break;
+
+            monkero_apply_tuple((
+                s.word = s.required || s.container ?
+                    s.container->get_bitmask_word(word) : 0,
+                void()
+            ), ...);
+            std::uint64_t mask = all_optional ?
+                monkero_apply_tuple(((s.excluded ? 0 : s.word) | ...)) :
+                monkero_apply_tuple(
+                    ((s.required ? s.word : ~std::uint64_t(0)) & ...)
+                );
+            mask &= monkero_apply_tuple(
+                ((s.excluded ? ~s.word : ~std::uint64_t(0)) & ...)
             );
+            if(first < begin)
+                mask &= ~std::uint64_t(0) << (begin - first);
+            if(last - first < 63)
+                mask &= (std::uint64_t(2) << (last - first)) - 1;
+
+            // Components of the matches a few steps ahead within the word
+            // are prefetched.
+            std::uint64_t ahead = mask;
+            auto prefetch_next = [&](){
+                if(ahead == 0) return;
+                unsigned bit = bitscan_forward(ahead);
+                ahead &= ahead - 1;
+                monkero_apply_tuple(((
+                    s.required || (!s.excluded && ((s.word >> bit) & 1)) ?
+                        s.container->prefetch_component(entity(first + bit)) :
+                        void()
+                ), ...));
+            };
+            if constexpr(MONKERO_PREFETCH_DISTANCE > 0)
+            {
+                for(unsigned i = 0; i < MONKERO_PREFETCH_DISTANCE; ++i)
+                    prefetch_next();
+            }
+
+            while(mask != 0)
+            {
+                unsigned bit = bitscan_forward(mask);
+                mask &= mask - 1;
+                entity id = entity(first + bit);
+                if constexpr(MONKERO_PREFETCH_DISTANCE > 0)
+                    prefetch_next();
+                if(!monkero_apply_tuple(call(
+                    std::forward<F>(f), id,
+                    (s.required || (!s.excluded && ((s.word >> bit) & 1)) ?
+                        s.container->get_unsafe(id) : nullptr)...
+                ))) return false;
+            }
+
+            if(first + 64 > last) break;
+            ++word;
         }
     }
-    else
-    {
-        // This is the generic implementation for when there's multiple
-        // components where some are potentially optional.
-        std::size_t min_length = monkero_apply_tuple(std::min({
-            (it.required ?
-                it.iter.get_container()->size() :
-                std::numeric_limits<std::size_t>::max()
-            )...
-        }));
+#undef monkero_apply_tuple
+    return true;
+}
 
-        component_container_entity_advancer advancer = {};
+template<typename... Components>
+template<typename F>
+void scene::foreach_chunk_impl<Components...>::foreach(scene& ctx, F&& f)
+{
+    static_assert(
+        sizeof...(Components) > 0,
+        "foreach_chunk needs at least one component type"
+    );
+    ctx.start_batch();
+
+    std::tuple containers(&ctx.get_container<Components>()...);
+#define monkero_apply_tuple(...) \
+    std::apply([&](auto*... c){return (__VA_ARGS__);}, containers)
+
+    // Runs are cut at the boundaries of the smallest buckets.
+    constexpr std::uint32_t min_exp = std::min({
+        component_container<Components>::bucket_exp...
+    });
+
+    entity run_first = INVALID_ENTITY;
+    std::uint64_t run_count = 0;
+    auto flush = [&](){
+        if(run_count == 0) return;
         monkero_apply_tuple(
-            (it.required && it.iter.get_container()->size() == min_length ?
-                (advancer = it.iter.get_advancer(), void()): void()), ...
+            f(run_first, std::size_t(run_count), c->get_unsafe(run_first)...)
         );
+        run_count = 0;
+    };
 
-        while(advancer.current_entity != INVALID_ENTITY)
+    entity word = 0;
+    for(;;)
+    {
+        // Leapfrog until all containers agree on the next non-empty word.
+        entity start_word;
+        bool found = true;
+        do
         {
-            bool have_all_required = monkero_apply_tuple(
-                (it.iter.try_advance(advancer.current_entity) || !it.required) && ...
-            );
-            if(have_all_required)
+            start_word = word;
+            found = monkero_apply_tuple((c->find_next_word(word) && ...));
+        }
+        while(found && start_word != word);
+        if(!found) break;
+
+        std::uint64_t mask = monkero_apply_tuple(
+            (c->get_bitmask_word(word) & ...)
+        );
+        while(mask != 0)
+        {
+            unsigned start = bitscan_forward(mask);
+            std::uint64_t rest = ~(mask >> start);
+            unsigned length = rest == 0 ? 64 - start : bitscan_forward(rest);
+            mask = start + length >= 64 ? 0 : mask & (~std::uint64_t(0) << (start + length));
+
+            std::uint64_t first = (std::uint64_t(word) << 6) + start;
+            while(length > 0)
             {
-                monkero_apply_tuple(call(
-                    std::forward<F>(f), advancer.current_entity,
-                    (it.iter.get_id() == advancer.current_entity ? (*it.iter).second : nullptr)...
-                ));
+                std::uint64_t bucket_end = ((first >> min_exp) + 1) << min_exp;
+                unsigned piece = std::min<std::uint64_t>(length, bucket_end - first);
+                if(
+                    run_count == 0 ||
+                    run_first + run_count != first ||
+                    (run_first >> min_exp) != (first >> min_exp)
+                ){
+                    flush();
+                    run_first = first;
+                }
+                run_count += piece;
+                first += piece;
+                length -= piece;
             }
-            advancer.advance();
         }
+        ++word;
     }
+    flush();
 #undef monkero_apply_tuple
 
     ctx.finish_batch();
@@ -138,6 +541,23 @@ struct scene::foreach_impl<pass_id, Components...>::converter<Component*>
     static inline T* convert(T* val) { return val; }
 };
 
+template<bool pass_id, typename... Components>
+template<typename Component>
+struct scene::foreach_impl<pass_id, Components...>::converter<soa_ref<Component>>
+{
+    template<typename T>
+    static inline soa_ref<Component> convert(soa_ref<T> val) { return val; }
+};
+
+template<bool pass_id, typename... Components>
+template<typename Component>
+struct scene::foreach_impl<pass_id, Components...>::converter<without<Component>>
+{
+    // Takes whatever pointer type the container has, even soa_ref.
+    template<typename Pointer>
+    static inline without<Component> convert(Pointer) { return {}; }
+};
+
 template<bool pass_id, typename... Components>
 template<typename Component>
 template<typename T>
@@ -148,13 +568,152 @@ T& scene::foreach_impl<pass_id, Components...>::converter<Component>::convert(T*
 
 template<bool pass_id, typename... Components>
 template<typename F>
-void scene::foreach_impl<pass_id, Components...>::call(
+bool scene::foreach_impl<pass_id, Components...>::call(
     F&& f,
     entity id,
-    std::decay_t<std::remove_pointer_t<std::decay_t<Components>>>*... args
+    typename container_type<Components>::pointer... args
 ){
-    if constexpr(pass_id) f(id, converter<Components>::convert(args)...);
-    else f(converter<Components>::convert(args)...);
+    if constexpr(pass_id)
+        return invoke_callback(f, id, converter<Components>::convert(args)...);
+    else return invoke_callback(f, converter<Components>::convert(args)...);
+}
+
+template<typename F, typename... Args>
+bool scene::invoke_callback(F& f, Args&&... args)
+{
+    if constexpr(std::is_void_v<std::invoke_result_t<F&, Args...>>)
+    {
+        f(std::forward<Args>(args)...);
+        return true;
+    }
+    else return f(std::forward<Args>(args)...) != iteration_control::BREAK;
+}
+
+template<typename T>
+scene::id_page_table<T>::id_page_table(
+    std::pmr::memory_resource* resource,
+    std::size_t width
+):  resource(resource), width(width), directories(resource)
+{
+}
+
+template<typename T>
+scene::id_page_table<T>::~id_page_table()
+{
+    clear();
+}
+
+template<typename T>
+T* scene::id_page_table<T>::find(entity id) const
+{
+    std::size_t page = id >> page_exp;
+    std::size_t directory = page >> directory_exp;
+    if(directory >= directories.size() || !directories[directory])
+        return nullptr;
+    T* values = directories[directory][page & (directory_size - 1)];
+    if(!values)
+        return nullptr;
+    return values + (id & (page_size - 1)) * width;
+}
+
+template<typename T>
+T* scene::id_page_table<T>::ensure(entity id)
+{
+    std::size_t page = id >> page_exp;
+    std::size_t directory = page >> directory_exp;
+    if(directory >= directories.size())
+        directories.resize(directory + 1, nullptr);
+    T**& pages = directories[directory];
+    if(!pages)
+    {
+        pages = static_cast<T**>(resource->allocate(
+            sizeof(T*) * directory_size, alignof(T*)
+        ));
+        std::fill_n(pages, directory_size, nullptr);
+    }
+    T*& values = pages[page & (directory_size - 1)];
+    if(!values)
+        values = allocate_page(width);
+    return values + (id & (page_size - 1)) * width;
+}
+
+template<typename T>
+template<typename F>
+void scene::id_page_table<T>::foreach_page(F&& f) const
+{
+    for(std::size_t directory = 0; directory < directories.size(); ++directory)
+    {
+        T** pages = directories[directory];
+        if(!pages) continue;
+        for(std::size_t i = 0; i < directory_size; ++i)
+        {
+            if(pages[i])
+                f(entity(((directory << directory_exp) + i) << page_exp), pages[i]);
+        }
+    }
+}
+
+template<typename T>
+std::size_t scene::id_page_table<T>::get_width() const
+{
+    return width;
+}
+
+template<typename T>
+void scene::id_page_table<T>::set_width(std::size_t new_width)
+{
+    std::size_t kept = std::min(width, new_width);
+    for(T** pages: directories)
+    {
+        if(!pages) continue;
+        for(std::size_t i = 0; i < directory_size; ++i)
+        {
+            if(!pages[i]) continue;
+            T* values = allocate_page(new_width);
+            for(std::size_t j = 0; j < page_size; ++j)
+                std::copy_n(pages[i] + j * width, kept, values + j * new_width);
+            deallocate_page(pages[i], width);
+            pages[i] = values;
+        }
+    }
+    width = new_width;
+}
+
+template<typename T>
+void scene::id_page_table<T>::clear()
+{
+    for(T** pages: directories)
+    {
+        if(!pages) continue;
+        for(std::size_t i = 0; i < directory_size; ++i)
+            if(pages[i]) deallocate_page(pages[i], width);
+        resource->deallocate(pages, sizeof(T*) * directory_size, alignof(T*));
+    }
+    std::pmr::vector<T**>(resource).swap(directories);
+}
+
+template<typename T>
+void scene::id_page_table<T>::swap(id_page_table& other)
+{
+    std::swap(resource, other.resource);
+    std::swap(width, other.width);
+    directories.swap(other.directories);
+}
+
+template<typename T>
+T* scene::id_page_table<T>::allocate_page(std::size_t width)
+{
+    T* values = static_cast<T*>(resource->allocate(
+        sizeof(T) * (width << page_exp), alignof(T)
+    ));
+    std::fill_n(values, width << page_exp, T());
+    return values;
+}
+
+template<typename T>
+void scene::id_page_table<T>::deallocate_page(T* page, std::size_t width)
+{
+    resource->deallocate(page, sizeof(T) * (width << page_exp), alignof(T));
 }
 
 template<typename T, typename=void>
@@ -176,6 +735,15 @@ void scene::try_attach_dependencies(entity id)
         Component::ensure_dependency_components_exist(id, *this);
 }
 
+void scene::assert_not_parallel() const
+{
+    assert(
+        !parallel_iterating &&
+        "Entities and components can't be added or removed during "
+        "parallel_foreach()"
+    );
+}
+
 template<typename F>
 void scene::foreach(F&& f)
 {
@@ -192,30 +760,245 @@ void scene::operator()(F&& f)
     foreach(std::forward<F>(f));
 }
 
+template<typename F>
+void scene::foreach(F&& f) const
+{
+    foreach_range(INVALID_ENTITY, INVALID_ENTITY, std::forward<F>(f));
+}
+
+template<typename F>
+void scene::operator()(F&& f) const
+{
+    foreach(std::forward<F>(f));
+}
+
+template<typename F>
+void scene::foreach_range(entity begin, entity end, F&& f)
+{
+    decltype(
+        foreach_redirector(std::function(f))
+    )::foreach_range(*this, std::forward<F>(f), begin, end);
+}
+
+template<typename F>
+void scene::foreach_range(entity begin, entity end, F&& f) const
+{
+    decltype(
+        foreach_redirector(std::function(f))
+    )::foreach_read_only(*this, std::forward<F>(f), begin, end);
+}
+
+template<typename F>
+entity scene::find_if(F&& pred)
+{
+    return decltype(
+        foreach_redirector(std::function(pred))
+    )::template find_if<false>(*this, std::forward<F>(pred));
+}
+
+template<typename F>
+entity scene::find_if(F&& pred) const
+{
+    return decltype(
+        foreach_redirector(std::function(pred))
+    )::template find_if<true>(
+        const_cast<scene&>(*this), std::forward<F>(pred)
+    );
+}
+
+template<typename F>
+void scene::foreach_chunk(F&& f)
+{
+    decltype(
+        foreach_chunk_redirector(std::function(f))
+    )::foreach(*this, std::forward<F>(f));
+}
+
+template<typename F>
+void scene::parallel_foreach(F&& f, unsigned thread_count)
+{
+    decltype(
+        foreach_redirector(std::function(f))
+    )::parallel_foreach(*this, std::forward<F>(f), thread_count);
+}
+
 entity scene::add()
 {
+    assert_not_parallel();
     if(reusable_ids.size() > 0)
+        return reuse_id(reusable_ids);
+    if(id_counter == INVALID_ENTITY)
+        return INVALID_ENTITY;
+    return id_counter++;
+}
+
+template<typename... Components>
+entity scene::add(Components&&... components)
+{
+    entity id = add();
+    attach(id, std::forward<Components>(components)...);
+    return id;
+}
+
+void scene::set_id_policy(id_policy policy)
+{
+    if(policy == id_policy::REUSE_LOWEST && this->policy != policy)
     {
-        entity id = reusable_ids.back();
-        reusable_ids.pop_back();
+        std::make_heap(
+            reusable_ids.begin(), reusable_ids.end(), std::greater<entity>()
+        );
+        for(id_pool& pool: id_pools)
+        {
+            std::make_heap(
+                pool.reusable_ids.begin(), pool.reusable_ids.end(),
+                std::greater<entity>()
+            );
+        }
+    }
+    this->policy = policy;
+}
+
+std::size_t scene::add_id_pool(std::size_t capacity)
+{
+    id_pools.push_back({INVALID_ENTITY, 0, 0, {}});
+    reserve_id_pool(id_pools.back(), capacity);
+    return id_pools.size()-1;
+}
+
+entity scene::add_in_pool(std::size_t pool)
+{
+    assert_not_parallel();
+    id_pool& p = id_pools[pool];
+    entity id = reuse_id(p.reusable_ids);
+    if(id != INVALID_ENTITY)
         return id;
+    if(p.used == p.capacity)
+        return INVALID_ENTITY;
+    return p.first + entity(p.used++);
+}
+
+template<typename... Components>
+entity scene::add_in_pool(std::size_t pool, Components&&... components)
+{
+    entity id = add_in_pool(pool);
+    attach(id, std::forward<Components>(components)...);
+    return id;
+}
+
+void scene::sort_ids(std::pmr::vector<entity>& ids)
+{
+    if(ids.size() < 256)
+    {
+        std::sort(ids.begin(), ids.end());
+        return;
     }
-    else
+
+    // Least significant digit first, digits above the largest ID are skipped.
+    constexpr unsigned digit_bits = 11;
+    constexpr std::size_t digit_mask = (std::size_t(1) << digit_bits) - 1;
+    entity max_id = *std::max_element(ids.begin(), ids.end());
+    std::pmr::vector<entity> sorted(ids.size(), ids.get_allocator());
+    std::size_t offsets[std::size_t(1) << digit_bits];
+    for(
+        unsigned shift = 0;
+        shift < sizeof(entity) * 8 && (max_id >> shift) != 0;
+        shift += digit_bits
+    ){
+        std::fill(std::begin(offsets), std::end(offsets), 0);
+        for(entity id: ids)
+            offsets[(id >> shift) & digit_mask]++;
+        std::size_t total = 0;
+        for(std::size_t& offset: offsets)
+        {
+            std::size_t digit_count = offset;
+            offset = total;
+            total += digit_count;
+        }
+        for(entity id: ids)
+            sorted[offsets[(id >> shift) & digit_mask]++] = id;
+        ids.swap(sorted);
+    }
+}
+
+void scene::reserve_id_pool(id_pool& pool, std::size_t capacity)
+{
+    // The number of IDs left doesn't fit in 64-bit entities when all of them
+    // are left, so this is one less than that.
+    bool exhausted = id_counter == INVALID_ENTITY;
+    std::uint64_t last_left = std::numeric_limits<entity>::max() - id_counter;
+    // Empty pools go to the end to keep id_pools sorted.
+    pool.first = exhausted ? std::numeric_limits<entity>::max() : id_counter;
+    pool.capacity = exhausted || capacity == 0 ? 0 :
+        std::min<std::uint64_t>(capacity - 1, last_left) + 1;
+    pool.used = 0;
+    pool.reusable_ids.clear();
+    // Wraps around to INVALID_ENTITY if this took the last IDs.
+    id_counter += entity(pool.capacity);
+}
+
+void scene::release_id(entity id)
+{
+    std::pmr::vector<entity>* ids = &reusable_ids;
+    if(!id_pools.empty() && id >= id_pools.front().first)
     {
-        if(id_counter == INVALID_ENTITY)
-            return INVALID_ENTITY;
-        return id_counter++;
+        auto it = std::upper_bound(
+            id_pools.begin(), id_pools.end(), id,
+            [](entity id, const id_pool& pool){ return id < pool.first; }
+        );
+        // Empty pools don't own any IDs, so they're skipped.
+        do --it;
+        while(it->capacity == 0 && it != id_pools.begin());
+        if(id - it->first < it->capacity)
+            ids = &it->reusable_ids;
     }
+    ids->push_back(id);
+    if(policy == id_policy::REUSE_LOWEST)
+        std::push_heap(ids->begin(), ids->end(), std::greater<entity>());
 }
 
-template<typename... Components>
-entity scene::add(Components&&... components)
+entity scene::reuse_id(std::pmr::vector<entity>& ids)
 {
-    entity id = add();
-    attach(id, std::forward<Components>(components)...);
+    if(ids.empty())
+        return INVALID_ENTITY;
+    if(policy == id_policy::REUSE_LOWEST)
+        std::pop_heap(ids.begin(), ids.end(), std::greater<entity>());
+    entity id = ids.back();
+    ids.pop_back();
     return id;
 }
 
+template<typename... Components, typename... F>
+entity scene::add_many(std::size_t count, F&&... init)
+{
+    static_assert(
+        sizeof...(F) == 0 || sizeof...(F) == sizeof...(Components),
+        "add_many needs either no initializers or one per component"
+    );
+    if(
+        count == 0 || id_counter == INVALID_ENTITY ||
+        count - 1 > std::numeric_limits<entity>::max() - id_counter
+    ) return INVALID_ENTITY;
+
+    assert_not_parallel();
+    entity first = id_counter;
+    id_counter += count;
+
+    for(std::uint64_t id = first; id < first + count; ++id)
+        (try_attach_dependencies<Components>(entity(id)), ...);
+
+    if constexpr(sizeof...(F) == 0)
+    {
+        (get_container<Components>().emplace_range(
+            first, count, [](entity){ return Components(); }
+        ), ...);
+    }
+    else
+    {
+        (get_container<Components>().emplace_range(first, count, init), ...);
+    }
+    return first;
+}
+
 template<typename Component, typename... Args>
 void scene::emplace(entity id, Args&&... args)
 {
@@ -240,22 +1023,92 @@ void scene::attach(entity id, Components&&... components)
 
 void scene::remove(entity id)
 {
-    for(auto& c: components)
-        if(c) c->erase(id);
+    assert_not_parallel();
+    // Only the containers that the entity has components in are visited.
+    // Each signature word is cleared once as a whole, so the containers
+    // don't need to clear their bits one by one. Removal handlers may widen
+    // the signatures, so the pointer is looked up again for every word.
+    for(std::size_t w = 0; w < signatures.get_width(); ++w)
+    {
+        std::uint64_t* words = signatures.find(id);
+        if(!words)
+            break;
+        std::uint64_t word = words[w];
+        words[w] = 0;
+        for(; word; word &= word-1)
+            components[w*64 + bitscan_forward(word)]->erase(id, false);
+    }
+    release_generation(id);
     if(defer_batch == 0)
-        reusable_ids.push_back(id);
+        release_id(id);
     else
         post_batch_reusable_ids.push_back(id);
 }
 
+void scene::remove(const entity* ids, std::size_t count)
+{
+    assert_not_parallel();
+    std::pmr::vector<entity> sorted(ids, ids + count, resource);
+    sort_ids(sorted);
+
+    // Only the containers that some of the entities have components in are
+    // visited. The signatures are cleared here, the containers leave them be.
+    std::size_t width = signatures.get_width();
+    std::pmr::vector<std::uint64_t> used(width, 0, resource);
+    for(entity id: sorted)
+    {
+        if(std::uint64_t* words = signatures.find(id))
+        {
+            for(std::size_t w = 0; w < width; ++w)
+            {
+                used[w] |= words[w];
+                words[w] = 0;
+            }
+        }
+    }
+    for(std::size_t w = 0; w < used.size(); ++w)
+    {
+        for(std::uint64_t word = used[w]; word; word &= word-1)
+        {
+            components[w*64 + bitscan_forward(word)]->erase_many(
+                sorted.data(), sorted.size()
+            );
+        }
+    }
+    for(entity id: sorted)
+        release_generation(id);
+
+    if(defer_batch == 0)
+    {
+        for(std::size_t i = 0; i < count; ++i)
+            release_id(ids[i]);
+    }
+    else
+    {
+        post_batch_reusable_ids.insert(
+            post_batch_reusable_ids.end(), ids, ids + count
+        );
+    }
+}
+
 template<typename Component>
 void scene::remove(entity id)
 {
     get_container<Component>().erase(id);
 }
 
+template<typename Component>
+void scene::remove_all()
+{
+    get_container<Component>().clear();
+}
+
 void scene::clear_entities()
 {
+    assert_not_parallel();
+    // Every signature is going to be empty, so the containers don't need to
+    // clear their bits one by one.
+    signatures.clear();
     for(auto& c: components)
         if(c) c->clear();
 
@@ -264,9 +1117,192 @@ void scene::clear_entities()
         id_counter = 1;
         reusable_ids.clear();
         post_batch_reusable_ids.clear();
+        for(id_pool& pool: id_pools)
+            reserve_id_pool(pool, pool.capacity);
+
+        // All IDs were released at once.
+        release_all_generations();
     }
 }
 
+entity_handle scene::get_handle(entity id)
+{
+    // The odd bit marks that the generation has a handle, so that removing
+    // the ID has to move on to the next one.
+    std::uint32_t& generation = *generations.ensure(id);
+    generation |= 1;
+    generation_top = std::max(generation_top, generation);
+    return {id, generation_base + generation};
+}
+
+bool scene::alive(entity_handle handle) const
+{
+    if(
+        handle.id == INVALID_ENTITY ||
+        (id_counter != INVALID_ENTITY && handle.id >= id_counter)
+    ) return false;
+    return handle.generation == get_generation(handle.id);
+}
+
+std::uint32_t scene::get_generation(entity id) const
+{
+    const std::uint32_t* generation = generations.find(id);
+    return generation_base + (generation ? *generation : 0);
+}
+
+void scene::release_generation(entity id)
+{
+    // Without handles, nothing can tell the generations apart, so this
+    // doesn't allocate or write anything.
+    if(generation_top == 0)
+        return;
+    std::uint32_t* generation = generations.find(id);
+    if(generation && (*generation & 1))
+        ++*generation;
+}
+
+void scene::signature_insert(entity id, std::size_t key)
+{
+    std::size_t word = key >> 6;
+    if(word >= signatures.get_width())
+        signatures.set_width(word + 1);
+    signatures.ensure(id)[word] |= std::uint64_t(1) << (key & 63);
+}
+
+void scene::signature_erase(entity id, std::size_t key)
+{
+    std::size_t word = key >> 6;
+    std::uint64_t* words = signatures.find(id);
+    if(words && word < signatures.get_width())
+        words[word] &= ~(std::uint64_t(1) << (key & 63));
+}
+
+void scene::signature_erase_all(std::size_t key)
+{
+    std::size_t word = key >> 6;
+    std::size_t width = signatures.get_width();
+    if(word >= width)
+        return;
+    std::uint64_t mask = ~(std::uint64_t(1) << (key & 63));
+    std::size_t page_words = width << id_page_table<std::uint64_t>::page_exp;
+    signatures.foreach_page([&](entity, std::uint64_t* page){
+        for(std::size_t i = word; i < page_words; i += width)
+            page[i] &= mask;
+    });
+}
+
+void scene::release_all_generations()
+{
+    // Every generation starts from one that no existing handle can have.
+    generation_base += generation_top + 1;
+    generation_top = 0;
+    generations.clear();
+}
+
+compact_result scene::compact()
+{
+    compact_result result;
+    if(defer_batch != 0)
+        return result;
+
+    // The released IDs split the handed out ones into runs of live IDs,
+    // which get consecutive new IDs. Those are in ascending order, so no ID
+    // ever grows.
+    std::pmr::vector<entity> released(
+        reusable_ids.begin(), reusable_ids.end(), resource
+    );
+    for(const id_pool& pool: id_pools)
+        released.insert(
+            released.end(), pool.reusable_ids.begin(), pool.reusable_ids.end()
+        );
+    sort_ids(released);
+
+    auto& runs = result.translation_table.runs;
+    auto free_id = released.begin();
+    entity next = 1;
+    // Translates the live IDs in [first, last].
+    auto translate = [&](entity first, entity last){
+        for(entity id = first;;)
+        {
+            while(free_id != released.end() && *free_id < id)
+                ++free_id;
+            entity run_last = last;
+            if(free_id != released.end() && *free_id <= last)
+            {
+                if(*free_id == id)
+                {
+                    if(id == last)
+                        return;
+                    ++id;
+                    continue;
+                }
+                run_last = *free_id - 1;
+            }
+            entity count = run_last - id + 1;
+            runs.push_back({id, next, count});
+            next += count;
+            if(run_last == last)
+                return;
+            id = run_last + 1;
+        }
+    };
+
+    // Pools keep their capacity, only their live entities are packed at the
+    // start. Their unused ends are skipped without looking at them.
+    entity id = 1;
+    for(id_pool& pool: id_pools)
+    {
+        // Pools that got no IDs at all are at the end of the ID range.
+        if(pool.capacity == 0 && pool.first == std::numeric_limits<entity>::max())
+            continue;
+        if(id < pool.first)
+            translate(id, pool.first - 1);
+        entity first = next;
+        if(pool.used != 0)
+            translate(pool.first, pool.first + entity(pool.used - 1));
+        id = pool.first + entity(pool.capacity);
+        pool.first = first;
+        pool.used = next - first;
+        pool.reusable_ids.clear();
+        next = first + entity(pool.capacity);
+    }
+    // Wraps around to INVALID_ENTITY if every ID has been handed out.
+    entity last = id_counter - 1;
+    if(id != INVALID_ENTITY && last != INVALID_ENTITY && id <= last)
+        translate(id, last);
+    id_counter = next;
+    reusable_ids.clear();
+
+    // The signatures are moved to new pages, since the old ones may be
+    // scattered far apart.
+    id_page_table<std::uint64_t> old_signatures(resource);
+    old_signatures.swap(signatures);
+    std::size_t width = old_signatures.get_width();
+    signatures.set_width(width);
+    old_signatures.foreach_page([&](entity first, const std::uint64_t* page){
+        for(std::size_t i = 0; i < id_page_table<std::uint64_t>::page_size; ++i)
+        {
+            const std::uint64_t* words = page + i * width;
+            if(std::all_of(
+                words, words + width,
+                [](std::uint64_t word){ return word == 0; }
+            )) continue;
+            entity new_id = result.translation_table[first + entity(i)];
+            if(new_id != INVALID_ENTITY)
+                std::copy_n(words, width, signatures.ensure(new_id));
+        }
+    });
+
+    for(auto& c: components)
+        if(c) result.released_bytes += c->renumber(result.translation_table);
+
+    // Existing handles carry the old IDs, so they must not stay alive.
+    release_all_generations();
+
+    emit(renumber_entities{&result.translation_table});
+    return result;
+}
+
 void scene::concat(
     scene& other,
     std::map<entity, entity>* translation_table_ptr
@@ -300,12 +1336,8 @@ entity scene::copy(scene& other, entity other_id)
 
 void scene::start_batch()
 {
+    // Containers join the batch lazily when they are first modified.
     ++defer_batch;
-    if(defer_batch == 1)
-    {
-        for(auto& c: components)
-            if(c) c->start_batch();
-    }
 }
 
 void scene::finish_batch()
@@ -315,14 +1347,12 @@ void scene::finish_batch()
         --defer_batch;
         if(defer_batch == 0)
         {
-            for(auto& c: components)
-                if(c) c->finish_batch();
+            for(component_container_base* c: batched_containers)
+                c->finish_batch();
+            batched_containers.clear();
 
-            reusable_ids.insert(
-                reusable_ids.end(),
-                post_batch_reusable_ids.begin(),
-                post_batch_reusable_ids.end()
-            );
+            for(entity id: post_batch_reusable_ids)
+                release_id(id);
             post_batch_reusable_ids.clear();
         }
     }
@@ -340,20 +1370,28 @@ bool scene::has(entity id) const
     return get_container<Component>().contains(id);
 }
 
+scene::signature scene::get_signature(entity id) const
+{
+    const std::uint64_t* words = signatures.find(id);
+    return signature(words, words ? signatures.get_width() : 0);
+}
+
 template<typename Component>
-const Component* scene::get(entity id) const
+typename component_container<Component>::const_pointer
+scene::get(entity id) const
 {
     return get_container<Component>()[id];
 }
 
 template<typename Component>
-Component* scene::get(entity id)
+typename component_container<Component>::pointer scene::get(entity id)
 {
     return get_container<Component>()[id];
 }
 
 template<typename Component, typename... Args>
-Component* scene::find_component(Args&&... args)
+typename component_container<Component>::pointer
+scene::find_component(Args&&... args)
 {
     return get<Component>(
         find<Component>(std::forward<Args>(args)...)
@@ -361,7 +1399,8 @@ Component* scene::find_component(Args&&... args)
 }
 
 template<typename Component, typename... Args>
-const Component* scene::find_component(Args&&... args) const
+typename component_container<Component>::const_pointer
+scene::find_component(Args&&... args) const
 {
     return get<Component>(
         find<Component>(std::forward<Args>(args)...)
@@ -386,6 +1425,30 @@ void scene::update_search_indices()
         if(c) c->update_search_index();
 }
 
+void scene::set_bucket_pool_limit(std::size_t limit)
+{
+    bucket_pool_limit = limit;
+    for(auto& c: components)
+        if(c) c->set_bucket_pool_limit(limit);
+}
+
+template<typename Component>
+void scene::set_bucket_pool_limit(std::size_t limit)
+{
+    get_container<Component>().set_bucket_pool_limit(limit);
+}
+
+template<typename Component>
+bucket_pool_stats scene::get_bucket_pool_stats() const
+{
+    return get_container<Component>().get_bucket_pool_stats();
+}
+
+std::pmr::memory_resource* scene::get_memory_resource() const
+{
+    return resource;
+}
+
 template<typename EventType>
 void scene::emit(const EventType& event)
 {
@@ -463,13 +1526,40 @@ component_container<Component>& scene::get_container() const
     auto& base_ptr = components[key];
     if(!base_ptr)
     {
-        base_ptr.reset(new component_container<Component>(*const_cast<scene*>(this)));
-        if(defer_batch > 0)
-            base_ptr->start_batch();
+        assert_not_parallel();
+        void* mem = resource->allocate(
+            sizeof(component_container<Component>),
+            alignof(component_container<Component>)
+        );
+        base_ptr = std::unique_ptr<component_container_base, container_deleter>(
+            new (mem) component_container<Component>(*const_cast<scene*>(this)),
+            container_deleter{
+                resource,
+                sizeof(component_container<Component>),
+                alignof(component_container<Component>)
+            }
+        );
+        base_ptr->set_bucket_pool_limit(bucket_pool_limit);
     }
     return *static_cast<component_container<Component>*>(base_ptr.get());
 }
 
+template<typename Component>
+component_container<Component>* scene::find_container() const
+{
+    size_t key = get_component_type_key<Component>();
+    if(components.size() <= key)
+        return nullptr;
+    return static_cast<component_container<Component>*>(components[key].get());
+}
+
+void scene::container_deleter::operator()(component_container_base* c) const
+{
+    void* mem = dynamic_cast<void*>(c);
+    c->~component_container_base();
+    resource->deallocate(mem, size, alignment);
+}
+
 template<typename Component>
 size_t scene::get_component_type_key()
 {
@@ -522,6 +1612,239 @@ ensure_dependency_components_exist(entity id, scene& ctx)
     ((ctx.has<DependencyComponents>(id) ? void() : ctx.attach(id, DependencyComponents())), ...);
 }
 
+template<typename... Components>
+scene::query<Components...>::query(scene& ctx)
+:   ctx(&ctx), entries(ctx.get_memory_resource()),
+    indices(ctx.get_memory_resource()), deferred(ctx.get_memory_resource()),
+    iterating(0),
+    sub(ctx.subscribe(
+        [this](scene&, const add_component<Components>& e){
+            refresh(e.id);
+        }...,
+        // Removal is handled without checking the other components, as
+        // they may already be on their way out too (e.g. when clearing).
+        [this](scene&, const remove_component<Components>& e){
+            if(iterating) deferred.push_back(e.id);
+            else erase(e.id);
+        }...,
+        [this](scene&, const renumber_entities&){ rebuild(); }
+    ))
+{
+    static_assert(
+        sizeof...(Components) > 0,
+        "A query needs at least one component type"
+    );
+    static_assert(
+        ((std::is_same_v<Components, std::decay_t<Components>> &&
+          !std::is_pointer_v<Components>) && ...),
+        "Query components must be plain component types"
+    );
+    rebuild();
+}
+
+template<typename... Components>
+template<typename F>
+void scene::query<Components...>::foreach(F&& f)
+{
+    ctx->start_batch();
+    iterating++;
+    for(std::size_t i = 0; i < entries.size(); ++i)
+    {
+        entry& e = entries[i];
+        bool proceed = std::apply([&](auto... ptr){
+            auto deref = [](auto p) -> decltype(auto) {
+                if constexpr(std::is_pointer_v<decltype(p)>) return *p;
+                else return p;
+            };
+            if constexpr(std::is_invocable_v<F&, entity, decltype(deref(ptr))...>)
+                return invoke_callback(f, e.id, deref(ptr)...);
+            else return invoke_callback(f, deref(ptr)...);
+        }, e.components);
+        if(!proceed) break;
+    }
+    iterating--;
+    ctx->finish_batch();
+
+    if(iterating == 0)
+    {
+        // Refreshing can't cause further changes, so this can't grow while
+        // it's being walked.
+        for(entity id: deferred)
+            refresh(id);
+        deferred.clear();
+    }
+}
+
+template<typename... Components>
+template<typename F>
+void scene::query<Components...>::operator()(F&& f)
+{
+    foreach(std::forward<F>(f));
+}
+
+template<typename... Components>
+std::size_t scene::query<Components...>::size() const
+{
+    return entries.size();
+}
+
+template<typename... Components>
+bool scene::query<Components...>::contains(entity id) const
+{
+    const std::uint32_t* index = indices.find(id);
+    return index && *index != 0;
+}
+
+template<typename... Components>
+void scene::query<Components...>::refresh(entity id)
+{
+    if(iterating)
+        deferred.push_back(id);
+    else if((ctx->has<Components>(id) && ...))
+        insert(id);
+    else erase(id);
+}
+
+template<typename... Components>
+void scene::query<Components...>::rebuild()
+{
+    entries.clear();
+    indices.clear();
+    foreach_impl<
+        true,
+        std::conditional_t<
+            component_container<Components>::soa_component,
+            soa_ref<Components>,
+            Components&
+        >...
+    >::foreach(*ctx, [&](entity id, auto&&...){ insert(id); });
+}
+
+template<typename... Components>
+void scene::query<Components...>::insert(entity id)
+{
+    // Components may have been replaced, so the pointers are always updated.
+    std::uint32_t& index = *indices.ensure(id);
+    if(index == 0)
+    {
+        entries.push_back({id, {}});
+        index = entries.size();
+    }
+    entries[index-1].components = {ctx->get<Components>(id)...};
+}
+
+template<typename... Components>
+void scene::query<Components...>::erase(entity id)
+{
+    if(!contains(id))
+        return;
+
+    std::uint32_t* index = indices.find(id);
+    std::uint32_t i = *index;
+    *index = 0;
+    if(i != entries.size())
+    {
+        entries[i-1] = entries.back();
+        *indices.find(entries[i-1].id) = i;
+    }
+    entries.pop_back();
+}
+
+scene::cursor::cursor(scene& ctx)
+:   ctx(&ctx), position(INVALID_ENTITY)
+{
+}
+
+template<typename F>
+bool scene::cursor::foreach(F&& f, std::size_t max_count)
+{
+    if(max_count == 0)
+        return false;
+    std::size_t count = 0;
+    return foreach_slice(
+        std::forward<F>(f), [&](){ return ++count == max_count; }
+    );
+}
+
+template<typename F, typename Rep, typename Period>
+bool scene::cursor::foreach(F&& f, std::chrono::duration<Rep, Period> max_time)
+{
+    auto deadline = std::chrono::steady_clock::now() + max_time;
+    return foreach_slice(
+        std::forward<F>(f),
+        [&](){ return std::chrono::steady_clock::now() >= deadline; }
+    );
+}
+
+void scene::cursor::reset()
+{
+    position = INVALID_ENTITY;
+}
+
+entity scene::cursor::get_position() const
+{
+    return position;
+}
+
+template<typename F, typename S>
+bool scene::cursor::foreach_slice(F&& f, S&& stop)
+{
+    position = decltype(
+        foreach_redirector(std::function(f))
+    )::foreach_slice(*ctx, std::forward<F>(f), position, stop);
+    return position == INVALID_ENTITY;
+}
+
+template<typename... Components>
+bool scene::signature::has() const
+{
+    return (test(get_component_type_key<Components>()) && ...);
+}
+
+template<typename... Components>
+bool scene::signature::has_any() const
+{
+    return (test(get_component_type_key<Components>()) || ...);
+}
+
+std::size_t scene::signature::count() const
+{
+    std::size_t total = 0;
+    for(std::size_t i = 0; i < word_count; ++i)
+        total += popcount(words[i]);
+    return total;
+}
+
+bool scene::signature::operator==(const signature& other) const
+{
+    // Missing words are the same as empty ones.
+    for(std::size_t i = 0; i < std::max(word_count, other.word_count); ++i)
+    {
+        std::uint64_t a = i < word_count ? words[i] : 0;
+        std::uint64_t b = i < other.word_count ? other.words[i] : 0;
+        if(a != b)
+            return false;
+    }
+    return true;
+}
+
+bool scene::signature::operator!=(const signature& other) const
+{
+    return !operator==(other);
+}
+
+scene::signature::signature(const std::uint64_t* words, std::size_t word_count)
+:   words(words), word_count(word_count)
+{
+}
+
+bool scene::signature::test(std::size_t key) const
+{
+    std::size_t word = key >> 6;
+    return word < word_count &&
+        (words[word] & (std::uint64_t(1) << (key & 63)));
+}
+
 }
 
 #endif
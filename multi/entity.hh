@@ -23,20 +23,92 @@ SOFTWARE.
 */
 #ifndef MONKERO_ENTITY_HH
 #define MONKERO_ENTITY_HH
+#include <algorithm>
 #include <cstdint>
+#include <vector>
 
 namespace monkero
 {
 
+// Define this before including to use 64-bit entity IDs.
+//#define MONKERO_64BIT_ENTITIES
+
 /** The entity type, it's just an ID.
  * An entity alone will not take up memory in the ECS, only once components are
- * added does the entity truly use memory. You can change this to uint64_t if
- * you truly need over 4 billion entities and have tons of memory.
+ * added does the entity truly use memory. Define MONKERO_64BIT_ENTITIES if
+ * you truly need over 4 billion entities and have tons of memory; it doubles
+ * the size of the jump tables and of everything else that stores IDs.
+ * The per-ID bookkeeping of scenes and queries is paged, so it only takes
+ * memory around the IDs in use. Component containers still have a bucket
+ * slot for every 2^bucket_exp IDs up to the highest one, so components of
+ * IDs far past 32 bits should get a large component_bucket_exp_hint.
  */
+#ifdef MONKERO_64BIT_ENTITIES
+using entity = std::uint64_t;
+#else
 using entity = std::uint32_t;
+#endif
 // You are not allowed to use this entity ID.
 inline constexpr entity INVALID_ENTITY = 0;
 
+/** An entity ID along with the generation of that ID.
+ * The generation changes whenever the ID is released, so a handle kept
+ * around never refers to a later entity that happens to reuse the ID. See
+ * scene::get_handle() and scene::alive().
+ */
+struct entity_handle
+{
+    entity id = INVALID_ENTITY;
+    std::uint32_t generation = 0;
+
+    bool operator==(const entity_handle& other) const
+    { return id == other.id && generation == other.generation; }
+    bool operator!=(const entity_handle& other) const
+    { return !(*this == other); }
+};
+
+/** The new IDs that scene::compact() gave to the old ones.
+ * Live IDs keep their order, so this only stores runs of consecutive IDs.
+ * Its size depends on how scattered the live entities were, not on how high
+ * their IDs went.
+ */
+class entity_translation
+{
+public:
+    /** Returns the new ID of an old ID, INVALID_ENTITY if the old ID was not
+     * in use.
+     */
+    entity operator[](entity old_id) const
+    {
+        auto it = std::upper_bound(
+            runs.begin(), runs.end(), old_id,
+            [](entity id, const run& r){ return id < r.old_first; }
+        );
+        if(it == runs.begin())
+            return INVALID_ENTITY;
+        --it;
+        entity offset = old_id - it->old_first;
+        return offset < it->count ? it->new_first + offset : INVALID_ENTITY;
+    }
+
+    /** Returns true if no ID was translated, which is the case when nothing
+     * was compacted or there were no entities.
+     */
+    bool empty() const { return runs.empty(); }
+
+private:
+    friend class scene;
+
+    // IDs [old_first, old_first+count) became [new_first, new_first+count).
+    struct run
+    {
+        entity old_first;
+        entity new_first;
+        entity count;
+    };
+    std::vector<run> runs;
+};
+
 }
 
 #endif
@@ -24,6 +24,7 @@ SOFTWARE.
 #ifndef MONKERO_EVENT_HH
 #define MONKERO_EVENT_HH
 #include "entity.hh"
+#include <cstddef>
 
 namespace monkero
 {
@@ -49,6 +50,17 @@ struct remove_component
     Component* data; /**< A pointer to the component (it's not destroyed quite yet) */
 };
 
+/** A built-in event emitted by scene::compact() once entities have been
+ * renumbered. Anything that stores entity IDs should translate them here.
+ */
+struct renumber_entities
+{
+    /** New ID of each old ID. IDs that were not in use map to
+     * INVALID_ENTITY.
+     */
+    const entity_translation* translation_table;
+};
+
 /** This class is used to receive events of the specified type(s).
  * Once it is destructed, no events will be delivered to the associated
  * callback function anymore.
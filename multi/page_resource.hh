@@ -0,0 +1,112 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2020, 2021, 2022 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef MONKERO_PAGE_RESOURCE_HH
+#define MONKERO_PAGE_RESOURCE_HH
+#include <cstdint>
+#include <map>
+#include <memory_resource>
+
+namespace monkero
+{
+
+#ifdef __linux__
+/** A memory resource that places component buckets on huge pages.
+ * Large scenes can spend a lot of time in TLB misses when accessing components
+ * randomly. This resource reserves one large range of virtual memory up front
+ * and asks the kernel to back it with transparent huge pages. The memory is
+ * only committed when it is first touched. Freed blocks are merged with the
+ * free ranges next to them, and later allocations of any size are taken from
+ * those ranges first. Memory is only given back to the kernel once a whole
+ * huge page has become free, as discarding a part of one would split it.
+ *
+ * Allocations smaller than a page, and anything that no longer fits in the
+ * reserved range, are passed on to the upstream resource. Give this to the
+ * scene constructor to use it for all component storage. Like the scene, it
+ * is not thread-safe.
+ */
+class huge_page_resource: public std::pmr::memory_resource
+{
+public:
+    /** The constructor.
+     * \param reserve_size The size of the virtual address range to reserve.
+     * This does not use physical memory until the range is used.
+     * \param upstream The resource for small allocations and overflow.
+     */
+    inline explicit huge_page_resource(
+        std::size_t reserve_size = std::size_t(1) << 36,
+        std::pmr::memory_resource* upstream = std::pmr::get_default_resource()
+    );
+    huge_page_resource(const huge_page_resource& other) = delete;
+    inline ~huge_page_resource();
+
+    /** Returns the number of bytes currently allocated from the reserved range.
+     * \return The number of bytes in use, rounded up to whole pages.
+     */
+    inline std::size_t get_used_size() const;
+
+protected:
+    inline void* do_allocate(std::size_t bytes, std::size_t alignment) override;
+    inline void do_deallocate(
+        void* p,
+        std::size_t bytes,
+        std::size_t alignment
+    ) override;
+    inline bool do_is_equal(
+        const std::pmr::memory_resource& other
+    ) const noexcept override;
+
+private:
+    static constexpr std::size_t huge_page_size = std::size_t(2) << 20;
+
+    inline std::size_t round_size(
+        std::size_t bytes,
+        std::size_t alignment
+    ) const;
+    inline bool owns(void* p) const;
+    static inline std::uintptr_t align_up(
+        std::uintptr_t address,
+        std::size_t alignment
+    );
+    static inline std::uintptr_t align_down(
+        std::uintptr_t address,
+        std::size_t alignment
+    );
+
+    std::pmr::memory_resource* upstream;
+    std::size_t page_size;
+    std::uint8_t* mapping;
+    std::size_t mapping_size;
+    std::uint8_t* begin;
+    std::uint8_t* end;
+    std::uint8_t* top;
+    std::size_t used_size;
+    // Released ranges below top by their start address, to their sizes.
+    // Neighbouring ranges are always merged, and no range ends at top.
+    std::pmr::map<std::uint8_t*, std::size_t> free_ranges;
+};
+#endif
+
+}
+
+#endif
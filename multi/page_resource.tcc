@@ -0,0 +1,232 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2020, 2021, 2022 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef MONKERO_PAGE_RESOURCE_TCC
+#define MONKERO_PAGE_RESOURCE_TCC
+#include "page_resource.hh"
+#include <algorithm>
+#include <iterator>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace monkero
+{
+
+#ifdef __linux__
+huge_page_resource::huge_page_resource(
+    std::size_t reserve_size,
+    std::pmr::memory_resource* upstream
+):  upstream(upstream), page_size(sysconf(_SC_PAGESIZE)), mapping(nullptr),
+    mapping_size(0), begin(nullptr), end(nullptr), top(nullptr),
+    used_size(0), free_ranges(upstream)
+{
+    // Reserve an extra huge page so that the usable range can be aligned to
+    // huge page boundaries.
+    mapping_size = reserve_size + huge_page_size;
+    void* ptr = mmap(
+        nullptr, mapping_size, PROT_READ|PROT_WRITE,
+        MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0
+    );
+    if(ptr == MAP_FAILED)
+    { // Everything will just go to upstream then.
+        mapping_size = 0;
+        return;
+    }
+    mapping = static_cast<std::uint8_t*>(ptr);
+    begin = reinterpret_cast<std::uint8_t*>(align_up(
+        reinterpret_cast<std::uintptr_t>(mapping), huge_page_size
+    ));
+    end = begin + reserve_size;
+    top = begin;
+#ifdef MADV_HUGEPAGE
+    madvise(begin, reserve_size, MADV_HUGEPAGE);
+#endif
+}
+
+huge_page_resource::~huge_page_resource()
+{
+    if(mapping)
+        munmap(mapping, mapping_size);
+}
+
+std::size_t huge_page_resource::get_used_size() const
+{
+    return used_size;
+}
+
+void* huge_page_resource::do_allocate(std::size_t bytes, std::size_t alignment)
+{
+    if(bytes < page_size || !mapping)
+        return upstream->allocate(bytes, alignment);
+
+    std::size_t size = round_size(bytes, alignment);
+    std::size_t align = std::max(alignment, page_size);
+
+    // The lowest released range that fits is used first, which keeps the
+    // used memory packed towards the start.
+    for(auto it = free_ranges.begin(); it != free_ranges.end(); ++it)
+    {
+        std::uintptr_t range_begin = reinterpret_cast<std::uintptr_t>(it->first);
+        std::uintptr_t range_end = range_begin + it->second;
+        std::uintptr_t start = align_up(range_begin, align);
+        if(start + size > range_end)
+            continue;
+
+        free_ranges.erase(it);
+        if(start > range_begin)
+        {
+            free_ranges.emplace(
+                reinterpret_cast<std::uint8_t*>(range_begin),
+                start - range_begin
+            );
+        }
+        if(start + size < range_end)
+        {
+            free_ranges.emplace(
+                reinterpret_cast<std::uint8_t*>(start + size),
+                range_end - start - size
+            );
+        }
+        used_size += size;
+        return reinterpret_cast<void*>(start);
+    }
+
+    std::uintptr_t start = align_up(reinterpret_cast<std::uintptr_t>(top), align);
+    if(start + size > reinterpret_cast<std::uintptr_t>(end))
+        return upstream->allocate(bytes, alignment);
+
+    // Nothing ends at top, so the skipped part doesn't need to be merged.
+    if(start > reinterpret_cast<std::uintptr_t>(top))
+        free_ranges.emplace(top, start - reinterpret_cast<std::uintptr_t>(top));
+    top = reinterpret_cast<std::uint8_t*>(start + size);
+    used_size += size;
+    return reinterpret_cast<void*>(start);
+}
+
+void huge_page_resource::do_deallocate(
+    void* p,
+    std::size_t bytes,
+    std::size_t alignment
+){
+    if(!owns(p))
+    {
+        upstream->deallocate(p, bytes, alignment);
+        return;
+    }
+
+    std::size_t size = round_size(bytes, alignment);
+    used_size -= size;
+    std::uint8_t* block_begin = static_cast<std::uint8_t*>(p);
+    std::uint8_t* block_end = block_begin + size;
+    std::uint8_t* range_begin = block_begin;
+    std::uint8_t* range_end = block_end;
+
+    auto next = free_ranges.lower_bound(block_begin);
+    if(next != free_ranges.end() && next->first == block_end)
+    {
+        range_end += next->second;
+        next = free_ranges.erase(next);
+    }
+    if(next != free_ranges.begin())
+    {
+        auto prev = std::prev(next);
+        if(prev->first + prev->second == block_begin)
+        {
+            range_begin = prev->first;
+            free_ranges.erase(prev);
+        }
+    }
+
+    // Only the huge pages that this block was the last used part of are
+    // discarded. Everything above top is free as well, and no whole huge page
+    // there is kept, so a range that reaches top also frees the huge page
+    // that top was in.
+    std::uintptr_t discard_begin = std::max(
+        align_up(reinterpret_cast<std::uintptr_t>(range_begin), huge_page_size),
+        align_down(reinterpret_cast<std::uintptr_t>(block_begin), huge_page_size)
+    );
+    std::uintptr_t discard_end = std::min(
+        align_down(reinterpret_cast<std::uintptr_t>(range_end), huge_page_size),
+        align_up(reinterpret_cast<std::uintptr_t>(block_end), huge_page_size)
+    );
+    if(range_end == top)
+    {
+        discard_end = std::min(
+            align_up(reinterpret_cast<std::uintptr_t>(top), huge_page_size),
+            reinterpret_cast<std::uintptr_t>(mapping + mapping_size)
+        );
+    }
+    if(discard_begin < discard_end)
+    {
+        madvise(
+            reinterpret_cast<void*>(discard_begin),
+            discard_end - discard_begin, MADV_DONTNEED
+        );
+    }
+
+    if(range_end == top)
+        top = range_begin;
+    else free_ranges.emplace(range_begin, range_end - range_begin);
+}
+
+bool huge_page_resource::do_is_equal(
+    const std::pmr::memory_resource& other
+) const noexcept
+{
+    return this == &other;
+}
+
+std::size_t huge_page_resource::round_size(
+    std::size_t bytes,
+    std::size_t alignment
+) const
+{
+    std::size_t align = std::max(alignment, page_size);
+    return (bytes + align - 1) / align * align;
+}
+
+bool huge_page_resource::owns(void* p) const
+{
+    return p >= begin && p < end;
+}
+
+std::uintptr_t huge_page_resource::align_up(
+    std::uintptr_t address,
+    std::size_t alignment
+){
+    return (address + alignment - 1) & ~(alignment - 1);
+}
+
+std::uintptr_t huge_page_resource::align_down(
+    std::uintptr_t address,
+    std::size_t alignment
+){
+    return address & ~(alignment - 1);
+}
+#endif
+
+}
+
+#endif
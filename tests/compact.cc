@@ -0,0 +1,213 @@
+#include "test.hh"
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct test_component_tag { test_component_tag(int = 123){} };
+struct test_component_normal { test_component_normal(int a = 123): a(a) {} int a; };
+struct test_component_owned
+{
+    test_component_owned(int a = 123): a(std::make_unique<int>(a)) {}
+    std::unique_ptr<int> a;
+};
+struct test_component_particle
+{
+    float x;
+    int y;
+
+    using soa_fields = monkero::soa_fields<
+        &test_component_particle::x,
+        &test_component_particle::y
+    >;
+};
+struct test_component_named { std::string name; };
+
+template<>
+class monkero::search_index<test_component_named>
+{
+public:
+    entity find(const std::string& name) const
+    {
+        auto it = name_to_id.find(name);
+        if(it == name_to_id.end())
+            return INVALID_ENTITY;
+        return it->second;
+    }
+
+    void add_entity(entity id, const test_component_named& data)
+    {
+        name_to_id[data.name] = id;
+    }
+
+    void remove_entity(entity, const test_component_named& data)
+    {
+        name_to_id.erase(data.name);
+    }
+
+    void update(scene&) {}
+
+private:
+    std::unordered_map<std::string, entity> name_to_id;
+};
+
+int main()
+{
+    scene e;
+    constexpr size_t N = 20000;
+    for(size_t i = 0; i < N; ++i)
+    {
+        entity id = e.add(test_component_normal(i));
+        if(i%3 == 0) e.attach(id, test_component_tag());
+        if(i%5 == 0) e.attach(id, test_component_owned(i));
+        if(i%7 == 0) e.attach(id, test_component_particle{float(i), int(i)});
+        if(i%11 == 0) e.attach(id, test_component_named{std::to_string(i)});
+    }
+    scene::query<test_component_normal, test_component_tag> q(e);
+
+    // Remove most entities at random, leaving them scattered.
+    std::mt19937 rng(0);
+    std::vector<entity> removed;
+    for(entity id = 1; id <= N; ++id)
+        if(rng()%8 != 0) removed.push_back(id);
+    e.remove(removed.data(), removed.size());
+    size_t live = N - removed.size();
+
+    compact_result res;
+    {
+        size_t renumber_events = 0;
+        entity_translation event_table;
+        event_subscription sub = e.subscribe(
+            [&](scene&, const renumber_entities& ev){
+                event_table = *ev.translation_table;
+                renumber_events++;
+            }
+        );
+        res = e.compact();
+        test(renumber_events == 1);
+        for(entity old_id = 0; old_id <= N+1; ++old_id)
+            test(event_table[old_id] == res.translation_table[old_id]);
+    }
+    test(res.translation_table[INVALID_ENTITY] == INVALID_ENTITY);
+    test(res.translation_table[N+1] == INVALID_ENTITY);
+    test(res.released_bytes > 0);
+
+    // Live entities are numbered densely, in their original order.
+    entity prev = INVALID_ENTITY;
+    size_t mapped = 0;
+    for(entity old_id = 1; old_id <= N; ++old_id)
+    {
+        entity new_id = res.translation_table[old_id];
+        if(new_id == INVALID_ENTITY)
+            continue;
+        test(new_id == prev + 1);
+        prev = new_id;
+        mapped++;
+
+        int i = old_id-1;
+        test(e.get<test_component_normal>(new_id)->a == i);
+        bool tagged = i%3 == 0, owned = i%5 == 0, particle = i%7 == 0;
+        test(e.has<test_component_tag>(new_id) == tagged);
+        test_component_owned* o = e.get<test_component_owned>(new_id);
+        test((o != nullptr) == owned);
+        if(o) test(*o->a == i);
+        auto p = e.get<test_component_particle>(new_id);
+        test(bool(p) == particle);
+        if(p)
+        {
+            test_component_particle v = p.load();
+            test(v.x == float(i) && v.y == i);
+        }
+        if(i%11 == 0)
+            test(e.find<test_component_named>(std::to_string(i)) == new_id);
+    }
+    test(mapped == live);
+    test(e.count<test_component_normal>() == live);
+
+    // Iteration sees exactly the new IDs.
+    size_t count = 0;
+    e.foreach([&](entity id, test_component_normal&){
+        count++;
+        test(id == count);
+    });
+    test(count == live);
+
+    // Queries follow the new IDs.
+    size_t query_count = 0;
+    q([&](entity id, test_component_normal& n, test_component_tag&){
+        test(e.get<test_component_normal>(id) == &n);
+        query_count++;
+    });
+    test(query_count == e.count<test_component_tag>());
+
+    // New entities continue right after the packed ones.
+    entity next = e.add(test_component_normal(-1));
+    test(next == live + 1);
+    entity_handle h = e.get_handle(next);
+    test(e.alive(h));
+
+    // Compacting again doesn't move anything, but still invalidates handles.
+    res = e.compact();
+    for(entity id = 1; id <= live+1; ++id)
+        test(res.translation_table[id] == id);
+    test(res.released_bytes == 0);
+    test(!e.alive(h));
+    test(e.alive(e.get_handle(next)));
+
+    // Pools keep their capacity and their live entities.
+    scene p;
+    p.add();
+    size_t pool = p.add_id_pool(100);
+    entity outside = p.add();
+    std::vector<entity> pooled;
+    for(int i = 0; i < 10; ++i)
+        pooled.push_back(p.add_in_pool(pool, test_component_normal(i)));
+    p.remove(1);
+    p.remove(pooled[2]);
+    p.remove(pooled[5]);
+    res = p.compact();
+    test(res.translation_table[outside] == 101);
+    entity first = res.translation_table[pooled[0]];
+    test(first == 1);
+    int expected = 0;
+    p.foreach([&](entity id, test_component_normal& n){
+        if(expected == 2 || expected == 5) expected++;
+        test(n.a == expected);
+        test(res.translation_table[pooled[expected]] == id);
+        expected++;
+    });
+    test(expected == 10);
+    entity pooled_id = p.add_in_pool(pool);
+    test(pooled_id == first + 8);
+    test(p.add() == 102);
+
+    // Nothing happens while batching.
+    p.start_batch();
+    test(p.compact().translation_table.empty());
+    p.finish_batch();
+
+    // An empty scene has nothing to move.
+    scene empty;
+    res = empty.compact();
+    test(res.translation_table.empty());
+    test(res.released_bytes == 0);
+    test(empty.add() == 1);
+
+    // The unused ends of huge pools are skipped, not walked through.
+    scene huge;
+    entity before = huge.add(test_component_normal(0));
+    size_t huge_pool = huge.add_id_pool(size_t(1) << 30);
+    entity in_huge = huge.add_in_pool(huge_pool, test_component_normal(1));
+    entity after = huge.add(test_component_normal(2));
+    test(after > (entity(1) << 30));
+    huge.remove(before);
+    res = huge.compact();
+    test(res.translation_table[in_huge] == 1);
+    test(res.translation_table[after] == (entity(1) << 30) + 1);
+    test(huge.get<test_component_normal>(1)->a == 1);
+    test(huge.get<test_component_normal>((entity(1) << 30) + 1)->a == 2);
+    test(huge.add() == (entity(1) << 30) + 2);
+    test(huge.add_in_pool(huge_pool) == 2);
+    return 0;
+}
@@ -1,6 +1,7 @@
 #include "test.hh"
 #include <random>
 #include <algorithm>
+#include <utility>
 
 struct test_component_tag { test_component_tag(int = 123){} };
 struct test_component_normal { test_component_normal(int a = 123): a(a) {} int a; };
@@ -21,6 +22,21 @@ struct test_component_dependency_normal:
     int a;
 };
 
+template<int I>
+struct test_component_filler { int a; };
+
+template<int... I>
+void attach_fillers(scene& e, entity id, std::integer_sequence<int, I...>)
+{
+    (e.attach(id, test_component_filler<I>{I}), ...);
+}
+
+template<int... I>
+size_t count_fillers(scene& e, std::integer_sequence<int, I...>)
+{
+    return (e.count<test_component_filler<I>>() + ...);
+}
+
 template<typename Component>
 void test_sum(scene& e, size_t expected)
 {
@@ -181,6 +197,189 @@ int main()
     run_tests<test_component_dependency_tag>(e);
     run_tests<test_component_dependency_normal>(e);
 
+    // Buckets released by clear_entities() should get recycled.
+    scene p;
+    p.set_bucket_pool_limit(1024);
+    for(int i = 0; i < 10000; ++i)
+        p.add(test_component_normal(i), test_component_tag());
+    p.clear_entities();
+    bucket_pool_stats before = p.get_bucket_pool_stats<test_component_normal>();
+    test(before.retained > 0);
+    test(before.deallocations == 0);
+    for(int i = 0; i < 10000; ++i)
+        p.add(test_component_normal(i), test_component_tag());
+    bucket_pool_stats after = p.get_bucket_pool_stats<test_component_normal>();
+    test(after.allocations == before.allocations);
+    test(after.reuses == before.retained);
+    test(p.get_bucket_pool_stats<test_component_tag>().allocations ==
+        p.get_bucket_pool_stats<test_component_tag>().reuses);
+
+    // Lowering the limit gives the blocks back.
+    p.clear_entities();
+    p.set_bucket_pool_limit(0);
+    after = p.get_bucket_pool_stats<test_component_normal>();
+    test(after.retained == 0);
+    test(after.deallocations == after.allocations);
+
+    // Bulk adds should be indistinguishable from adding one by one.
+    scene b;
+    for(int i = 0; i < 100; ++i)
+        b.add(test_component_normal(-1));
+    entity first = b.add_many<test_component_normal, test_component_tag>(
+        100000,
+        [](entity id){ return test_component_normal(id); },
+        [](entity){ return test_component_tag(); }
+    );
+    test(first == 101);
+    test(b.count<test_component_normal>() == 100100);
+    test(b.count<test_component_tag>() == 100000);
+    entity prev = INVALID_ENTITY;
+    size_t count = 0;
+    b.foreach([&](entity id, test_component_normal& n, test_component_tag&){
+        test(n.a == int(id));
+        test(id > prev);
+        prev = id;
+        count++;
+    });
+    test(count == 100000);
+
+    // Removal and regular adds must still work on top of bulk-added ranges.
+    for(entity id = first; id < first + 100000; id += 3)
+        b.remove(id);
+    entity last = b.add(test_component_normal(7), test_component_tag());
+    count = 0;
+    b.foreach([&](entity id, test_component_normal& n, test_component_tag&){
+        bool removed = id >= first && (id - first) % 3 == 0;
+        test(!removed || id == last);
+        test(n.a == int(id) || id == last);
+        count++;
+    });
+    test(count == 100000 - 33334 + 1);
+
+    // Dependencies and default construction
+    first = b.add_many<test_component_dependency_normal>(1000);
+    test(b.get<test_component_dependency_normal>(first)->a == 123);
+    test(b.has<test_component_tag>(first+999));
+    test(b.has<test_component_normal>(first+999));
+
+    // Bulk adds during batching
+    b.foreach([&](test_component_dependency_normal&){
+        b.add_many<test_component_tag>(10);
+    });
+    test(b.count<test_component_tag>() == 100000 - 33334 + 1 + 1000 + 10000);
+
+    // Bulk removal of a component type
+    size_t removed = 0;
+    auto sub = b.subscribe([&](scene&, const remove_component<test_component_normal>&){
+        removed++;
+    });
+    size_t normal_count = b.count<test_component_normal>();
+    b.remove_all<test_component_normal>();
+    test(removed == normal_count);
+    test(b.count<test_component_normal>() == 0);
+    test(b.count<test_component_tag>() > 0);
+    b.foreach([&](test_component_normal&){ test(false); });
+
+    // Bulk removal of entities, in scrambled order
+    scene r;
+    std::vector<entity> ids;
+    for(int i = 0; i < 10000; ++i)
+        ids.push_back(r.add(test_component_normal(i), test_component_tag()));
+    std::vector<entity> doomed;
+    for(size_t i = 0; i < ids.size(); i += 2)
+        doomed.push_back(ids[i]);
+    std::shuffle(doomed.begin(), doomed.end(), std::mt19937(1));
+    r.remove(doomed.data(), doomed.size());
+    test(r.count<test_component_normal>() == 5000);
+    test(r.count<test_component_tag>() == 5000);
+    count = 0;
+    r.foreach([&](entity id, test_component_normal& n, test_component_tag&){
+        test(n.a == int(id-1));
+        test((id & 1) == 0);
+        count++;
+    });
+    test(count == 5000);
+
+    // The IDs get reused.
+    for(size_t i = 0; i < doomed.size(); ++i)
+        test(r.add() <= ids.back());
+
+    // Emptied buckets are released and can be filled again.
+    std::vector<entity> rest;
+    r.foreach([&](entity id, test_component_normal&){ rest.push_back(id); });
+    std::reverse(rest.begin(), rest.end());
+    r.remove(rest.data(), rest.size());
+    test(r.count<test_component_normal>() == 0);
+    r.foreach([&](test_component_normal&){ test(false); });
+    entity refill = r.add(test_component_normal(7), test_component_tag());
+    count = 0;
+    r.foreach([&](entity id, test_component_normal& n, test_component_tag&){
+        test(id == refill && n.a == 7);
+        count++;
+    });
+    test(count == 1);
+
+    // Signatures list the component types of each entity.
+    scene g;
+    entity id_a = g.add(test_component_normal(1), test_component_tag());
+    entity id_b = g.add(test_component_normal(2));
+    entity id_c = g.add(test_component_tag(), test_component_normal(3));
+    test((g.get_signature(id_a).has<test_component_normal, test_component_tag>()));
+    test(!g.get_signature(id_b).has<test_component_tag>());
+    test((g.get_signature(id_b).has_any<test_component_tag, test_component_normal>()));
+    test(!g.get_signature(id_b).has_any<test_component_dependency_normal>());
+    test(g.get_signature(id_a).count() == 2);
+    test(g.get_signature(id_a) == g.get_signature(id_c));
+    test(g.get_signature(id_a) != g.get_signature(id_b));
+    test(g.get_signature(INVALID_ENTITY).count() == 0);
+    test(g.get_signature(12345).count() == 0);
+    g.remove<test_component_tag>(id_a);
+    test(g.get_signature(id_a) == g.get_signature(id_b));
+
+    // They follow batched changes immediately, like has() does.
+    g.foreach([&](entity id, test_component_normal&){
+        g.attach(id, test_component_dependency_normal(4));
+        test(g.get_signature(id).has<test_component_dependency_normal>());
+        if(id == id_b) g.remove<test_component_normal>(id);
+    });
+    test(!g.get_signature(id_b).has<test_component_normal>());
+    test(g.get_signature(id_b).count() == 2);
+
+    // Many component types widen the signatures without losing anything.
+    auto fillers = std::make_integer_sequence<int, 64>();
+    entity id_d = g.add();
+    attach_fillers(g, id_d, fillers);
+    test(g.get_signature(id_d).count() == 64);
+    test((g.get_signature(id_d).has<test_component_filler<0>, test_component_filler<63>>()));
+    test((g.get_signature(id_c).has<test_component_normal, test_component_tag>()));
+    test(!g.get_signature(id_c).has_any<test_component_filler<63>>());
+    g.remove(id_d);
+    test(count_fillers(g, fillers) == 0);
+    test(g.get_signature(id_d).count() == 0);
+
+    // Bulk removal clears the signatures too, also while batching.
+    entity bulk[] = {g.add(), g.add()};
+    attach_fillers(g, bulk[0], fillers);
+    g.attach(bulk[1], test_component_tag());
+    g.remove(bulk, 2);
+    test(g.get_signature(bulk[0]).count() == 0);
+    test(g.get_signature(bulk[1]).count() == 0);
+    bulk[0] = g.add(test_component_tag());
+    bulk[1] = g.add(test_component_tag());
+    g.start_batch();
+    g.remove(bulk, 2);
+    test(g.get_signature(bulk[0]).count() == 0);
+    test(!g.get_signature(bulk[1]).has<test_component_tag>());
+    g.finish_batch();
+    test(count_fillers(g, fillers) == 0);
+
+    // Removing a component type altogether clears it from every signature.
+    g.remove_all<test_component_normal>();
+    test(!g.get_signature(id_a).has<test_component_normal>());
+    test(g.get_signature(id_c).has<test_component_tag>());
+    g.clear_entities();
+    test(g.get_signature(id_c).count() == 0);
+
     return 0;
 }
 
@@ -0,0 +1,114 @@
+#include "test.hh"
+#include <chrono>
+#include <random>
+#include <vector>
+
+struct test_component_tag { test_component_tag(int = 123){} };
+struct test_component_normal { test_component_normal(int a = 123): a(a) {} int a; };
+
+int main()
+{
+    scene e;
+    constexpr size_t N = 10000;
+    for(size_t i = 0; i < N; ++i)
+    {
+        entity id = e.add(test_component_normal(i));
+        if(i%4 == 0) e.attach(id, test_component_tag());
+    }
+
+    // Slices cover everything exactly once, in order.
+    scene::cursor c(e);
+    test(c.get_position() == INVALID_ENTITY);
+    std::vector<entity> visited;
+    size_t calls = 0;
+    bool done = false;
+    while(!done)
+    {
+        done = c.foreach([&](entity id, test_component_normal& n){
+            test(n.a == int(id-1));
+            visited.push_back(id);
+        }, 333);
+        test(done || visited.size() == 333 * (calls+1));
+        calls++;
+    }
+    test(visited.size() == N);
+    test(calls == (N+332)/333);
+    for(size_t i = 0; i < N; ++i)
+        test(visited[i] == entity(i+1));
+    test(c.get_position() == INVALID_ENTITY);
+
+    // Joins and id-less callbacks work the same way.
+    size_t count = 0;
+    while(!c.foreach([&](test_component_normal&, test_component_tag&){ count++; }, 100));
+    test(count == N/4);
+
+    // Entities may be added and removed between slices.
+    std::mt19937 rng(0);
+    std::vector<int> seen(2*N+1, 0);
+    std::vector<bool> removed(2*N+1, false);
+    std::vector<bool> late(2*N+1, false);
+    done = false;
+    while(!done)
+    {
+        done = c.foreach([&](entity id, test_component_normal&){
+            seen[id]++;
+        }, 500);
+        entity position = c.get_position();
+        for(int i = 0; i < 20; ++i)
+        {
+            entity id = 1 + rng()%N;
+            if(!removed[id] && !seen[id])
+            {
+                e.remove(id);
+                removed[id] = true;
+            }
+        }
+        for(int i = 0; i < 10; ++i)
+        {
+            entity id = e.add(test_component_normal(0));
+            removed[id] = false;
+            // Added behind the cursor, so it can't be visited in this pass.
+            if(!done && position != INVALID_ENTITY && id < position)
+                late[id] = true;
+        }
+    }
+    for(entity id = 1; id < seen.size(); ++id)
+    {
+        test(seen[id] <= 1);
+        if(late[id]) test(seen[id] == 0);
+        if(removed[id]) test(seen[id] == 0);
+    }
+
+    // Components can be modified during a slice, batching still applies.
+    c.reset();
+    size_t before = e.count<test_component_tag>();
+    c.foreach([&](entity id, test_component_tag&){
+        e.remove<test_component_tag>(id);
+    }, 10);
+    test(e.count<test_component_tag>() == before - 10);
+
+    // Breaking ends the slice after the current entity.
+    c.reset();
+    entity last = INVALID_ENTITY;
+    test(!c.foreach([&](entity id, test_component_normal&){
+        last = id;
+        return id >= 100 ? iteration_control::BREAK : iteration_control::CONTINUE;
+    }, N));
+    test(c.get_position() == last + 1);
+
+    // Time budgets
+    c.reset();
+    count = 0;
+    test(!c.foreach([&](test_component_normal&){ count++; }, std::chrono::seconds(0)));
+    test(count == 1);
+    count = 0;
+    test(c.foreach([&](test_component_normal&){ count++; }, std::chrono::hours(1)));
+    test(count == e.count<test_component_normal>() - 1);
+
+    // Nothing to visit at all
+    scene empty;
+    scene::cursor ec(empty);
+    test(ec.foreach([&](test_component_normal&){ test(false); }, 10));
+    test(!ec.foreach([&](test_component_normal&){ test(false); }, 0));
+    return 0;
+}
@@ -1,7 +1,136 @@
 #include "test.hh"
 
+struct test_component_normal { test_component_normal(int a = 123): a(a) {} int a; };
+struct test_component_tag {};
+
 int main()
 {
+    // Handles of removed entities go stale, even when the ID is reused.
+    {
+        scene s;
+        entity a = s.add(test_component_normal(1));
+        entity b = s.add();
+        entity_handle ha = s.get_handle(a);
+        entity_handle hb = s.get_handle(b);
+        test(s.alive(ha) && s.alive(hb));
+        test(ha != hb);
+        test(!s.alive(entity_handle{}));
+        test(!s.alive(entity_handle{b+1, hb.generation}));
+
+        s.remove(a);
+        test(!s.alive(ha) && s.alive(hb));
+        entity c = s.add();
+        test(c == a);
+        entity_handle hc = s.get_handle(c);
+        test(s.alive(hc) && !s.alive(ha) && hc != ha);
+
+        // Also during batching and for bulk removal
+        s.start_batch();
+        s.remove(b);
+        test(!s.alive(hb));
+        s.finish_batch();
+        entity ids[] = {c, s.add()};
+        entity_handle hd = s.get_handle(ids[1]);
+        s.remove(ids, 2);
+        test(!s.alive(hc) && !s.alive(hd));
+
+        // Generations only move for IDs that had handles, but that doesn't
+        // show.
+        entity plain = s.add();
+        s.remove(plain);
+        test(s.add() == plain);
+        entity_handle hp = s.get_handle(plain);
+        test(s.get_handle(plain) == hp && s.alive(hp));
+        s.remove(plain);
+        test(s.add() == plain);
+        test(!s.alive(hp) && s.alive(s.get_handle(plain)));
+        test(s.get_handle(plain) != hp);
+        s.remove(plain);
+
+        // Clearing makes all existing handles stale, including ones that
+        // were never removed before.
+        entity_handle old[10];
+        for(entity_handle& h: old)
+            h = s.get_handle(s.add());
+        s.remove(old[3].id);
+        s.clear_entities();
+        for(int i = 0; i < 10; ++i)
+        {
+            entity_handle h = s.get_handle(s.add());
+            test(s.alive(h));
+            for(const entity_handle& o: old)
+                test(!s.alive(o) && o != h);
+        }
+    }
+
+    // Lowest released IDs first
+    {
+        scene s;
+        entity ids[100];
+        for(entity& id: ids)
+            id = s.add();
+        s.remove(ids[50]);
+        s.remove(ids[20]);
+        s.set_id_policy(id_policy::REUSE_LOWEST);
+        s.remove(ids[70]);
+        s.remove(ids[10]);
+        test(s.add() == ids[10]);
+        test(s.add() == ids[20]);
+
+        s.start_batch();
+        s.remove(ids[5]);
+        s.remove(ids[90]);
+        s.finish_batch();
+        entity bulk[] = {ids[60], ids[2]};
+        s.remove(bulk, 2);
+        entity expected[] = {ids[2], ids[5], ids[50], ids[60], ids[70], ids[90]};
+        for(entity id: expected)
+            test(s.add() == id);
+        test(s.add() == 101);
+
+        s.set_id_policy(id_policy::REUSE_LATEST);
+        s.remove(ids[3]);
+        s.remove(ids[4]);
+        test(s.add() == ids[4]);
+    }
+
+    // ID pools
+    {
+        scene s;
+        entity a = s.add();
+        size_t p0 = s.add_id_pool(100);
+        size_t p1 = s.add_id_pool(10);
+        test(s.add() == a + 111);
+        test(s.add_in_pool(p0) == a + 1);
+        entity in_pool = s.add_in_pool(p0, test_component_normal(5));
+        test(in_pool == a + 2);
+        test(s.get<test_component_normal>(in_pool)->a == 5);
+
+        entity pooled[10];
+        for(entity& id: pooled)
+        {
+            id = s.add_in_pool(p1);
+            test(id > a + 100 && id <= a + 110);
+        }
+        test(s.add_in_pool(p1) == INVALID_ENTITY);
+
+        // Released IDs stay in their own pool.
+        s.remove(pooled[4]);
+        s.remove(in_pool);
+        test(s.add() == a + 112);
+        test(s.add_in_pool(p1) == pooled[4]);
+        test(s.add_in_pool(p1) == INVALID_ENTITY);
+        test(s.add_in_pool(p0) == in_pool);
+
+        // Pools get their ranges back after clearing.
+        s.clear_entities();
+        test(s.add_in_pool(p1) == 101);
+        test(s.add_in_pool(p0) == 1);
+        test(s.add() == 111);
+    }
+
+#ifndef MONKERO_64BIT_ENTITIES
+    // There's no running out of 64-bit IDs in a test.
     scene e;
 
     // Add so many entities that we reach the error state
@@ -26,6 +155,45 @@ int main()
     }
 
     e.clear_entities();
+#else
+    // IDs past 32 bits work the same, they're reached by reserving a huge pool
+    // first.
+    scene e;
+    size_t pool = e.add_id_pool(size_t(1) << 33);
+    entity first = e.add(test_component_normal(0));
+    test(first == (entity(1) << 33) + 1);
+    for(int i = 1; i < 1000; ++i)
+    {
+        entity id = e.add(test_component_normal(i));
+        if(i%3 == 0) e.attach(id, test_component_tag());
+    }
+    test(e.add_in_pool(pool) == 1);
+
+    size_t count = 0;
+    e.foreach([&](entity id, test_component_normal& n){
+        test(id == first + n.a);
+        count++;
+    });
+    test(count == 1000);
+    count = 0;
+    e.foreach([&](entity id, test_component_normal&, test_component_tag&){
+        bool tagged = (id - first) % 3 == 0;
+        test(tagged);
+        count++;
+    });
+    test(count == 333);
+
+    e.remove<test_component_normal>(first + 3);
+    test(!e.has<test_component_normal>(first + 3));
+    test(e.get_signature(first + 3).has<test_component_tag>());
+    test(e.get_signature(first + 6).count() == 2);
+    test(e.find_if([&](entity id, test_component_normal&){
+        return id > first + 500;
+    }) == first + 501);
+    e.remove(first + 6);
+    test(!e.has<test_component_tag>(first + 6));
+    test(e.count<test_component_normal>() == 998);
+#endif
 
     return 0;
 }
@@ -7,6 +7,11 @@
 struct test_component_tag { test_component_tag(int = 123){} };
 struct test_component_normal { test_component_normal(int a = 123): a(a) {} int a; };
 struct test_component_ptr { test_component_ptr(int a = 123): a(a) {} int a; };
+struct test_component_small_bucket
+{
+    static constexpr std::uint32_t bucket_exp_hint = 3;
+    int a;
+};
 
 int main()
 {
@@ -159,6 +164,69 @@ int main()
     });
     test(iter_count == tag_ids.size());
 
+    // Test chunk iteration
+    iter_count = 0;
+    normal_sum = 0;
+    entity prev_end = INVALID_ENTITY;
+    e.foreach_chunk([&](entity first, size_t count, test_component_normal* n){
+        test(count > 0);
+        // Adjacent runs are only split at bucket boundaries.
+        test(first != prev_end || (first & ((1u<<component_bucket_exp_hint<test_component_normal>::value)-1)) == 0);
+        for(size_t i = 0; i < count; ++i)
+        {
+            test(&n[i] == e.get<test_component_normal>(first+i));
+            normal_sum += n[i].a;
+        }
+        iter_count += count;
+        prev_end = first + count;
+    });
+    test(iter_count == normal_ids.size());
+    test(normal_sum == real_normal_sum);
+
+    iter_count = 0;
+    and_sum = 0;
+    e.foreach_chunk([&](
+        entity first,
+        size_t count,
+        const test_component_tag*,
+        test_component_normal* n,
+        test_component_ptr* p
+    ){
+        for(size_t i = 0; i < count; ++i)
+        {
+            test(tag_ids.count(first+i) != 0);
+            test(&n[i] == e.get<test_component_normal>(first+i));
+            test(&p[i] == e.get<test_component_ptr>(first+i));
+            and_sum += (n[i].a+p[i].a)/2;
+        }
+        iter_count += count;
+    });
+    test(iter_count == all_count);
+    test(and_sum == real_and_sum);
+
+    // Runs must be split at bucket boundaries, also when buckets are smaller
+    // than a bitmask word.
+    {
+        scene s;
+        for(int i = 0; i < 1000; ++i)
+            s.add(test_component_small_bucket{i}, test_component_normal(i));
+        s.remove<test_component_normal>(500);
+        iter_count = 0;
+        s.foreach_chunk([&](
+            entity first,
+            size_t count,
+            test_component_small_bucket* sb,
+            test_component_normal* n
+        ){
+            test(first != 500);
+            test((first >> 3) == ((first + count - 1) >> 3));
+            for(size_t i = 0; i < count; ++i)
+                test(sb[i].a == n[i].a && entity(n[i].a) == first+i-1);
+            iter_count += count;
+        });
+        test(iter_count == 999);
+    }
+
     // Remove during iteration
     e.foreach([&](
         entity id,
@@ -241,7 +309,394 @@ int main()
     });
     test(or_sum == real_or_sum);
 
-    return 0;
-}
+    // Small and large batches are applied differently, both must end up with
+    // the same result.
+    for(size_t changes: {100, 20000})
+    {
+        scene s;
+        std::vector<bool> present(N/10, false);
+        for(size_t i = 0; i < N/10; ++i)
+        {
+            entity id = s.add();
+            if(rand()%2)
+            {
+                s.attach(id, test_component_normal(id), test_component_small_bucket{int(id)});
+                present[i] = true;
+            }
+        }
+        s.start_batch();
+        for(size_t i = 0; i < changes; ++i)
+        {
+            entity id = 1 + rand()%(N/10);
+            if(present[id-1])
+            {
+                s.remove<test_component_normal>(id);
+                s.remove<test_component_small_bucket>(id);
+            }
+            else s.attach(id, test_component_normal(id), test_component_small_bucket{int(id)});
+            present[id-1] = !present[id-1];
+        }
+        s.finish_batch();
+
+        entity prev = INVALID_ENTITY;
+        size_t count = 0;
+        s.foreach([&](entity id, test_component_normal& n, test_component_small_bucket& b){
+            test(id > prev && present[id-1]);
+            test(n.a == int(id) && b.a == int(id));
+            prev = id;
+            count++;
+        });
+        test(count == size_t(std::count(present.begin(), present.end(), true)));
+
+        // The jump tables must still work for further modifications.
+        for(size_t i = 0; i < N/10; i += 7)
+        {
+            if(present[i]) s.remove<test_component_normal>(i+1);
+            else s.attach(i+1, test_component_normal(i+1));
+            present[i] = !present[i];
+        }
+        prev = INVALID_ENTITY;
+        count = 0;
+        s.foreach([&](entity id, test_component_normal&){
+            test(id > prev && present[id-1]);
+            prev = id;
+            count++;
+        });
+        test(count == size_t(std::count(present.begin(), present.end(), true)));
+    }
+
+    // Containers only join a batch once they get modified, iteration must not
+    // see the modifications of either kind before the batch is finished.
+    {
+        scene s;
+        for(size_t i = 0; i < 1000; ++i)
+        {
+            entity id = s.add(test_component_normal(i));
+            if(i%2 == 0) s.attach(id, test_component_ptr(i));
+            if(i%5 == 0) s.attach(id, test_component_tag());
+        }
+        size_t count = 0;
+        size_t removed = 0;
+        s.foreach([&](entity id, test_component_normal&){
+            // Modified containers still show their pre-batch state, untouched
+            // ones aren't batching at all.
+            if(count == 500)
+            {
+                size_t inner = 0;
+                s.foreach([&](test_component_tag&){ inner++; });
+                test(inner == 200);
+                inner = 0;
+                s.foreach([&](test_component_ptr&){ inner++; });
+                test(inner == 500);
+                inner = 0;
+                s.foreach([&](test_component_small_bucket&){ inner++; });
+                test(inner == 0);
+            }
+            s.attach(id, test_component_small_bucket{int(id)});
+            if(s.get<test_component_ptr>(id) && id%3 == 0)
+            {
+                s.remove<test_component_ptr>(id);
+                removed++;
+            }
+            count++;
+        });
+        test(count == 1000);
+        test(s.count<test_component_small_bucket>() == 1000);
+        test(s.count<test_component_ptr>() == 500 - removed);
+        count = 0;
+        s.foreach([&](entity id, test_component_small_bucket& b, test_component_tag&){
+            test(b.a == int(id));
+            count++;
+        });
+        test(count == 200);
+    }
+
+    // Joins must agree with a plain lookup both when the rarest required
+    // component is dense and when it is sparse. In the last case, both
+    // required components are sparse and mostly in different blocks of IDs,
+    // so the join has to leapfrog over long gaps.
+    for(int sparse = 0; sparse <= 2; ++sparse)
+    {
+        scene s;
+        constexpr size_t N = 100000;
+        std::mt19937 rng(sparse);
+        for(size_t i = 0; i < N; ++i)
+        {
+            entity id = s.add();
+            bool block = (i / 3000)%2;
+            if(sparse == 2)
+            {
+                bool both = i%997 == 0;
+                if(both || rng()%(block ? 100 : 5000) == 0) s.attach(id, test_component_tag());
+                if(both || rng()%(block ? 5000 : 100) == 0) s.attach(id, test_component_normal(id));
+            }
+            else
+            {
+                if(rng()%(sparse ? 500 : 3) == 0) s.attach(id, test_component_tag());
+                if(rng()%2 == 0) s.attach(id, test_component_normal(id));
+            }
+            if(rng()%4 == 0) s.attach(id, test_component_small_bucket{int(id)});
+        }
 
+        size_t expected = 0;
+        size_t expected_any = 0;
+        for(entity id = 1; id <= N; ++id)
+        {
+            bool tag = s.has<test_component_tag>(id);
+            bool normal = s.has<test_component_normal>(id);
+            bool small = s.has<test_component_small_bucket>(id);
+            if(tag && normal) expected++;
+            if(tag || small) expected_any++;
+        }
+
+        entity prev = INVALID_ENTITY;
+        size_t count = 0;
+        s.foreach([&](
+            entity id,
+            test_component_tag&,
+            test_component_normal& n,
+            test_component_small_bucket* b
+        ){
+            test(id > prev);
+            test(n.a == int(id));
+            test(b == s.get<test_component_small_bucket>(id));
+            prev = id;
+            count++;
+        });
+        test(count == expected);
+
+        prev = INVALID_ENTITY;
+        count = 0;
+        s.foreach([&](
+            entity id,
+            test_component_tag* t,
+            test_component_small_bucket* b
+        ){
+            test(id > prev);
+            test(t || b);
+            test((t != nullptr) == s.has<test_component_tag>(id));
+            test(!b || b->a == int(id));
+            prev = id;
+            count++;
+        });
+        test(count == expected_any);
+    }
+
+    // Exclusion
+    {
+        scene s;
+        constexpr size_t N = 10000;
+        for(size_t i = 0; i < N; ++i)
+        {
+            entity id = s.add();
+            s.attach(id, test_component_normal(id));
+            if(i%3 == 0) s.attach(id, test_component_tag());
+            if(i%5 == 0) s.attach(id, test_component_small_bucket{int(id)});
+        }
+
+        size_t count = 0;
+        s.foreach([&](entity id, test_component_normal&, without<test_component_tag>){
+            test(!s.has<test_component_tag>(id));
+            count++;
+        });
+        test(count == N - (N+2)/3);
+
+        count = 0;
+        s.foreach([&](
+            test_component_normal& n,
+            test_component_small_bucket* b,
+            without<test_component_tag>
+        ){
+            test(!s.has<test_component_tag>(n.a));
+            test(!b || b->a == n.a);
+            count++;
+        });
+        test(count == N - (N+2)/3);
+
+        // All optional: only entities without tags but with one of the others.
+        count = 0;
+        s.foreach([&](
+            entity id,
+            test_component_small_bucket* b,
+            without<test_component_tag>
+        ){
+            test(b && !s.has<test_component_tag>(id));
+            count++;
+        });
+        test(count == (N+4)/5 - (N+14)/15);
+
+        // Removing the excluded component during iteration doesn't make the
+        // entity visible until the next foreach.
+        count = 0;
+        s.foreach([&](entity id, test_component_normal&, test_component_tag&){
+            s.remove<test_component_tag>(id);
+            count++;
+        });
+        test(count == (N+2)/3);
+        count = 0;
+        s.foreach([&](test_component_normal&, without<test_component_tag>){
+            count++;
+        });
+        test(count == N);
+    }
+
+    // Read-only iteration
+    {
+        scene s;
+        constexpr size_t N = 10000;
+        size_t normal_sum = 0;
+        for(size_t i = 0; i < N; ++i)
+        {
+            entity id = s.add(test_component_normal(i));
+            normal_sum += i;
+            if(i%3 == 0) s.attach(id, test_component_tag());
+        }
+
+        const scene& cs = s;
+        size_t count = 0;
+        size_t sum = 0;
+        cs.foreach([&](entity id, const test_component_normal& n){
+            test(id == entity(n.a+1));
+            sum += n.a;
+            count++;
+        });
+        test(count == N && sum == normal_sum);
+
+        count = 0;
+        cs([&](const test_component_normal&, const test_component_tag*, without<test_component_tag>){
+            count++;
+        });
+        test(count == N - (N+2)/3);
+
+        // Never added component types count as empty.
+        count = 0;
+        cs.foreach([&](const test_component_normal&, const test_component_ptr* p){
+            test(!p);
+            count++;
+        });
+        test(count == N);
+        cs.foreach([&](const test_component_ptr&){ test(false); });
+        cs.foreach([&](const test_component_tag&, const test_component_ptr&){ test(false); });
 
+        // Works inside a batch, seeing the state that is being iterated.
+        count = 0;
+        s.foreach([&](entity id, test_component_tag&){
+            s.remove<test_component_tag>(id);
+            cs.foreach([&](const test_component_tag&){ count++; });
+        });
+        test(count == ((N+2)/3) * ((N+2)/3));
+        count = 0;
+        cs.foreach([&](const test_component_tag&){ count++; });
+        test(count == 0);
+    }
+
+    // Ranges
+    {
+        scene s;
+        constexpr size_t N = 20000;
+        for(size_t i = 0; i < N; ++i)
+        {
+            entity id = s.add();
+            if(i%2 == 0) s.attach(id, test_component_normal(id));
+            if(i%3 == 0) s.attach(id, test_component_tag());
+        }
+
+        std::mt19937 rng(1);
+        for(int i = 0; i < 100; ++i)
+        {
+            entity begin = rng()%(N+10);
+            entity end = begin + rng()%1000;
+            size_t single = 0, joined = 0, optional = 0;
+            for(entity id = std::max(begin, entity(1)); id < end && id <= N; ++id)
+            {
+                bool normal = (id-1)%2 == 0;
+                bool tag = (id-1)%3 == 0;
+                single += normal;
+                joined += normal && tag;
+                optional += normal || tag;
+            }
+
+            size_t count = 0;
+            s.foreach_range(begin, end, [&](entity id, test_component_normal& n){
+                test(id >= begin && id < end && n.a == int(id));
+                count++;
+            });
+            test(count == single);
+
+            count = 0;
+            s.foreach_range(begin, end, [&](entity id, test_component_normal&, test_component_tag&){
+                test(id >= begin && id < end);
+                count++;
+            });
+            test(count == joined);
+
+            count = 0;
+            const scene& cs = s;
+            cs.foreach_range(begin, end, [&](entity id, const test_component_normal*, const test_component_tag*){
+                test(id >= begin && id < end);
+                count++;
+            });
+            test(count == optional);
+        }
+
+        // Consecutive ranges cover everything exactly once, and the last one
+        // can be unbounded.
+        size_t count = 0;
+        entity prev = INVALID_ENTITY;
+        for(entity begin = 0; begin < N; begin += 777)
+        {
+            entity end = begin + 777 >= N ? INVALID_ENTITY : begin + 777;
+            s.foreach_range(begin, end, [&](entity id, test_component_normal&){
+                test(id > prev);
+                prev = id;
+                count++;
+            });
+        }
+        test(count == N/2);
+    }
+
+    // Early exit
+    {
+        scene s;
+        constexpr size_t N = 20000;
+        for(size_t i = 0; i < N; ++i)
+        {
+            entity id = s.add(test_component_normal(i));
+            if(i%3 == 0) s.attach(id, test_component_tag());
+        }
+
+        size_t count = 0;
+        s.foreach([&](test_component_normal& n){
+            count++;
+            return n.a == 99 ? iteration_control::BREAK : iteration_control::CONTINUE;
+        });
+        test(count == 100);
+
+        // Changes made before stopping still get applied.
+        count = 0;
+        s.foreach([&](entity id, test_component_normal&, test_component_tag*){
+            s.remove<test_component_normal>(id);
+            return ++count == 10 ? iteration_control::BREAK : iteration_control::CONTINUE;
+        });
+        test(count == 10);
+        test(s.count<test_component_normal>() == N - 10);
+        test(!s.get<test_component_normal>(10) && s.get<test_component_normal>(11));
+
+        // Entities 1-10 no longer have a normal component.
+        entity found = s.find_if([](test_component_normal& n){ return n.a%3 == 0; });
+        test(found == 13);
+        test(s.find_if([](entity id, test_component_normal&, test_component_tag&){
+            return id > 5000;
+        }) == 5002);
+        test(s.find_if([](test_component_normal&, without<test_component_tag>){
+            return true;
+        }) == 11);
+        test(s.find_if([](test_component_normal& n){ return n.a < 0; }) == INVALID_ENTITY);
+        test(s.find_if([](test_component_ptr&){ return true; }) == INVALID_ENTITY);
+
+        const scene& cs = s;
+        test(cs.find_if([](const test_component_normal& n){ return n.a == 1000; }) == 1001);
+    }
+
+    return 0;
+}
@@ -0,0 +1,173 @@
+#include "test.hh"
+#include <memory_resource>
+#ifdef __linux__
+#include <cstring>
+#include <vector>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Counts the bytes of [p, p+size) that are backed by physical memory.
+size_t resident_size(void* p, size_t size)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    std::vector<unsigned char> pages((size + page_size - 1) / page_size);
+    if(mincore(p, size, pages.data()) != 0)
+        return 0;
+    size_t resident = 0;
+    for(unsigned char page: pages)
+        if(page & 1) resident += page_size;
+    return resident;
+}
+#endif
+
+struct test_component_tag { test_component_tag(int = 123){} };
+struct test_component_normal { test_component_normal(int a = 123): a(a) {} int a; };
+struct alignas(64) test_component_aligned { int a = 0; };
+
+class counting_resource: public std::pmr::memory_resource
+{
+public:
+    size_t allocated = 0;
+    size_t allocations = 0;
+    size_t deallocations = 0;
+
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override
+    {
+        allocated += bytes;
+        allocations++;
+        return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override
+    {
+        test(allocated >= bytes);
+        allocated -= bytes;
+        deallocations++;
+        std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        return this == &other;
+    }
+};
+
+int main()
+{
+    counting_resource res;
+    {
+        scene e(&res);
+        test(e.get_memory_resource() == &res);
+
+        constexpr int N = 100000;
+        for(int batching = 0; batching <= 1; ++batching)
+        {
+            if(batching) e.start_batch();
+            std::vector<entity> ids;
+            for(int i = 0; i < N; ++i)
+            {
+                ids.push_back(e.add(test_component_normal(i)));
+                if(i%3 == 0) e.attach(ids.back(), test_component_tag());
+                if(i%7 == 0) e.attach(ids.back(), test_component_aligned());
+            }
+            if(batching) e.finish_batch();
+            test(res.allocated > 0);
+
+            e.foreach([&](test_component_aligned& a){
+                test((reinterpret_cast<uintptr_t>(&a) & 63) == 0);
+            });
+
+            for(int i = 0; i < N; i += 2)
+                e.remove(ids[i]);
+            e.clear_entities();
+        }
+    }
+    // Everything must have been returned to the resource.
+    test(res.allocated == 0);
+    test(res.allocations == res.deallocations);
+    test(res.allocations > 0);
+
+#ifdef __linux__
+    // Buckets on huge pages
+    {
+        huge_page_resource pages(std::size_t(1) << 30, &res);
+        {
+            scene e(&pages);
+            constexpr int N = 100000;
+            for(int i = 0; i < N; ++i)
+                e.add(test_component_normal(i), test_component_aligned());
+            test(pages.get_used_size() > 0);
+
+            size_t count = 0;
+            e.foreach([&](entity id, test_component_normal& n, test_component_aligned& a){
+                test(n.a == int(id-1));
+                test((reinterpret_cast<uintptr_t>(&a) & 63) == 0);
+                count++;
+            });
+            test(count == N);
+
+            // Released blocks get recycled.
+            e.clear_entities();
+            test(pages.get_used_size() == 0);
+            for(int i = 0; i < N; ++i)
+                e.add(test_component_normal(i));
+            test(pages.get_used_size() > 0);
+        }
+        test(pages.get_used_size() == 0);
+    }
+
+    // Released ranges are merged, so that they can be reused for any size.
+    {
+        huge_page_resource pages(std::size_t(1) << 30, &res);
+        constexpr size_t block = size_t(1) << 16;
+        void* a = pages.allocate(block);
+        void* b = pages.allocate(3 * block);
+        void* c = pages.allocate(block);
+        pages.deallocate(b, 3 * block);
+        pages.deallocate(a, block);
+        void* d = pages.allocate(4 * block);
+        test(d == a);
+        void* e = pages.allocate(block);
+        test(static_cast<char*>(e) == static_cast<char*>(c) + block);
+
+        pages.deallocate(c, block);
+        pages.deallocate(d, 4 * block);
+        pages.deallocate(e, block);
+        test(pages.get_used_size() == 0);
+        void* f = pages.allocate(6 * block);
+        test(f == a);
+        pages.deallocate(f, 6 * block);
+    }
+
+    // Memory is given back to the kernel in whichever order it's freed,
+    // newest first too.
+    {
+        huge_page_resource pages(std::size_t(1) << 30, &res);
+        constexpr size_t block = size_t(256) << 10;
+        constexpr size_t count = 25;
+        char* blocks[count];
+        for(char*& b: blocks)
+        {
+            b = static_cast<char*>(pages.allocate(block));
+            memset(b, 1, block);
+        }
+        char* first = blocks[0];
+        test(resident_size(first, count * block) == count * block);
+
+        // The huge page that is still partly used stays, the rest go.
+        for(size_t i = count; i-- > 1;)
+            pages.deallocate(blocks[i], block);
+        size_t huge = size_t(2) << 20;
+        test(resident_size(first, block) == block);
+        test(resident_size(first + huge, count * block - huge) == 0);
+
+        pages.deallocate(blocks[0], block);
+        test(pages.get_used_size() == 0);
+        test(resident_size(first, count * block) == 0);
+    }
+    test(res.allocated == 0);
+#endif
+
+    return 0;
+}
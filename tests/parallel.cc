@@ -0,0 +1,190 @@
+#include "test.hh"
+#include <atomic>
+#include <thread>
+#include <cstdlib>
+#include <mutex>
+#include <unordered_set>
+#include <vector>
+#if defined(__linux__) && !defined(NDEBUG)
+#include <csignal>
+#include <cstdio>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+struct test_component_tag { test_component_tag(int = 123){} };
+struct test_component_normal { test_component_normal(int a = 123): a(a) {} int a; };
+struct test_component_ptr { test_component_ptr(int a = 123): a(a) {} int a; };
+
+int main()
+{
+    scene e;
+
+    constexpr size_t N = 1000000;
+    std::unordered_set<entity> normal_ids;
+    size_t real_normal_sum = 0;
+    size_t real_and_sum = 0;
+    size_t and_count = 0;
+    size_t any_count = 0;
+    size_t untagged_count = 0;
+    for(size_t i = 0; i < N; ++i)
+    {
+        entity id = e.add();
+        bool tag = false, normal = false, ptr = false;
+        if((rand()%3) == 0)
+        {
+            e.attach(id, test_component_tag{});
+            tag = true;
+        }
+        if((rand()%4) == 0)
+        {
+            e.attach(id, test_component_normal(i));
+            normal_ids.insert(id);
+            real_normal_sum += i;
+            normal = true;
+        }
+        if((rand()%5) == 0)
+        {
+            e.attach(id, test_component_ptr(i));
+            ptr = true;
+        }
+        if(tag && normal)
+        {
+            real_and_sum += i;
+            and_count++;
+        }
+        if(tag || normal || ptr)
+            any_count++;
+        if(normal && !tag)
+            untagged_count++;
+    }
+
+    for(unsigned threads = 1; threads <= 8; threads *= 2)
+    {
+        // Single component
+        std::atomic<size_t> iter_count(0);
+        std::atomic<size_t> normal_sum(0);
+        e.parallel_foreach([&](entity id, test_component_normal& n){
+            test(id == entity(n.a+1));
+            iter_count++;
+            normal_sum += n.a;
+        }, threads);
+        test(iter_count == normal_ids.size());
+        test(normal_sum == real_normal_sum);
+
+        // Required & optional
+        iter_count = 0;
+        std::atomic<size_t> and_sum(0);
+        e.parallel_foreach([&](
+            entity id,
+            test_component_tag&,
+            test_component_normal& n,
+            test_component_ptr* p
+        ){
+            test(!p || p->a == n.a);
+            test(id == entity(n.a+1));
+            iter_count++;
+            and_sum += n.a;
+        }, threads);
+        test(iter_count == and_count);
+        test(and_sum == real_and_sum);
+
+        // All optional
+        iter_count = 0;
+        e.parallel_foreach([&](
+            test_component_tag* t,
+            test_component_normal* n,
+            test_component_ptr* p
+        ){
+            test(t || n || p);
+            iter_count++;
+        }, threads);
+        test(iter_count == any_count);
+
+        // Exclusion
+        iter_count = 0;
+        e.parallel_foreach([&](test_component_normal&, without<test_component_tag>){
+            iter_count++;
+        }, threads);
+        test(iter_count == untagged_count);
+    }
+
+    // Stopping early skips at least some of the work.
+    {
+        std::atomic<size_t> iter_count(0);
+        e.parallel_foreach([&](test_component_normal&){
+            iter_count++;
+            return iteration_control::BREAK;
+        }, 4);
+        test(iter_count >= 1 && iter_count <= 4);
+    }
+
+    // Modifying components in-place from multiple threads is fine.
+    e.parallel_foreach([&](test_component_normal& n){ n.a = 1; });
+    size_t count = 0;
+    e.foreach([&](test_component_normal& n){ count += n.a; });
+    test(count == normal_ids.size());
+
+    // Adding and removing must wait until the threads are done, even with a
+    // lock. Debug builds catch it.
+    {
+        std::mutex m;
+        std::vector<entity> untagged;
+        e.parallel_foreach([&](entity id, test_component_normal&, without<test_component_tag>){
+            std::lock_guard<std::mutex> lock(m);
+            untagged.push_back(id);
+        });
+        test(untagged.size() == untagged_count);
+
+#if defined(__linux__) && !defined(NDEBUG)
+        pid_t pid = fork();
+        if(pid == 0)
+        {
+            freopen("/dev/null", "w", stderr);
+            e.parallel_foreach([&](entity id, test_component_normal&){
+                std::lock_guard<std::mutex> lock(m);
+                e.attach(id, test_component_tag());
+            }, 1);
+            _exit(0);
+        }
+        int status = 0;
+        waitpid(pid, &status, 0);
+        test(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+#endif
+
+        for(entity id: untagged)
+            e.attach(id, test_component_tag());
+        size_t still_untagged = 0;
+        e.foreach([&](test_component_normal&, without<test_component_tag>){
+            still_untagged++;
+        });
+        test(still_untagged == 0);
+    }
+
+    // Read-only iteration from several threads at once
+    {
+        const scene& ce = e;
+        std::vector<std::thread> readers;
+        std::atomic<size_t> read_count(0);
+        for(unsigned i = 0; i < 4; ++i)
+        {
+            readers.emplace_back([&](){
+                size_t local = 0;
+                ce.foreach([&](const test_component_normal& n, const test_component_tag*){
+                    local += n.a;
+                });
+                read_count += local;
+            });
+        }
+        for(std::thread& t: readers)
+            t.join();
+        test(read_count == 4 * normal_ids.size());
+    }
+
+    // Empty containers shouldn't break anything either.
+    scene empty;
+    empty.parallel_foreach([&](test_component_normal&){ test(false); });
+    empty.parallel_foreach([&](test_component_tag*, test_component_ptr*){ test(false); });
+
+    return 0;
+}
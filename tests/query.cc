@@ -0,0 +1,193 @@
+#include "test.hh"
+#include <algorithm>
+#include <random>
+
+struct test_component_tag { test_component_tag(int = 123){} };
+struct test_component_normal { test_component_normal(int a = 123): a(a) {} int a; };
+struct test_component_ptr { test_component_ptr(int a = 123): a(a) {} int a; };
+struct test_component_soa
+{
+    int x;
+    float y;
+
+    using soa_fields = monkero::soa_fields<
+        &test_component_soa::x,
+        &test_component_soa::y
+    >;
+};
+// Wide buckets keep the bucket arrays small even for IDs far past 32 bits.
+struct test_component_far
+{
+    int a;
+    static constexpr std::uint32_t bucket_exp_hint = 20;
+};
+
+// Compares the query against a plain foreach over the same components.
+template<typename... Components>
+bool matches_foreach(scene& e, scene::query<Components...>& q)
+{
+    std::vector<entity> expected;
+    e.foreach([&](entity id, Components&...){ expected.push_back(id); });
+    std::vector<entity> listed;
+    q([&](entity id, Components&...){ listed.push_back(id); });
+    std::sort(listed.begin(), listed.end());
+    return expected == listed && q.size() == listed.size();
+}
+
+int main()
+{
+    scene e;
+    scene::query<test_component_tag, test_component_normal> early(e);
+    test(early.size() == 0);
+
+    constexpr size_t N = 10000;
+    std::mt19937 rng(0);
+    for(size_t i = 0; i < N; ++i)
+    {
+        entity id = e.add();
+        if(rng()%2 == 0) e.attach(id, test_component_tag());
+        if(rng()%3 == 0) e.attach(id, test_component_normal(id));
+        if(rng()%4 == 0) e.attach(id, test_component_ptr(id));
+    }
+
+    // Queries created before and after the entities agree.
+    scene::query<test_component_tag, test_component_normal> late(e);
+    test(matches_foreach(e, early));
+    test(matches_foreach(e, late));
+    test(early.size() == late.size());
+
+    // Both parameter styles work, and the components are the right ones.
+    late([&](entity id, test_component_tag&, test_component_normal& n){
+        test(n.a == int(id));
+        test(late.contains(id));
+    });
+    size_t count = 0;
+    late([&](test_component_tag&, test_component_normal&){ count++; });
+    test(count == late.size());
+
+    // Attaching, removing and replacing components and removing entities
+    std::vector<bool> removed(N+1, false);
+    for(size_t i = 0; i < N/2; ++i)
+    {
+        entity id = 1 + rng()%N;
+        if(removed[id]) continue;
+        switch(rng()%4)
+        {
+        case 0:
+            e.attach(id, test_component_tag());
+            break;
+        case 1:
+            e.attach(id, test_component_normal(id));
+            break;
+        case 2:
+            e.remove<test_component_normal>(id);
+            break;
+        case 3:
+            e.remove(id);
+            removed[id] = true;
+            break;
+        }
+    }
+    test(matches_foreach(e, early));
+    test(matches_foreach(e, late));
+
+    // Changes made during scene::foreach are picked up.
+    e.foreach([&](entity id, test_component_ptr&){
+        if(id&1) e.attach(id, test_component_tag(), test_component_normal(id));
+        else e.remove<test_component_tag>(id);
+    });
+    test(matches_foreach(e, late));
+
+    // Changes made while iterating the query itself are deferred.
+    size_t before = late.size();
+    count = 0;
+    late([&](entity id, test_component_tag&, test_component_normal&){
+        e.remove<test_component_tag>(id);
+        entity other = e.add(test_component_tag(), test_component_normal(0));
+        test(!late.contains(other));
+        count++;
+    });
+    test(count == before);
+    test(late.size() == before);
+    test(matches_foreach(e, late));
+    test(matches_foreach(e, early));
+
+    // Early exit
+    count = 0;
+    late([&](test_component_tag&, test_component_normal&){
+        return ++count == 3 ? iteration_control::BREAK : iteration_control::CONTINUE;
+    });
+    test(late.size() < 3 || count == 3);
+
+    // Structure-of-arrays components
+    {
+        scene::query<test_component_soa, test_component_ptr> soa(e);
+        test(soa.size() == 0);
+        e.foreach([&](entity id, test_component_ptr&){
+            e.attach(id, test_component_soa{int(id), 1.0f});
+        });
+        test(soa.size() == e.count<test_component_ptr>());
+        soa([&](entity id, soa_ref<test_component_soa> s, test_component_ptr& p){
+            test(s.get<&test_component_soa::x>() == int(id));
+            test(p.a == int(id));
+        });
+        e.remove_all<test_component_soa>();
+        test(soa.size() == 0);
+    }
+
+    e.clear_entities();
+    test(early.size() == 0);
+    test(late.size() == 0);
+
+    // Far apart IDs, the index only grows around the IDs in use.
+    {
+        scene s;
+        scene::query<test_component_normal> q(s);
+        entity low = s.add(test_component_normal(1));
+        s.add_id_pool(size_t(1) << 24);
+        entity high = s.add(test_component_normal(2));
+        test(high > (entity(1) << 24));
+        test(q.size() == 2 && q.contains(low) && q.contains(high));
+        test(!q.contains(high - 1) && !q.contains(high + 5000000));
+        s.remove(low);
+        test(q.size() == 1 && !q.contains(low) && q.contains(high));
+        q([&](entity id, test_component_normal& n){
+            test(id == high && n.a == 2);
+        });
+    }
+
+#ifdef MONKERO_64BIT_ENTITIES
+    // IDs above 2^36 work with queries, handles and compaction, without
+    // memory for the range below them.
+    {
+        scene s;
+        scene::query<test_component_far> q(s);
+        entity low = s.add(test_component_far{1});
+        s.add_id_pool(size_t(1) << 36);
+        entity high = s.add(test_component_far{2});
+        test(high == (entity(1) << 36) + 2);
+        entity_handle h = s.get_handle(high);
+        test(q.size() == 2 && q.contains(low) && q.contains(high));
+        int sum = 0;
+        q([&](entity id, test_component_far& f){
+            test(id == (f.a == 1 ? low : high));
+            sum += f.a;
+        });
+        test(sum == 3);
+        test(s.get_signature(high).has<test_component_far>());
+
+        s.remove(low);
+        test(q.size() == 1 && !q.contains(low));
+        compact_result res = s.compact();
+        entity moved = res.translation_table[high];
+        test(moved == high - 1);
+        test(!s.alive(h) && !s.has<test_component_far>(high));
+        test(s.get<test_component_far>(moved)->a == 2);
+        test(s.get_signature(moved).has<test_component_far>());
+        test(q.size() == 1 && q.contains(moved));
+        s.remove(moved);
+        test(q.size() == 0);
+    }
+#endif
+    return 0;
+}
@@ -0,0 +1,166 @@
+#include "test.hh"
+#include <memory>
+#include <string>
+
+struct test_component_particle
+{
+    float x;
+    double y;
+    std::uint8_t mass;
+
+    using soa_fields = monkero::soa_fields<
+        &test_component_particle::x,
+        &test_component_particle::y,
+        &test_component_particle::mass
+    >;
+};
+
+struct test_component_named
+{
+    int id;
+    std::string name;
+};
+
+namespace monkero
+{
+template<>
+struct component_soa_fields<test_component_named>
+{
+    using type = soa_fields<&test_component_named::id, &test_component_named::name>;
+};
+}
+
+struct test_component_normal { test_component_normal(int a = 123): a(a) {} int a; };
+
+int main()
+{
+    static_assert(component_container<test_component_particle>::soa_component);
+    static_assert(component_container<test_component_named>::soa_component);
+    static_assert(!component_container<test_component_normal>::soa_component);
+
+    scene e;
+
+    // Field access
+    constexpr int N = 10000;
+    std::vector<entity> ids;
+    for(int i = 0; i < N; ++i)
+    {
+        entity id = e.add();
+        e.emplace<test_component_particle>(id, float(i), i * 0.5, std::uint8_t(i));
+        if(i % 3 == 0) e.attach(id, test_component_normal(i));
+        ids.push_back(id);
+    }
+    test(e.count<test_component_particle>() == N);
+    for(int i = 0; i < N; ++i)
+    {
+        soa_ref<test_component_particle> p = e.get<test_component_particle>(ids[i]);
+        test(p);
+        test(p.get<&test_component_particle::x>() == float(i));
+        test(p.get<&test_component_particle::y>() == i * 0.5);
+        test(p.get<&test_component_particle::mass>() == std::uint8_t(i));
+        test_component_particle copy = p.load();
+        test(copy.x == float(i) && copy.mass == std::uint8_t(i));
+    }
+    test(!e.get<test_component_particle>(INVALID_ENTITY));
+
+    // Const access
+    const scene& ce = e;
+    soa_ref<const test_component_particle> cp = ce.get<test_component_particle>(ids[1]);
+    test(cp.get<&test_component_particle::x>() == 1.0f);
+
+    // Each field array is contiguous within a bucket.
+    soa_ref<test_component_particle> p0 = e.get<test_component_particle>(ids[0]);
+    soa_ref<test_component_particle> p1 = e.get<test_component_particle>(ids[1]);
+    test(&p0.get<&test_component_particle::x>() + 1 == &p1.get<&test_component_particle::x>());
+    test(&p0.get<&test_component_particle::y>() + 1 == &p1.get<&test_component_particle::y>());
+
+    // foreach
+    size_t count = 0;
+    e.foreach([&](entity id, soa_ref<test_component_particle> p){
+        test(p.get<&test_component_particle::x>() == float(id-1));
+        p.get<&test_component_particle::y>() = 1.0;
+        count++;
+    });
+    test(count == N);
+
+    count = 0;
+    e.foreach([&](soa_ref<const test_component_particle> p, test_component_normal& n){
+        test(p.get<&test_component_particle::x>() == float(n.a));
+        test(p.get<&test_component_particle::y>() == 1.0);
+        count++;
+    });
+    test(count == (N+2)/3);
+
+    // Excluding entities that have a structure-of-arrays component
+    count = 0;
+    e.foreach([&](test_component_normal&, without<test_component_particle>){
+        count++;
+    });
+    test(count == 0);
+    entity lone = e.add(test_component_normal(-1));
+    e.foreach([&](entity id, test_component_normal& n, without<test_component_particle>){
+        test(id == lone && n.a == -1);
+        count++;
+    });
+    test(count == 1);
+    count = 0;
+    ce.foreach([&](soa_ref<const test_component_particle>, without<test_component_normal>){
+        count++;
+    });
+    test(count == N - (N+2)/3);
+    e.remove(lone);
+
+    // foreach_chunk hands out plain arrays per field.
+    count = 0;
+    e.foreach_chunk([&](entity first, size_t n, soa_span<test_component_particle> p){
+        float* x = p.get<&test_component_particle::x>();
+        for(size_t i = 0; i < n; ++i)
+        {
+            test(x[i] == float(first + i - 1));
+            test(p[i].get<&test_component_particle::mass>() == std::uint8_t(first + i - 1));
+            x[i] += 1.0f;
+        }
+        count += n;
+    });
+    test(count == N);
+    test(e.get<test_component_particle>(ids[5]).get<&test_component_particle::x>() == 6.0f);
+
+    // Events see a gathered copy of the whole component.
+    int adds = 0;
+    int removes = 0;
+    auto sub = e.subscribe(
+        [&](scene&, const add_component<test_component_named>& ev){
+            test(ev.data->name == "named" + std::to_string(ev.data->id));
+            adds++;
+        },
+        [&](scene&, const remove_component<test_component_named>& ev){
+            test(ev.data->name == "named" + std::to_string(ev.data->id));
+            removes++;
+        }
+    );
+    for(int i = 0; i < N; i += 2)
+        e.attach(ids[i], test_component_named{i, "named" + std::to_string(i)});
+    test(adds == N/2);
+
+    // Removal during batching
+    e.foreach([&](entity id, soa_ref<test_component_named> n){
+        test(n.get<&test_component_named::id>() == int(id-1));
+        if(id % 4 == 1) e.remove<test_component_named>(id);
+    });
+    test(removes == N/4);
+    test(e.count<test_component_named>() == N/4);
+
+    // Replacing an existing component
+    e.attach(ids[2], test_component_named{2, "named2"});
+    test(adds == N/2+1 && removes == N/4+1);
+
+    // Copying entities copies the fields too.
+    entity copy_id = e.copy(e, ids[2]);
+    test(e.get<test_component_named>(copy_id).get<&test_component_named::name>() == "named2");
+    test(e.get<test_component_particle>(copy_id).get<&test_component_particle::x>() == 3.0f);
+
+    e.clear_entities();
+    test(removes == adds);
+    test(e.count<test_component_particle>() == 0);
+    return 0;
+}